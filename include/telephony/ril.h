@@ -5386,6 +5386,30 @@ RIL_REQUEST_IMS_REG_STATE_CHANGE
 
 #define RIL_REQUEST_SET_EMERGENCY_NUMBER (RIL_CUS_REQUEST_BASE + 1)
 
+/**
+ * RIL_REQUEST_BATCH
+ *
+ * Envelope carrying several requests in a single record. It is handled by
+ * libril and never passed to the vendor RIL.
+ *
+ * "data" is int32 count (1 to RIL_MAX_BATCH_REQUESTS), followed by count
+ * sub-requests, each an int32 length and a regular request record
+ * (request, token, payload) padded to 4 bytes.
+ *
+ * Sub-requests are dispatched in order. Once all of them completed, a single
+ * frame of response type 2 (solicited batch) is sent: the envelope token,
+ * int32 count, then count sub-responses in sub-request order, each an int32
+ * length and a regular solicited response padded to 4 bytes. If that frame
+ * would be too large the sub-responses are sent as regular solicited frames.
+ *
+ * Errors sent as a regular response to the envelope token:
+ *  INVALID_ARGUMENTS
+ *  NO_MEMORY
+ */
+#define RIL_REQUEST_BATCH 3000
+
+#define RIL_MAX_BATCH_REQUESTS 32
+
 /* Backward compatible */
 
 /**
@@ -5503,6 +5527,15 @@ struct RIL_Env {
      * RIL_onRequestAck will be called by vendor when an Async RIL request was received
      * by them and an ack needs to be sent back to java ril. */
     void (*OnRequestAck)(RIL_Token t);
+
+    /**
+     * Lets requests run concurrently. "getLane" maps a request number to a
+     * lane in [0, numLanes). Requests of lane 0 are dispatched on the event
+     * loop thread as before, every other lane has a thread of its own that
+     * calls onRequest for its requests in the order they were received.
+     *
+     * Call from RIL_Init. May be NULL if the RIL library does not support it */
+    void (*SetRequestLanes)(int numLanes, int (*getLane)(int request));
 };
 
 /**
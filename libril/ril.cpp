@@ -32,10 +32,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <atomic>
+
 #include <telephony/record_stream.h>
 #include <telephony/ril.h>
 #include <telephony/ril_log.h>
@@ -55,6 +58,11 @@ extern "C" void RIL_onRequestComplete(RIL_Token t, RIL_Errno e, void* response,
 // match with constant in RIL.java
 #define MAX_COMMAND_BYTES (8 * 1024)
 
+#define MAX_REQUEST_LANES 4
+
+// Max number of queued responses written with a single writev()
+#define MAX_RESPONSE_BATCH 16
+
 // Basically: memset buffers that the client library
 // shouldn't be using anymore in an attempt to find
 // memory usage issues sooner.
@@ -67,6 +75,7 @@ extern "C" void RIL_onRequestComplete(RIL_Token t, RIL_Errno e, void* response,
 /* Constants for response types */
 #define RESPONSE_SOLICITED 0
 #define RESPONSE_UNSOLICITED 1
+#define RESPONSE_SOLICITED_BATCH 2
 
 /* Negative values for private RIL errno's */
 #define RIL_ERRNO_INVALID_RESPONSE -1
@@ -110,26 +119,93 @@ enum WakeType {
     WAKE_PARTIAL
 };
 
+/* Whether the last payload of an unsolicited response is kept for
+ * replay to a client that connects after it was sent */
+enum RetainType {
+    DONT_RETAIN,
+    RETAIN_LATEST, // always keep the latest payload, replay on every connect
+    RETAIN_UNDELIVERED // keep only if delivery failed, replay once
+};
+
+/* Whether identical requests in flight may share one execution */
+enum DedupType {
+    DONT_DEDUP,
+    DEDUP_INFLIGHT // read-only query, same arguments give the same answer
+};
+
 typedef struct {
     int requestNumber;
     void (*dispatchFunction)(Parcel& p, struct RequestInfo* pRI);
     int (*responseFunction)(Parcel& p, void* response, size_t responselen);
+    DedupType dedupType;
 } CommandInfo;
 
 typedef struct {
     int requestNumber;
     int (*responseFunction)(Parcel& p, void* response, size_t responselen);
     WakeType wakeType;
+    RetainType retainType;
 } UnsolResponseInfo;
 
+typedef struct {
+    void* data;
+    size_t dataSize;
+    unsigned int version; /* moves on each payload kept */
+} RetainedResponse;
+
+/* A serialized sub-response of a RIL_REQUEST_BATCH envelope */
+typedef struct {
+    uint8_t* data;
+    size_t dataSize;
+} BatchSlot;
+
+typedef struct BatchInfo {
+    int32_t token; // token of the envelope
+    unsigned int generation; // command connection it came from
+    int count;
+    std::atomic<int> remaining; // sub-requests not completed yet
+    BatchSlot slots[RIL_MAX_BATCH_REQUESTS];
+} BatchInfo;
+
 typedef struct RequestInfo {
     int32_t token; // this is not RIL_Token
     CommandInfo* pCI;
     struct RequestInfo* p_next;
     char cancelled;
     char local; // responses to local commands do not go back to command process
+    BatchInfo* pBatch; // envelope this request came in, if any
+    int batchIndex;
+    uint8_t* dedupKey; // argument bytes while executing as a dedup leader
+    size_t dedupKeyLen;
+    struct RequestInfo* p_nextInflight;
+    struct RequestInfo* p_followers; // identical requests answered with this one
+    struct RequestInfo* p_nextFollower;
 } RequestInfo;
 
+/* A serialized response waiting for the response writer thread */
+typedef struct ResponseRecord {
+    struct ResponseRecord* p_next;
+    unsigned int generation; // command connection it belongs to
+    size_t recordSize; // length header + payload
+    uint8_t* record;
+} ResponseRecord;
+
+/* A request record waiting for its dispatch lane */
+typedef struct LaneRecord {
+    struct LaneRecord* p_next;
+    unsigned int generation; // command connection it came from
+    size_t buflen;
+    uint8_t* buffer;
+} LaneRecord;
+
+typedef struct {
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    LaneRecord* p_head;
+    LaneRecord* p_tail;
+} RequestLane;
+
 typedef struct UserCallbackInfo {
     RIL_TimedCallback p_callback;
     void* userParam;
@@ -200,13 +276,40 @@ static struct ril_event s_listen_event;
 static pthread_mutex_t s_pendingRequestsMutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t s_writeMutex = PTHREAD_MUTEX_INITIALIZER;
 static RequestInfo* s_pendingRequests = NULL;
+/* DEDUP_INFLIGHT requests being executed, guarded by s_pendingRequestsMutex */
+static RequestInfo* s_inflightRequests = NULL;
 
 static const struct timeval TIMEVAL_WAKE_TIMEOUT = { 1, 0 };
 
 static UserCallbackInfo* s_last_wake_timeout_info = NULL;
 
-static void* s_lastNITZTimeData = NULL;
-static size_t s_lastNITZTimeDataSize;
+static pthread_mutex_t s_retainedMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * No response is written by the thread producing it. Solicited and
+ * unsolicited responses alike are serialized and pushed on |s_completions|
+ * (lock free, newest first), so they reach the socket in the order they
+ * were produced. |s_tid_writer| takes the whole list at once and writes it
+ * in batches; it does nothing else, so responses never wait behind timed
+ * callbacks doing modem round trips on the event loop. It sleeps on
+ * |s_completionsCond| while the list is empty.
+ * |s_commandGeneration| changes on every new command connection so responses
+ * queued for a closed connection are dropped.
+ */
+static std::atomic<ResponseRecord*> s_completions(NULL);
+static std::atomic<unsigned int> s_commandGeneration(0);
+static pthread_t s_tid_writer;
+static pthread_mutex_t s_completionsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_completionsCond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Requests of lane 0 are dispatched on the event loop. Lanes set by the
+ * vendor RIL through RIL_setRequestLanes() have a thread each that
+ * dispatches copies of the request records in order.
+ */
+static RequestLane s_lanes[MAX_REQUEST_LANES];
+static int s_numLanes = 1;
+static int (*s_getLane)(int request) = NULL;
 
 #if RILC_LOG
 static char printBuf[PRINTBUF_SIZE];
@@ -214,6 +317,7 @@ static char printBuf[PRINTBUF_SIZE];
 
 /*******************************************************************/
 static int sendResponse(Parcel& p);
+static int queueResponse(Parcel& p);
 
 static void dispatchVoid(Parcel& p, RequestInfo* pRI);
 static void dispatchString(Parcel& p, RequestInfo* pRI);
@@ -286,6 +390,9 @@ static UnsolResponseInfo s_unsolResponses[] = {
 #include "ril_unsol_commands.h"
 };
 
+/* Index == unsolResponseIndex, guarded by s_retainedMutex */
+static RetainedResponse s_retainedResponses[NUM_ELEMS(s_unsolResponses)];
+
 /* Index == requestNumber */
 static CommandInfo s_cus_commands[] = {
 #include "ril_cus_commands.h"
@@ -328,7 +435,185 @@ static void memsetString(char* s)
     }
 }
 
-static int processCommandBuffer(void* buffer, size_t buflen)
+static int dispatchCommandBuffer(void* buffer, size_t buflen, BatchInfo* pBatch, int batchIndex);
+
+static void sendErrorResponse(int32_t token, RIL_Errno e)
+{
+    Parcel p;
+
+    p.writeInt32(RESPONSE_SOLICITED);
+    p.writeInt32(token);
+    p.writeInt32(e);
+
+    if (sendResponse(p) < 0) {
+        RLOGE("failed to send error response parcel");
+    }
+}
+
+/**
+ * Drop one reference to the envelope. The last one sends the batch frame
+ * and frees it.
+ */
+static void releaseBatch(BatchInfo* pBatch)
+{
+    if (--pBatch->remaining > 0) {
+        return;
+    }
+
+    if (pBatch->generation != s_commandGeneration.load()) {
+        RLOGD("RIL releaseBatch: Command channel closed");
+        goto done;
+    }
+
+    {
+        Parcel out;
+
+        out.writeInt32(RESPONSE_SOLICITED_BATCH);
+        out.writeInt32(pBatch->token);
+        out.writeInt32(pBatch->count);
+        for (int i = 0; i < pBatch->count; i++) {
+            out.writeInt32(pBatch->slots[i].dataSize);
+            if (pBatch->slots[i].dataSize > 0) {
+                out.write(pBatch->slots[i].data, pBatch->slots[i].dataSize);
+            }
+        }
+
+        if (out.dataSize() <= MAX_COMMAND_BYTES) {
+            queueResponse(out);
+            goto done;
+        }
+    }
+
+    // Too big for one record, fall back to one frame per response
+    for (int i = 0; i < pBatch->count; i++) {
+        Parcel single;
+
+        if (pBatch->slots[i].data == NULL) {
+            continue;
+        }
+
+        single.setData(pBatch->slots[i].data, pBatch->slots[i].dataSize);
+        queueResponse(single);
+    }
+
+done:
+    for (int i = 0; i < pBatch->count; i++) {
+        free(pBatch->slots[i].data);
+    }
+    free(pBatch);
+}
+
+/* Store the serialized response of one sub-request */
+static void onBatchResponse(BatchInfo* pBatch, int batchIndex, Parcel& p)
+{
+    BatchSlot* pSlot = &pBatch->slots[batchIndex];
+
+    pSlot->data = (uint8_t*)malloc(p.dataSize());
+    if (pSlot->data != NULL) {
+        memcpy(pSlot->data, p.data(), p.dataSize());
+        pSlot->dataSize = p.dataSize();
+    } else {
+        RLOGE("Memory allocation failed in onBatchResponse");
+    }
+
+    releaseBatch(pBatch);
+}
+
+/**
+ * Unpack a RIL_REQUEST_BATCH envelope and dispatch the requests it carries
+ */
+static int processBatchBuffer(Parcel& p, int32_t token)
+{
+    BatchInfo* pBatch;
+    int32_t count;
+    int32_t len;
+    const void* record;
+
+    if (p.readInt32(&count) != NO_ERROR || count < 1 || count > RIL_MAX_BATCH_REQUESTS) {
+        RLOGE("invalid request batch token %ld", token);
+        sendErrorResponse(token, RIL_E_INVALID_ARGUMENTS);
+        return 0;
+    }
+
+    pBatch = (BatchInfo*)calloc(1, sizeof(BatchInfo));
+    if (pBatch == NULL) {
+        RLOGE("Memory allocation failed for request batch");
+        sendErrorResponse(token, RIL_E_NO_MEMORY);
+        return 0;
+    }
+
+    pBatch->token = token;
+    pBatch->generation = s_commandGeneration.load();
+    pBatch->count = count;
+    // Held until every sub-request got a slot, so early completions can
+    // not send the batch frame while later ones are still being dispatched
+    pBatch->remaining = count + 1;
+
+    for (int i = 0; i < count; i++) {
+        record = NULL;
+        if (p.readInt32(&len) == NO_ERROR && len > 0) {
+            record = p.readInplace(len);
+        }
+
+        if (record == NULL || dispatchCommandBuffer((void*)record, len, pBatch, i) < 0) {
+            Parcel pErr;
+
+            // unreadable sub-request, there is no token to answer with
+            pErr.writeInt32(RESPONSE_SOLICITED);
+            pErr.writeInt32(0);
+            pErr.writeInt32(RIL_E_INVALID_ARGUMENTS);
+            onBatchResponse(pBatch, i, pErr);
+        }
+    }
+
+    releaseBatch(pBatch);
+
+    return 0;
+}
+
+/**
+ * Look for an identical request in flight and follow it if there is one,
+ * otherwise register pRI as the one executing. The arguments are whatever
+ * is left unread in the request parcel.
+ * Assumes s_pendingRequestsMutex is held. Returns true if pRI follows.
+ */
+static bool attachToInflight(RequestInfo* pRI, Parcel& p)
+{
+    const uint8_t* key = p.data() + p.dataPosition();
+    size_t keyLen = p.dataAvail();
+
+    for (RequestInfo* pCur = s_inflightRequests; pCur != NULL; pCur = pCur->p_nextInflight) {
+        if (pCur->pCI == pRI->pCI && pCur->dedupKeyLen == keyLen
+            && (keyLen == 0 || memcmp(pCur->dedupKey, key, keyLen) == 0)) {
+            RLOGD("[%04d]> %s follows [%04d]", pRI->token,
+                requestToString(pRI->pCI->requestNumber), pCur->token);
+            pRI->p_nextFollower = pCur->p_followers;
+            pCur->p_followers = pRI;
+            return true;
+        }
+    }
+
+    if (keyLen > 0) {
+        pRI->dedupKey = (uint8_t*)malloc(keyLen);
+        if (pRI->dedupKey == NULL) {
+            // not shareable, just execute it
+            return false;
+        }
+        memcpy(pRI->dedupKey, key, keyLen);
+    }
+
+    pRI->dedupKeyLen = keyLen;
+    pRI->p_nextInflight = s_inflightRequests;
+    s_inflightRequests = pRI;
+
+    return false;
+}
+
+/**
+ * Dispatch one request record. pBatch is the envelope it came in, or NULL.
+ * Returns -1 if the request was dropped without a response.
+ */
+static int dispatchCommandBuffer(void* buffer, size_t buflen, BatchInfo* pBatch, int batchIndex)
 {
     Parcel p;
     status_t status;
@@ -347,7 +632,16 @@ static int processCommandBuffer(void* buffer, size_t buflen)
 
     if (status != NO_ERROR) {
         RLOGE("invalid request block");
-        return 0;
+        return -1;
+    }
+
+    if (request == RIL_REQUEST_BATCH) {
+        if (pBatch != NULL) {
+            RLOGE("nested request batch token %ld", token);
+            return -1;
+        }
+
+        return processBatchBuffer(p, token);
     }
 
     if (request < 1
@@ -367,10 +661,12 @@ static int processCommandBuffer(void* buffer, size_t buflen)
 
         if (status != NO_ERROR) {
             RLOGE("failed to construct error response parcel");
-            return 0;
+            return -1;
         }
 
-        if (sendResponse(pErr) < 0) {
+        if (pBatch != NULL) {
+            onBatchResponse(pBatch, batchIndex, pErr);
+        } else if (sendResponse(pErr) < 0) {
             RLOGE("failed to send error response parcel");
         }
 
@@ -380,10 +676,12 @@ static int processCommandBuffer(void* buffer, size_t buflen)
     pRI = (RequestInfo*)calloc(1, sizeof(RequestInfo));
     if (pRI == NULL) {
         RLOGE("Memory allocation failed for request %s", requestToString(request));
-        return 0;
+        return -1;
     }
 
     pRI->token = token;
+    pRI->pBatch = pBatch;
+    pRI->batchIndex = batchIndex;
     if (request > 0 && request < (int32_t)NUM_ELEMS(s_commands)) {
         pRI->pCI = &(s_commands[request]);
     } else if (request > RIL_SECOND_REQUEST_BASE
@@ -406,6 +704,13 @@ static int processCommandBuffer(void* buffer, size_t buflen)
     pRI->p_next = s_pendingRequests;
     s_pendingRequests = pRI;
 
+    if (pRI->pCI->dedupType == DEDUP_INFLIGHT && attachToInflight(pRI, p)) {
+        // answered when the identical request in flight completes
+        ret = pthread_mutex_unlock(&s_pendingRequestsMutex);
+        assert(ret == 0);
+        return 0;
+    }
+
     ret = pthread_mutex_unlock(&s_pendingRequestsMutex);
     assert(ret == 0);
 
@@ -419,6 +724,90 @@ static int processCommandBuffer(void* buffer, size_t buflen)
     return 0;
 }
 
+static void* laneLoop(void* param)
+{
+    RequestLane* pLane = (RequestLane*)param;
+    LaneRecord* pRecord;
+
+    for (;;) {
+        pthread_mutex_lock(&pLane->mutex);
+        while (pLane->p_head == NULL) {
+            pthread_cond_wait(&pLane->cond, &pLane->mutex);
+        }
+
+        pRecord = pLane->p_head;
+        pLane->p_head = pRecord->p_next;
+        if (pLane->p_head == NULL) {
+            pLane->p_tail = NULL;
+        }
+        pthread_mutex_unlock(&pLane->mutex);
+
+        // the connection it came from is gone, nobody waits for the response
+        if (pRecord->generation == s_commandGeneration.load()) {
+            dispatchCommandBuffer(pRecord->buffer, pRecord->buflen, NULL, 0);
+        }
+
+        free(pRecord);
+    }
+
+    return NULL;
+}
+
+/* Returns -1 if the record could not be queued */
+static int queueToLane(RequestLane* pLane, void* buffer, size_t buflen)
+{
+    LaneRecord* pRecord;
+
+    // the record stream reuses its buffer, keep a copy
+    pRecord = (LaneRecord*)malloc(sizeof(LaneRecord) + buflen);
+    if (pRecord == NULL) {
+        return -1;
+    }
+
+    pRecord->p_next = NULL;
+    pRecord->generation = s_commandGeneration.load();
+    pRecord->buflen = buflen;
+    pRecord->buffer = (uint8_t*)(pRecord + 1);
+    memcpy(pRecord->buffer, buffer, buflen);
+
+    pthread_mutex_lock(&pLane->mutex);
+    if (pLane->p_tail != NULL) {
+        pLane->p_tail->p_next = pRecord;
+    } else {
+        pLane->p_head = pRecord;
+    }
+    pLane->p_tail = pRecord;
+    pthread_cond_signal(&pLane->cond);
+    pthread_mutex_unlock(&pLane->mutex);
+
+    return 0;
+}
+
+static int processCommandBuffer(void* buffer, size_t buflen)
+{
+    Parcel p;
+    int32_t request;
+    int lane = 0;
+
+    if (s_getLane != NULL) {
+        p.setData((uint8_t*)buffer, buflen);
+
+        // batches are dispatched on the event loop
+        if (p.readInt32(&request) == NO_ERROR && request != RIL_REQUEST_BATCH) {
+            lane = s_getLane(request);
+        }
+    }
+
+    if (lane > 0 && lane < s_numLanes
+        && queueToLane(&s_lanes[lane], buffer, buflen) == 0) {
+        return 0;
+    }
+
+    dispatchCommandBuffer(buffer, buflen, NULL, 0);
+
+    return 0;
+}
+
 static void invalidCommandBlock(RequestInfo* pRI)
 {
     RLOGE("invalid command block for token %ld request %s",
@@ -1469,79 +1858,18 @@ invalid:
     return;
 }
 
-static int blockingWrite(int fd, const void* buffer, size_t len)
-{
-    size_t writeOffset = 0;
-    const uint8_t* toWrite;
-
-    toWrite = (const uint8_t*)buffer;
-
-    while (writeOffset < len) {
-        ssize_t written;
-        do {
-            written = write(fd, toWrite + writeOffset,
-                len - writeOffset);
-        } while (written < 0 && ((errno == EINTR) || (errno == EAGAIN)));
-
-        if (written >= 0) {
-            writeOffset += written;
-        } else { // written < 0
-            RLOGE("RIL Response: unexpected error on write errno: %d", errno);
-            close(fd);
-            return -1;
-        }
-    }
-
-    RLOGD("RIL Response bytes written: %zu", writeOffset);
-
-    return 0;
-}
-
-static int sendResponseRaw(const void* data, size_t dataSize)
+/**
+ * Queues "p" for the client like any other response, so that it reaches
+ * the socket in the order it was produced. Returns -1 if no client is
+ * connected
+ */
+static int sendResponse(Parcel& p)
 {
-    int fd = s_fdCommand;
-    int ret;
-    uint32_t header;
-
     if (s_fdCommand < 0) {
-        RLOGE("RIL: no valid fd for URC channel");
-        return -1;
-    }
-
-    if (dataSize > MAX_COMMAND_BYTES) {
-        RLOGE("RIL: packet larger than %u (%u)",
-            MAX_COMMAND_BYTES, (unsigned int)dataSize);
-
         return -1;
     }
 
-    pthread_mutex_lock(&s_writeMutex);
-
-    header = htonl(dataSize);
-
-    ret = blockingWrite(fd, (void*)&header, sizeof(header));
-
-    if (ret < 0) {
-        pthread_mutex_unlock(&s_writeMutex);
-        return ret;
-    }
-
-    ret = blockingWrite(fd, data, dataSize);
-
-    if (ret < 0) {
-        pthread_mutex_unlock(&s_writeMutex);
-        return ret;
-    }
-
-    pthread_mutex_unlock(&s_writeMutex);
-
-    return 0;
-}
-
-static int sendResponse(Parcel& p)
-{
-    printResponse;
-    return sendResponseRaw(p.data(), p.dataSize());
+    return queueResponse(p);
 }
 
 static int responseInts(Parcel& p, void* response, size_t responselen)
@@ -2389,6 +2717,176 @@ static int responseActivityData(Parcel& p, void* response, size_t responselen)
     return 0;
 }
 
+static int blockingWritev(int fd, struct iovec* iov, int iovcnt)
+{
+    size_t total = 0;
+
+    while (iovcnt > 0) {
+        ssize_t written;
+
+        do {
+            written = writev(fd, iov, iovcnt);
+        } while (written < 0 && ((errno == EINTR) || (errno == EAGAIN)));
+
+        if (written < 0) {
+            RLOGE("RIL Response: unexpected error on writev errno: %d", errno);
+            close(fd);
+            return -1;
+        }
+
+        total += written;
+
+        /* skip what was fully written, then trim the partial one */
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    RLOGD("RIL Response bytes written: %zu", total);
+
+    return 0;
+}
+
+static void writeResponseBatch(ResponseRecord** batch, int count)
+{
+    struct iovec iov[MAX_RESPONSE_BATCH];
+
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = batch[i]->record;
+        iov[i].iov_len = batch[i]->recordSize;
+    }
+
+    pthread_mutex_lock(&s_writeMutex);
+
+    if (s_fdCommand < 0) {
+        RLOGD("RIL processCompletions: Command channel closed");
+    } else if (blockingWritev(s_fdCommand, iov, count) < 0) {
+        RLOGE("failed to send solicited command response");
+    }
+
+    pthread_mutex_unlock(&s_writeMutex);
+
+    for (int i = 0; i < count; i++) {
+        free(batch[i]);
+    }
+}
+
+/* Called on the response writer thread to flush all queued responses */
+static void processCompletions(void)
+{
+    ResponseRecord* batch[MAX_RESPONSE_BATCH];
+    ResponseRecord* p_list;
+    ResponseRecord* p_fifo = NULL;
+    int count = 0;
+
+    p_list = s_completions.exchange(NULL, std::memory_order_acquire);
+
+    /* the list is newest first, restore completion order */
+    while (p_list != NULL) {
+        ResponseRecord* p_next = p_list->p_next;
+
+        p_list->p_next = p_fifo;
+        p_fifo = p_list;
+        p_list = p_next;
+    }
+
+    while (p_fifo != NULL) {
+        ResponseRecord* p_cur = p_fifo;
+
+        p_fifo = p_fifo->p_next;
+
+        if (p_cur->generation != s_commandGeneration.load()) {
+            free(p_cur);
+            continue;
+        }
+
+        batch[count++] = p_cur;
+        if (count == MAX_RESPONSE_BATCH) {
+            writeResponseBatch(batch, count);
+            count = 0;
+        }
+    }
+
+    if (count > 0) {
+        writeResponseBatch(batch, count);
+    }
+}
+
+/**
+ * Queue a serialized response for the writer thread. Only the first one
+ * into an empty queue needs to wake it up, the rest ride along.
+ */
+static int queueResponseRaw(const void* data, size_t dataSize)
+{
+    ResponseRecord* p_record;
+    ResponseRecord* p_head;
+    uint32_t header;
+
+    if (dataSize > MAX_COMMAND_BYTES) {
+        RLOGE("RIL: packet larger than %u (%u)",
+            MAX_COMMAND_BYTES, (unsigned int)dataSize);
+
+        return -1;
+    }
+
+    p_record = (ResponseRecord*)malloc(sizeof(ResponseRecord) + sizeof(header) + dataSize);
+    if (p_record == NULL) {
+        RLOGE("Memory allocation failed in queueResponse");
+        return -1;
+    }
+
+    header = htonl(dataSize);
+    p_record->generation = s_commandGeneration.load();
+    p_record->recordSize = sizeof(header) + dataSize;
+    p_record->record = (uint8_t*)(p_record + 1);
+    memcpy(p_record->record, &header, sizeof(header));
+    memcpy(p_record->record + sizeof(header), data, dataSize);
+
+    p_head = s_completions.load(std::memory_order_relaxed);
+    do {
+        p_record->p_next = p_head;
+    } while (!s_completions.compare_exchange_weak(p_head, p_record,
+        std::memory_order_release, std::memory_order_relaxed));
+
+    if (p_head == NULL) {
+        pthread_mutex_lock(&s_completionsMutex);
+        pthread_cond_signal(&s_completionsCond);
+        pthread_mutex_unlock(&s_completionsMutex);
+    }
+
+    return 0;
+}
+
+static int queueResponse(Parcel& p)
+{
+    printResponse;
+    return queueResponseRaw(p.data(), p.dataSize());
+}
+
+static void* responseWriterLoop(void* param)
+{
+    (void)param;
+
+    for (;;) {
+        pthread_mutex_lock(&s_completionsMutex);
+        while (s_completions.load(std::memory_order_acquire) == NULL) {
+            pthread_cond_wait(&s_completionsCond, &s_completionsMutex);
+        }
+        pthread_mutex_unlock(&s_completionsMutex);
+
+        processCompletions();
+    }
+
+    return NULL;
+}
+
 /**
  * A write on the wakeup fd is done just to pop us out of select()
  * We empty the buffer here and then ril_event will reset the timers on the
@@ -2473,8 +2971,99 @@ static void processCommandsCallback(int fd, short flags, void* param)
     }
 }
 
+static void retainResponse(int unsolResponseIndex, Parcel& p)
+{
+    RetainedResponse* pRR = &s_retainedResponses[unsolResponseIndex];
+    void* data;
+
+    data = realloc(pRR->data, p.dataSize());
+    if (data == NULL) {
+        RLOGE("Memory allocation failed in retainResponse");
+        return;
+    }
+
+    memcpy(data, p.data(), p.dataSize());
+    pRR->data = data;
+    pRR->dataSize = p.dataSize();
+    pRR->version++;
+}
+
+/* Drops the RETAIN_LATEST state, and the undelivered responses too if "all" */
+static void dropRetainedResponses(bool all)
+{
+    pthread_mutex_lock(&s_retainedMutex);
+
+    for (int i = 0; i < (int)NUM_ELEMS(s_retainedResponses); i++) {
+        if (!all && s_unsolResponses[i].retainType != RETAIN_LATEST) {
+            continue;
+        }
+
+        free(s_retainedResponses[i].data);
+        s_retainedResponses[i].data = NULL;
+        s_retainedResponses[i].dataSize = 0;
+    }
+
+    pthread_mutex_unlock(&s_retainedMutex);
+}
+
+/**
+ * Sends the retained responses to a new client. Each is copied out and
+ * written without s_retainedMutex held, so URCs are not kept waiting on
+ * the socket. A RETAIN_LATEST payload replaced while its copy was being
+ * written was sent live before or after it, and is sent again so the
+ * client ends with the latest.
+ */
+static void replayRetainedResponses(void)
+{
+    for (int i = 0; i < (int)NUM_ELEMS(s_retainedResponses); i++) {
+        RetainedResponse* pRR = &s_retainedResponses[i];
+        void* data;
+        size_t dataSize;
+        unsigned int version;
+        bool again;
+
+        do {
+            pthread_mutex_lock(&s_retainedMutex);
+            data = NULL;
+            dataSize = pRR->dataSize;
+            version = pRR->version;
+            if (pRR->data != NULL) {
+                data = malloc(dataSize);
+                if (data != NULL) {
+                    memcpy(data, pRR->data, dataSize);
+                }
+            }
+            pthread_mutex_unlock(&s_retainedMutex);
+
+            if (data == NULL) {
+                break;
+            }
+
+            RLOGD("Replay retained %s",
+                requestToString(s_unsolResponses[i].requestNumber));
+            if (s_fdCommand < 0 || queueResponseRaw(data, dataSize) != 0) {
+                free(data);
+                return;
+            }
+
+            free(data);
+
+            pthread_mutex_lock(&s_retainedMutex);
+            again = pRR->version != version;
+            if (!again && s_unsolResponses[i].retainType == RETAIN_UNDELIVERED) {
+                free(pRR->data);
+                pRR->data = NULL;
+                pRR->dataSize = 0;
+            }
+            pthread_mutex_unlock(&s_retainedMutex);
+        } while (again && s_unsolResponses[i].retainType == RETAIN_LATEST);
+    }
+}
+
 static void onNewCommandConnect(void)
 {
+    s_commandGeneration++;
+
     // Inform we are connected and the ril version
     int rilVer = s_callbacks.version;
     RLOGD("RIL_UNSOL_RIL_CONNECTED message send");
@@ -2484,13 +3073,8 @@ static void onNewCommandConnect(void)
     RLOGD("RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED message send");
     RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED, NULL, 0);
 
-    // Send last NITZ time data, in case it was missed
-    if (s_lastNITZTimeData != NULL) {
-        sendResponseRaw(s_lastNITZTimeData, s_lastNITZTimeDataSize);
-
-        free(s_lastNITZTimeData);
-        s_lastNITZTimeData = NULL;
-    }
+    // Replay retained state, in case it was missed
+    replayRetainedResponses();
 }
 
 static void listenCallback(int fd, short flags, void* param)
@@ -2590,6 +3174,12 @@ extern "C" void RIL_startEventLoop(void)
     s_fdWakeupWrite = filedes[1];
     RLOGD("start eventLoop PIPE SUCCESS");
 
+    ret = pthread_create(&s_tid_writer, NULL, responseWriterLoop, NULL);
+    if (ret != 0) {
+        RLOGE("Failed to create response writer thread: %s", strerror(ret));
+        exit(-1);
+    }
+
     fcntl(s_fdWakeupRead, F_SETFL, O_NONBLOCK);
     ril_event_set(&s_wakeupfd_event, s_fdWakeupRead, true,
         processWakeupCallback, NULL);
@@ -2689,13 +3279,42 @@ static int checkAndDequeueRequestInfo(struct RequestInfo* pRI)
     return ret;
 }
 
+/**
+ * Take pRI off the in-flight list and return the requests following it.
+ * Followers that got cancelled meanwhile are still returned.
+ */
+static RequestInfo* detachFromInflight(RequestInfo* pRI)
+{
+    RequestInfo* p_followers = NULL;
+
+    pthread_mutex_lock(&s_pendingRequestsMutex);
+
+    for (RequestInfo** ppCur = &s_inflightRequests; *ppCur != NULL;
+         ppCur = &((*ppCur)->p_nextInflight)) {
+        if (pRI == *ppCur) {
+            *ppCur = pRI->p_nextInflight;
+            p_followers = pRI->p_followers;
+            pRI->p_followers = NULL;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&s_pendingRequestsMutex);
+
+    free(pRI->dedupKey);
+    pRI->dedupKey = NULL;
+
+    return p_followers;
+}
+
+static void completeRequest(RequestInfo* pRI, RIL_Errno e, void* response,
+    size_t responselen);
+
 extern "C" void RIL_onRequestComplete(RIL_Token t, RIL_Errno e, void* response,
     size_t responselen)
 {
     RequestInfo* pRI;
-    int ret;
-    size_t errorOffset;
-    Parcel p;
+    RequestInfo* p_followers;
     pRI = (RequestInfo*)t;
 
     if (!checkAndDequeueRequestInfo(pRI)) {
@@ -2703,6 +3322,28 @@ extern "C" void RIL_onRequestComplete(RIL_Token t, RIL_Errno e, void* response,
         return;
     }
 
+    p_followers = pRI->pCI->dedupType == DEDUP_INFLIGHT ? detachFromInflight(pRI) : NULL;
+
+    completeRequest(pRI, e, response, responselen);
+
+    // fan the same result out to the identical requests that waited on it
+    while (p_followers != NULL) {
+        RequestInfo* p_next = p_followers->p_nextFollower;
+
+        if (checkAndDequeueRequestInfo(p_followers)) {
+            completeRequest(p_followers, e, response, responselen);
+        }
+        p_followers = p_next;
+    }
+}
+
+static void completeRequest(RequestInfo* pRI, RIL_Errno e, void* response,
+    size_t responselen)
+{
+    int ret;
+    size_t errorOffset;
+    Parcel p;
+
     RLOGD("RequestComplete");
 
     if (pRI->local > 0) {
@@ -2713,7 +3354,7 @@ extern "C" void RIL_onRequestComplete(RIL_Token t, RIL_Errno e, void* response,
         goto done;
     }
 
-    if (pRI->cancelled == 0) {
+    if (pRI->cancelled == 0 || pRI->pBatch != NULL) {
         p.writeInt32(RESPONSE_SOLICITED);
         p.writeInt32(pRI->token);
         errorOffset = p.dataPosition();
@@ -2736,12 +3377,13 @@ extern "C" void RIL_onRequestComplete(RIL_Token t, RIL_Errno e, void* response,
             appendPrintBuf("%s fails by %s", printBuf, failCauseToString(e));
         }
 
-        if (s_fdCommand < 0) {
+        if (pRI->pBatch != NULL) {
+            // the batch frame is dropped later if the client went away
+            onBatchResponse(pRI->pBatch, pRI->batchIndex, p);
+        } else if (s_fdCommand < 0) {
             RLOGD("RIL onRequestComplete: Command channel closed");
-        }
-
-        if (sendResponse(p) < 0) {
-            RLOGE("failed to send solicited command response");
+        } else if (queueResponse(p) < 0) {
+            RLOGE("failed to queue solicited command response");
         }
     }
 
@@ -2898,6 +3540,11 @@ extern "C" void RIL_onUnsolicitedResponse(int unsolResponse, const void* data,
         p.writeInt32(newState);
         appendPrintBuf("%s {%s}", printBuf,
             radioStateToString(s_callbacks.onStateRequest()));
+        if (newState != RADIO_STATE_ON) {
+            // The state of a radio that is off is not current, and nothing
+            // retained from before the modem went away is
+            dropRetainedResponses(newState == RADIO_STATE_UNAVAILABLE);
+        }
         break;
 
     case RIL_UNSOL_NITZ_TIME_RECEIVED:
@@ -2930,26 +3577,33 @@ extern "C" void RIL_onUnsolicitedResponse(int unsolResponse, const void* data,
 #if VDBG
     RLOGI("%s UNSOLICITED: %s length:%d", rilSocketIdToString(soc_id), requestToString(unsolResponse), p.dataSize());
 #endif
-    ret = sendResponse(p);
-    if (ret != 0 && unsolResponse == RIL_UNSOL_NITZ_TIME_RECEIVED) {
+    switch (s_unsolResponses[unsolResponseIndex].retainType) {
+    case RETAIN_LATEST:
+        // Keep the latest payload so a client connecting later gets
+        // the current state without polling the modem again. Send
+        // and store under one lock so a replay never goes out of order.
+        pthread_mutex_lock(&s_retainedMutex);
+        sendResponse(p);
+        retainResponse(unsolResponseIndex, p);
+        pthread_mutex_unlock(&s_retainedMutex);
+        break;
 
+    case RETAIN_UNDELIVERED:
         // Unfortunately, NITZ time is not poll/update like everything
         // else in the system. So, if the upstream client isn't connected,
         // keep a copy of the last NITZ response (with receive time noted
         // above) around so we can deliver it when it is connected
-
-        if (s_lastNITZTimeData != NULL) {
-            free(s_lastNITZTimeData);
-            s_lastNITZTimeData = NULL;
+        pthread_mutex_lock(&s_retainedMutex);
+        if (sendResponse(p) != 0) {
+            retainResponse(unsolResponseIndex, p);
         }
+        pthread_mutex_unlock(&s_retainedMutex);
+        break;
 
-        s_lastNITZTimeData = calloc(p.dataSize(), 1);
-        if (s_lastNITZTimeData == NULL) {
-            RLOGE("Memory allocation failed in RIL_onUnsolicitedResponse");
-            goto error_exit;
-        }
-        s_lastNITZTimeDataSize = p.dataSize();
-        memcpy(s_lastNITZTimeData, p.data(), p.dataSize());
+    case DONT_RETAIN:
+    default:
+        sendResponse(p);
+        break;
     }
 
     // Normal exit
@@ -3000,6 +3654,41 @@ extern "C" void RIL_requestTimedCallback(RIL_TimedCallback callback, void* param
     internalRequestTimedCallback(callback, param, relativeTime);
 }
 
+extern "C" void RIL_setRequestLanes(int numLanes, int (*getLane)(int request))
+{
+    int ret;
+    int i;
+
+    if (s_getLane != NULL) {
+        RLOGE("RIL_setRequestLanes has been called more than once");
+        return;
+    }
+
+    if (numLanes > MAX_REQUEST_LANES) {
+        RLOGW("RIL_setRequestLanes: %d lanes requested, using %d",
+            numLanes, MAX_REQUEST_LANES);
+        numLanes = MAX_REQUEST_LANES;
+    }
+
+    for (i = 1; i < numLanes; i++) {
+        RequestLane* pLane = &s_lanes[i];
+
+        pthread_mutex_init(&pLane->mutex, NULL);
+        pthread_cond_init(&pLane->cond, NULL);
+
+        ret = pthread_create(&pLane->tid, NULL, laneLoop, pLane);
+        if (ret != 0) {
+            RLOGE("Failed to create request lane %d: %s", i, strerror(ret));
+            break;
+        }
+    }
+
+    s_numLanes = i > 1 ? i : 1;
+    s_getLane = getLane;
+
+    RLOGI("RIL_setRequestLanes: %d lanes", s_numLanes);
+}
+
 const char* failCauseToString(RIL_Errno e)
 {
     switch (e) {
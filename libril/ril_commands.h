@@ -14,152 +14,152 @@
 ** See the License for the specific language governing permissions and
 ** limitations under the License.
 */
-{ 0, NULL, NULL }, // none
-    { RIL_REQUEST_GET_SIM_STATUS, dispatchVoid, responseSimStatus },
-    { RIL_REQUEST_ENTER_SIM_PIN, dispatchStrings, responseInts },
-    { RIL_REQUEST_ENTER_SIM_PUK, dispatchStrings, responseInts },
-    { RIL_REQUEST_ENTER_SIM_PIN2, dispatchStrings, responseInts },
-    { RIL_REQUEST_ENTER_SIM_PUK2, dispatchStrings, responseInts },
-    { RIL_REQUEST_CHANGE_SIM_PIN, dispatchStrings, responseInts },
-    { RIL_REQUEST_CHANGE_SIM_PIN2, dispatchStrings, responseInts },
-    { RIL_REQUEST_ENTER_NETWORK_DEPERSONALIZATION, dispatchStrings, responseInts },
-    { RIL_REQUEST_GET_CURRENT_CALLS, dispatchVoid, responseCallList },
-    { RIL_REQUEST_DIAL, dispatchDial, responseVoid },
-    { RIL_REQUEST_GET_IMSI, dispatchStrings, responseString },
-    { RIL_REQUEST_HANGUP, dispatchInts, responseVoid },
-    { RIL_REQUEST_HANGUP_WAITING_OR_BACKGROUND, dispatchVoid, responseVoid },
-    { RIL_REQUEST_HANGUP_FOREGROUND_RESUME_BACKGROUND, dispatchVoid, responseVoid },
-    { RIL_REQUEST_SWITCH_WAITING_OR_HOLDING_AND_ACTIVE, dispatchVoid, responseVoid },
-    { RIL_REQUEST_CONFERENCE, dispatchVoid, responseVoid },
-    { RIL_REQUEST_UDUB, dispatchVoid, responseVoid },
-    { RIL_REQUEST_LAST_CALL_FAIL_CAUSE, dispatchVoid, responseInts },
-    { RIL_REQUEST_SIGNAL_STRENGTH, dispatchVoid, responseRilSignalStrength },
-    { RIL_REQUEST_VOICE_REGISTRATION_STATE, dispatchVoid, responseStrings },
-    { RIL_REQUEST_DATA_REGISTRATION_STATE, dispatchVoid, responseStrings },
-    { RIL_REQUEST_OPERATOR, dispatchVoid, responseStrings },
-    { RIL_REQUEST_RADIO_POWER, dispatchInts, responseVoid },
-    { RIL_REQUEST_DTMF, dispatchString, responseVoid },
-    { RIL_REQUEST_SEND_SMS, dispatchStrings, responseSMS },
-    { RIL_REQUEST_SEND_SMS_EXPECT_MORE, dispatchStrings, responseSMS },
-    { RIL_REQUEST_SETUP_DATA_CALL, dispatchDataCall, responseSetupDataCall },
-    { RIL_REQUEST_SIM_IO, dispatchSIM_IO, responseSIM_IO },
-    { RIL_REQUEST_SEND_USSD, dispatchString, responseVoid },
-    { RIL_REQUEST_CANCEL_USSD, dispatchVoid, responseVoid },
-    { RIL_REQUEST_GET_CLIR, dispatchVoid, responseInts },
-    { RIL_REQUEST_SET_CLIR, dispatchInts, responseVoid },
-    { RIL_REQUEST_QUERY_CALL_FORWARD_STATUS, dispatchCallForward, responseCallForwards },
-    { RIL_REQUEST_SET_CALL_FORWARD, dispatchCallForward, responseVoid },
-    { RIL_REQUEST_QUERY_CALL_WAITING, dispatchInts, responseInts },
-    { RIL_REQUEST_SET_CALL_WAITING, dispatchInts, responseVoid },
-    { RIL_REQUEST_SMS_ACKNOWLEDGE, dispatchInts, responseVoid },
-    { RIL_REQUEST_GET_IMEI, dispatchVoid, responseString },
-    { RIL_REQUEST_GET_IMEISV, dispatchVoid, responseString },
-    { RIL_REQUEST_ANSWER, dispatchVoid, responseVoid },
-    { RIL_REQUEST_DEACTIVATE_DATA_CALL, dispatchStrings, responseVoid },
-    { RIL_REQUEST_QUERY_FACILITY_LOCK, dispatchStrings, responseInts },
-    { RIL_REQUEST_SET_FACILITY_LOCK, dispatchStrings, responseInts },
-    { RIL_REQUEST_CHANGE_BARRING_PASSWORD, dispatchStrings, responseVoid },
-    { RIL_REQUEST_QUERY_NETWORK_SELECTION_MODE, dispatchVoid, responseInts },
-    { RIL_REQUEST_SET_NETWORK_SELECTION_AUTOMATIC, dispatchVoid, responseVoid },
-    { RIL_REQUEST_SET_NETWORK_SELECTION_MANUAL, dispatchManualSelection, responseVoid },
-    { RIL_REQUEST_QUERY_AVAILABLE_NETWORKS, dispatchVoid, responseStrings },
-    { RIL_REQUEST_DTMF_START, dispatchString, responseVoid },
-    { RIL_REQUEST_DTMF_STOP, dispatchVoid, responseVoid },
-    { RIL_REQUEST_BASEBAND_VERSION, dispatchVoid, responseString },
-    { RIL_REQUEST_SEPARATE_CONNECTION, dispatchInts, responseVoid },
-    { RIL_REQUEST_SET_MUTE, dispatchInts, responseVoid },
-    { RIL_REQUEST_GET_MUTE, dispatchVoid, responseInts },
-    { RIL_REQUEST_QUERY_CLIP, dispatchVoid, responseInts },
-    { RIL_REQUEST_LAST_DATA_CALL_FAIL_CAUSE, dispatchVoid, responseInts },
-    { RIL_REQUEST_DATA_CALL_LIST, dispatchVoid, responseDataCallList },
-    { RIL_REQUEST_RESET_RADIO, dispatchVoid, responseVoid },
-    { RIL_REQUEST_OEM_HOOK_RAW, dispatchRaw, responseRaw },
-    { RIL_REQUEST_OEM_HOOK_STRINGS, dispatchStrings, responseStrings },
-    { RIL_REQUEST_SCREEN_STATE, dispatchInts, responseVoid },
-    { RIL_REQUEST_SET_SUPP_SVC_NOTIFICATION, dispatchInts, responseVoid },
-    { RIL_REQUEST_WRITE_SMS_TO_SIM, dispatchSmsWrite, responseInts },
-    { RIL_REQUEST_DELETE_SMS_ON_SIM, dispatchInts, responseVoid },
-    { RIL_REQUEST_SET_BAND_MODE, dispatchInts, responseVoid },
-    { RIL_REQUEST_QUERY_AVAILABLE_BAND_MODE, dispatchVoid, responseInts },
-    { RIL_REQUEST_STK_GET_PROFILE, dispatchVoid, responseString },
-    { RIL_REQUEST_STK_SET_PROFILE, dispatchString, responseVoid },
-    { RIL_REQUEST_STK_SEND_ENVELOPE_COMMAND, dispatchString, responseString },
-    { RIL_REQUEST_STK_SEND_TERMINAL_RESPONSE, dispatchString, responseVoid },
-    { RIL_REQUEST_STK_HANDLE_CALL_SETUP_REQUESTED_FROM_SIM, dispatchInts, responseVoid },
-    { RIL_REQUEST_EXPLICIT_CALL_TRANSFER, dispatchVoid, responseVoid },
-    { RIL_REQUEST_SET_PREFERRED_NETWORK_TYPE, dispatchInts, responseVoid },
-    { RIL_REQUEST_GET_PREFERRED_NETWORK_TYPE, dispatchVoid, responseInts },
-    { RIL_REQUEST_GET_NEIGHBORING_CELL_IDS, dispatchVoid, responseCellList },
-    { RIL_REQUEST_SET_LOCATION_UPDATES, dispatchInts, responseVoid },
-    { 77, NULL, NULL },
-    { 78, NULL, NULL },
-    { 79, NULL, NULL },
-    { RIL_REQUEST_SET_TTY_MODE, dispatchInts, responseVoid },
-    { RIL_REQUEST_QUERY_TTY_MODE, dispatchVoid, responseInts },
-    { 82, NULL, NULL },
-    { 83, NULL, NULL },
-    { 84, NULL, NULL },
-    { 85, NULL, NULL },
-    { 86, NULL, NULL },
-    { 87, NULL, NULL },
-    { 88, NULL, NULL },
-    { RIL_REQUEST_GSM_GET_BROADCAST_SMS_CONFIG, dispatchVoid, responseGsmBrSmsCnf },
-    { RIL_REQUEST_GSM_SET_BROADCAST_SMS_CONFIG, dispatchGsmBrSmsCnf, responseVoid },
-    { RIL_REQUEST_GSM_SMS_BROADCAST_ACTIVATION, dispatchInts, responseVoid },
-    { 92, NULL, NULL },
-    { 93, NULL, NULL },
-    { 94, NULL, NULL },
-    { 95, NULL, NULL },
-    { 96, NULL, NULL },
-    { 97, NULL, NULL },
-    { RIL_REQUEST_DEVICE_IDENTITY, dispatchVoid, responseStrings },
-    { RIL_REQUEST_EXIT_EMERGENCY_CALLBACK_MODE, dispatchVoid, responseVoid },
-    { RIL_REQUEST_GET_SMSC_ADDRESS, dispatchVoid, responseString },
-    { RIL_REQUEST_SET_SMSC_ADDRESS, dispatchString, responseVoid },
-    { RIL_REQUEST_REPORT_SMS_MEMORY_STATUS, dispatchInts, responseVoid },
-    { RIL_REQUEST_REPORT_STK_SERVICE_IS_RUNNING, dispatchVoid, responseVoid },
-    { 104, NULL, NULL },
-    { RIL_REQUEST_ISIM_AUTHENTICATION, dispatchString, responseString },
-    { RIL_REQUEST_ACKNOWLEDGE_INCOMING_GSM_SMS_WITH_PDU, dispatchStrings, responseVoid },
-    { RIL_REQUEST_STK_SEND_ENVELOPE_WITH_STATUS, dispatchString, responseSIM_IO },
-    { RIL_REQUEST_VOICE_RADIO_TECH, dispatchVoiceRadioTech, responseInts },
-    { RIL_REQUEST_GET_CELL_INFO_LIST, dispatchVoid, responseCellInfoList },
-    { RIL_REQUEST_SET_UNSOL_CELL_INFO_LIST_RATE, dispatchInts, responseVoid },
-    { RIL_REQUEST_SET_INITIAL_ATTACH_APN, dispatchSetInitialAttachApn, responseVoid },
-    { 112, NULL, NULL },
-    { RIL_REQUEST_IMS_SEND_SMS, dispatchImsSms, responseSMS },
-    { RIL_REQUEST_SIM_TRANSMIT_APDU_BASIC, dispatchSIM_APDU, responseSIM_IO },
-    { RIL_REQUEST_SIM_OPEN_CHANNEL, dispatchString, responseInts },
-    { RIL_REQUEST_SIM_CLOSE_CHANNEL, dispatchInts, responseVoid },
-    { RIL_REQUEST_SIM_TRANSMIT_APDU_CHANNEL, dispatchSIM_APDU, responseSIM_IO },
-    { 118, NULL, NULL },
-    { 119, NULL, NULL },
-    { 120, NULL, NULL },
-    { 121, NULL, NULL },
-    { 122, NULL, NULL },
-    { RIL_REQUEST_ALLOW_DATA, dispatchInts, responseVoid },
-    { 124, NULL, NULL },
-    { 125, NULL, NULL },
-    { 126, NULL, NULL },
-    { 127, NULL, NULL },
-    { RIL_REQUEST_SET_DATA_PROFILE, dispatchDataProfile, responseVoid },
-    { 129, dispatchVoid, responseVoid },
-    { 130, NULL, NULL },
-    { 131, NULL, NULL },
-    { 132, dispatchInts, NULL },
-    { 133, dispatchVoid, NULL },
-    { 134, NULL, NULL },
-    { RIL_REQUEST_GET_ACTIVITY_INFO, dispatchVoid, responseActivityData },
-    { 136, NULL, NULL },
-    { 137, NULL, NULL },
-    { 138, NULL, NULL },
-    { 139, NULL, NULL },
-    { 140, NULL, NULL },
-    { 141, NULL, NULL },
-    { 142, NULL, NULL },
-    { 143, NULL, NULL },
-    { 144, NULL, NULL },
-    { 145, NULL, NULL },
-    { RIL_REQUEST_ENABLE_MODEM, dispatchInts, responseVoid },
-    { RIL_REQUEST_GET_MODEM_STATUS, dispatchVoid, responseInts },
-    { RIL_REQUEST_DEFLECT_CALL, dispatchString, responseVoid },
\ No newline at end of file
+{ 0, NULL, NULL, DONT_DEDUP }, // none
+    { RIL_REQUEST_GET_SIM_STATUS, dispatchVoid, responseSimStatus, DEDUP_INFLIGHT },
+    { RIL_REQUEST_ENTER_SIM_PIN, dispatchStrings, responseInts, DONT_DEDUP },
+    { RIL_REQUEST_ENTER_SIM_PUK, dispatchStrings, responseInts, DONT_DEDUP },
+    { RIL_REQUEST_ENTER_SIM_PIN2, dispatchStrings, responseInts, DONT_DEDUP },
+    { RIL_REQUEST_ENTER_SIM_PUK2, dispatchStrings, responseInts, DONT_DEDUP },
+    { RIL_REQUEST_CHANGE_SIM_PIN, dispatchStrings, responseInts, DONT_DEDUP },
+    { RIL_REQUEST_CHANGE_SIM_PIN2, dispatchStrings, responseInts, DONT_DEDUP },
+    { RIL_REQUEST_ENTER_NETWORK_DEPERSONALIZATION, dispatchStrings, responseInts, DONT_DEDUP },
+    { RIL_REQUEST_GET_CURRENT_CALLS, dispatchVoid, responseCallList, DEDUP_INFLIGHT },
+    { RIL_REQUEST_DIAL, dispatchDial, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_GET_IMSI, dispatchStrings, responseString, DEDUP_INFLIGHT },
+    { RIL_REQUEST_HANGUP, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_HANGUP_WAITING_OR_BACKGROUND, dispatchVoid, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_HANGUP_FOREGROUND_RESUME_BACKGROUND, dispatchVoid, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_SWITCH_WAITING_OR_HOLDING_AND_ACTIVE, dispatchVoid, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_CONFERENCE, dispatchVoid, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_UDUB, dispatchVoid, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_LAST_CALL_FAIL_CAUSE, dispatchVoid, responseInts, DEDUP_INFLIGHT },
+    { RIL_REQUEST_SIGNAL_STRENGTH, dispatchVoid, responseRilSignalStrength, DEDUP_INFLIGHT },
+    { RIL_REQUEST_VOICE_REGISTRATION_STATE, dispatchVoid, responseStrings, DEDUP_INFLIGHT },
+    { RIL_REQUEST_DATA_REGISTRATION_STATE, dispatchVoid, responseStrings, DEDUP_INFLIGHT },
+    { RIL_REQUEST_OPERATOR, dispatchVoid, responseStrings, DEDUP_INFLIGHT },
+    { RIL_REQUEST_RADIO_POWER, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_DTMF, dispatchString, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_SEND_SMS, dispatchStrings, responseSMS, DONT_DEDUP },
+    { RIL_REQUEST_SEND_SMS_EXPECT_MORE, dispatchStrings, responseSMS, DONT_DEDUP },
+    { RIL_REQUEST_SETUP_DATA_CALL, dispatchDataCall, responseSetupDataCall, DONT_DEDUP },
+    { RIL_REQUEST_SIM_IO, dispatchSIM_IO, responseSIM_IO, DONT_DEDUP },
+    { RIL_REQUEST_SEND_USSD, dispatchString, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_CANCEL_USSD, dispatchVoid, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_GET_CLIR, dispatchVoid, responseInts, DONT_DEDUP },
+    { RIL_REQUEST_SET_CLIR, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_QUERY_CALL_FORWARD_STATUS, dispatchCallForward, responseCallForwards, DONT_DEDUP },
+    { RIL_REQUEST_SET_CALL_FORWARD, dispatchCallForward, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_QUERY_CALL_WAITING, dispatchInts, responseInts, DONT_DEDUP },
+    { RIL_REQUEST_SET_CALL_WAITING, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_SMS_ACKNOWLEDGE, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_GET_IMEI, dispatchVoid, responseString, DEDUP_INFLIGHT },
+    { RIL_REQUEST_GET_IMEISV, dispatchVoid, responseString, DEDUP_INFLIGHT },
+    { RIL_REQUEST_ANSWER, dispatchVoid, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_DEACTIVATE_DATA_CALL, dispatchStrings, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_QUERY_FACILITY_LOCK, dispatchStrings, responseInts, DONT_DEDUP },
+    { RIL_REQUEST_SET_FACILITY_LOCK, dispatchStrings, responseInts, DONT_DEDUP },
+    { RIL_REQUEST_CHANGE_BARRING_PASSWORD, dispatchStrings, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_QUERY_NETWORK_SELECTION_MODE, dispatchVoid, responseInts, DEDUP_INFLIGHT },
+    { RIL_REQUEST_SET_NETWORK_SELECTION_AUTOMATIC, dispatchVoid, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_SET_NETWORK_SELECTION_MANUAL, dispatchManualSelection, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_QUERY_AVAILABLE_NETWORKS, dispatchVoid, responseStrings, DONT_DEDUP },
+    { RIL_REQUEST_DTMF_START, dispatchString, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_DTMF_STOP, dispatchVoid, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_BASEBAND_VERSION, dispatchVoid, responseString, DEDUP_INFLIGHT },
+    { RIL_REQUEST_SEPARATE_CONNECTION, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_SET_MUTE, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_GET_MUTE, dispatchVoid, responseInts, DEDUP_INFLIGHT },
+    { RIL_REQUEST_QUERY_CLIP, dispatchVoid, responseInts, DONT_DEDUP },
+    { RIL_REQUEST_LAST_DATA_CALL_FAIL_CAUSE, dispatchVoid, responseInts, DONT_DEDUP },
+    { RIL_REQUEST_DATA_CALL_LIST, dispatchVoid, responseDataCallList, DEDUP_INFLIGHT },
+    { RIL_REQUEST_RESET_RADIO, dispatchVoid, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_OEM_HOOK_RAW, dispatchRaw, responseRaw, DONT_DEDUP },
+    { RIL_REQUEST_OEM_HOOK_STRINGS, dispatchStrings, responseStrings, DONT_DEDUP },
+    { RIL_REQUEST_SCREEN_STATE, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_SET_SUPP_SVC_NOTIFICATION, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_WRITE_SMS_TO_SIM, dispatchSmsWrite, responseInts, DONT_DEDUP },
+    { RIL_REQUEST_DELETE_SMS_ON_SIM, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_SET_BAND_MODE, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_QUERY_AVAILABLE_BAND_MODE, dispatchVoid, responseInts, DONT_DEDUP },
+    { RIL_REQUEST_STK_GET_PROFILE, dispatchVoid, responseString, DONT_DEDUP },
+    { RIL_REQUEST_STK_SET_PROFILE, dispatchString, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_STK_SEND_ENVELOPE_COMMAND, dispatchString, responseString, DONT_DEDUP },
+    { RIL_REQUEST_STK_SEND_TERMINAL_RESPONSE, dispatchString, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_STK_HANDLE_CALL_SETUP_REQUESTED_FROM_SIM, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_EXPLICIT_CALL_TRANSFER, dispatchVoid, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_SET_PREFERRED_NETWORK_TYPE, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_GET_PREFERRED_NETWORK_TYPE, dispatchVoid, responseInts, DEDUP_INFLIGHT },
+    { RIL_REQUEST_GET_NEIGHBORING_CELL_IDS, dispatchVoid, responseCellList, DONT_DEDUP },
+    { RIL_REQUEST_SET_LOCATION_UPDATES, dispatchInts, responseVoid, DONT_DEDUP },
+    { 77, NULL, NULL, DONT_DEDUP },
+    { 78, NULL, NULL, DONT_DEDUP },
+    { 79, NULL, NULL, DONT_DEDUP },
+    { RIL_REQUEST_SET_TTY_MODE, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_QUERY_TTY_MODE, dispatchVoid, responseInts, DONT_DEDUP },
+    { 82, NULL, NULL, DONT_DEDUP },
+    { 83, NULL, NULL, DONT_DEDUP },
+    { 84, NULL, NULL, DONT_DEDUP },
+    { 85, NULL, NULL, DONT_DEDUP },
+    { 86, NULL, NULL, DONT_DEDUP },
+    { 87, NULL, NULL, DONT_DEDUP },
+    { 88, NULL, NULL, DONT_DEDUP },
+    { RIL_REQUEST_GSM_GET_BROADCAST_SMS_CONFIG, dispatchVoid, responseGsmBrSmsCnf, DONT_DEDUP },
+    { RIL_REQUEST_GSM_SET_BROADCAST_SMS_CONFIG, dispatchGsmBrSmsCnf, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_GSM_SMS_BROADCAST_ACTIVATION, dispatchInts, responseVoid, DONT_DEDUP },
+    { 92, NULL, NULL, DONT_DEDUP },
+    { 93, NULL, NULL, DONT_DEDUP },
+    { 94, NULL, NULL, DONT_DEDUP },
+    { 95, NULL, NULL, DONT_DEDUP },
+    { 96, NULL, NULL, DONT_DEDUP },
+    { 97, NULL, NULL, DONT_DEDUP },
+    { RIL_REQUEST_DEVICE_IDENTITY, dispatchVoid, responseStrings, DEDUP_INFLIGHT },
+    { RIL_REQUEST_EXIT_EMERGENCY_CALLBACK_MODE, dispatchVoid, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_GET_SMSC_ADDRESS, dispatchVoid, responseString, DEDUP_INFLIGHT },
+    { RIL_REQUEST_SET_SMSC_ADDRESS, dispatchString, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_REPORT_SMS_MEMORY_STATUS, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_REPORT_STK_SERVICE_IS_RUNNING, dispatchVoid, responseVoid, DONT_DEDUP },
+    { 104, NULL, NULL, DONT_DEDUP },
+    { RIL_REQUEST_ISIM_AUTHENTICATION, dispatchString, responseString, DONT_DEDUP },
+    { RIL_REQUEST_ACKNOWLEDGE_INCOMING_GSM_SMS_WITH_PDU, dispatchStrings, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_STK_SEND_ENVELOPE_WITH_STATUS, dispatchString, responseSIM_IO, DONT_DEDUP },
+    { RIL_REQUEST_VOICE_RADIO_TECH, dispatchVoiceRadioTech, responseInts, DEDUP_INFLIGHT },
+    { RIL_REQUEST_GET_CELL_INFO_LIST, dispatchVoid, responseCellInfoList, DEDUP_INFLIGHT },
+    { RIL_REQUEST_SET_UNSOL_CELL_INFO_LIST_RATE, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_SET_INITIAL_ATTACH_APN, dispatchSetInitialAttachApn, responseVoid, DONT_DEDUP },
+    { 112, NULL, NULL, DONT_DEDUP },
+    { RIL_REQUEST_IMS_SEND_SMS, dispatchImsSms, responseSMS, DONT_DEDUP },
+    { RIL_REQUEST_SIM_TRANSMIT_APDU_BASIC, dispatchSIM_APDU, responseSIM_IO, DONT_DEDUP },
+    { RIL_REQUEST_SIM_OPEN_CHANNEL, dispatchString, responseInts, DONT_DEDUP },
+    { RIL_REQUEST_SIM_CLOSE_CHANNEL, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_SIM_TRANSMIT_APDU_CHANNEL, dispatchSIM_APDU, responseSIM_IO, DONT_DEDUP },
+    { 118, NULL, NULL, DONT_DEDUP },
+    { 119, NULL, NULL, DONT_DEDUP },
+    { 120, NULL, NULL, DONT_DEDUP },
+    { 121, NULL, NULL, DONT_DEDUP },
+    { 122, NULL, NULL, DONT_DEDUP },
+    { RIL_REQUEST_ALLOW_DATA, dispatchInts, responseVoid, DONT_DEDUP },
+    { 124, NULL, NULL, DONT_DEDUP },
+    { 125, NULL, NULL, DONT_DEDUP },
+    { 126, NULL, NULL, DONT_DEDUP },
+    { 127, NULL, NULL, DONT_DEDUP },
+    { RIL_REQUEST_SET_DATA_PROFILE, dispatchDataProfile, responseVoid, DONT_DEDUP },
+    { 129, dispatchVoid, responseVoid, DONT_DEDUP },
+    { 130, NULL, NULL, DONT_DEDUP },
+    { 131, NULL, NULL, DONT_DEDUP },
+    { 132, dispatchInts, NULL, DONT_DEDUP },
+    { 133, dispatchVoid, NULL, DONT_DEDUP },
+    { 134, NULL, NULL, DONT_DEDUP },
+    { RIL_REQUEST_GET_ACTIVITY_INFO, dispatchVoid, responseActivityData, DONT_DEDUP },
+    { 136, NULL, NULL, DONT_DEDUP },
+    { 137, NULL, NULL, DONT_DEDUP },
+    { 138, NULL, NULL, DONT_DEDUP },
+    { 139, NULL, NULL, DONT_DEDUP },
+    { 140, NULL, NULL, DONT_DEDUP },
+    { 141, NULL, NULL, DONT_DEDUP },
+    { 142, NULL, NULL, DONT_DEDUP },
+    { 143, NULL, NULL, DONT_DEDUP },
+    { 144, NULL, NULL, DONT_DEDUP },
+    { 145, NULL, NULL, DONT_DEDUP },
+    { RIL_REQUEST_ENABLE_MODEM, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_GET_MODEM_STATUS, dispatchVoid, responseInts, DONT_DEDUP },
+    { RIL_REQUEST_DEFLECT_CALL, dispatchString, responseVoid, DONT_DEDUP },
\ No newline at end of file
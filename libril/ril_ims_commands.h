@@ -15,11 +15,11 @@
 ** limitations under the License.
 */
 // none
-{ 0, NULL, NULL },
+{ 0, NULL, NULL, DONT_DEDUP },
     // 500
-    { RIL_REQUEST_IMS_REG_STATE_CHANGE, dispatchInts, responseVoid },
-    { RIL_REQUEST_IMS_REGISTRATION_STATE, dispatchVoid, responseImsStatus },
-    { RIL_REQUEST_IMS_SET_SERVICE_STATUS, dispatchInts, responseVoid },
-    { RIL_REQUEST_ADD_PARTICIPANT, dispatchConferenceInvite, responseVoid },
-    { 505, NULL, NULL },
-    { RIL_REQUEST_DIAL_CONFERENCE, dispatchConferenceInvite, responseVoid },
+    { RIL_REQUEST_IMS_REG_STATE_CHANGE, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_IMS_REGISTRATION_STATE, dispatchVoid, responseImsStatus, DEDUP_INFLIGHT },
+    { RIL_REQUEST_IMS_SET_SERVICE_STATUS, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_ADD_PARTICIPANT, dispatchConferenceInvite, responseVoid, DONT_DEDUP },
+    { 505, NULL, NULL, DONT_DEDUP },
+    { RIL_REQUEST_DIAL_CONFERENCE, dispatchConferenceInvite, responseVoid, DONT_DEDUP },
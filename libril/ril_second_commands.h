@@ -15,14 +15,14 @@
 ** limitations under the License.
 */
 // none
-{ 0, NULL, NULL },
+{ 0, NULL, NULL, DONT_DEDUP },
     // 200
-    { 201, NULL, NULL },
-    { 202, NULL, NULL },
-    { 203, NULL, NULL },
-    { 204, NULL, NULL },
-    { RIL_REQUEST_EMERGENCY_DIAL, dispatchDial, responseVoid },
-    { 206, NULL, NULL },
-    { 207, NULL, NULL },
-    { RIL_REQUEST_ENABLE_UICC_APPLICATIONS, dispatchInts, responseVoid },
-    { RIL_REQUEST_GET_UICC_APPLICATIONS_ENABLEMENT, dispatchVoid, responseInts },
+    { 201, NULL, NULL, DONT_DEDUP },
+    { 202, NULL, NULL, DONT_DEDUP },
+    { 203, NULL, NULL, DONT_DEDUP },
+    { 204, NULL, NULL, DONT_DEDUP },
+    { RIL_REQUEST_EMERGENCY_DIAL, dispatchDial, responseVoid, DONT_DEDUP },
+    { 206, NULL, NULL, DONT_DEDUP },
+    { 207, NULL, NULL, DONT_DEDUP },
+    { RIL_REQUEST_ENABLE_UICC_APPLICATIONS, dispatchInts, responseVoid, DONT_DEDUP },
+    { RIL_REQUEST_GET_UICC_APPLICATIONS_ENABLEMENT, dispatchVoid, responseInts, DONT_DEDUP },
@@ -18,9 +18,11 @@
 #define NDEBUG 1
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/cdefs.h>
 
+#include <telephony/librilutils.h>
 #include <telephony/ril_log.h>
 
 #include "at_call.h"
@@ -34,6 +36,156 @@
 #define MAX_PARTICIPANTS 5
 #define MAX_TEL_DIGITS 15
 
+/* call table, see CallEntry */
+#define MAX_CALLS 7 /* call indexes are 1 to 7, 3GPP 22.030 6.5.5.1 */
+#define MAX_CALL_NUMBER_LEN 64
+#define CALL_TABLE_MAX_AGE_MSEC 5000
+
+/*
+ * Supplementary services are held by the network, which may change them
+ * behind our back (e.g. from another device), so their queries are only
+ * reused for a while. Our own settings drop them through the verb family.
+ */
+static const ATCachePolicy s_suppServiceCache = { 60000, NULL, AT_CACHE_SIM_CHANGED };
+
+/*
+ * The calls of the last AT+CLCC, so GET_CURRENT_CALLS can be answered
+ * without asking the modem while nothing changed them. The call URCs do
+ * not tell which call changed, so each one makes the table stale, except
+ * a repeated RING for a call already ringing. So do requests that act on
+ * calls, from their start until they completed. |s_callGeneration| moves
+ * on each of these, and a CLCC that raced one is not taken as fresh.
+ * DIALING and ALERTING calls change without a URC on many modems, so a
+ * table holding one is never fresh, and one holding any call is asked
+ * for again after CALL_TABLE_MAX_AGE_MSEC. |s_callTableMutex| guards it.
+ */
+typedef struct {
+    RIL_Call call;
+    char number[MAX_CALL_NUMBER_LEN];
+} CallEntry;
+
+static pthread_mutex_t s_callTableMutex = PTHREAD_MUTEX_INITIALIZER;
+static CallEntry s_calls[MAX_CALLS];
+static int s_numCalls;
+static bool s_callTableFresh;
+static uint64_t s_callTableTime;
+static unsigned int s_callGeneration;
+static int s_callChangesPending;
+
+/* assumes s_callTableMutex is held */
+static void invalidateCallTableLocked(void)
+{
+    s_callTableFresh = false;
+    s_callGeneration++;
+}
+
+static void invalidateCallTable(void)
+{
+    pthread_mutex_lock(&s_callTableMutex);
+    invalidateCallTableLocked();
+    pthread_mutex_unlock(&s_callTableMutex);
+}
+
+/**
+ * Copies the calls to "p_entries" if the table is fresh. Returns their
+ * count, or -1 with the generation to pass to storeCallTable() in
+ * *p_generation if the modem has to be asked
+ */
+static int readCallTable(CallEntry* p_entries, unsigned int* p_generation)
+{
+    int count = -1;
+
+    pthread_mutex_lock(&s_callTableMutex);
+
+    if (s_callTableFresh && s_callChangesPending == 0
+        && (s_numCalls == 0
+            || (ril_nano_time() - s_callTableTime) / 1000000 < CALL_TABLE_MAX_AGE_MSEC)) {
+        count = s_numCalls;
+        memcpy(p_entries, s_calls, count * sizeof(CallEntry));
+    }
+
+    *p_generation = s_callGeneration;
+
+    pthread_mutex_unlock(&s_callTableMutex);
+
+    for (int i = 0; i < count; i++) {
+        if (p_entries[i].call.number != NULL) {
+            p_entries[i].call.number = p_entries[i].number;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Replaces the table with the "count" calls of a CLCC sent at
+ * "generation". "complete" is false if some lines could not be parsed
+ */
+static void storeCallTable(const RIL_Call* p_calls, int count, bool complete,
+    unsigned int generation)
+{
+    bool fresh = complete && count <= MAX_CALLS;
+
+    for (int i = 0; fresh && i < count; i++) {
+        fresh = p_calls[i].state != RIL_CALL_DIALING && p_calls[i].state != RIL_CALL_ALERTING
+            && (p_calls[i].number == NULL || strlen(p_calls[i].number) < MAX_CALL_NUMBER_LEN);
+    }
+
+    pthread_mutex_lock(&s_callTableMutex);
+
+    if (!fresh || generation != s_callGeneration) {
+        s_callTableFresh = false;
+        pthread_mutex_unlock(&s_callTableMutex);
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        s_calls[i].call = p_calls[i];
+        if (p_calls[i].number != NULL) {
+            strcpy(s_calls[i].number, p_calls[i].number);
+            s_calls[i].call.number = s_calls[i].number;
+        }
+    }
+
+    s_numCalls = count;
+    s_callTableTime = ril_nano_time();
+    s_callTableFresh = true;
+
+    pthread_mutex_unlock(&s_callTableMutex);
+}
+
+/* a request that acts on calls starts (begin true) or completed */
+static void trackCallChange(bool begin)
+{
+    pthread_mutex_lock(&s_callTableMutex);
+    s_callChangesPending += begin ? 1 : -1;
+    invalidateCallTableLocked();
+    pthread_mutex_unlock(&s_callTableMutex);
+}
+
+static bool changesCalls(int request)
+{
+    switch (request) {
+    case RIL_REQUEST_DIAL:
+    case RIL_REQUEST_EMERGENCY_DIAL:
+    case RIL_REQUEST_HANGUP:
+    case RIL_REQUEST_HANGUP_WAITING_OR_BACKGROUND:
+    case RIL_REQUEST_HANGUP_FOREGROUND_RESUME_BACKGROUND:
+    case RIL_REQUEST_SWITCH_WAITING_OR_HOLDING_AND_ACTIVE:
+    case RIL_REQUEST_CONFERENCE:
+    case RIL_REQUEST_UDUB:
+    case RIL_REQUEST_EXPLICIT_CALL_TRANSFER:
+    case RIL_REQUEST_ANSWER:
+    case RIL_REQUEST_SEPARATE_CONNECTION:
+    case RIL_REQUEST_DEFLECT_CALL:
+    case RIL_REQUEST_ADD_PARTICIPANT:
+    case RIL_REQUEST_DIAL_CONFERENCE:
+        return true;
+    default:
+        return false;
+    }
+}
+
 static int clccStateToRILState(int state, RIL_CallState* p_state)
 {
     switch (state) {
@@ -154,7 +306,6 @@ static void requestCallFailCause(void* data, size_t datalen, RIL_Token t)
     (void)data;
     (void)datalen;
 
-    char* line = NULL;
     ATResponse* p_response = NULL;
     int err = -1;
     int cause = 0;
@@ -165,15 +316,7 @@ static void requestCallFailCause(void* data, size_t datalen, RIL_Token t)
         goto error;
     }
 
-    line = p_response->p_intermediates->line;
-    err = at_tok_start(&line);
-    if (err < 0) {
-        RLOGE("Failed to parse line in %s", __func__);
-        goto error;
-    }
-
-    err = at_tok_nextint(&line, &cause);
-    if (err < 0) {
+    if (at_tok_parse(p_response->p_intermediates->line, "+CEER: %d", &cause) != 1) {
         RLOGE("Failed to parse fail cause in %s", __func__);
         goto error;
     }
@@ -263,6 +406,8 @@ static void requestGetCurrentCalls(void* data, size_t datalen, RIL_Token t)
     (void)data;
     (void)datalen;
 
+    CallEntry cached[MAX_CALLS];
+    unsigned int generation;
     int err = -1;
     ATResponse* p_response = NULL;
     ATLine* p_cur = NULL;
@@ -272,11 +417,23 @@ static void requestGetCurrentCalls(void* data, size_t datalen, RIL_Token t)
     RIL_Call** pp_calls = NULL;
     RIL_Errno ril_err = RIL_E_SUCCESS;
 
+    countValidCalls = readCallTable(cached, &generation);
+    if (countValidCalls >= 0) {
+        pp_calls = (RIL_Call**)alloca(countValidCalls * sizeof(RIL_Call*));
+        for (int i = 0; i < countValidCalls; i++) {
+            pp_calls[i] = &(cached[i].call);
+        }
+        goto on_exit;
+    }
+
+    countValidCalls = 0;
+
     err = at_send_command_multiline("AT+CLCC", "+CLCC:", &p_response);
 
     /* CLCC allows empty line if no calls found */
     if (err == AT_ERROR_INVALID_RESPONSE) {
         RLOGW("No current calls found");
+        storeCallTable(NULL, 0, true, generation);
         goto on_exit;
     }
 
@@ -313,6 +470,8 @@ static void requestGetCurrentCalls(void* data, size_t datalen, RIL_Token t)
         countValidCalls++;
     }
 
+    storeCallTable(p_calls, countValidCalls, countValidCalls == countCalls, generation);
+
 on_exit:
     RIL_onRequestComplete(t, ril_err, ril_err == RIL_E_SUCCESS ? pp_calls : NULL,
         ril_err == RIL_E_SUCCESS ? countValidCalls * sizeof(RIL_Call*) : 0);
@@ -794,7 +953,7 @@ static void requestQueryCallWaiting(void* data, size_t datalen, RIL_Token t)
         }
     }
 
-    err = at_send_command_multiline(cmd, "+CCWA:", &p_response);
+    err = at_send_command_cached(cmd, MULTILINE, "+CCWA:", &s_suppServiceCache, &p_response);
     if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
         RLOGE("Failure occurred in sending %s due to: %s", cmd, at_io_err_str(err));
         ril_err = RIL_E_GENERIC_FAILURE;
@@ -1108,7 +1267,6 @@ static void requestQueryClir(void* data, size_t datalen, RIL_Token t)
 
     int err = -1;
     int response[2] = { 1, 1 };
-    char* line = NULL;
     ATResponse* p_response = NULL;
 
     if (getSIMStatus() == SIM_ABSENT) {
@@ -1116,31 +1274,19 @@ static void requestQueryClir(void* data, size_t datalen, RIL_Token t)
         return;
     }
 
-    err = at_send_command_singleline("AT+CLIR?", "+CLIR:", &p_response);
+    err = at_send_command_cached("AT+CLIR?", SINGLELINE, "+CLIR:", &s_suppServiceCache, &p_response);
     if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
         RLOGE("Failure occurred in sending %s due to: %s", "AT+CLIR?", at_io_err_str(err));
         goto error;
     }
 
-    line = p_response->p_intermediates->line;
-    err = at_tok_start(&line);
-    if (err < 0) {
+    if (at_tok_parse(p_response->p_intermediates->line, "+CLIR: %d,%d",
+            &response[0], &response[1])
+        != 2) {
         RLOGE("Failed to parse line in %s", __func__);
         goto error;
     }
 
-    err = at_tok_nextint(&line, &response[0]);
-    if (err < 0) {
-        RLOGE("Failed to parse response[0] in %s", __func__);
-        goto error;
-    }
-
-    err = at_tok_nextint(&line, &response[1]);
-    if (err < 0) {
-        RLOGE("Failed to parse response[0] in %s", __func__);
-        goto error;
-    }
-
     RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof(response));
     at_response_free(p_response);
     return;
@@ -1156,9 +1302,7 @@ static void requestQueryClip(void* data, size_t datalen, RIL_Token t)
     (void)data;
 
     int err = -1;
-    int skip = 0;
     int response = 0;
-    char* line = NULL;
     ATResponse* p_response = NULL;
 
     if (getSIMStatus() == SIM_ABSENT) {
@@ -1166,27 +1310,15 @@ static void requestQueryClip(void* data, size_t datalen, RIL_Token t)
         return;
     }
 
-    err = at_send_command_singleline("AT+CLIP?", "+CLIP:", &p_response);
+    err = at_send_command_cached("AT+CLIP?", SINGLELINE, "+CLIP:", &s_suppServiceCache, &p_response);
     if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
         RLOGE("Failure occurred in sending %s due to: %s", "AT+CLIP?", at_io_err_str(err));
         goto error;
     }
 
-    line = p_response->p_intermediates->line;
-    err = at_tok_start(&line);
-    if (err < 0) {
-        RLOGE("Failed to parse line in %s", __func__);
-        goto error;
-    }
-
-    err = at_tok_nextint(&line, &skip);
-    if (err < 0) {
-        RLOGE("Failed to parse integer in %s", __func__);
-        goto error;
-    }
-
-    err = at_tok_nextint(&line, &response);
-    if (err < 0) {
+    if (at_tok_parse(p_response->p_intermediates->line, "+CLIP: %_,%d",
+            &response)
+        != 2) {
         RLOGE("Failed to parse clip in %s", __func__);
         goto error;
     }
@@ -1207,7 +1339,6 @@ static void requestGetMute(void* data, size_t datalen, RIL_Token t)
 
     int err = -1;
     int muteResponse = 0; // Mute disabled
-    char* line = NULL;
     ATResponse* p_response = NULL;
 
     err = at_send_command_singleline("AT+CMUT?", "+CMUT:", &p_response);
@@ -1216,15 +1347,9 @@ static void requestGetMute(void* data, size_t datalen, RIL_Token t)
         goto error;
     }
 
-    line = p_response->p_intermediates->line;
-    err = at_tok_start(&line);
-    if (err < 0) {
-        RLOGE("Failed to parse line in %s", __func__);
-        goto error;
-    }
-
-    err = at_tok_nextint(&line, &muteResponse);
-    if (err < 0) {
+    if (at_tok_parse(p_response->p_intermediates->line, "+CMUT: %d",
+            &muteResponse)
+        != 1) {
         RLOGE("Failed to parse mute in %s", __func__);
         goto error;
     }
@@ -1408,6 +1533,12 @@ static void requestGetTtyMode(void* data, size_t datalen, RIL_Token t)
 
 void on_request_call(int request, void* data, size_t datalen, RIL_Token t)
 {
+    bool change = changesCalls(request);
+
+    if (change) {
+        trackCallChange(true);
+    }
+
     switch (request) {
     case RIL_REQUEST_GET_CURRENT_CALLS:
         requestGetCurrentCalls(data, datalen, t);
@@ -1502,68 +1633,114 @@ void on_request_call(int request, void* data, size_t datalen, RIL_Token t)
         break;
     }
 
+    if (change) {
+        trackCallChange(false);
+    }
+
     RLOGD("On request call end\n");
 }
 
-bool try_handle_unsol_call(const char* s)
+static void onCallStateChangedUnsol(const char* s, const char* sms_pdu)
 {
-    bool ret = false;
-    char *line = NULL, *p;
-
-    RLOGD("unsol call string: %s", s);
-
-    if (strStartsWith(s, "+CRING:")
-        || strStartsWith(s, "RING")
-        || strStartsWith(s, "NO CARRIER")
-        || strStartsWith(s, "+CCWA")
-        || strStartsWith(s, "ALERTING")) {
-        RLOGI("Receive call state changed URC");
-        RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED, NULL, 0);
-        ret = true;
-    } else if (strStartsWith(s, "HOLD")) {
-        RLOGI("Receive supplementary service URC(Remote HOLD)");
-        unsolicitedSuppSvcNotification(1, 2, 0, 0, NULL);
-        ret = true;
-    } else if (strStartsWith(s, "UNHOLD")) {
-        RLOGI("Receive supplementary service URC(Remote UNHOLD)");
-        unsolicitedSuppSvcNotification(1, 3, 0, 0, NULL);
-        ret = true;
-    } else if (strStartsWith(s, "MPTY")) {
-        RLOGI("Receive supplementary service URC(Remote MPTY)");
-        unsolicitedSuppSvcNotification(1, 4, 0, 0, NULL);
-        ret = true;
-    } else if (strStartsWith(s, "UNMPTY")) {
-        RLOGI("Receive supplementary service URC(Remote UNMPTY)");
-        unsolicitedSuppSvcNotification(1, 10, 0, 0, NULL);
-        ret = true;
-    } else if (strStartsWith(s, "+WSOS: ")) {
-        RLOGI("Receive emergency mode changed URC");
-        char state = 0;
-        int unsol;
-        line = p = strdup(s);
-        if (!line) {
-            RLOGE("+WSOS: Unable to allocate memory");
-            return true;
-        }
-        if (at_tok_start(&p) < 0) {
-            RLOGE("invalid response string");
-            free(line);
-            return true;
-        }
-        if (at_tok_nextbool(&p, &state) < 0) {
-            RLOGE("invalid +WSOS response: %s", line);
-            free(line);
-            return true;
-        }
-        free(line);
+    (void)s;
+    (void)sms_pdu;
 
-        unsol = state ? RIL_UNSOL_ENTER_EMERGENCY_CALLBACK_MODE : RIL_UNSOL_EXIT_EMERGENCY_CALLBACK_MODE;
+    RLOGI("Receive call state changed URC");
+    invalidateCallTable();
+    RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED, NULL, 0);
+}
 
-        RIL_onUnsolicitedResponse(unsol, NULL, 0);
-        ret = true;
-    } else {
-        RLOGD("Can't match any unsol call handlers");
+static void onRingUnsol(const char* s, const char* sms_pdu)
+{
+    bool ringing = false;
+
+    (void)s;
+    (void)sms_pdu;
+
+    RLOGI("Receive ring URC");
+
+    /* RING repeats while a call is incoming, that one changes nothing */
+    pthread_mutex_lock(&s_callTableMutex);
+    for (int i = 0; s_callTableFresh && i < s_numCalls; i++) {
+        ringing = ringing || s_calls[i].call.state == RIL_CALL_INCOMING;
+    }
+    if (!ringing) {
+        invalidateCallTableLocked();
+    }
+    pthread_mutex_unlock(&s_callTableMutex);
+
+    RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED, NULL, 0);
+}
+
+static void onRemoteHoldUnsol(const char* s, const char* sms_pdu)
+{
+    (void)s;
+    (void)sms_pdu;
+
+    RLOGI("Receive supplementary service URC(Remote HOLD)");
+    unsolicitedSuppSvcNotification(1, 2, 0, 0, NULL);
+}
+
+static void onRemoteUnholdUnsol(const char* s, const char* sms_pdu)
+{
+    (void)s;
+    (void)sms_pdu;
+
+    RLOGI("Receive supplementary service URC(Remote UNHOLD)");
+    unsolicitedSuppSvcNotification(1, 3, 0, 0, NULL);
+}
+
+static void onRemoteMptyUnsol(const char* s, const char* sms_pdu)
+{
+    (void)s;
+    (void)sms_pdu;
+
+    RLOGI("Receive supplementary service URC(Remote MPTY)");
+    unsolicitedSuppSvcNotification(1, 4, 0, 0, NULL);
+}
+
+static void onRemoteUnmptyUnsol(const char* s, const char* sms_pdu)
+{
+    (void)s;
+    (void)sms_pdu;
+
+    RLOGI("Receive supplementary service URC(Remote UNMPTY)");
+    unsolicitedSuppSvcNotification(1, 10, 0, 0, NULL);
+}
+
+static void onEmergencyModeUnsol(const char* s, const char* sms_pdu)
+{
+    char state = 0;
+    int unsol;
+
+    (void)sms_pdu;
+
+    RLOGI("Receive emergency mode changed URC");
+    if (at_tok_parse(s, "+WSOS: %b", &state) != 1) {
+        RLOGE("invalid +WSOS response: %s", s);
+        return;
     }
 
-    return ret;
+    unsol = state ? RIL_UNSOL_ENTER_EMERGENCY_CALLBACK_MODE : RIL_UNSOL_EXIT_EMERGENCY_CALLBACK_MODE;
+
+    RIL_onUnsolicitedResponse(unsol, NULL, 0);
+}
+
+static const ATUnsolPrefix s_callUnsols[] = {
+    { "+CRING:", onRingUnsol },
+    { "RING", onRingUnsol },
+    { "NO CARRIER", onCallStateChangedUnsol },
+    { "+CCWA", onCallStateChangedUnsol },
+    { "ALERTING", onCallStateChangedUnsol },
+    { "HOLD", onRemoteHoldUnsol },
+    { "UNHOLD", onRemoteUnholdUnsol },
+    { "MPTY", onRemoteMptyUnsol },
+    { "UNMPTY", onRemoteUnmptyUnsol },
+    { "+WSOS: ", onEmergencyModeUnsol },
+};
+
+int register_unsol_call(void)
+{
+    return at_register_unsol_handlers(s_callUnsols,
+        sizeof(s_callUnsols) / sizeof(s_callUnsols[0]));
 }
\ No newline at end of file
@@ -21,6 +21,6 @@
 #include <telephony/ril.h>
 
 void on_request_call(int request, void* data, size_t datalen, RIL_Token t);
-bool try_handle_unsol_call(const char* s);
+int register_unsol_call(void);
 
 #endif
\ No newline at end of file
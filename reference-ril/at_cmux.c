@@ -0,0 +1,608 @@
+/*
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#define LOG_TAG "AT_CMUX"
+#define NDEBUG 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <telephony/ril_log.h>
+
+#include "at_cmux.h"
+
+/*
+ * TS 27.010 basic option multiplexer. Every DLC is handed to atchannel as
+ * one end of a socketpair; |s_tid_mux| moves the bytes between the other
+ * ends and UIH frames on the tty:
+ *
+ *   flag | address | control | length | information | FCS | flag
+ */
+#define CMUX_FLAG 0xF9
+#define CMUX_EA 0x01
+#define CMUX_CR 0x02
+#define CMUX_PF 0x10
+
+/* control field without the P/F bit */
+#define CMUX_SABM 0x2F
+#define CMUX_UA 0x63
+#define CMUX_DM 0x0F
+#define CMUX_DISC 0x43
+#define CMUX_UIH 0xEF
+#define CMUX_UI 0x03
+
+/* multiplexer control messages on DLCI 0 */
+#define CMUX_CLD 0xC1
+#define CMUX_MSC 0xE1
+
+/* modem status signals: ready to communicate, ready to receive, valid data */
+#define CMUX_MSC_SIGNALS (CMUX_EA | 0x04 | 0x08 | 0x80)
+
+#define CMUX_N1 31 /* default maximum information length of basic mode */
+#define CMUX_RX_BUFFER (4 * 1024)
+#define CMUX_TIMEOUT_MSEC 3000
+
+#define NS_PER_S 1000000000
+
+enum {
+    DLC_CLOSED,
+    DLC_OPENING,
+    DLC_OPEN,
+    DLC_REJECTED
+};
+
+static int s_ttyFd = -1;
+static int s_numDlcs;
+
+/* multiplexer end of the stream of each DLC, indexed by DLCI */
+static int s_dlcFds[CMUX_MAX_DLCS + 1];
+
+static pthread_mutex_t s_stateMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_stateCond = PTHREAD_COND_INITIALIZER;
+static int s_dlcState[CMUX_MAX_DLCS + 1];
+
+/* frames are written from the mux thread and while starting up */
+static pthread_mutex_t s_writeMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t s_tid_mux;
+static bool s_muxJoinable;
+static int s_stopFds[2] = { -1, -1 };
+
+static uint8_t s_rxBuffer[CMUX_RX_BUFFER];
+static size_t s_rxLen;
+
+static pthread_once_t s_crcOnce = PTHREAD_ONCE_INIT;
+static uint8_t s_crcTable[256];
+
+/* TS 27.010 5.2.1.6, reflected CRC-8 with polynomial x^8 + x^2 + x + 1 */
+static void initCrcTable(void)
+{
+    int i;
+    int bit;
+
+    for (i = 0; i < 256; i++) {
+        uint8_t crc = (uint8_t)i;
+
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (uint8_t)((crc >> 1) ^ 0xE0) : (uint8_t)(crc >> 1);
+        }
+
+        s_crcTable[i] = crc;
+    }
+}
+
+static uint8_t crcOf(const uint8_t* p, size_t len)
+{
+    uint8_t crc = 0xFF;
+
+    while (len-- > 0) {
+        crc = s_crcTable[crc ^ *p++];
+    }
+
+    return crc;
+}
+
+static int writeAll(int fd, const void* buf, size_t len)
+{
+    const uint8_t* p = (const uint8_t*)buf;
+    ssize_t written;
+
+    while (len > 0) {
+        do {
+            written = write(fd, p, len);
+        } while (written < 0 && errno == EINTR);
+
+        if (written <= 0) {
+            return -1;
+        }
+
+        p += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+/* len must not exceed CMUX_N1 */
+static int sendFrame(int dlci, uint8_t control, const uint8_t* data, size_t len)
+{
+    uint8_t frame[CMUX_N1 + 6];
+    size_t n = 0;
+    int ret;
+
+    frame[n++] = CMUX_FLAG;
+    frame[n++] = (uint8_t)((dlci << 2) | CMUX_CR | CMUX_EA);
+    frame[n++] = control;
+    frame[n++] = (uint8_t)((len << 1) | CMUX_EA);
+
+    if (len > 0) {
+        memcpy(frame + n, data, len);
+        n += len;
+    }
+
+    /* basic mode UIH frames only cover the header */
+    frame[n++] = 0xFF - crcOf(frame + 1, 3);
+    frame[n++] = CMUX_FLAG;
+
+    pthread_mutex_lock(&s_writeMutex);
+    ret = writeAll(s_ttyFd, frame, n);
+    pthread_mutex_unlock(&s_writeMutex);
+
+    if (ret < 0) {
+        RLOGE("CMUX write failed on DLCI %d: %s", dlci, strerror(errno));
+    }
+
+    return ret;
+}
+
+static void closeDlc(int dlci)
+{
+    if (s_dlcFds[dlci] >= 0) {
+        close(s_dlcFds[dlci]);
+        s_dlcFds[dlci] = -1;
+    }
+}
+
+static void setDlcState(int dlci, int state)
+{
+    pthread_mutex_lock(&s_stateMutex);
+    s_dlcState[dlci] = state;
+    pthread_cond_broadcast(&s_stateCond);
+    pthread_mutex_unlock(&s_stateMutex);
+}
+
+static void handleControlMessage(const uint8_t* data, size_t len)
+{
+    uint8_t reply[CMUX_N1];
+
+    if (len < 2 || len > sizeof(reply)) {
+        return;
+    }
+
+    /* acknowledge modem status commands with the same content */
+    if (data[0] == (CMUX_MSC | CMUX_CR)) {
+        memcpy(reply, data, len);
+        reply[0] = CMUX_MSC;
+        sendFrame(0, CMUX_UIH, reply, len);
+    }
+}
+
+static void handleFrame(int dlci, uint8_t control, const uint8_t* data, size_t len)
+{
+    if (dlci > s_numDlcs) {
+        RLOGW("CMUX frame for unknown DLCI %d", dlci);
+        return;
+    }
+
+    switch (control) {
+    case CMUX_UA:
+        setDlcState(dlci, DLC_OPEN);
+        break;
+    case CMUX_DM:
+        setDlcState(dlci, DLC_REJECTED);
+        break;
+    case CMUX_DISC:
+        sendFrame(dlci, CMUX_UA | CMUX_PF, NULL, 0);
+        setDlcState(dlci, DLC_CLOSED);
+        closeDlc(dlci);
+        break;
+    case CMUX_UIH:
+    case CMUX_UI:
+        if (dlci == 0) {
+            handleControlMessage(data, len);
+        } else if (s_dlcFds[dlci] >= 0 && writeAll(s_dlcFds[dlci], data, len) < 0) {
+            RLOGE("CMUX DLCI %d stream closed", dlci);
+            closeDlc(dlci);
+        }
+        break;
+    default:
+        RLOGW("CMUX unhandled control 0x%02x on DLCI %d", control, dlci);
+        break;
+    }
+}
+
+/* Handles the complete frames in s_rxBuffer and keeps what is left */
+static void parseFrames(void)
+{
+    size_t pos = 0;
+
+    while (pos < s_rxLen) {
+        const uint8_t* p = s_rxBuffer + pos;
+        size_t avail = s_rxLen - pos;
+        size_t hdrLen;
+        size_t infoLen;
+        size_t frameLen;
+
+        if (p[0] != CMUX_FLAG || (avail > 1 && p[1] == CMUX_FLAG)) {
+            /* skip garbage and repeated flags */
+            pos++;
+            continue;
+        }
+
+        if (avail < 5) {
+            break;
+        }
+
+        if (p[3] & CMUX_EA) {
+            hdrLen = 3;
+            infoLen = p[3] >> 1;
+        } else {
+            hdrLen = 4;
+            infoLen = (p[3] >> 1) | ((size_t)p[4] << 7);
+        }
+
+        /* opening flag, header, information and FCS; the closing flag
+         * may also open the next frame */
+        frameLen = 1 + hdrLen + infoLen + 1;
+
+        if (frameLen + 1 > sizeof(s_rxBuffer)) {
+            RLOGE("CMUX frame too long, resyncing");
+            pos++;
+            continue;
+        }
+
+        if (avail < frameLen + 1) {
+            break;
+        }
+
+        if (p[frameLen] != CMUX_FLAG
+            || s_crcTable[crcOf(p + 1, hdrLen) ^ p[frameLen - 1]] != 0xCF) {
+            RLOGW("CMUX bad frame, resyncing");
+            pos++;
+            continue;
+        }
+
+        handleFrame(p[1] >> 2, p[2] & ~CMUX_PF, p + 1 + hdrLen, infoLen);
+
+        pos += frameLen;
+    }
+
+    memmove(s_rxBuffer, s_rxBuffer + pos, s_rxLen - pos);
+    s_rxLen -= pos;
+}
+
+static void* muxLoop(void* arg)
+{
+    struct pollfd fds[CMUX_MAX_DLCS + 2];
+    uint8_t buf[CMUX_N1];
+    ssize_t count;
+    int dlci;
+    int ret;
+
+    (void)arg;
+
+    for (;;) {
+        fds[0].fd = s_ttyFd;
+        fds[1].fd = s_stopFds[0];
+        for (dlci = 1; dlci <= s_numDlcs; dlci++) {
+            /* negative fds are ignored by poll() */
+            fds[dlci + 1].fd = s_dlcFds[dlci];
+        }
+        for (dlci = 0; dlci < s_numDlcs + 2; dlci++) {
+            fds[dlci].events = POLLIN;
+            fds[dlci].revents = 0;
+        }
+
+        ret = poll(fds, s_numDlcs + 2, -1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            RLOGE("CMUX poll: %s", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) {
+            do {
+                count = read(s_ttyFd, s_rxBuffer + s_rxLen, sizeof(s_rxBuffer) - s_rxLen);
+            } while (count < 0 && errno == EINTR);
+
+            if (count <= 0) {
+                RLOGE("CMUX tty closed");
+                break;
+            }
+
+            s_rxLen += count;
+            parseFrames();
+        }
+
+        for (dlci = 1; dlci <= s_numDlcs; dlci++) {
+            if (!(fds[dlci + 1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            do {
+                count = read(s_dlcFds[dlci], buf, sizeof(buf));
+            } while (count < 0 && errno == EINTR);
+
+            if (count <= 0) {
+                /* the AT channel on this DLC was closed */
+                sendFrame(dlci, CMUX_DISC | CMUX_PF, NULL, 0);
+                closeDlc(dlci);
+                continue;
+            }
+
+            sendFrame(dlci, CMUX_UIH, buf, count);
+        }
+    }
+
+    /* the AT channels see EOF */
+    for (dlci = 1; dlci <= s_numDlcs; dlci++) {
+        closeDlc(dlci);
+    }
+
+    return NULL;
+}
+
+/* Sends AT+CMUX=0 and waits for the final result, nothing else reads fd yet */
+static int enterMuxMode(int fd)
+{
+    static const char cmd[] = "AT+CMUX=0\r";
+    char buf[128];
+    size_t len = 0;
+    ssize_t count;
+    int ret;
+
+    RLOGD("AT> AT+CMUX=0\n");
+
+    if (writeAll(fd, cmd, strlen(cmd)) < 0) {
+        return -1;
+    }
+
+    for (;;) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+
+        ret = poll(&pfd, 1, CMUX_TIMEOUT_MSEC);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret <= 0) {
+            RLOGE("No response to AT+CMUX");
+            return -1;
+        }
+
+        do {
+            count = read(fd, buf + len, sizeof(buf) - 1 - len);
+        } while (count < 0 && errno == EINTR);
+
+        if (count <= 0) {
+            return -1;
+        }
+
+        len += count;
+        buf[len] = '\0';
+
+        /* echo may be on, the final result is on a line of its own */
+        if (strstr(buf, "\nOK\r") != NULL || strncmp(buf, "OK\r", 3) == 0) {
+            return 0;
+        }
+
+        if (strstr(buf, "ERROR") != NULL) {
+            RLOGE("AT+CMUX rejected");
+            return -1;
+        }
+
+        if (len == sizeof(buf) - 1) {
+            /* keep the tail, a result may be split across reads */
+            memmove(buf, buf + len - 8, 8);
+            len = 8;
+        }
+    }
+}
+
+static int openDlc(int dlci)
+{
+    struct timespec ts;
+    int state;
+    int ret = 0;
+
+    setDlcState(dlci, DLC_OPENING);
+
+    if (sendFrame(dlci, CMUX_SABM | CMUX_PF, NULL, 0) < 0) {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += CMUX_TIMEOUT_MSEC / 1000;
+    ts.tv_nsec += (CMUX_TIMEOUT_MSEC % 1000) * 1000000L;
+    if (ts.tv_nsec >= NS_PER_S) {
+        ts.tv_sec++;
+        ts.tv_nsec -= NS_PER_S;
+    }
+
+    pthread_mutex_lock(&s_stateMutex);
+    while (s_dlcState[dlci] == DLC_OPENING && ret == 0) {
+        ret = pthread_cond_timedwait(&s_stateCond, &s_stateMutex, &ts);
+    }
+    state = s_dlcState[dlci];
+    pthread_mutex_unlock(&s_stateMutex);
+
+    if (state != DLC_OPEN) {
+        RLOGE("CMUX DLCI %d not opened (%s)", dlci, ret != 0 ? "timeout" : "rejected");
+        return -1;
+    }
+
+    if (dlci > 0) {
+        uint8_t msc[] = {
+            CMUX_MSC | CMUX_CR,
+            (2 << 1) | CMUX_EA,
+            (uint8_t)((dlci << 2) | CMUX_CR | CMUX_EA),
+            CMUX_MSC_SIGNALS
+        };
+
+        sendFrame(0, CMUX_UIH, msc, sizeof(msc));
+    }
+
+    return 0;
+}
+
+/* Stops the mux thread and returns the modem to AT command mode */
+static void stopMux(void)
+{
+    static const uint8_t cld[] = { CMUX_CLD | CMUX_CR, CMUX_EA };
+    char buff[16];
+    int dlci;
+
+    if (!s_muxJoinable) {
+        return;
+    }
+
+    writeAll(s_stopFds[1], " ", 1);
+    pthread_join(s_tid_mux, NULL);
+    s_muxJoinable = false;
+
+    while (read(s_stopFds[0], buff, sizeof(buff)) > 0)
+        ;
+
+    sendFrame(0, CMUX_UIH, cld, sizeof(cld));
+
+    for (dlci = 0; dlci <= s_numDlcs; dlci++) {
+        closeDlc(dlci);
+        s_dlcState[dlci] = DLC_CLOSED;
+    }
+}
+
+int cmux_start(int fd, int numDlcs, int* p_dlcFds)
+{
+    int sv[2];
+    int dlci;
+    int ret;
+
+    if (numDlcs < 1 || numDlcs > CMUX_MAX_DLCS) {
+        RLOGE("Invalid number of CMUX DLCs %d", numDlcs);
+        return -1;
+    }
+
+    pthread_once(&s_crcOnce, initCrcTable);
+
+    if (s_stopFds[0] < 0) {
+        if (pipe(s_stopFds) < 0) {
+            RLOGE("Error in pipe() errno: %d", errno);
+            return -1;
+        }
+        fcntl(s_stopFds[0], F_SETFL, O_NONBLOCK);
+    }
+
+    if (enterMuxMode(fd) < 0) {
+        return -1;
+    }
+
+    s_ttyFd = fd;
+    s_numDlcs = numDlcs;
+    s_rxLen = 0;
+
+    for (dlci = 0; dlci <= CMUX_MAX_DLCS; dlci++) {
+        s_dlcFds[dlci] = -1;
+        s_dlcState[dlci] = DLC_CLOSED;
+    }
+
+    for (dlci = 1; dlci <= numDlcs; dlci++) {
+        p_dlcFds[dlci - 1] = -1;
+    }
+
+    for (dlci = 1; dlci <= numDlcs; dlci++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+            RLOGE("Error in socketpair() errno: %d", errno);
+            goto error;
+        }
+
+        p_dlcFds[dlci - 1] = sv[0];
+        s_dlcFds[dlci] = sv[1];
+    }
+
+    ret = pthread_create(&s_tid_mux, NULL, muxLoop, NULL);
+    if (ret != 0) {
+        RLOGE("pthread_create mux: %s", strerror(ret));
+        goto error;
+    }
+
+    s_muxJoinable = true;
+
+    /* the control channel first */
+    for (dlci = 0; dlci <= numDlcs; dlci++) {
+        if (openDlc(dlci) < 0) {
+            goto error;
+        }
+    }
+
+    RLOGI("CMUX started with %d DLCs", numDlcs);
+
+    return 0;
+
+error:
+    if (s_muxJoinable) {
+        stopMux();
+    } else {
+        for (dlci = 1; dlci <= numDlcs; dlci++) {
+            closeDlc(dlci);
+        }
+    }
+
+    for (dlci = 1; dlci <= numDlcs; dlci++) {
+        if (p_dlcFds[dlci - 1] >= 0) {
+            close(p_dlcFds[dlci - 1]);
+            p_dlcFds[dlci - 1] = -1;
+        }
+    }
+
+    /* the caller keeps fd */
+    s_ttyFd = -1;
+
+    return -1;
+}
+
+void cmux_stop(void)
+{
+    stopMux();
+
+    if (s_ttyFd >= 0) {
+        close(s_ttyFd);
+        s_ttyFd = -1;
+    }
+}
@@ -0,0 +1,42 @@
+/*
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef _AT_CMUX_H
+#define _AT_CMUX_H
+
+/**
+ * number of TS 27.010 DLCs to run AT channels on, 0 disables CMUX.
+ * Built with it set, rild -- -d /dev/pts/N runs the RIL against a modem
+ * simulator on the other end of that pty
+ */
+#ifndef AT_CMUX_DLCS
+#define AT_CMUX_DLCS 0
+#endif
+
+#define CMUX_MAX_DLCS 3
+
+/**
+ * Switches the modem on "fd" to TS 27.010 basic mode and opens DLC 1 to
+ * "numDlcs". On success "p_dlcFds" holds one stream fd per DLC and "fd"
+ * belongs to the multiplexer until cmux_stop().
+ * Returns 0 on success, -1 on error
+ */
+int cmux_start(int fd, int numDlcs, int* p_dlcFds);
+
+/* Closes down the multiplexer and "fd" given to cmux_start() */
+void cmux_stop(void);
+
+#endif
@@ -17,17 +17,16 @@
 #define LOG_TAG "AT_DATA"
 #define NDEBUG 1
 
-#include <alloca.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <net/if.h>
-#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/cdefs.h>
-#include <sys/ioctl.h>
-#include <sys/socket.h>
+#include <unistd.h>
 
+#include <telephony/librilutils.h>
 #include <telephony/ril_log.h>
 
 #include "at_data.h"
@@ -38,6 +37,7 @@
 #include "at_tok.h"
 #include "atchannel.h"
 #include "misc.h"
+#include "netcfg.h"
 
 #define MAX_PDP 11 // max LTE bearers
 
@@ -48,33 +48,71 @@
 // This is used for emulator
 #define EMULATOR_RADIO_INTERFACE "eth0"
 
+// Network interface of the QMI data path
+#define QMI_INTERFACE "rmnet0"
+
+// Longest wait for the QMI data connection to come up
+#define QMI_LINK_TIMEOUT_MSEC 10000
+
 // Default MTU value
 #define DEFAULT_MTU 1500
 
+// Sizes of the context fields kept for RIL_Data_Call_Response_v11
+#define PDP_TYPE_LEN 16
+#define PDP_ADDR_LEN 64
+
 enum PDPState {
     PDP_IDLE,
     PDP_BUSY,
 };
 
+/*
+ * The PDP contexts by cid. |state| tells whether a data call was set up
+ * on it, the rest is what the modem last told of it, so DATA_CALL_LIST is
+ * answered from memory. AT+CGACT? fills the table while it is not known.
+ * Setup and deactivate results and +CGEV: events naming a cid update it,
+ * other +CGEV: events make it unknown again. A context activated or
+ * modified is read again with AT+CGDCONT? and AT+CGCONTRDP.
+ * |s_pdpGeneration| moves on each change, so a read that raced one is not
+ * kept. |s_pdpVersion| moves when what DATA_CALL_LIST reports changes.
+ * |s_pdpMutex| guards the table.
+ */
 struct PDPInfo {
     int cid;
     enum PDPState state;
+    bool active;
+    bool known; /* nothing left to read of it */
+    char type[PDP_TYPE_LEN];
+    char addresses[PDP_ADDR_LEN];
+    char dnses[PDP_ADDR_LEN];
+    char gateways[PDP_ADDR_LEN];
 };
 
 struct PDPInfo s_PDP[] = {
-    { 1, PDP_IDLE },
-    { 2, PDP_IDLE },
-    { 3, PDP_IDLE },
-    { 4, PDP_IDLE },
-    { 5, PDP_IDLE },
-    { 6, PDP_IDLE },
-    { 7, PDP_IDLE },
-    { 8, PDP_IDLE },
-    { 9, PDP_IDLE },
-    { 10, PDP_IDLE },
-    { 11, PDP_IDLE },
+    { .cid = 1, .state = PDP_IDLE, .known = true },
+    { .cid = 2, .state = PDP_IDLE, .known = true },
+    { .cid = 3, .state = PDP_IDLE, .known = true },
+    { .cid = 4, .state = PDP_IDLE, .known = true },
+    { .cid = 5, .state = PDP_IDLE, .known = true },
+    { .cid = 6, .state = PDP_IDLE, .known = true },
+    { .cid = 7, .state = PDP_IDLE, .known = true },
+    { .cid = 8, .state = PDP_IDLE, .known = true },
+    { .cid = 9, .state = PDP_IDLE, .known = true },
+    { .cid = 10, .state = PDP_IDLE, .known = true },
+    { .cid = 11, .state = PDP_IDLE, .known = true },
 };
 
+static pthread_mutex_t s_pdpMutex = PTHREAD_MUTEX_INITIALIZER;
+static bool s_pdpListKnown;
+static unsigned int s_pdpGeneration;
+static unsigned int s_pdpVersion;
+/* versions last sent with RIL_UNSOL_DATA_CALL_LIST_CHANGED and last
+ * cleared the interface at, see requestOrSendDataCallList() */
+static unsigned int s_pdpReportedVersion;
+static unsigned int s_pdpClearedVersion;
+/* AT+CGEREP was answered OK in a data call setup of this radio session */
+static bool s_eventReportingSet;
+
 enum InterfaceState {
     kInterfaceUp,
     kInterfaceDown,
@@ -82,146 +120,15 @@ enum InterfaceState {
 
 static void requestOrSendDataCallList(int cid, RIL_Token* t);
 
-static void set_Ip_Addr(const char* addr, const char* radioInterfaceName)
-{
-    RLOGD("%s %d setting ip addr %s on interface %s", __func__, __LINE__, addr,
-        radioInterfaceName);
-    struct ifreq request;
-    struct sockaddr_in* sin = NULL;
-    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
-    if (sock == -1) {
-        RLOGE("Failed to open interface socket: %s (%d)", strerror(errno), errno);
-        return;
-    }
-
-    memset(&request, 0, sizeof(request));
-    strncpy(request.ifr_name, radioInterfaceName, sizeof(request.ifr_name));
-    request.ifr_name[sizeof(request.ifr_name) - 1] = '\0';
-
-    char* myaddr = strdup(addr);
-    char* pch = NULL;
-    pch = strchr(myaddr, '/');
-    if (pch) {
-        *pch = '\0';
-        pch++;
-        int subnet_mask = atoi(pch);
-        sin = (struct sockaddr_in*)&request.ifr_addr;
-        sin->sin_family = AF_INET;
-        sin->sin_addr.s_addr = htonl(((uint32_t)(-1)) << (32 - subnet_mask));
-        if (ioctl(sock, SIOCSIFNETMASK, &request) < 0) {
-            RLOGE("%s: failed.", __func__);
-        }
-    }
-
-    sin = (struct sockaddr_in*)&request.ifr_addr;
-    sin->sin_family = AF_INET;
-    sin->sin_addr.s_addr = inet_addr(myaddr);
-    if (ioctl(sock, SIOCSIFADDR, &request) < 0) {
-        RLOGE("%s: failed.", __func__);
-    }
-
-    close(sock);
-    free(myaddr);
-    RLOGD("%s %d done.", __func__, __LINE__);
-}
-
-static void set_Gw_Addr(const char* gw, const char* radioInterfaceName)
-{
-    RLOGD("%s %d setting gateway addr %s on interface %s", __func__, __LINE__, gw,
-        radioInterfaceName);
-    struct ifreq request;
-    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
-    if (sock == -1) {
-        RLOGE("Failed to open interface socket: %s (%d)", strerror(errno), errno);
-        return;
-    }
-
-    memset(&request, 0, sizeof(request));
-    strncpy(request.ifr_name, radioInterfaceName, sizeof(request.ifr_name));
-    request.ifr_name[sizeof(request.ifr_name) - 1] = '\0';
-
-    struct sockaddr_in* sin = (struct sockaddr_in*)&request.ifr_addr;
-    sin->sin_family = AF_INET;
-    sin->sin_addr.s_addr = inet_addr(gw);
-    if (ioctl(sock, SIOCSIFDSTADDR, &request) < 0) {
-        RLOGE("%s: failed.", __func__);
-    }
-
-    close(sock);
-    RLOGD("%s %d done.", __func__, __LINE__);
-}
-
-static void clearNetworkConfig(const char* interfaceName)
-{
-    struct ifreq request;
-    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
-    if (sock == -1) {
-        RLOGE("Failed to open interface socket: %s (%d)",
-            strerror(errno), errno);
-        return;
-    }
-
-    memset(&request, 0, sizeof(request));
-    strncpy(request.ifr_name, interfaceName, sizeof(request.ifr_name));
-
-    if (ioctl(sock, SIOCSIFADDR, &request) < 0) {
-        RLOGE("Fail to clear IP addr");
-    }
-
-    if (ioctl(sock, SIOCSIFNETMASK, &request) < 0) {
-        RLOGE("Fail to clear netmask");
-    }
-
-    if (ioctl(sock, SIOCSIFDSTADDR, &request) < 0) {
-        RLOGE("Fail to clear gateway");
-    }
-
-    close(sock);
-}
-
 static RIL_Errno setInterfaceState(const char* interfaceName, enum InterfaceState state)
 {
-    struct ifreq request;
-    int status = 0;
-    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
-    if (sock == -1) {
-        RLOGE("Failed to open interface socket: %s (%d)", strerror(errno), errno);
-        return RIL_E_GENERIC_FAILURE;
-    }
+    int ret = netcfg_set_up(interfaceName, state == kInterfaceUp);
 
-    memset(&request, 0, sizeof(request));
-    strncpy(request.ifr_name, interfaceName, sizeof(request.ifr_name));
-    request.ifr_name[sizeof(request.ifr_name) - 1] = '\0';
-    status = ioctl(sock, SIOCGIFFLAGS, &request);
-    if (status != 0) {
-        RLOGE("Failed to get interface flags for %s: %s (%d)",
-            interfaceName, strerror(errno), errno);
-        close(sock);
+    if (ret == -ENODEV) {
         return RIL_E_RADIO_NOT_AVAILABLE;
     }
 
-    bool isUp = (request.ifr_flags & IFF_UP);
-    if ((state == kInterfaceUp && isUp) || (state == kInterfaceDown && !isUp)) {
-        // Interface already in desired state
-        close(sock);
-        return RIL_E_SUCCESS;
-    }
-
-    if (state == kInterfaceDown) {
-        request.ifr_flags &= ~(IFF_UP | IFF_RUNNING);
-    } else
-        request.ifr_flags |= IFF_UP;
-
-    status = ioctl(sock, SIOCSIFFLAGS, &request);
-    if (status != 0) {
-        RLOGE("Failed to set interface flags for %s: %s (%d)",
-            interfaceName, strerror(errno), errno);
-        close(sock);
-        return RIL_E_GENERIC_FAILURE;
-    }
-
-    close(sock);
-    return RIL_E_SUCCESS;
+    return ret < 0 ? RIL_E_GENERIC_FAILURE : RIL_E_SUCCESS;
 }
 
 void onDataCallListChanged(void* param)
@@ -246,274 +153,337 @@ static const char* getRadioInterfaceName(void)
     return PPP_TTY_PATH_ETH0;
 }
 
-static void requestOrSendDataCallList(int cid, RIL_Token* t)
+/* assumes s_pdpMutex is held */
+static void setPDPActiveLocked(struct PDPInfo* p_pdp, bool active)
+{
+    if (p_pdp->active == active) {
+        return;
+    }
+
+    p_pdp->active = active;
+    p_pdp->known = !active;
+    s_pdpVersion++;
+    p_pdp->type[0] = '\0';
+    p_pdp->addresses[0] = '\0';
+    p_pdp->dnses[0] = '\0';
+    p_pdp->gateways[0] = '\0';
+}
+
+/* assumes s_pdpMutex is held, the context is to be read again */
+static void setPDPActivatedLocked(struct PDPInfo* p_pdp)
+{
+    setPDPActiveLocked(p_pdp, true);
+    p_pdp->known = false;
+    s_pdpVersion++;
+}
+
+void invalidateDataCallList(void)
+{
+    pthread_mutex_lock(&s_pdpMutex);
+    s_pdpListKnown = false;
+    s_pdpGeneration++;
+    s_eventReportingSet = false;
+    pthread_mutex_unlock(&s_pdpMutex);
+}
+
+/* Reads which contexts are active with AT+CGACT?, unless something changed since "generation" */
+static int readActivePDPs(unsigned int generation)
 {
     ATResponse* p_response = NULL;
     ATLine* p_cur = NULL;
-    int err = -1;
-    int n = 0;
-    char* out = NULL;
-    const char* radioInterfaceName = getRadioInterfaceName();
-    RIL_Errno ril_err = RIL_E_SUCCESS;
+    bool active[MAX_PDP] = { false };
+    int cid, state;
+    int err;
 
     err = at_send_command_multiline("AT+CGACT?", "+CGACT:", &p_response);
     if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
-        if (t != NULL) {
-            RLOGE("Failure occurred in sending %s due to: %s", "AT+CGACT?", at_io_err_str(err));
-            RIL_onRequestComplete(*t, RIL_E_GENERIC_FAILURE, NULL, 0);
-        } else
-            RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED,
-                NULL, 0);
-        return;
+        RLOGE("Failure occurred in sending %s due to: %s", "AT+CGACT?", at_io_err_str(err));
+        at_response_free(p_response);
+        return err != AT_ERROR_OK ? err : AT_ERROR_GENERIC;
     }
 
-    for (p_cur = p_response->p_intermediates; p_cur != NULL;
-         p_cur = p_cur->p_next)
-        n++;
-
-    RIL_Data_Call_Response_v11* responses = alloca(n * sizeof(RIL_Data_Call_Response_v11));
-
-    int i;
-    for (i = 0; i < n; i++) {
-        responses[i].status = -1;
-        responses[i].suggestedRetryTime = -1;
-        responses[i].cid = -1;
-        responses[i].active = -1;
-        responses[i].type = "";
-        responses[i].ifname = "";
-        responses[i].addresses = "";
-        responses[i].dnses = "";
-        responses[i].gateways = "";
-        responses[i].pcscf = "";
-        responses[i].mtu = 0;
-    }
-
-    RIL_Data_Call_Response_v11* response = responses;
     for (p_cur = p_response->p_intermediates; p_cur != NULL;
          p_cur = p_cur->p_next) {
-        char* line = p_cur->line;
-
-        err = at_tok_start(&line);
-        if (err < 0) {
+        if (at_tok_parse(p_cur->line, "+CGACT: %d,%d", &cid, &state) != 2) {
             RLOGE("Failed to parse line in %s", __func__);
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto error;
+            at_response_free(p_response);
+            return AT_ERROR_INVALID_RESPONSE;
         }
 
-        err = at_tok_nextint(&line, &response->cid);
-        if (err < 0) {
-            RLOGE("Failed to parse cid in %s", __func__);
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto error;
-        }
-
-        err = at_tok_nextint(&line, &response->active);
-        if (err < 0) {
-            RLOGE("Failed to parse active in %s", __func__);
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto error;
+        if (cid >= 1 && cid <= MAX_PDP) {
+            active[cid - 1] = state == 1;
         }
-
-        response++;
     }
 
     at_response_free(p_response);
 
-    err = at_send_command_multiline("AT+CGDCONT?", "+CGDCONT:", &p_response);
-    if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
-        if (t != NULL) {
-            RLOGE("Failure occurred in sending %s due to: %s", "AT+CGDCONT?", at_io_err_str(err));
-            RIL_onRequestComplete(*t, RIL_E_GENERIC_FAILURE, NULL, 0);
-        } else
-            RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED,
-                NULL, 0);
-        return;
+    pthread_mutex_lock(&s_pdpMutex);
+    if (generation == s_pdpGeneration) {
+        for (int i = 0; i < MAX_PDP; i++) {
+            setPDPActiveLocked(&s_PDP[i], active[i]);
+        }
+        s_pdpListKnown = true;
     }
+    pthread_mutex_unlock(&s_pdpMutex);
+
+    return AT_ERROR_OK;
+}
+
+/* Fills the type and address of "p_pdp" from its line of an AT+CGDCONT? response, if any */
+static void parseDefinedContext(const ATResponse* p_response, struct PDPInfo* p_pdp)
+{
+    ATLine* p_cur = NULL;
+    ATView type, address;
+    int cid;
 
     for (p_cur = p_response->p_intermediates; p_cur != NULL;
          p_cur = p_cur->p_next) {
-        char* line = p_cur->line;
-        int ncid;
-
-        err = at_tok_start(&line);
-        if (err < 0) {
-            RLOGE("Failed to parse line in %s", __func__);
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto error;
+        // APN ignored for v5
+        if (at_tok_parse(p_cur->line, "+CGDCONT: %d,%s,%_,%s", &cid, &type, &address) != 4
+            || cid != p_pdp->cid) {
+            continue;
         }
 
-        err = at_tok_nextint(&line, &ncid);
-        if (err < 0) {
-            RLOGE("Failed to parse line in %s", __func__);
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto error;
-        }
+        snprintf(p_pdp->type, sizeof(p_pdp->type), "%.*s", (int)type.len, type.p);
+        snprintf(p_pdp->addresses, sizeof(p_pdp->addresses), "%.*s", (int)address.len,
+            address.p);
+        break;
+    }
+}
 
-        if (cid != ncid)
-            continue;
+/**
+ * Fills the gateway and DNS of "p_pdp" from its AT+CGCONTRDP "line".
+ * Returns AT_ERROR_OK, or AT_ERROR_INVALID_RESPONSE if it is not of it
+ */
+static int parseContextParams(const char* line, struct PDPInfo* p_pdp)
+{
+    ATView gateway, dns;
+    int cid;
 
-        i = ncid - 1;
-        // Assume no error
-        responses[i].status = 0;
+    // cid, bearer_id, apn, local_addr_and_subnet_mask, gw_addr, dns_prim_addr
+    if (at_tok_parse(line, "+CGCONTRDP: %d,%_,%_,%_,%s,%s", &cid, &gateway, &dns) != 6
+        || cid != p_pdp->cid) {
+        return AT_ERROR_INVALID_RESPONSE;
+    }
 
-        // type
-        err = at_tok_nextstr(&line, &out);
-        if (err < 0) {
-            RLOGE("Failed to parse type in %s", __func__);
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto error;
-        }
+    snprintf(p_pdp->gateways, sizeof(p_pdp->gateways), "%.*s", (int)gateway.len, gateway.p);
+    snprintf(p_pdp->dnses, sizeof(p_pdp->dnses), "%.*s", (int)dns.len, dns.p);
+    return AT_ERROR_OK;
+}
 
-        int type_size = strlen(out) + 1;
-        responses[i].type = alloca(type_size);
-        strlcpy(responses[i].type, out, type_size);
+/* Sets the DNS and gateway of "p_pdp" assumed until AT+CGCONTRDP tells */
+static void setDefaultContextParams(struct PDPInfo* p_pdp)
+{
+    snprintf(p_pdp->dnses, sizeof(p_pdp->dnses), "8.8.8.8 8.8.4.4");
+    snprintf(p_pdp->gateways, sizeof(p_pdp->gateways), "0.0.0.0");
+}
 
-        // APN ignored for v5
-        err = at_tok_nextstr(&line, &out);
-        if (err < 0) {
-            RLOGE("Failed to parse apn in %s", __func__);
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto error;
-        }
+/**
+ * Reads the type and addresses of the "numCids" contexts of "cids" with
+ * AT+CGDCONT? and AT+CGCONTRDP, and configures the radio interface with
+ * them. They are kept unless something changed since "generation"
+ */
+static int readPDPAddresses(const int* cids, int numCids, unsigned int generation)
+{
+    const char* radioInterfaceName = getRadioInterfaceName();
+    struct PDPInfo read[MAX_PDP];
+    ATResponse* p_response = NULL;
+    char* cmd = NULL;
+    int err = AT_ERROR_OK;
+    int i;
 
-        int ifname_size = strlen(radioInterfaceName) + 1;
-        responses[i].ifname = alloca(ifname_size);
-        strlcpy(responses[i].ifname, radioInterfaceName, ifname_size);
+    memset(read, 0, sizeof(read));
+    for (i = 0; i < numCids; i++) {
+        read[i].cid = cids[i];
+        setDefaultContextParams(&read[i]);
+    }
 
-        err = at_tok_nextstr(&line, &out);
-        if (err < 0) {
-            RLOGE("Failed to parse address in %s", __func__);
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto error;
+    err = at_send_command_multiline("AT+CGDCONT?", "+CGDCONT:", &p_response);
+    if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
+        RLOGE("Failure occurred in sending %s due to: %s", "AT+CGDCONT?", at_io_err_str(err));
+        at_response_free(p_response);
+        return err != AT_ERROR_OK ? err : AT_ERROR_GENERIC;
+    }
+
+    for (i = 0; i < numCids; i++) {
+        parseDefinedContext(p_response, &read[i]);
+    }
+
+    at_response_free(p_response);
+    p_response = NULL;
+
+    for (i = 0; i < numCids; i++) {
+        if (asprintf(&cmd, "AT+CGCONTRDP=%d", read[i].cid) < 0) {
+            RLOGE("Failed to allocate memory");
+            return AT_ERROR_GENERIC;
         }
 
-        int addresses_size = strlen(out) + 1;
-        responses[i].addresses = alloca(addresses_size);
-        strlcpy(responses[i].addresses, out, addresses_size);
-        set_Ip_Addr(responses[i].addresses, radioInterfaceName);
+        err = at_send_command_singleline(cmd, "+CGCONTRDP:", &p_response);
+        if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
+            RLOGE("Failure occurred in sending %s due to: %s", cmd, at_io_err_str(err));
+            err = err != AT_ERROR_OK ? err : AT_ERROR_GENERIC;
+            break;
+        }
 
-        responses[i].dnses = "8.8.8.8 8.8.4.4";
-        responses[i].gateways = "0.0.0.0";
-    }
+        err = parseContextParams(p_response->p_intermediates->line, &read[i]);
+        if (err != AT_ERROR_OK) {
+            RLOGE("Failed to parse line in %s", __func__);
+            break;
+        }
+
+        read[i].known = true;
 
-    // If cid = -1, return the data call list without processing CGCONTRDP (setupDataCall)
-    if (cid == -1) {
-        if (t != NULL) {
-            if (n != 0)
-                RIL_onRequestComplete(*t, RIL_E_SUCCESS, &responses[0], sizeof(RIL_Data_Call_Response_v11));
-            else
-                RIL_onRequestComplete(*t, RIL_E_SUCCESS, NULL, 0);
-        } else
-            RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED, responses,
-                n * sizeof(RIL_Data_Call_Response_v11));
-
-        clearNetworkConfig(radioInterfaceName);
         at_response_free(p_response);
         p_response = NULL;
-        return;
+        free(cmd);
+        cmd = NULL;
     }
 
     at_response_free(p_response);
-    p_response = NULL;
-
-    char* cmd = NULL;
+    free(cmd);
 
-    if (asprintf(&cmd, "AT+CGCONTRDP=%d", cid) < 0) {
-        RLOGE("Failed to allocate memory");
-        ril_err = RIL_E_NO_MEMORY;
-        goto error;
+    pthread_mutex_lock(&s_pdpMutex);
+    for (i = 0; i < numCids && generation == s_pdpGeneration; i++) {
+        struct PDPInfo* p_pdp = &s_PDP[read[i].cid - 1];
+
+        if (read[i].known && p_pdp->active && !p_pdp->known) {
+            memcpy(p_pdp->type, read[i].type, sizeof(p_pdp->type));
+            memcpy(p_pdp->addresses, read[i].addresses, sizeof(p_pdp->addresses));
+            memcpy(p_pdp->dnses, read[i].dnses, sizeof(p_pdp->dnses));
+            memcpy(p_pdp->gateways, read[i].gateways, sizeof(p_pdp->gateways));
+            p_pdp->known = true;
+            s_pdpVersion++;
+        }
     }
+    pthread_mutex_unlock(&s_pdpMutex);
 
-    err = at_send_command_singleline(cmd, "+CGCONTRDP:", &p_response);
-    if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
-        RLOGE("Failure occurred in sending %s due to: %s", cmd, at_io_err_str(err));
-        ril_err = RIL_E_GENERIC_FAILURE;
-        goto error;
+    for (i = 0; i < numCids; i++) {
+        if (read[i].known) {
+            netcfg_add(radioInterfaceName, read[i].addresses, read[i].gateways);
+        }
     }
 
-    int skip = 0;
-    char* sskip = NULL;
-    char* input = p_response->p_intermediates->line;
+    return err;
+}
 
-    int ncid = -1;
-    err = at_tok_start(&input);
-    if (err < 0) {
-        RLOGE("Failed to parse line in %s", __func__);
-        ril_err = RIL_E_GENERIC_FAILURE;
-        goto error;
+/**
+ * Brings s_PDP up to date: which contexts are active if that is not
+ * known, then the addresses of the ones activated since they were read.
+ * Sends no command while the table is up to date
+ */
+static int updatePDPTable(void)
+{
+    unsigned int generation;
+    int cids[MAX_PDP];
+    int numCids = 0;
+    bool listKnown;
+    int err;
+
+    pthread_mutex_lock(&s_pdpMutex);
+    listKnown = s_pdpListKnown;
+    generation = s_pdpGeneration;
+    pthread_mutex_unlock(&s_pdpMutex);
+
+    if (!listKnown) {
+        err = readActivePDPs(generation);
+        if (err != AT_ERROR_OK) {
+            return err;
+        }
     }
 
-    err = at_tok_nextint(&input, &ncid); // cid
-    if (err < 0) {
-        RLOGE("Failed to parse ncid in %s", __func__);
-        ril_err = RIL_E_GENERIC_FAILURE;
-        goto error;
+    pthread_mutex_lock(&s_pdpMutex);
+    generation = s_pdpGeneration;
+    for (int i = 0; i < MAX_PDP; i++) {
+        if (s_PDP[i].active && !s_PDP[i].known) {
+            cids[numCids++] = s_PDP[i].cid;
+        }
     }
+    pthread_mutex_unlock(&s_pdpMutex);
 
-    if (cid != ncid) {
-        RLOGE("cid is error");
-        ril_err = RIL_E_GENERIC_FAILURE;
-        goto error;
+    if (numCids == 0) {
+        return AT_ERROR_OK;
     }
 
-    i = ncid - 1;
+    return readPDPAddresses(cids, numCids, generation);
+}
 
-    err = at_tok_nextint(&input, &skip); // bearer_id
-    if (err < 0) {
-        RLOGE("Failed to parse bearer_id in %s", __func__);
-        ril_err = RIL_E_GENERIC_FAILURE;
-        goto error;
-    }
+/* Fills "p_response" with context "p_pdp", pointing into it */
+static void fillDataCallResponse(RIL_Data_Call_Response_v11* p_response, struct PDPInfo* p_pdp)
+{
+    p_response->status = 0;
+    p_response->suggestedRetryTime = -1;
+    p_response->cid = p_pdp->cid;
+    p_response->active = p_pdp->active ? 1 : 0;
+    p_response->type = p_pdp->type;
+    p_response->ifname = p_pdp->active ? (char*)getRadioInterfaceName() : "";
+    p_response->addresses = p_pdp->addresses;
+    p_response->dnses = p_pdp->dnses;
+    p_response->gateways = p_pdp->gateways;
+    p_response->pcscf = "";
+    p_response->mtu = 0;
+}
 
-    err = at_tok_nextstr(&input, &sskip); // apn
-    if (err < 0) {
-        RLOGE("Failed to parse apn in %s", __func__);
-        ril_err = RIL_E_GENERIC_FAILURE;
-        goto error;
-    }
+/**
+ * Answers "t" with context "cid", or all active contexts for -1. Without
+ * a token sends all active contexts with RIL_UNSOL_DATA_CALL_LIST_CHANGED,
+ * the framework ending the calls missing from it, unless nothing changed
+ * since it was last sent
+ */
+static void requestOrSendDataCallList(int cid, RIL_Token* t)
+{
+    RIL_Data_Call_Response_v11 responses[MAX_PDP];
+    struct PDPInfo copies[MAX_PDP];
+    bool anyActive = false;
+    bool send;
+    bool clear;
+    int err;
+    int n = 0;
 
-    err = at_tok_nextstr(&input, &sskip); // local_addr_and_subnet_mask
-    if (err < 0) {
-        RLOGE("Failed to parse local_addr_and_subnet_mask in %s", __func__);
-        ril_err = RIL_E_GENERIC_FAILURE;
-        goto error;
+    err = updatePDPTable();
+    if (err != AT_ERROR_OK) {
+        if (t != NULL) {
+            RIL_onRequestComplete(*t, RIL_E_GENERIC_FAILURE, NULL, 0);
+        } else {
+            /* an empty list would end every call, the next change retries */
+            RLOGE("Failed to read the data call list: %s", at_io_err_str(err));
+        }
+        return;
     }
 
-    err = at_tok_nextstr(&input, &responses[i].gateways); // gw_addr
-    if (err < 0) {
-        RLOGE("Failed to parse gw_addr in %s", __func__);
-        ril_err = RIL_E_GENERIC_FAILURE;
-        goto error;
-    }
+    pthread_mutex_lock(&s_pdpMutex);
+    for (int i = 0; i < MAX_PDP; i++) {
+        struct PDPInfo* p_pdp = &s_PDP[i];
 
-    set_Gw_Addr(responses[i].gateways, radioInterfaceName);
-    err = at_tok_nextstr(&input, &responses[i].dnses); // dns_prim_addr
-    if (err < 0) {
-        RLOGE("Failed to parse dns in %s", __func__);
-        ril_err = RIL_E_GENERIC_FAILURE;
-        goto error;
-    }
+        anyActive = anyActive || p_pdp->active;
+        if (t != NULL && cid > 0 ? p_pdp->cid != cid : !p_pdp->active) {
+            continue;
+        }
 
-    if (t != NULL)
-        RIL_onRequestComplete(*t, ril_err, &responses[i],
-            sizeof(RIL_Data_Call_Response_v11));
-    else
-        RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED,
-            responses, n * sizeof(RIL_Data_Call_Response_v11));
+        copies[n] = *p_pdp;
+        fillDataCallResponse(&responses[n], &copies[n]);
+        n++;
+    }
 
-    at_response_free(p_response);
-    free(cmd);
+    send = t == NULL && s_pdpVersion != s_pdpReportedVersion;
+    if (send) {
+        s_pdpReportedVersion = s_pdpVersion;
+    }
 
-    return;
+    clear = !anyActive && s_pdpVersion != s_pdpClearedVersion;
+    s_pdpClearedVersion = s_pdpVersion;
+    pthread_mutex_unlock(&s_pdpMutex);
 
-error:
-    if (t != NULL)
-        RIL_onRequestComplete(*t, ril_err, NULL, 0);
-    else
-        RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED, NULL, 0);
+    if (t != NULL) {
+        RIL_onRequestComplete(*t, RIL_E_SUCCESS, n > 0 ? responses : NULL,
+            n * sizeof(RIL_Data_Call_Response_v11));
+    } else if (send) {
+        RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED, n > 0 ? responses : NULL,
+            n * sizeof(RIL_Data_Call_Response_v11));
+    }
 
-    at_response_free(p_response);
-    free(cmd);
+    if (clear) {
+        netcfg_clear(getRadioInterfaceName());
+    }
 }
 
 static void putPDP(int cid)
@@ -522,7 +492,9 @@ static void putPDP(int cid)
         return;
     }
 
+    pthread_mutex_lock(&s_pdpMutex);
     s_PDP[cid - 1].state = PDP_IDLE;
+    pthread_mutex_unlock(&s_pdpMutex);
 }
 
 #define REG_DATA_STATE_LEN 14
@@ -534,10 +506,8 @@ static void requestDataRegistrationState(void* data, size_t datalen, RIL_Token t
     int err;
     int* registration = NULL;
     char** responseStr = NULL;
-    ATResponse* p_response = NULL;
     const char* cmd;
     const char* prefix;
-    char* line;
     int i = 0, j, numElements = 0;
     int count = 3;
     int type = 0;
@@ -552,18 +522,9 @@ static void requestDataRegistrationState(void* data, size_t datalen, RIL_Token t
         prefix = "+CEREG:";
     }
 
-    err = at_send_command_singleline(cmd, prefix, &p_response);
-
-    if (err != AT_ERROR_OK || !p_response->success || p_response->success != AT_OK) {
-        RLOGE("Failure occurred in sending %s due to: %s", cmd, at_io_err_str(err));
-        ril_err = RIL_E_GENERIC_FAILURE;
-        goto error;
-    }
-
-    line = p_response->p_intermediates->line;
-
-    if (parseRegistrationState(line, &type, &count, &registration)) {
-        RLOGE("Failure to parse registration state");
+    err = getRegistrationState(cmd, prefix, &type, &count, &registration);
+    if (err != AT_ERROR_OK) {
+        RLOGE("Failure to get registration state: %s", at_io_err_str(err));
         ril_err = RIL_E_GENERIC_FAILURE;
         goto error;
     }
@@ -677,7 +638,6 @@ static void requestDataRegistrationState(void* data, size_t datalen, RIL_Token t
 
     free(responseStr);
     responseStr = NULL;
-    at_response_free(p_response);
 
     return;
 error:
@@ -698,13 +658,13 @@ error:
 
     RLOGE("requestDataRegistrationState must never return an error when radio is on");
     RIL_onRequestComplete(t, ril_err, NULL, 0);
-    at_response_free(p_response);
 }
 
 static int getPDP(void)
 {
     int ret = -1;
 
+    pthread_mutex_lock(&s_pdpMutex);
     for (int i = 0; i < MAX_PDP; i++) {
         if (s_PDP[i].state == PDP_IDLE) {
             s_PDP[i].state = PDP_BUSY;
@@ -712,17 +672,495 @@ static int getPDP(void)
             break;
         }
     }
+    pthread_mutex_unlock(&s_pdpMutex);
 
     return ret;
 }
 
+/**
+ * Waits until the QMI device "fd" tells the data connection is up, or
+ * QMI_INTERFACE starts running as told by the netcfg_watch_links() socket
+ * "linkFd" (-1 for none), at most QMI_LINK_TIMEOUT_MSEC. "running" is
+ * whether it already ran before, only the device tells then.
+ * Returns 0 when up, -1 on error or timeout
+ */
+static int waitForQmiLink(int fd, int linkFd, bool running)
+{
+    bool wasRunning = running;
+    uint64_t deadline = ril_nano_time() + QMI_LINK_TIMEOUT_MSEC * 1000000ULL;
+    struct pollfd fds[2];
+    char status[32];
+    ssize_t rlen;
+    int ret;
+
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = linkFd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        uint64_t now = ril_nano_time();
+
+        if (now >= deadline) {
+            RLOGE("### Timed out waiting for the data connection");
+            return -1;
+        }
+
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+        ret = poll(fds, 2, (int)((deadline - now + 999999) / 1000000));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            RLOGE("### ERROR polling /dev/qmi: %s", strerror(errno));
+            return -1;
+        }
+
+        if (fds[0].revents & (POLLERR | POLLNVAL)) {
+            RLOGE("### ERROR on /dev/qmi");
+            return -1;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            do {
+                rlen = read(fd, status, sizeof(status) - 1);
+            } while (rlen < 0 && errno == EINTR);
+
+            if (rlen < 0) {
+                RLOGE("### ERROR reading from /dev/qmi");
+                return -1;
+            }
+
+            if (rlen == 0) {
+                /* nothing more from the device, only the link can tell */
+                fds[0].fd = -1;
+            } else {
+                status[rlen] = '\0';
+                RLOGD("### status: %s", status);
+                if (strncmp(status, "STATE=up", 8) == 0 || strcmp(status, "online") == 0) {
+                    return 0;
+                }
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            ret = netcfg_read_link_events(linkFd, QMI_INTERFACE, &running);
+            if (ret < 0) {
+                fds[1].fd = -1;
+            } else if (running && !wasRunning) {
+                RLOGD("### %s running", QMI_INTERFACE);
+                return 0;
+            }
+
+            wasRunning = running;
+        }
+    }
+}
+
+/**
+ * Copies the address of an AT+CGCONTRDP line to "out". Its "a.b.c.d.m1.m2.m3.m4"
+ * form of address and subnet mask, 32 numbers for IPv6, is turned into
+ * "a.b.c.d/len", any other form is copied as is
+ */
+static void formatContrdpAddress(const ATView* p_view, char* out, size_t size)
+{
+    unsigned char bytes[32];
+    char text[INET6_ADDRSTRLEN];
+    size_t n = 0;
+    size_t i = 0;
+    int prefixLen = 0;
+
+    while (i < p_view->len && n < sizeof(bytes)) {
+        unsigned int value = 0;
+        size_t start = i;
+
+        while (i < p_view->len && p_view->p[i] >= '0' && p_view->p[i] <= '9' && value <= 255) {
+            value = value * 10 + (p_view->p[i++] - '0');
+        }
+
+        if (i == start || value > 255 || (i < p_view->len && p_view->p[i] != '.')) {
+            break;
+        }
+
+        bytes[n++] = value;
+        if (i < p_view->len) {
+            i++;
+        }
+    }
+
+    if (i != p_view->len || (n != 8 && n != 32) || p_view->p[i - 1] == '.') {
+        snprintf(out, size, "%.*s", (int)p_view->len, p_view->p);
+        return;
+    }
+
+    for (i = n / 2; i < n; i++) {
+        prefixLen += __builtin_popcount(bytes[i]);
+    }
+
+    inet_ntop(n == 8 ? AF_INET : AF_INET6, bytes, text, sizeof(text));
+    snprintf(out, size, "%s/%d", text, prefixLen);
+}
+
+/**
+ * Reads the context the QMI device brought up on "apn" with AT+CGCONTRDP
+ * into "p_pdp" and puts its address on QMI_INTERFACE.
+ * Returns RIL_E_SUCCESS, or an error if there is none or it cannot be set
+ */
+static RIL_Errno readQmiDataCall(const char* apn, struct PDPInfo* p_pdp)
+{
+    ATResponse* p_response = NULL;
+    ATLine* p_cur = NULL;
+    ATView ctxApn, address, gateway, dns;
+    RIL_Errno ret = RIL_E_GENERIC_FAILURE;
+    int err;
+
+    err = at_send_command_multiline("AT+CGCONTRDP", "+CGCONTRDP:", &p_response);
+    if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
+        RLOGE("Failure occurred in sending %s due to: %s", "AT+CGCONTRDP", at_io_err_str(err));
+        at_response_free(p_response);
+        return RIL_E_GENERIC_FAILURE;
+    }
+
+    for (p_cur = p_response->p_intermediates; p_cur != NULL;
+         p_cur = p_cur->p_next) {
+        // cid, bearer_id, apn, local_addr_and_subnet_mask, gw_addr, dns_prim_addr
+        if (at_tok_parse(p_cur->line, "+CGCONTRDP: %d,%_,%s,%s,%s,%s", &p_pdp->cid, &ctxApn,
+                &address, &gateway, &dns)
+                != 6
+            || (apn != NULL && apn[0] != '\0'
+                && (strlen(apn) != ctxApn.len || strncasecmp(apn, ctxApn.p, ctxApn.len) != 0))) {
+            continue;
+        }
+
+        p_pdp->active = true;
+        p_pdp->known = true;
+        formatContrdpAddress(&address, p_pdp->addresses, sizeof(p_pdp->addresses));
+        snprintf(p_pdp->type, sizeof(p_pdp->type), "%s",
+            strchr(p_pdp->addresses, ':') != NULL ? "IPV6" : "IP");
+        snprintf(p_pdp->gateways, sizeof(p_pdp->gateways), "%.*s", (int)gateway.len, gateway.p);
+        snprintf(p_pdp->dnses, sizeof(p_pdp->dnses), "%.*s", (int)dns.len, dns.p);
+        ret = RIL_E_SUCCESS;
+        break;
+    }
+
+    at_response_free(p_response);
+
+    if (ret != RIL_E_SUCCESS) {
+        RLOGE("No context of APN '%s' in AT+CGCONTRDP", apn);
+        return ret;
+    }
+
+    if (netcfg_add(QMI_INTERFACE, p_pdp->addresses, p_pdp->gateways) < 0) {
+        RLOGE("Failed to configure %s with %s", QMI_INTERFACE, p_pdp->addresses);
+        return RIL_E_GENERIC_FAILURE;
+    }
+
+    return RIL_E_SUCCESS;
+}
+
+/* the steps of a data call setup, in the order sent */
+enum SetupStep {
+    SETUP_DEFINE_CONTEXT,
+    SETUP_QOS_REQUIRED,
+    SETUP_QOS_MINIMUM,
+    SETUP_EVENT_REPORTING,
+    SETUP_HANGUP,
+    SETUP_DIAL,
+    SETUP_READ_TYPE,
+    SETUP_READ_PARAMS,
+    SETUP_DONE,
+};
+
+/*
+ * A data call being set up on context |cid|. Each step is queued with
+ * at_channel_send_command_async() when the previous one completed, so the
+ * setups of different contexts interleave their commands on the channel
+ * instead of each holding it for the whole sequence. The context is read
+ * into |pdp| by the last steps, onDataCallSetUp() answers the request
+ * from it on the event loop without sending anything.
+ *
+ * The modem has to start data on the network interface and answer the
+ * dial with OK. Nothing else of a setup is sent on a channel while a dial
+ * is in flight on it, |s_dialing| and |s_dialHeld| under |s_pdpMutex|,
+ * and a dial answered with CONNECT, which leaves the channel in data
+ * mode, fails its setup and those held behind it.
+ */
+typedef struct DataCallSetup {
+    RIL_Token t;
+    ATChannel* p_channel;
+    int cid;
+    enum SetupStep step;
+    RIL_Errno err;
+    bool dialed;
+    char* apn;
+    char* pdpType;
+    struct PDPInfo pdp;
+    struct DataCallSetup* p_next;
+} DataCallSetup;
+
+static DataCallSetup* s_dialing;
+static DataCallSetup* s_dialHeld;
+
+static void sendSetupStep(DataCallSetup* p_setup);
+
+static void onDataCallSetUp(void* param)
+{
+    DataCallSetup* p_setup = (DataCallSetup*)param;
+    RIL_Data_Call_Response_v11 response;
+    struct PDPInfo copy;
+
+    if (p_setup->err == RIL_E_SUCCESS) {
+        struct PDPInfo* p_pdp = &s_PDP[p_setup->cid - 1];
+
+        pthread_mutex_lock(&s_pdpMutex);
+        setPDPActiveLocked(p_pdp, true);
+        memcpy(p_pdp->type, p_setup->pdp.type, sizeof(p_pdp->type));
+        memcpy(p_pdp->addresses, p_setup->pdp.addresses, sizeof(p_pdp->addresses));
+        memcpy(p_pdp->dnses, p_setup->pdp.dnses, sizeof(p_pdp->dnses));
+        memcpy(p_pdp->gateways, p_setup->pdp.gateways, sizeof(p_pdp->gateways));
+        p_pdp->known = true;
+        s_pdpVersion++;
+        s_pdpGeneration++;
+        copy = *p_pdp;
+        pthread_mutex_unlock(&s_pdpMutex);
+
+        netcfg_add(getRadioInterfaceName(), copy.addresses, copy.gateways);
+        fillDataCallResponse(&response, &copy);
+        RIL_onRequestComplete(p_setup->t, RIL_E_SUCCESS, &response, sizeof(response));
+    } else {
+        if (p_setup->dialed) {
+            /* up but not read, the next data call list reads it */
+            pthread_mutex_lock(&s_pdpMutex);
+            setPDPActivatedLocked(&s_PDP[p_setup->cid - 1]);
+            s_pdpGeneration++;
+            pthread_mutex_unlock(&s_pdpMutex);
+        } else {
+            putPDP(p_setup->cid);
+        }
+
+        RIL_onRequestComplete(p_setup->t, p_setup->err, NULL, 0);
+    }
+
+    free(p_setup->apn);
+    free(p_setup->pdpType);
+    free(p_setup);
+}
+
+/* ends "p_setup" with "err", may be called on the reader thread */
+static void finishSetup(DataCallSetup* p_setup, RIL_Errno err)
+{
+    p_setup->err = err;
+    p_setup->step = SETUP_DONE;
+    RIL_requestTimedCallback(onDataCallSetUp, p_setup, NULL);
+}
+
+/**
+ * Ends the dial of "p_setup" and goes on with the setups held behind it,
+ * failing them if "connected" left the channel in data mode
+ */
+static void endDial(DataCallSetup* p_setup, bool connected)
+{
+    DataCallSetup** pp_cur;
+    DataCallSetup* p_held = NULL;
+    DataCallSetup** pp_held = &p_held;
+    DataCallSetup* p_next;
+
+    pthread_mutex_lock(&s_pdpMutex);
+    for (pp_cur = &s_dialing; *pp_cur != NULL; pp_cur = &(*pp_cur)->p_next) {
+        if (*pp_cur == p_setup) {
+            *pp_cur = p_setup->p_next;
+            break;
+        }
+    }
+
+    for (pp_cur = &s_dialHeld; *pp_cur != NULL;) {
+        if ((*pp_cur)->p_channel == p_setup->p_channel) {
+            *pp_held = *pp_cur;
+            *pp_cur = (*pp_cur)->p_next;
+            pp_held = &(*pp_held)->p_next;
+        } else {
+            pp_cur = &(*pp_cur)->p_next;
+        }
+    }
+    *pp_held = NULL;
+    pthread_mutex_unlock(&s_pdpMutex);
+
+    for (; p_held != NULL; p_held = p_next) {
+        p_next = p_held->p_next;
+        if (connected) {
+            finishSetup(p_held, RIL_E_GENERIC_FAILURE);
+        } else {
+            sendSetupStep(p_held);
+        }
+    }
+}
+
+static void onSetupStepDone(int err, ATResponse* p_response, void* ctx)
+{
+    DataCallSetup* p_setup = (DataCallSetup*)ctx;
+
+    if (p_setup->step == SETUP_DIAL) {
+        bool connected = err == AT_ERROR_OK && p_response->success == AT_OK
+            && strStartsWith(p_response->finalResponse, "CONNECT");
+
+        endDial(p_setup, connected);
+        if (connected) {
+            RLOGE("Dial of cid %d answered CONNECT, the channel is in data mode", p_setup->cid);
+            at_response_free(p_response);
+            finishSetup(p_setup, RIL_E_GENERIC_FAILURE);
+            return;
+        }
+    }
+
+    if (err == AT_ERROR_OK && p_response->success == AT_OK) {
+        if (p_setup->step == SETUP_READ_TYPE) {
+            parseDefinedContext(p_response, &p_setup->pdp);
+        } else if (p_setup->step == SETUP_READ_PARAMS) {
+            err = p_response->p_intermediates != NULL
+                ? parseContextParams(p_response->p_intermediates->line, &p_setup->pdp)
+                : AT_ERROR_INVALID_RESPONSE;
+        }
+    }
+
+    if (err != AT_ERROR_OK || p_response->success != AT_OK) {
+        RLOGE("Failure occurred in setup step %d of cid %d due to: %s", p_setup->step,
+            p_setup->cid, at_io_err_str(err));
+        at_response_free(p_response);
+        finishSetup(p_setup, RIL_E_GENERIC_FAILURE);
+        return;
+    }
+
+    at_response_free(p_response);
+
+    if (p_setup->step == SETUP_EVENT_REPORTING) {
+        /* setups racing this one sent it as well */
+        pthread_mutex_lock(&s_pdpMutex);
+        s_eventReportingSet = true;
+        pthread_mutex_unlock(&s_pdpMutex);
+    }
+
+    p_setup->dialed = p_setup->dialed || p_setup->step == SETUP_DIAL;
+    p_setup->step++;
+    if (p_setup->step == SETUP_DONE) {
+        finishSetup(p_setup, RIL_E_SUCCESS);
+    } else {
+        sendSetupStep(p_setup);
+    }
+}
+
+/* Queues the command of the current step of "p_setup", unless held behind a dial */
+static void sendSetupStep(DataCallSetup* p_setup)
+{
+    ATCommandType type = NO_RESULT;
+    const char* prefix = NULL;
+    DataCallSetup* p_cur;
+    DataCallSetup** pp_tail;
+    char* cmd = NULL;
+    int ret = -1;
+
+    pthread_mutex_lock(&s_pdpMutex);
+    for (p_cur = s_dialing; p_cur != NULL && p_cur->p_channel != p_setup->p_channel;
+         p_cur = p_cur->p_next)
+        ;
+    if (p_cur != NULL) {
+        /* endDial() sends it, in the order held */
+        for (pp_tail = &s_dialHeld; *pp_tail != NULL; pp_tail = &(*pp_tail)->p_next)
+            ;
+        p_setup->p_next = NULL;
+        *pp_tail = p_setup;
+        pthread_mutex_unlock(&s_pdpMutex);
+        return;
+    }
+
+    if (p_setup->step == SETUP_DIAL) {
+        p_setup->p_next = s_dialing;
+        s_dialing = p_setup;
+    }
+    pthread_mutex_unlock(&s_pdpMutex);
+
+    if (p_setup->step == SETUP_EVENT_REPORTING) {
+        bool set;
+
+        pthread_mutex_lock(&s_pdpMutex);
+        set = s_eventReportingSet;
+        pthread_mutex_unlock(&s_pdpMutex);
+
+        if (set) {
+            p_setup->step++;
+        }
+    }
+
+    switch (p_setup->step) {
+    case SETUP_DEFINE_CONTEXT:
+        ret = asprintf(&cmd, "AT+CGDCONT=%d,\"%s\",\"%s\",,0,0", p_setup->cid,
+            p_setup->pdpType, p_setup->apn);
+        break;
+    case SETUP_QOS_REQUIRED:
+        // Set required QoS params to default
+        ret = asprintf(&cmd, "AT+CGQREQ=%d", p_setup->cid);
+        break;
+    case SETUP_QOS_MINIMUM:
+        // Set minimum QoS params to default
+        ret = asprintf(&cmd, "AT+CGQMIN=%d", p_setup->cid);
+        break;
+    case SETUP_EVENT_REPORTING:
+        // packet-domain event reporting
+        ret = asprintf(&cmd, "AT+CGEREP=1,0");
+        break;
+    case SETUP_HANGUP:
+        // Hangup anything that's happening there now
+        ret = asprintf(&cmd, "AT+CGACT=1,0");
+        break;
+    case SETUP_DIAL:
+        // Start data on the PDP context
+        ret = asprintf(&cmd, "ATD*99***%d#", p_setup->cid);
+        break;
+    case SETUP_READ_TYPE:
+        ret = asprintf(&cmd, "AT+CGDCONT?");
+        type = MULTILINE;
+        prefix = "+CGDCONT:";
+        break;
+    case SETUP_READ_PARAMS:
+        ret = asprintf(&cmd, "AT+CGCONTRDP=%d", p_setup->cid);
+        type = SINGLELINE;
+        prefix = "+CGCONTRDP:";
+        setDefaultContextParams(&p_setup->pdp);
+        break;
+    case SETUP_DONE:
+        break;
+    }
+
+    if (ret < 0) {
+        RLOGE("Failed to allocate memory");
+        if (p_setup->step == SETUP_DIAL) {
+            endDial(p_setup, false);
+        }
+        finishSetup(p_setup, RIL_E_NO_MEMORY);
+        return;
+    }
+
+    /* p_setup may be gone once queued */
+    if (at_channel_send_command_async(p_setup->p_channel, cmd, type, prefix,
+            AT_TIMEOUT_DEFAULT, onSetupStepDone, p_setup)
+        != AT_ERROR_OK) {
+        RLOGE("Failure occurred in sending %s", cmd);
+        if (p_setup->step == SETUP_DIAL) {
+            endDial(p_setup, false);
+        }
+        finishSetup(p_setup, RIL_E_GENERIC_FAILURE);
+    }
+
+    free(cmd);
+}
+
 static void requestSetupDataCall(void* data, size_t datalen, RIL_Token t)
 {
     const char* apn = NULL;
     char* cmd = NULL;
-    int err = -1;
     int cid = -1;
-    ATResponse* p_response = NULL;
+    DataCallSetup* p_setup = NULL;
     RIL_Errno ril_err = RIL_E_SUCCESS;
 
     if (data == NULL) {
@@ -733,13 +1171,15 @@ static void requestSetupDataCall(void* data, size_t datalen, RIL_Token t)
 
     apn = ((const char**)data)[2];
 
-    int fd, qmistatus;
+    int fd;
     size_t cur = 0;
     size_t len;
-    ssize_t written, rlen;
-    char status[32] = { 0 };
-    int retry = 10;
+    ssize_t written;
+    int linkFd = -1;
+    bool linkRunning = false;
     const char* pdp_type;
+    struct PDPInfo qmiPdp;
+    RIL_Data_Call_Response_v11 response;
 
     RLOGD("requesting data connection to APN '%s'", apn);
 
@@ -747,6 +1187,25 @@ static void requestSetupDataCall(void* data, size_t datalen, RIL_Token t)
     if (fd >= 0) { /* the device doesn't exist on the emulator */
 
         RLOGD("opened the qmi device\n");
+
+        /*
+         * Setting it up is told on the watch as well, and may find it
+         * running already. That is read before asking for the connection,
+         * so only a link starting to run after it counts
+         */
+        linkFd = netcfg_watch_links();
+        if (setInterfaceState(QMI_INTERFACE, kInterfaceUp) != RIL_E_SUCCESS) {
+            RLOGE("set %s state error", QMI_INTERFACE);
+            ril_err = RIL_E_GENERIC_FAILURE;
+            close(fd);
+            goto error;
+        }
+
+        if (linkFd >= 0 && netcfg_read_link_events(linkFd, QMI_INTERFACE, &linkRunning) < 0) {
+            close(linkFd);
+            linkFd = -1;
+        }
+
         if (asprintf(&cmd, "up:%s", apn) < 0) {
             RLOGE("Failed to allocate memory");
             ril_err = RIL_E_NO_MEMORY;
@@ -770,43 +1229,23 @@ static void requestSetupDataCall(void* data, size_t datalen, RIL_Token t)
             cur += written;
         }
 
-        // wait for interface to come online
-
-        do {
-            sleep(1);
-            do {
-                rlen = read(fd, status, 31);
-            } while (rlen < 0 && errno == EINTR);
-
-            if (rlen < 0) {
-                RLOGE("### ERROR reading from /dev/qmi");
-                ril_err = RIL_E_GENERIC_FAILURE;
-                close(fd);
-                goto error;
-            } else {
-                status[rlen] = '\0';
-                RLOGD("### status: %s", status);
-            }
-        } while (strncmp(status, "STATE=up", 8) && strcmp(status, "online") && --retry);
-
-        close(fd);
-
-        if (retry == 0) {
+        if (waitForQmiLink(fd, linkFd, linkRunning) < 0) {
             RLOGE("### Failed to get data connection up\n");
             ril_err = RIL_E_GENERIC_FAILURE;
+            close(fd);
             goto error;
         }
 
-        qmistatus = system("netcfg rmnet0 dhcp");
-
-        RLOGD("netcfg rmnet0 dhcp: status %d\n", qmistatus);
+        close(fd);
 
-        if (qmistatus < 0) {
-            RLOGE("qmistatus < 0");
-            ril_err = RIL_E_GENERIC_FAILURE;
+        memset(&qmiPdp, 0, sizeof(qmiPdp));
+        ril_err = readQmiDataCall(apn, &qmiPdp);
+        if (ril_err != RIL_E_SUCCESS) {
             goto error;
         }
 
+        fillDataCallResponse(&response, &qmiPdp);
+        response.ifname = QMI_INTERFACE;
     } else {
         const char* radioInterfaceName = getRadioInterfaceName();
         if (setInterfaceState(radioInterfaceName, kInterfaceUp) != RIL_E_SUCCESS) {
@@ -840,84 +1279,45 @@ static void requestSetupDataCall(void* data, size_t datalen, RIL_Token t)
             return;
         }
 
-        if (asprintf(&cmd, "AT+CGDCONT=%d,\"%s\",\"%s\",,0,0", cid, pdp_type, apn) < 0) {
+        p_setup = (DataCallSetup*)calloc(1, sizeof(DataCallSetup));
+        if (p_setup == NULL || (p_setup->apn = strdup(apn)) == NULL
+            || (p_setup->pdpType = strdup(pdp_type)) == NULL) {
             RLOGE("Failed to allocate memory");
+            putPDP(cid);
+            if (p_setup != NULL) {
+                free(p_setup->apn);
+                free(p_setup);
+            }
             ril_err = RIL_E_NO_MEMORY;
             goto error;
         }
 
-        // FIXME check for error here
-        err = at_send_command(cmd, &p_response);
-        if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
-            RLOGE("Failure occurred in sending %s due to: %s", cmd, at_io_err_str(err));
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto error;
-        }
-
-        at_response_free(p_response);
-        p_response = NULL;
-
-        // Set required QoS params to default
-        err = at_send_command("AT+CGQREQ=1", &p_response);
-        if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
-            RLOGE("Failure occurred in sending AT+CGQREQ=1 due to: %s", at_io_err_str(err));
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto error;
-        }
-
-        at_response_free(p_response);
-        p_response = NULL;
-
-        // Set minimum QoS params to default
-        err = at_send_command("AT+CGQMIN=1", &p_response);
-        if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
-            RLOGE("Failure occurred in sending AT+CGQMIN=1 due to: %s", at_io_err_str(err));
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto error;
-        }
-
-        at_response_free(p_response);
-        p_response = NULL;
-
-        // packet-domain event reporting
-        err = at_send_command("AT+CGEREP=1,0", &p_response);
-        if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
-            RLOGE("Failure occurred in sending AT+CGEREP=1,0 due to: %s", at_io_err_str(err));
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto error;
-        }
-
-        at_response_free(p_response);
-        p_response = NULL;
-
-        // Hangup anything that's happening there now
-        err = at_send_command("AT+CGACT=1,0", &p_response);
-        if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
-            RLOGE("Failure occurred in sending AT+CGACT=1,0 due to: %s", at_io_err_str(err));
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto error;
-        }
+        p_setup->t = t;
+        p_setup->p_channel = at_get_thread_channel();
+        p_setup->cid = cid;
+        p_setup->pdp.cid = cid;
+        p_setup->step = SETUP_DEFINE_CONTEXT;
+        p_setup->err = RIL_E_SUCCESS;
 
-        at_response_free(p_response);
-        p_response = NULL;
+        /* answered by onDataCallSetUp() */
+        sendSetupStep(p_setup);
+        return;
+    }
 
-        // Start data on PDP context 1
-        err = at_send_command("ATD*99***1#", &p_response);
-        if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
-            RLOGE("Failure occurred in sending ATD*99***1# due to: %s", at_io_err_str(err));
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto error;
-        }
+    if (linkFd >= 0) {
+        close(linkFd);
     }
 
-    requestOrSendDataCallList(cid, &t);
-    at_response_free(p_response);
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, &response, sizeof(response));
     free(cmd);
 
     return;
 error:
+    if (linkFd >= 0) {
+        close(linkFd);
+    }
+
     RIL_onRequestComplete(t, ril_err, NULL, 0);
-    at_response_free(p_response);
     free(cmd);
 }
 
@@ -944,6 +1344,12 @@ static void requestDeactivateDataCall(void* data, size_t datalen, RIL_Token t)
     rilErrno = setInterfaceState(radioInterfaceName, kInterfaceDown);
     RIL_onRequestComplete(t, rilErrno, NULL, 0);
     putPDP(cid);
+
+    pthread_mutex_lock(&s_pdpMutex);
+    setPDPActiveLocked(&s_PDP[cid - 1], false);
+    s_pdpGeneration++;
+    pthread_mutex_unlock(&s_pdpMutex);
+
     requestOrSendDataCallList(-1, NULL);
 }
 
@@ -976,24 +1382,59 @@ void on_request_data(int request, void* data, size_t datalen, RIL_Token t)
     RLOGD("On request data end");
 }
 
-bool try_handle_unsol_data(const char* s)
+/* Applies a +CGEV: event to s_PDP, see 3GPP TS 27.007 10.1.19 */
+static void onDataCallListChangedUnsol(const char* s, const char* sms_pdu)
 {
-    int ret = false;
+    const char* event = s + strlen("+CGEV:");
+    int cid = -1;
 
-    RLOGD("unsol data string: %s", s);
+    (void)sms_pdu;
 
-    if (strStartsWith(s, "+CGEV:")) {
-        RLOGI("Receive data call list changed URC");
-        /* Really, we can ignore NW CLASS and ME CLASS events here,
-         * but right now we don't since extranous
-         * RIL_UNSOL_DATA_CALL_LIST_CHANGED calls are tolerated
-         */
-        /* can't issue AT commands here -- call on main thread */
-        RIL_requestTimedCallback(onDataCallListChanged, NULL, NULL);
-        ret = true;
+    RLOGI("Receive data call list changed URC");
+    while (*event == ' ') {
+        event++;
+    }
+
+    if (strStartsWith(event, "NW CLASS") || strStartsWith(event, "ME CLASS")) {
+        /* no context changed */
+        return;
+    }
+
+    pthread_mutex_lock(&s_pdpMutex);
+
+    if (strStartsWith(event, "NW DETACH") || strStartsWith(event, "ME DETACH")) {
+        for (int i = 0; i < MAX_PDP; i++) {
+            setPDPActiveLocked(&s_PDP[i], false);
+        }
+    } else if ((sscanf(event, "NW PDN DEACT %d", &cid) == 1
+                   || sscanf(event, "ME PDN DEACT %d", &cid) == 1)
+        && cid >= 1 && cid <= MAX_PDP) {
+        setPDPActiveLocked(&s_PDP[cid - 1], false);
+    } else if ((sscanf(event, "NW PDN ACT %d", &cid) == 1
+                   || sscanf(event, "ME PDN ACT %d", &cid) == 1
+                   || sscanf(event, "NW MODIFY %d", &cid) == 1
+                   || sscanf(event, "ME MODIFY %d", &cid) == 1)
+        && cid >= 1 && cid <= MAX_PDP) {
+        setPDPActivatedLocked(&s_PDP[cid - 1]);
     } else {
-        RLOGD("Can't match any unsol data handlers");
+        /* eg. the old NW DEACT <PDP_type>,<PDP_addr>, ask AT+CGACT? */
+        s_pdpListKnown = false;
     }
 
-    return ret;
+    s_pdpGeneration++;
+
+    pthread_mutex_unlock(&s_pdpMutex);
+
+    /* can't issue AT commands here -- call on main thread */
+    RIL_requestTimedCallback(onDataCallListChanged, NULL, NULL);
+}
+
+static const ATUnsolPrefix s_dataUnsols[] = {
+    { "+CGEV:", onDataCallListChangedUnsol },
+};
+
+int register_unsol_data(void)
+{
+    return at_register_unsol_handlers(s_dataUnsols,
+        sizeof(s_dataUnsols) / sizeof(s_dataUnsols[0]));
 }
\ No newline at end of file
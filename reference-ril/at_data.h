@@ -21,7 +21,10 @@
 #include <telephony/ril.h>
 
 void onDataCallListChanged(void* param);
+
+/* Forgets which PDP contexts are active, see requestOrSendDataCallList() */
+void invalidateDataCallList(void);
 void on_request_data(int request, void* data, size_t datalen, RIL_Token t);
-bool try_handle_unsol_data(const char* s);
+int register_unsol_data(void);
 
 #endif
\ No newline at end of file
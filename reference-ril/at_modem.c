@@ -25,6 +25,7 @@
 #include <telephony/ril_log.h>
 
 #include "at_modem.h"
+#include "at_network.h"
 #include "at_ril.h"
 #include "at_sim.h"
 #include "at_tok.h"
@@ -39,6 +40,9 @@
 #define NR (RAF_NR)
 
 static ModemInfo* sMdmInfo;
+
+/* firmware and device identities do not change while the modem runs */
+static const ATCachePolicy s_identityCache = { 0, NULL, 0 };
 static int s_modem_enabled = 0;
 
 static void requestRadioPower(void* data, size_t datalen, RIL_Token t)
@@ -100,7 +104,7 @@ static void requestBaseBandVersion(void* data, size_t datalen, RIL_Token t)
     char* line = NULL;
     char* responseStr = NULL;
 
-    err = at_send_command_singleline("AT+CGMR", "+CGMR:", &p_response);
+    err = at_send_command_cached("AT+CGMR", SINGLELINE, "+CGMR:", &s_identityCache, &p_response);
     if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
         RLOGE("Failure occurred in sending %s due to: %s", "AT+CGMR", at_io_err_str(err));
         ril_err = RIL_E_GENERIC_FAILURE;
@@ -145,7 +149,7 @@ static void requestDeviceIdentity(void* data, size_t datalen, RIL_Token t)
     responseStr[2] = "77777777";
     responseStr[3] = ""; // default empty for non-CDMA
 
-    err = at_send_command_numeric("AT+CGSN", &p_response);
+    err = at_send_command_cached("AT+CGSN", NUMERIC, NULL, &s_identityCache, &p_response);
     if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
         RLOGE("Failure occurred in sending %s due to: %s", "AT+CGSN", at_io_err_str(err));
         RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
@@ -207,10 +211,13 @@ static void requestScreenState(void* data, size_t datalen, RIL_Token t)
 {
     (void)datalen;
 
-    ATResponse* p_response = NULL;
+    /* registration URCs without location info while the screen is off */
+    static const char* const suspendCommands[] = { "AT+CEREG=1", "AT+CREG=1", "AT+CGREG=1" };
+    static const char* const resumeCommands[] = { "AT+CEREG=2", "AT+CREG=2", "AT+CGREG=2" };
+    const char* const* commands;
     RIL_Errno ril_err = RIL_E_SUCCESS;
+    int failed = 0;
     int err = -1;
-    int status;
 
     if (data == NULL) {
         RLOGE("requestScreenState data is null");
@@ -218,57 +225,19 @@ static void requestScreenState(void* data, size_t datalen, RIL_Token t)
         return;
     }
 
-    status = *((int*)data);
-
-    if (!status) {
-        /* Suspend */
-        err = at_send_command("AT+CEREG=1", &p_response);
-        if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
-            RLOGE("Failure occurred in sending %s due to: %s", "AT+CEREG=1", at_io_err_str(err));
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto on_exit;
-        }
-
-        err = at_send_command("AT+CREG=1", &p_response);
-        if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
-            RLOGE("Failure occurred in sending %s due to: %s", "AT+CREG=1", at_io_err_str(err));
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto on_exit;
-        }
-
-        err = at_send_command("AT+CGREG=1", &p_response);
-        if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
-            RLOGE("Failure occurred in sending %s due to: %s", "AT+CGREG=1", at_io_err_str(err));
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto on_exit;
-        }
-    } else {
-        /* Resume */
-        err = at_send_command("AT+CEREG=2", &p_response);
-        if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
-            RLOGE("Failure occurred in sending %s due to: %s", "AT+CEREG=2", at_io_err_str(err));
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto on_exit;
-        }
-
-        err = at_send_command("AT+CREG=2", &p_response);
-        if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
-            RLOGE("Failure occurred in sending %s due to: %s", "AT+CREG=2", at_io_err_str(err));
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto on_exit;
-        }
+    /* Suspend or Resume */
+    commands = *((int*)data) ? resumeCommands : suspendCommands;
 
-        err = at_send_command("AT+CGREG=2", &p_response);
-        if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
-            RLOGE("Failure occurred in sending %s due to: %s", "AT+CGREG=2", at_io_err_str(err));
-            ril_err = RIL_E_GENERIC_FAILURE;
-            goto on_exit;
-        }
+    err = at_send_commands(commands, sizeof(resumeCommands) / sizeof(resumeCommands[0]), &failed);
+    if (err != AT_ERROR_OK) {
+        RLOGE("Failure occurred in sending %s due to: %s", commands[failed], at_io_err_str(err));
+        ril_err = RIL_E_GENERIC_FAILURE;
     }
 
-on_exit:
+    /* the registration URCs and replies change shape with the mode */
+    invalidateNetworkState();
+
     RIL_onRequestComplete(t, ril_err, NULL, 0);
-    at_response_free(p_response);
 }
 
 static void requestGetModemStatus(void* data, size_t datalen, RIL_Token t)
@@ -310,7 +279,7 @@ static void requestGetIMEI(void* data, size_t datalen, RIL_Token t)
     RIL_Errno ril_err = RIL_E_SUCCESS;
     int err = -1;
 
-    err = at_send_command_numeric("AT+CGSN", &p_response);
+    err = at_send_command_cached("AT+CGSN", NUMERIC, NULL, &s_identityCache, &p_response);
 
     if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
         RLOGE("Failure occurred in sending %s due to: %s", "AT+CGSN", at_io_err_str(err));
@@ -330,7 +299,7 @@ static void requestGetIMEISV(void* data, size_t datalen, RIL_Token t)
     (void)datalen;
 
     ATResponse* p_response = NULL;
-    int err = at_send_command_numeric("AT+CGSN=2", &p_response);
+    int err = at_send_command_cached("AT+CGSN=2", NUMERIC, NULL, &s_identityCache, &p_response);
 
     if (err < 0 || p_response->success == 0) {
         RLOGE("Failure occurred in sending %s due to: %s", "AT+CGSN=2", at_io_err_str(err));
@@ -658,42 +627,54 @@ void on_request_modem(int request, void* data, size_t datalen, RIL_Token t)
     RLOGD("On request modem end");
 }
 
-bool try_handle_unsol_modem(const char* s)
+static void onTechnologyUnsol(const char* s, const char* sms_pdu)
 {
-    bool ret = false;
-
-    RLOGD("unsol modem string: %s", s);
-
-    if (strStartsWith(s, "+CTEC: ")) {
-        RLOGI("Receive technology URC");
-        int tech, mask;
-        switch (parse_technology_response(s, &tech, NULL)) {
-        case -1: // no argument could be parsed.
-            RLOGE("invalid CTEC line %s\n", s);
-            break;
-        case 1: // current mode correctly parsed
-        case 0: // preferred mode correctly parsed
-            mask = 1 << tech;
-            if (mask != MDM_GSM && mask != MDM_CDMA && mask != MDM_WCDMA && mask != MDM_LTE) {
-                RLOGE("Unknown technology %d\n", tech);
-            } else {
-                setRadioTechnology(sMdmInfo, tech);
-            }
-            break;
-        }
+    int tech, mask;
 
-        ret = true;
-    } else if (strStartsWith(s, "^MRINGTONE: ")) {
-        RLOGI("Receive ring tone URC");
-        unsolicitedRingBackTone(s);
-        ret = true;
-    } else if (strStartsWith(s, "+CFUN: 0")) {
-        RLOGI("Receive radio off URC");
-        setRadioState(RADIO_STATE_OFF);
-        ret = true;
-    } else {
-        RLOGD("Can't match any unsol modem handlers");
+    (void)sms_pdu;
+
+    RLOGI("Receive technology URC");
+    switch (parse_technology_response(s, &tech, NULL)) {
+    case -1: // no argument could be parsed.
+        RLOGE("invalid CTEC line %s\n", s);
+        break;
+    case 1: // current mode correctly parsed
+    case 0: // preferred mode correctly parsed
+        mask = 1 << tech;
+        if (mask != MDM_GSM && mask != MDM_CDMA && mask != MDM_WCDMA && mask != MDM_LTE) {
+            RLOGE("Unknown technology %d\n", tech);
+        } else {
+            setRadioTechnology(sMdmInfo, tech);
+        }
+        break;
     }
+}
 
-    return ret;
+static void onRingBackToneUnsol(const char* s, const char* sms_pdu)
+{
+    (void)sms_pdu;
+
+    RLOGI("Receive ring tone URC");
+    unsolicitedRingBackTone(s);
+}
+
+static void onRadioOffUnsol(const char* s, const char* sms_pdu)
+{
+    (void)s;
+    (void)sms_pdu;
+
+    RLOGI("Receive radio off URC");
+    setRadioState(RADIO_STATE_OFF);
+}
+
+static const ATUnsolPrefix s_modemUnsols[] = {
+    { "+CTEC: ", onTechnologyUnsol },
+    { "^MRINGTONE: ", onRingBackToneUnsol },
+    { "+CFUN: 0", onRadioOffUnsol },
+};
+
+int register_unsol_modem(void)
+{
+    return at_register_unsol_handlers(s_modemUnsols,
+        sizeof(s_modemUnsols) / sizeof(s_modemUnsols[0]));
 }
\ No newline at end of file
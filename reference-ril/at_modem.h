@@ -66,6 +66,6 @@ void setRadioTechnology(ModemInfo* mdm, int newtech);
 int techFromModemType(int mdmtype);
 int parse_technology_response(const char* response, int* current, int32_t* preferred);
 void on_request_modem(int request, void* data, size_t datalen, RIL_Token t);
-bool try_handle_unsol_modem(const char* s);
+int register_unsol_modem(void);
 
 #endif
\ No newline at end of file
@@ -19,6 +19,7 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/cdefs.h>
@@ -36,6 +37,10 @@
 
 #define MAX_OPER_NAME_LENGTH (30)
 
+/* registration and signal strength cache, see NetStateEntry */
+#define NETWORK_STATE_MAX_AGE_MSEC 10000
+#define REG_STATE_VALUES 4
+
 static int net2modem[] = {
     MDM_GSM | MDM_WCDMA, // 0  - GSM / WCDMA Pref
     MDM_GSM, // 1  - GSM only
@@ -114,6 +119,104 @@ static int s_cell_info_rate_ms = INT_MAX;
 static int s_lac = 0;
 static int s_cid = 0;
 
+/*
+ * The last registration states and signal strength, from the replies to
+ * AT+CREG?, AT+CGREG?, AT+CEREG? and AT+CSQ and from their URCs, so the
+ * requests for them are answered without asking the modem. An entry is
+ * valid for NETWORK_STATE_MAX_AGE_MSEC after it was last set, and the URCs
+ * set it again on every change. |generation| moves on each change, so a
+ * reply that raced a URC does not overwrite it. Radio state and URC mode
+ * changes invalidate every entry. |s_netStateMutex| guards them.
+ */
+typedef struct {
+    const char* prefix;
+    bool valid;
+    unsigned int generation;
+    uint64_t time;
+    int items; /* as counted by parseRegistrationState() */
+    int values[sizeof(RIL_SignalStrength_v12) / sizeof(int)];
+} NetStateEntry;
+
+static pthread_mutex_t s_netStateMutex = PTHREAD_MUTEX_INITIALIZER;
+static NetStateEntry s_netStates[] = {
+    { .prefix = "+CREG:" },
+    { .prefix = "+CGREG:" },
+    { .prefix = "+CEREG:" },
+    { .prefix = "+CSQ:" },
+};
+
+static NetStateEntry* findNetState(const char* line)
+{
+    for (size_t i = 0; i < sizeof(s_netStates) / sizeof(s_netStates[0]); i++) {
+        if (strStartsWith(line, s_netStates[i].prefix)) {
+            return &s_netStates[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Copies "count" values of "p_entry" to "values" if it is valid. Returns
+ * whether it was, and the generation to store a new state at in
+ * *p_generation
+ */
+static bool readNetState(NetStateEntry* p_entry, int* values, size_t count,
+    int* p_items, unsigned int* p_generation)
+{
+    bool valid;
+
+    pthread_mutex_lock(&s_netStateMutex);
+
+    valid = p_entry->valid
+        && (ril_nano_time() - p_entry->time) / 1000000 < NETWORK_STATE_MAX_AGE_MSEC;
+    if (valid) {
+        memcpy(values, p_entry->values, count * sizeof(int));
+        *p_items = p_entry->items;
+    }
+
+    *p_generation = p_entry->generation;
+
+    pthread_mutex_unlock(&s_netStateMutex);
+
+    return valid;
+}
+
+/**
+ * Sets "p_entry" to "count" values, from a URC or else from a reply to a
+ * query sent at "generation"
+ */
+static void storeNetState(NetStateEntry* p_entry, const int* values, size_t count,
+    int items, bool unsolicited, unsigned int generation)
+{
+    pthread_mutex_lock(&s_netStateMutex);
+
+    if (unsolicited || generation == p_entry->generation) {
+        memcpy(p_entry->values, values, count * sizeof(int));
+        p_entry->items = items;
+        p_entry->time = ril_nano_time();
+        p_entry->valid = true;
+        p_entry->generation++;
+    }
+
+    pthread_mutex_unlock(&s_netStateMutex);
+}
+
+static void invalidateNetState(NetStateEntry* p_entry)
+{
+    pthread_mutex_lock(&s_netStateMutex);
+    p_entry->valid = false;
+    p_entry->generation++;
+    pthread_mutex_unlock(&s_netStateMutex);
+}
+
+void invalidateNetworkState(void)
+{
+    for (size_t i = 0; i < sizeof(s_netStates) / sizeof(s_netStates[0]); i++) {
+        invalidateNetState(&s_netStates[i]);
+    }
+}
+
 static void requestQueryNetworkSelectionMode(void* data, size_t datalen, RIL_Token t)
 {
     (void)data;
@@ -171,8 +274,15 @@ static void requestSignalStrength(void* data, size_t datalen, RIL_Token t)
     int minNumOfElements = sizeof(RIL_SignalStrength_v6) / sizeof(int);
     int maxNumOfElements = sizeof(RIL_SignalStrength_v12) / sizeof(int);
     int response[maxNumOfElements];
+    NetStateEntry* p_signal = findNetState("+CSQ:");
+    unsigned int generation;
+    int items;
 
     memset(response, 0, sizeof(response));
+    if (readNetState(p_signal, response, maxNumOfElements, &items, &generation)) {
+        goto on_exit;
+    }
+
     err = at_send_command_singleline("AT+CSQ", "+CSQ:", &p_response);
     if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
         RLOGE("Fail to send AT+CSQ due to: %s", at_io_err_str(err));
@@ -197,6 +307,8 @@ static void requestSignalStrength(void* data, size_t datalen, RIL_Token t)
         }
     }
 
+    storeNetState(p_signal, response, maxNumOfElements, maxNumOfElements, false, generation);
+
 on_exit:
     if (ril_err != RIL_E_SUCCESS) {
         RLOGE("requestSignalStrength must never return an error when radio is on");
@@ -987,11 +1099,9 @@ static void requestVoiceRegistrationState(void* data, size_t datalen, RIL_Token
     int err;
     int* registration = NULL;
     char** responseStr = NULL;
-    ATResponse* p_response = NULL;
     RIL_Errno ril_err = RIL_E_SUCCESS;
     const char* cmd;
     const char* prefix;
-    char* line;
     int i = 0, j, numElements = 0;
     int count = 3;
     int type, startfrom;
@@ -1001,18 +1111,15 @@ static void requestVoiceRegistrationState(void* data, size_t datalen, RIL_Token
     prefix = "+CREG:";
     numElements = REG_STATE_LEN;
 
-    err = at_send_command_singleline(cmd, prefix, &p_response);
-    if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
-        RLOGE("Failure occurred in sending %s due to: %s", cmd, at_io_err_str(err));
-        ril_err = RIL_E_SUCCESS;
+    err = getRegistrationState(cmd, prefix, &type, &count, &registration);
+    if (err == AT_ERROR_INVALID_RESPONSE) {
+        RLOGE("Fail to parse registration state in %s", __func__);
+        ril_err = RIL_E_GENERIC_FAILURE;
         goto on_exit;
     }
 
-    line = p_response->p_intermediates->line;
-
-    if (parseRegistrationState(line, &type, &count, &registration)) {
-        RLOGE("Fail to parse registration state in %s", __func__);
-        ril_err = RIL_E_GENERIC_FAILURE;
+    if (err != AT_ERROR_OK) {
+        ril_err = RIL_E_SUCCESS;
         goto on_exit;
     }
 
@@ -1191,7 +1298,6 @@ on_exit:
     registration = NULL;
     RIL_onRequestComplete(t, ril_err, ril_err == RIL_E_SUCCESS ? responseStr : NULL,
         ril_err == RIL_E_SUCCESS ? numElements * sizeof(responseStr) : 0);
-    at_response_free(p_response);
     if (responseStr) {
         for (j = 0; j < numElements; j++) {
             free(responseStr[j]);
@@ -1259,30 +1365,26 @@ static void requestQueryBandMode(void* data, size_t datalen, RIL_Token t)
 
 static void on_nitz_unsol_resp(const char* s)
 {
-    char *line = NULL, *p;
-    int err;
     /* TI specific -- NITZ time */
-    char* response;
-
-    line = p = strdup(s);
-    at_tok_start(&p);
+    ATView time;
+    char response[64];
 
-    err = at_tok_nextstr(&p, &response);
-
-    if (err != 0) {
+    if (at_tok_parse(s, "%s", &time) != 1 || time.len >= sizeof(response)) {
         RLOGE("invalid NITZ line %s\n", s);
-    } else {
-        RIL_onUnsolicitedResponse(
-            RIL_UNSOL_NITZ_TIME_RECEIVED,
-            response, strlen(response) + 1);
+        return;
     }
 
-    free(line);
+    memcpy(response, time.p, time.len);
+    response[time.len] = '\0';
+
+    RIL_onUnsolicitedResponse(
+        RIL_UNSOL_NITZ_TIME_RECEIVED,
+        response, time.len + 1);
 }
 
 static void on_signal_strength_unsol_resp(const char* s)
 {
-    char *line = NULL, *p;
+    ATView cur;
     int err;
 
     // Accept a response that is at least v6, and up to v12
@@ -1291,21 +1393,24 @@ static void on_signal_strength_unsol_resp(const char* s)
     int response[maxNumOfElements];
     memset(response, 0, sizeof(response));
 
-    line = p = strdup(s);
-    at_tok_start(&p);
+    if (at_view_start(&cur, s) < 0) {
+        RLOGE("Fail to parse response in %s", __func__);
+        return;
+    }
 
     for (int count = 0; count < maxNumOfElements; count++) {
-        err = at_tok_nextint(&p, &(response[count]));
+        err = at_view_nextint(&cur, &(response[count]));
         if (err < 0 && count < minNumOfElements) {
             RLOGE("Fail to parse response in %s", __func__);
-            free(line);
+            invalidateNetState(findNetState("+CSQ:"));
             return;
         }
     }
 
+    storeNetState(findNetState("+CSQ:"), response, maxNumOfElements, maxNumOfElements, true, 0);
+
     RIL_onUnsolicitedResponse(RIL_UNSOL_SIGNAL_STRENGTH,
         response, sizeof(response));
-    free(line);
 }
 
 int mapNetworkRegistrationResponse(int in_response)
@@ -1353,18 +1458,28 @@ int mapNetworkRegistrationResponse(int in_response)
     return out_response;
 }
 
-int parseRegistrationState(char* str, int* type, int* items, int** response)
+/* the fields of a registration state by number of commas, see below */
+static const char* s_regStateFormats[] = {
+    "%d", /* +CREG: <stat> */
+    "%_,%d", /* +CREG: <n>, <stat> */
+    "%d,%h,%h", /* +CREG: <stat>, <lac>, <cid> */
+    "%_,%d,%h,%h", /* +CREG: <n>, <stat>, <lac>, <cid> */
+    /* special case for CGREG, there is a fourth parameter
+     * that is the network type (unknown/gprs/edge/umts)
+     */
+    "%_,%d,%h,%h,%d", /* +CGREG: <n>, <stat>, <lac>, <cid>, <networkType> */
+};
+
+int parseRegistrationState(const char* str, int* type, int* items, int** response)
 {
-    int err;
-    char *line = str, *p;
+    const char* p;
     int* resp = NULL;
-    int skip;
     int commas;
 
     RLOGD("parseRegistrationState. Parsing: %s", str);
 
-    err = at_tok_start(&line);
-    if (err < 0) {
+    p = strchr(str, ':');
+    if (p == NULL) {
         RLOGE("Fail to parse line in %s", __func__);
         goto error;
     }
@@ -1392,122 +1507,26 @@ int parseRegistrationState(char* str, int* type, int* items, int** response)
 
     /* count number of commas */
     commas = 0;
-    for (p = line; *p != '\0'; p++) {
+    for (p++; *p != '\0'; p++) {
         if (*p == ',')
             commas++;
     }
 
-    resp = (int*)calloc(commas + 1, sizeof(int));
+    if (commas >= (int)(sizeof(s_regStateFormats) / sizeof(s_regStateFormats[0]))) {
+        goto error;
+    }
+
+    /* room for all four values the formats may store */
+    resp = (int*)calloc(commas + 1 > 4 ? commas + 1 : 4, sizeof(int));
     if (!resp) {
         RLOGE("resp is null");
         goto error;
     }
 
-    switch (commas) {
-    case 0: /* +CREG: <stat> */
-        err = at_tok_nextint(&line, &resp[0]);
-        if (err < 0) {
-            RLOGE("Fail to parse stat in %s", __func__);
-            goto error;
-        }
-        break;
-
-    case 1: /* +CREG: <n>, <stat> */
-        err = at_tok_nextint(&line, &skip);
-        if (err < 0) {
-            RLOGE("Fail to parse integer in %s", __func__);
-            goto error;
-        }
-
-        err = at_tok_nextint(&line, &resp[0]);
-        if (err < 0) {
-            RLOGE("Fail to parse stat in %s", __func__);
-            goto error;
-        }
-        break;
-
-    case 2: /* +CREG: <stat>, <lac>, <cid> */
-        err = at_tok_nextint(&line, &resp[0]);
-        if (err < 0) {
-            RLOGE("Fail to parse stat in %s", __func__);
-            goto error;
-        }
-
-        err = at_tok_nexthexint(&line, &resp[1]);
-        if (err < 0) {
-            RLOGE("Fail to parse lac in %s", __func__);
-            goto error;
-        }
-
-        err = at_tok_nexthexint(&line, &resp[2]);
-        if (err < 0) {
-            RLOGE("Fail to parse cid in %s", __func__);
-            goto error;
-        }
-        break;
-
-    case 3: /* +CREG: <n>, <stat>, <lac>, <cid> */
-        err = at_tok_nextint(&line, &skip);
-        if (err < 0) {
-            RLOGE("Fail to parse integer in %s", __func__);
-            goto error;
-        }
-
-        err = at_tok_nextint(&line, &resp[0]);
-        if (err < 0) {
-            RLOGE("Fail to parse stat in %s", __func__);
-            goto error;
-        }
-
-        err = at_tok_nexthexint(&line, &resp[1]);
-        if (err < 0) {
-            RLOGE("Fail to parse lac in %s", __func__);
-            goto error;
-        }
-
-        err = at_tok_nexthexint(&line, &resp[2]);
-        if (err < 0) {
-            RLOGE("Fail to parse cid in %s", __func__);
-            goto error;
-        }
-        break;
-
-    /* special case for CGREG, there is a fourth parameter
-     * that is the network type (unknown/gprs/edge/umts)
-     */
-    case 4: /* +CGREG: <n>, <stat>, <lac>, <cid>, <networkType> */
-        err = at_tok_nextint(&line, &skip);
-        if (err < 0) {
-            RLOGE("Fail to parse integer in %s", __func__);
-            goto error;
-        }
-
-        err = at_tok_nextint(&line, &resp[0]);
-        if (err < 0) {
-            RLOGE("Fail to parse stat in %s", __func__);
-            goto error;
-        }
-
-        err = at_tok_nexthexint(&line, &resp[1]);
-        if (err < 0) {
-            RLOGE("Fail to parse lac in %s", __func__);
-            goto error;
-        }
-
-        err = at_tok_nexthexint(&line, &resp[2]);
-        if (err < 0) {
-            RLOGE("Fail to parse cid in %s", __func__);
-            goto error;
-        }
-
-        err = at_tok_nextint(&line, &resp[3]);
-        if (err < 0) {
-            RLOGE("Fail to parse networkType in %s", __func__);
-            goto error;
-        }
-        break;
-
-    default:
+    if (at_tok_parse(str, s_regStateFormats[commas], &resp[0], &resp[1],
+            &resp[2], &resp[3])
+        != commas + 1) {
+        RLOGE("Fail to parse registration state in %s", __func__);
         goto error;
     }
 
@@ -1536,6 +1555,88 @@ error:
     return -1;
 }
 
+int getRegistrationState(const char* cmd, const char* prefix, int* type,
+    int* items, int** response)
+{
+    NetStateEntry* p_entry = findNetState(prefix);
+    ATResponse* p_response = NULL;
+    int values[REG_STATE_VALUES];
+    unsigned int generation;
+    int err;
+
+    if (readNetState(p_entry, values, REG_STATE_VALUES, items, &generation)) {
+        *response = (int*)calloc(REG_STATE_VALUES, sizeof(int));
+        if (*response == NULL) {
+            RLOGE("Failed to allocate memory");
+            return AT_ERROR_GENERIC;
+        }
+
+        memcpy(*response, values, sizeof(values));
+        *type = techFromModemType(TECH(getModemInfo()));
+
+        return AT_ERROR_OK;
+    }
+
+    err = at_send_command_singleline(cmd, prefix, &p_response);
+    if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
+        RLOGE("Failure occurred in sending %s due to: %s", cmd, at_io_err_str(err));
+        at_response_free(p_response);
+        return err != AT_ERROR_OK ? err : AT_ERROR_GENERIC;
+    }
+
+    if (parseRegistrationState(p_response->p_intermediates->line, type, items, response)) {
+        at_response_free(p_response);
+        return AT_ERROR_INVALID_RESPONSE;
+    }
+
+    /* parseRegistrationState() allocates at least REG_STATE_VALUES */
+    storeNetState(p_entry, *response, REG_STATE_VALUES, *items, false, generation);
+
+    at_response_free(p_response);
+
+    return AT_ERROR_OK;
+}
+
+/* the fields of a registration URC by number of commas, it has no <n> */
+static const char* s_regUrcFormats[] = {
+    "%d", /* +CREG: <stat> */
+    NULL,
+    "%d,%h,%h", /* +CREG: <stat>, <lac>, <cid> */
+    "%d,%h,%h,%d", /* +CGREG: <stat>, <lac>, <cid>, <networkType> */
+};
+
+/* Stores the state of a registration URC as if it was queried */
+static void on_registration_unsol_resp(const char* s)
+{
+    NetStateEntry* p_entry = findNetState(s);
+    int values[REG_STATE_VALUES] = { 0 };
+    const char* p;
+    int commas = 0;
+
+    if (p_entry == NULL) {
+        return;
+    }
+
+    p = strchr(s, ':');
+    for (p++; *p != '\0'; p++) {
+        if (*p == ',')
+            commas++;
+    }
+
+    if (commas >= (int)(sizeof(s_regUrcFormats) / sizeof(s_regUrcFormats[0]))
+        || s_regUrcFormats[commas] == NULL
+        || at_tok_parse(s, s_regUrcFormats[commas], &values[0], &values[1],
+               &values[2], &values[3])
+            != commas + 1) {
+        RLOGE("invalid registration URC %s", s);
+        invalidateNetState(p_entry);
+        return;
+    }
+
+    /* the reply to a query has <n> first, count it too */
+    storeNetState(p_entry, values, REG_STATE_VALUES, commas + 2, true, 0);
+}
+
 int is3gpp2(int radioTech)
 {
     switch (radioTech) {
@@ -1618,66 +1719,78 @@ void on_request_network(int request, void* data, size_t datalen, RIL_Token t)
     RLOGD("On request network end");
 }
 
-bool try_handle_unsol_net(const char* s)
+static void onNitzUnsol(const char* s, const char* sms_pdu)
 {
-    bool ret = false;
-    char *line = NULL, *p;
-    int err;
+    (void)sms_pdu;
 
-    RLOGD("unsol network string: %s", s);
+    RLOGI("Receive NITZ URC");
+    on_nitz_unsol_resp(s);
+}
 
-    if (strStartsWith(s, "%CTZV:")) {
-        RLOGI("Receive NITZ URC");
-        on_nitz_unsol_resp(s);
-        ret = true;
-    } else if (strStartsWith(s, "+CREG:") || strStartsWith(s, "+CGREG:")) {
-        RLOGI("Receive EPS network state change URC");
-        RIL_onUnsolicitedResponse(
-            RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED, NULL, 0);
-        ret = true;
-    }
-#define CGFPCCFG "%CGFPCCFG:"
-    else if (strStartsWith(s, CGFPCCFG)) {
-        RLOGI("Receive physical channel configs URC");
-        /* cuttlefish/goldfish specific */
-        line = p = strdup(s);
-        RLOGD("got CGFPCCFG line %s and %s\n", s, p);
-        err = at_tok_start(&line);
-        if (err) {
-            RLOGE("invalid CGFPCCFG line %s and %s\n", s, p);
-        }
-#define kSize 5
-        int configs[kSize];
-        for (int i = 0; i < kSize && !err; ++i) {
-            err = at_tok_nextint(&line, &(configs[i]));
-            RLOGD("got i %d, val = %d", i, configs[i]);
-        }
+static void onNetworkStateChangedUnsol(const char* s, const char* sms_pdu)
+{
+    (void)sms_pdu;
 
-        if (err) {
-            RLOGE("invalid CGFPCCFG line %s and %s\n", s, p);
-        } else {
-            int modem_tech = configs[2];
-            configs[2] = techFromModemType(modem_tech);
-            RIL_onUnsolicitedResponse(
-                RIL_UNSOL_PHYSICAL_CHANNEL_CONFIGS,
-                configs, kSize);
-        }
+    RLOGI("Receive EPS network state change URC");
+    on_registration_unsol_resp(s);
+    RIL_onUnsolicitedResponse(
+        RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED, NULL, 0);
+}
 
-        free(p);
-        ret = true;
-    } else if (strStartsWith(s, "+CSQ: ")) {
-        RLOGI("Receive signal strength URC");
-        on_signal_strength_unsol_resp(s);
-        ret = true;
-    } else if (strStartsWith(s, "+CIREGU")) {
-        RLOGI("Receive ims_reg change URC");
-        RIL_onUnsolicitedResponse(
-            RIL_UNSOL_RESPONSE_IMS_NETWORK_STATE_CHANGED,
-            NULL, 0);
-        ret = true;
+#define CGFPCCFG "%CGFPCCFG:"
+static void onPhysicalChannelConfigsUnsol(const char* s, const char* sms_pdu)
+{
+    (void)sms_pdu;
+
+    RLOGI("Receive physical channel configs URC");
+    /* cuttlefish/goldfish specific */
+    RLOGD("got CGFPCCFG line %s\n", s);
+#define kSize 5
+    int configs[kSize];
+    if (at_tok_parse(s, "%%CGFPCCFG: %d,%d,%d,%d,%d", &configs[0], &configs[1],
+            &configs[2], &configs[3], &configs[4])
+        != kSize) {
+        RLOGE("invalid CGFPCCFG line %s\n", s);
     } else {
-        RLOGD("Can't match any unsol network handlers");
+        int modem_tech = configs[2];
+        configs[2] = techFromModemType(modem_tech);
+        RIL_onUnsolicitedResponse(
+            RIL_UNSOL_PHYSICAL_CHANNEL_CONFIGS,
+            configs, kSize);
     }
+}
 
-    return ret;
+static void onSignalStrengthUnsol(const char* s, const char* sms_pdu)
+{
+    (void)sms_pdu;
+
+    RLOGI("Receive signal strength URC");
+    on_signal_strength_unsol_resp(s);
+}
+
+static void onImsNetworkStateChangedUnsol(const char* s, const char* sms_pdu)
+{
+    (void)s;
+    (void)sms_pdu;
+
+    RLOGI("Receive ims_reg change URC");
+    RIL_onUnsolicitedResponse(
+        RIL_UNSOL_RESPONSE_IMS_NETWORK_STATE_CHANGED,
+        NULL, 0);
+}
+
+static const ATUnsolPrefix s_netUnsols[] = {
+    { "%CTZV:", onNitzUnsol },
+    { "+CREG:", onNetworkStateChangedUnsol },
+    { "+CGREG:", onNetworkStateChangedUnsol },
+    { "+CEREG:", onNetworkStateChangedUnsol },
+    { CGFPCCFG, onPhysicalChannelConfigsUnsol },
+    { "+CSQ: ", onSignalStrengthUnsol },
+    { "+CIREGU", onImsNetworkStateChangedUnsol },
+};
+
+int register_unsol_net(void)
+{
+    return at_register_unsol_handlers(s_netUnsols,
+        sizeof(s_netUnsols) / sizeof(s_netUnsols[0]));
 }
\ No newline at end of file
@@ -21,9 +21,21 @@
 #include <telephony/ril.h>
 
 void on_request_network(int request, void* data, size_t datalen, RIL_Token t);
-int parseRegistrationState(char* str, int* type, int* items, int** response);
+int parseRegistrationState(const char* str, int* type, int* items, int** response);
+
+/**
+ * Like parseRegistrationState() on the reply to "cmd", answered from the
+ * registration state kept from the URCs when it is known.
+ * returns AT_ERROR_OK, the error of the query, or AT_ERROR_INVALID_RESPONSE
+ * if the reply could not be parsed
+ */
+int getRegistrationState(const char* cmd, const char* prefix, int* type,
+    int* items, int** response);
+
+/* Forgets the registration states and signal strength kept */
+void invalidateNetworkState(void);
 int is3gpp2(int radioTech);
-bool try_handle_unsol_net(const char* s);
+int register_unsol_net(void);
 int mapNetworkRegistrationResponse(int in_response);
 
 #endif
\ No newline at end of file
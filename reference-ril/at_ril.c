@@ -22,11 +22,14 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <termios.h>
+#include <unistd.h>
 
 #include <telephony/ril.h>
 #include <telephony/ril_log.h>
 
 #include "at_call.h"
+#include "at_cmux.h"
 #include "at_data.h"
 #include "at_modem.h"
 #include "at_network.h"
@@ -75,6 +78,23 @@ static const struct RIL_Env* s_rilenv;
 /* trigger change to this with s_state_cond */
 static int s_closed = 0;
 
+/* guards s_channelsOpen and the channels while they are closed */
+static pthread_mutex_t s_channelsMutex = PTHREAD_MUTEX_INITIALIZER;
+static bool s_channelsOpen;
+
+/* tty given with -d, eg. a pty of a modem simulator to run CMUX against */
+static const char* s_device_path = NULL;
+
+#if AT_CMUX_DLCS > 0
+/* channels of DLC 2 and up, reused by every session */
+static ATChannel* s_dlcChannelPool[AT_CMUX_DLCS];
+/* the ones open in this session, NULL if not; DLC 1 is the default channel */
+static ATChannel* s_dlcChannels[AT_CMUX_DLCS];
+/* requests running on each DLC, which is not reopened before they are done */
+static int s_dlcUsers[AT_CMUX_DLCS];
+static pthread_cond_t s_dlcUsersCond = PTHREAD_COND_INITIALIZER;
+#endif
+
 static inline req_category_t request2eventtype(int request)
 {
     req_category_t type = REQ_UKNOWN_TYPE;
@@ -216,6 +236,76 @@ static inline req_category_t request2eventtype(int request)
     return type;
 }
 
+#if AT_CMUX_DLCS > 0
+/* index of the DLC that requests of "type" are sent on */
+static int categoryDlc(req_category_t type)
+{
+    int dlc;
+
+    switch (type) {
+    case REQ_SIM_TYPE:
+    case REQ_NETWORK_TYPE:
+        dlc = 1;
+        break;
+    case REQ_DATA_TYPE:
+        dlc = 2;
+        break;
+    default:
+        dlc = 0;
+        break;
+    }
+
+    return dlc < AT_CMUX_DLCS ? dlc : AT_CMUX_DLCS - 1;
+}
+
+/**
+ * Points this thread's AT commands at the DLC of requests of "type", or
+ * the default channel if that one is not open, and keeps it from being
+ * reopened until releaseDlc(). Returns the index to release
+ */
+static int acquireDlc(req_category_t type)
+{
+    int dlc = categoryDlc(type);
+
+    pthread_mutex_lock(&s_channelsMutex);
+    if (s_dlcChannels[dlc] == NULL) {
+        dlc = 0;
+    }
+    s_dlcUsers[dlc]++;
+    at_set_thread_channel(s_dlcChannels[dlc]);
+    pthread_mutex_unlock(&s_channelsMutex);
+
+    return dlc;
+}
+
+static void releaseDlc(int dlc)
+{
+    at_set_thread_channel(NULL);
+
+    pthread_mutex_lock(&s_channelsMutex);
+    if (--s_dlcUsers[dlc] == 0) {
+        pthread_cond_broadcast(&s_dlcUsersCond);
+    }
+    pthread_mutex_unlock(&s_channelsMutex);
+}
+#endif
+
+#if AT_CMUX_DLCS > 1
+/* requests on different DLCs are dispatched in parallel */
+static int requestLane(int request)
+{
+    int dlc = categoryDlc(request2eventtype(request));
+
+    pthread_mutex_lock(&s_channelsMutex);
+    if (s_dlcChannels[dlc] == NULL) {
+        dlc = 0;
+    }
+    pthread_mutex_unlock(&s_channelsMutex);
+
+    return dlc;
+}
+#endif
+
 static const char* getVersion(void)
 {
     return "android reference-ril 1.0";
@@ -315,18 +405,38 @@ static void waitForClose(void)
 /* do post-AT+CFUN=1 initialization */
 static void onRadioPowerOn(void)
 {
-    pollSIMState(NULL);
+    /* the wait for the card runs on the event loop thread */
+    RIL_requestTimedCallback(pollSIMState, NULL, NULL);
 }
 
 /**
  * Initialize everything that can be configured while we're still in
  * AT+CFUN=0
  */
+/* settings sent by initializeCallback() after ATE0Q0V1, in order */
+static const char* const s_initCommands[] = {
+    "ATS0=0", /* No auto-answer */
+    "AT+CMEE=1", /* Extended errors */
+    "AT+CREG=2", /* Network registration events */
+    "AT+CGREG=1", /* GPRS registration events */
+    "AT+CCWA=1", /* Call Waiting notifications */
+    "AT+CMOD=0", /* Alternating voice/data off */
+    "AT+CMUT=0", /* Not muted */
+    "AT+CSSN=0,1", /* +CSSU unsolicited supp service notifications */
+    "AT+COLP=0", /* no connected line identification */
+    "AT+CSCS=\"HEX\"", /* HEX character set */
+    "AT+CUSD=1", /* USSD unsolicited */
+    "AT+CGEREP=1,0", /* Enable +CGEV GPRS event notifications, but don't buffer */
+    "AT+CMGF=0", /* SMS PDU mode */
+};
+
 static void initializeCallback(void* param)
 {
     (void)param;
 
-    ATResponse* p_response = NULL;
+    size_t count = sizeof(s_initCommands) / sizeof(s_initCommands[0]);
+    size_t i;
+    int failed;
     int err;
 
     setRadioState(RADIO_STATE_OFF);
@@ -341,52 +451,20 @@ static void initializeCallback(void* param)
     /*  have verbose result codes */
     at_send_command("ATE0Q0V1", NULL);
 
-    /*  No auto-answer */
-    at_send_command("ATS0=0", NULL);
-
-    /*  Extended errors */
-    at_send_command("AT+CMEE=1", NULL);
-
-    /*  Network registration events */
-    err = at_send_command("AT+CREG=2", &p_response);
+    /* the rest is sent as few compound lines as the modem takes */
+    for (i = 0; i < count; i += failed + 1) {
+        failed = 0;
+        err = at_send_commands(&s_initCommands[i], count - i, &failed);
+        if (err == AT_ERROR_OK) {
+            break;
+        }
 
-    /* some handsets -- in tethered mode -- don't support CREG=2 */
-    if (err < 0 || p_response->success == 0) {
-        at_send_command("AT+CREG=1", NULL);
+        /* some handsets -- in tethered mode -- don't support CREG=2 */
+        if (strcmp(s_initCommands[i + failed], "AT+CREG=2") == 0) {
+            at_send_command("AT+CREG=1", NULL);
+        }
     }
 
-    at_response_free(p_response);
-
-    /*  GPRS registration events */
-    at_send_command("AT+CGREG=1", NULL);
-
-    /*  Call Waiting notifications */
-    at_send_command("AT+CCWA=1", NULL);
-
-    /*  Alternating voice/data off */
-    at_send_command("AT+CMOD=0", NULL);
-
-    /*  Not muted */
-    at_send_command("AT+CMUT=0", NULL);
-
-    /*  +CSSU unsolicited supp service notifications */
-    at_send_command("AT+CSSN=0,1", NULL);
-
-    /*  no connected line identification */
-    at_send_command("AT+COLP=0", NULL);
-
-    /*  HEX character set */
-    at_send_command("AT+CSCS=\"HEX\"", NULL);
-
-    /*  USSD unsolicited */
-    at_send_command("AT+CUSD=1", NULL);
-
-    /*  Enable +CGEV GPRS event notifications, but don't buffer */
-    at_send_command("AT+CGEREP=1,0", NULL);
-
-    /*  SMS PDU mode */
-    at_send_command("AT+CMGF=0", NULL);
-
     /* assume radio is off on error */
     if (isRadioOn() > 0) {
         setRadioState(RADIO_STATE_ON);
@@ -395,11 +473,13 @@ static void initializeCallback(void* param)
 
 /**
  * Called by atchannel when an unsolicited line appears
- * This is called on atchannel's reader thread. AT commands may
+ * This is called on atchannel's URC thread. AT commands may
  * not be issued here
  */
 static void onUnsolicited(const char* s, const char* sms_pdu)
 {
+    ATUnsolHandler handler;
+
     if (isModemEnable() == 0) {
         RLOGW("Modem is not alive");
         return;
@@ -416,38 +496,124 @@ static void onUnsolicited(const char* s, const char* sms_pdu)
         RLOGI("Handling sms notification");
     }
 
-    if (try_handle_unsol_call(s)) {
+    handler = at_find_unsol_handler(s);
+    if (handler != NULL) {
+        handler(s, sms_pdu);
         return;
     }
 
-    if (try_handle_unsol_modem(s)) {
-        return;
-    }
+    RLOGD("Can't handle AT line: %s", s);
+}
 
-    if (try_handle_unsol_net(s)) {
-        return;
+/**
+ * Opens the AT channels on "fd", one per DLC if the modem supports CMUX
+ * returns 0 on success, -1 on error
+ */
+static int openChannels(int fd)
+{
+#if AT_CMUX_DLCS > 0
+    ATChannel* channels[AT_CMUX_DLCS] = { NULL };
+    int dlcFds[AT_CMUX_DLCS];
+    int i;
+
+    if (cmux_start(fd, AT_CMUX_DLCS, dlcFds) == 0) {
+        /* the default channel last, opening a channel waits for the reader
+         * of its previous session so none of those is left afterwards */
+        for (i = 1; i < AT_CMUX_DLCS; i++) {
+            /* requests of the previous session still on it fail fast,
+             * its channel being closed */
+            pthread_mutex_lock(&s_channelsMutex);
+            while (s_dlcUsers[i] > 0) {
+                pthread_cond_wait(&s_dlcUsersCond, &s_channelsMutex);
+            }
+            pthread_mutex_unlock(&s_channelsMutex);
+
+            if (s_dlcChannelPool[i] == NULL) {
+                s_dlcChannelPool[i] = at_channel_create();
+            }
+
+            if (s_dlcChannelPool[i] != NULL
+                && at_channel_open(s_dlcChannelPool[i], dlcFds[i], onUnsolicited) == 0) {
+                channels[i] = s_dlcChannelPool[i];
+            } else {
+                RLOGW("DLC %d unused, its requests go to DLC 1", i + 1);
+                close(dlcFds[i]);
+            }
+        }
+
+        if (at_open(dlcFds[0], onUnsolicited) < 0) {
+            for (i = 1; i < AT_CMUX_DLCS; i++) {
+                at_channel_close(channels[i]);
+            }
+            close(dlcFds[0]);
+            cmux_stop();
+            return -1;
+        }
+
+        pthread_mutex_lock(&s_channelsMutex);
+        for (i = 1; i < AT_CMUX_DLCS; i++) {
+            s_dlcChannels[i] = channels[i];
+        }
+        s_channelsOpen = true;
+        pthread_mutex_unlock(&s_channelsMutex);
+
+        return 0;
     }
 
-    if (try_handle_unsol_sms(s, sms_pdu)) {
-        return;
+    RLOGW("CMUX not available, using a single AT channel");
+#endif
+
+    if (at_open(fd, onUnsolicited) < 0) {
+        return -1;
     }
 
-    if (try_handle_unsol_data(s)) {
-        return;
+    pthread_mutex_lock(&s_channelsMutex);
+    s_channelsOpen = true;
+    pthread_mutex_unlock(&s_channelsMutex);
+
+    return 0;
+}
+
+/**
+ * Closes all AT channels. Returns 0 if they were closed already, eg. when
+ * several DLCs report the end of the same session
+ */
+static int closeChannels(void)
+{
+#if AT_CMUX_DLCS > 0
+    int i;
+#endif
+
+    pthread_mutex_lock(&s_channelsMutex);
+
+    if (!s_channelsOpen) {
+        pthread_mutex_unlock(&s_channelsMutex);
+        return 0;
     }
 
-    if (try_handle_unsol_sim(s)) {
-        return;
+    s_channelsOpen = false;
+
+#if AT_CMUX_DLCS > 0
+    for (i = 1; i < AT_CMUX_DLCS; i++) {
+        at_channel_close(s_dlcChannels[i]);
+        s_dlcChannels[i] = NULL;
     }
+#endif
 
-    RLOGD("Can't handle AT line: %s", s);
+    at_close();
+
+    pthread_mutex_unlock(&s_channelsMutex);
+
+    return 1;
 }
 
 /* Called on command or reader thread */
 static void onATReaderClosed(void)
 {
     RLOGI("AT channel closed");
-    at_close();
+    if (closeChannels() == 0) {
+        return;
+    }
     s_closed = 1;
 
     setRadioState(RADIO_STATE_UNAVAILABLE);
@@ -457,7 +623,9 @@ static void onATReaderClosed(void)
 static void onATTimeout(void)
 {
     RLOGI("AT channel timeout; closing");
-    at_close();
+    if (closeChannels() == 0) {
+        return;
+    }
 
     s_closed = 1;
 
@@ -480,7 +648,19 @@ static void* mainLoop(void* param)
     for (;;) {
         fd = -1;
         while (fd < 0) {
-            if (isInEmulator()) {
+            if (s_device_path != NULL) {
+                fd = open(s_device_path, O_RDWR);
+                RLOGI("opening %s %d!", s_device_path, fd);
+
+                if (fd >= 0 && isatty(fd)) {
+                    /* CMUX frames are binary */
+                    struct termios ios;
+
+                    tcgetattr(fd, &ios);
+                    cfmakeraw(&ios);
+                    tcsetattr(fd, TCSANOW, &ios);
+                }
+            } else if (isInEmulator()) {
                 fd = open("/dev/ttyV0", O_RDWR);
                 RLOGI("opening qemu_modem_port %d!", fd);
             }
@@ -493,7 +673,7 @@ static void* mainLoop(void* param)
         }
 
         s_closed = 0;
-        ret = at_open(fd, onUnsolicited);
+        ret = openChannels(fd);
 
         if (ret < 0) {
             RLOGE("AT error %d on at_open\n", ret);
@@ -507,6 +687,10 @@ static void* mainLoop(void* param)
         sleep(1);
 
         waitForClose();
+
+#if AT_CMUX_DLCS > 0
+        cmux_stop();
+#endif
         RLOGI("Re-opening after close");
     }
 }
@@ -516,18 +700,44 @@ pthread_t s_tid_mainloop;
 const RIL_RadioFunctions* RIL_Init(const struct RIL_Env* env, int argc, char** argv)
 {
     int ret;
+    int opt;
     pthread_attr_t attr;
 
     s_rilenv = env;
 
     RLOGI("RIL_Init");
 
+    while ((opt = getopt(argc, argv, "d:")) != -1) {
+        switch (opt) {
+        case 'd':
+            s_device_path = optarg;
+            RLOGI("Opening tty device %s", s_device_path);
+            break;
+        default:
+            RLOGE("Usage: -d /dev/tty_device");
+            return NULL;
+        }
+    }
+
     initModem();
     if (!getModemInfo()) {
         RLOGE("Unable to alloc memory for ModemInfo");
         return NULL;
     }
 
+    if (register_unsol_call() < 0 || register_unsol_modem() < 0
+        || register_unsol_net() < 0 || register_unsol_sms() < 0
+        || register_unsol_data() < 0 || register_unsol_sim() < 0) {
+        RLOGE("Unable to register unsolicited handlers");
+        return NULL;
+    }
+
+#if AT_CMUX_DLCS > 1
+    if (env->SetRequestLanes != NULL) {
+        env->SetRequestLanes(AT_CMUX_DLCS, requestLane);
+    }
+#endif
+
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     ret = pthread_create(&s_tid_mainloop, &attr, mainLoop, NULL);
@@ -584,18 +794,8 @@ static void onCancel(RIL_Token t)
  * we must ensure that the underlying at_send_command_* function
  * is atomic.
  */
-static void onRequest(int request, void* data, size_t datalen, RIL_Token t)
+static void processRequest(int request, int req_type, void* data, size_t datalen, RIL_Token t)
 {
-    int req_type = 0;
-
-    req_type = request2eventtype(request);
-    RLOGI("onRequest: %d<->%s, reqtype: %d", request, requestToString(request), req_type);
-
-    if (req_type < 1) {
-        RIL_onRequestComplete(t, RIL_E_REQUEST_NOT_SUPPORTED, NULL, 0);
-        return;
-    }
-
     RLOGD("onRequest: %d, RadioState: %d", request, getRadioState());
     if (isModemEnable() == 0 && request != RIL_REQUEST_ENABLE_MODEM
         && request != RIL_REQUEST_GET_MODEM_STATUS) {
@@ -685,6 +885,30 @@ static void onRequest(int request, void* data, size_t datalen, RIL_Token t)
         RIL_onRequestComplete(t, RIL_E_REQUEST_NOT_SUPPORTED, NULL, 0);
         break;
     }
+}
+
+static void onRequest(int request, void* data, size_t datalen, RIL_Token t)
+{
+    int req_type = 0;
+#if AT_CMUX_DLCS > 0
+    int dlc;
+#endif
+
+    req_type = request2eventtype(request);
+    RLOGI("onRequest: %d<->%s, reqtype: %d", request, requestToString(request), req_type);
+
+    if (req_type < 1) {
+        RIL_onRequestComplete(t, RIL_E_REQUEST_NOT_SUPPORTED, NULL, 0);
+        return;
+    }
+
+#if AT_CMUX_DLCS > 0
+    dlc = acquireDlc(req_type);
+    processRequest(request, req_type, data, datalen, t);
+    releaseDlc(dlc);
+#else
+    processRequest(request, req_type, data, datalen, t);
+#endif
 
     RLOGD("On request end\n");
 }
@@ -725,6 +949,10 @@ void setRadioState(RIL_RadioState newState)
 
     /* do these outside of the mutex */
     if (sState != oldState) {
+        /* registration, signal, card and PDP contexts are to be queried again, eg. after CFUN */
+        invalidateNetworkState();
+        invalidateCardStatus();
+        invalidateDataCallList();
         RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED,
             NULL, 0);
         // Sim state can change as result of radio state change
@@ -17,9 +17,12 @@
 #define LOG_TAG "AT_SIM"
 #define NDEBUG 1
 
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/cdefs.h>
+#include <time.h>
 
+#include <telephony/librilutils.h>
 #include <telephony/ril_log.h>
 
 #include "at_modem.h"
@@ -30,9 +33,25 @@
 #include "atchannel.h"
 #include "misc.h"
 
-static const struct timeval TIMEVAL_SIMPOLL = { 1, 0 };
+/* first and longest delay of pollSIMState() asking AT+CPIN? again */
+#ifndef SIM_POLL_MIN_MSEC
+#define SIM_POLL_MIN_MSEC 20
+#endif
+#ifndef SIM_POLL_MAX_MSEC
+#define SIM_POLL_MAX_MSEC 1000
+#endif
+
 static int areUiccApplicationsEnabled = true;
 
+/*
+ * The wait for the card after the radio was turned on, see pollSIMState().
+ * Accessed on the event loop thread only.
+ */
+static bool s_simPolling;
+static uintptr_t s_simPollSession;
+static long s_simPollDelayMsec;
+static uint64_t s_simPollStart;
+
 // STK
 static bool s_stkServiceRunning = false;
 static char* s_stkUnsolResponse = NULL;
@@ -42,6 +61,82 @@ static int s_mcc = 0;
 static int s_mnc = 0;
 static int s_mncLength = 2;
 
+/* card identities hold until the card or its applications change */
+static const ATCachePolicy s_simCache = { 0, "+CUSATP:", AT_CACHE_SIM_CHANGED };
+
+/* SIM_IO commands, 3GPP TS 27.007 8.18 */
+#define SIM_CMD_READ_BINARY 176
+#define SIM_CMD_READ_RECORD 178
+#define SIM_CMD_GET_RESPONSE 192
+#define SIM_CMD_STATUS 242
+#define SIM_RECORD_ABSOLUTE 4 /* P2 of READ RECORD */
+
+#define MAX_EF_CACHE_ENTRIES 256
+
+/* records of a linear fixed EF read ahead after a READ RECORD, 0 disables */
+#ifndef SIM_EF_READ_AHEAD_RECORDS
+#define SIM_EF_READ_AHEAD_RECORDS 4
+#endif
+
+/* longest wait for a record read ahead, then it is read directly */
+#define SIM_EF_READ_AHEAD_WAIT_MSEC 5000
+
+/*
+ * Replies of the EF reads of RIL_REQUEST_SIM_IO, by command, file, path
+ * and P1-P3. The framework reads the same EFs again after each boot and
+ * refresh, while every APDU takes the card tens of ms. Any other command
+ * on an EF drops its entries, a refresh or a card change all of them.
+ * |s_efCacheGeneration| moves on each drop, so a read that raced one is
+ * not kept. A pending entry is a read ahead not answered yet, readers of
+ * it wait on |s_efCacheCond| until SIM_EF_READ_AHEAD_WAIT_MSEC runs out.
+ * |s_efCacheMutex| guards the table.
+ */
+typedef struct {
+    int command;
+    int fileid;
+    char* path;
+    int p1;
+    int p2;
+    int p3;
+    bool pending;
+    int sw1;
+    int sw2;
+    char* simResponse;
+} EfCacheEntry;
+
+static pthread_mutex_t s_efCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_efCacheCond = PTHREAD_COND_INITIALIZER;
+static EfCacheEntry s_efCache[MAX_EF_CACHE_ENTRIES];
+static int s_numEfCacheEntries;
+static unsigned int s_efCacheGeneration;
+
+/*
+ * The status of the card as of the last AT+CPIN? or +CPIN: URC, and the
+ * RIL_CardStatus_v1_5 built from it, so that GET_SIM_STATUS, asked after
+ * every SIM_STATUS_CHANGED, and the SIM checks of other requests are
+ * answered from memory. PIN and PUK requests, SIM URCs and radio state
+ * changes drop them. |s_cardGeneration| moves on each drop, so a query
+ * that raced one is not kept. |s_cardMutex| guards them.
+ */
+static pthread_mutex_t s_cardMutex = PTHREAD_MUTEX_INITIALIZER;
+static SIM_Status s_simStatus; /* SIM_READY whatever the radio state */
+static bool s_simStatusValid;
+static RIL_CardStatus_v1_5 s_cardStatus;
+static char s_cardIccid[64];
+static bool s_cardStatusValid;
+static unsigned int s_cardGeneration;
+
+/* a record read ahead, the key of its pending entry */
+typedef struct {
+    ATChannel* p_channel;
+    int fileid;
+    char* path;
+    int p1;
+    int last; /* the last record to read ahead */
+    int p3;
+    unsigned int generation;
+} EfReadAhead;
+
 typedef enum {
     STK_UNSOL_EVENT_UNKNOWN,
     STK_UNSOL_EVENT_NOTIFY,
@@ -96,6 +191,368 @@ static int parseSimResponseLine(char* line, RIL_SIM_IO_Response* response)
     return 0;
 }
 
+static bool isEfRead(int command)
+{
+    return command == SIM_CMD_READ_BINARY || command == SIM_CMD_READ_RECORD
+        || command == SIM_CMD_GET_RESPONSE;
+}
+
+static bool samePath(const char* a, const char* b)
+{
+    return a == NULL ? b == NULL : b != NULL && strcmp(a, b) == 0;
+}
+
+/* assumes s_efCacheMutex is held */
+static int findEfLocked(int command, int fileid, const char* path,
+    int p1, int p2, int p3)
+{
+    for (int i = 0; i < s_numEfCacheEntries; i++) {
+        const EfCacheEntry* p_entry = &s_efCache[i];
+
+        if (p_entry->command == command && p_entry->fileid == fileid
+            && p_entry->p1 == p1 && p_entry->p2 == p2 && p_entry->p3 == p3
+            && samePath(p_entry->path, path)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* assumes s_efCacheMutex is held and room in the table */
+static EfCacheEntry* addEfLocked(int command, int fileid, const char* path,
+    int p1, int p2, int p3)
+{
+    EfCacheEntry* p_entry = &s_efCache[s_numEfCacheEntries];
+
+    memset(p_entry, 0, sizeof(*p_entry));
+    p_entry->path = path ? strdup(path) : NULL;
+    if (path != NULL && p_entry->path == NULL) {
+        return NULL;
+    }
+
+    p_entry->command = command;
+    p_entry->fileid = fileid;
+    p_entry->p1 = p1;
+    p_entry->p2 = p2;
+    p_entry->p3 = p3;
+    s_numEfCacheEntries++;
+
+    return p_entry;
+}
+
+/* assumes s_efCacheMutex is held */
+static void dropEfLocked(int index)
+{
+    free(s_efCache[index].path);
+    free(s_efCache[index].simResponse);
+    s_efCache[index] = s_efCache[--s_numEfCacheEntries];
+}
+
+/* Drops the cached reads of "fileid", of all EFs for -1 */
+static void invalidateEfCache(int fileid)
+{
+    pthread_mutex_lock(&s_efCacheMutex);
+
+    for (int i = s_numEfCacheEntries - 1; i >= 0; i--) {
+        if (fileid < 0 || s_efCache[i].fileid == fileid) {
+            dropEfLocked(i);
+        }
+    }
+
+    s_efCacheGeneration++;
+    pthread_cond_broadcast(&s_efCacheCond);
+
+    pthread_mutex_unlock(&s_efCacheMutex);
+}
+
+/* Drops everything known about the card, when it changed or refreshed */
+static void invalidateSimCaches(void)
+{
+    invalidateEfCache(-1);
+    at_cache_invalidate(AT_CACHE_SIM_CHANGED);
+}
+
+/**
+ * Fills "p_sr" with the cached reply to "p_args", waiting for it at most
+ * SIM_EF_READ_AHEAD_WAIT_MSEC if it is read ahead, the caller frees
+ * p_sr->simResponse. Returns false on a miss, with the generation to
+ * store its reply at in *p_generation
+ */
+static bool readEfCache(const RIL_SIM_IO_v6* p_args, RIL_SIM_IO_Response* p_sr,
+    unsigned int* p_generation)
+{
+    struct timespec ts;
+    bool hit = false;
+    int ret = 0;
+    int i;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += SIM_EF_READ_AHEAD_WAIT_MSEC / 1000;
+    ts.tv_nsec += (SIM_EF_READ_AHEAD_WAIT_MSEC % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&s_efCacheMutex);
+
+    while ((i = findEfLocked(p_args->command, p_args->fileid, p_args->path,
+                p_args->p1, p_args->p2, p_args->p3))
+            >= 0
+        && s_efCache[i].pending && ret == 0) {
+        ret = pthread_cond_timedwait(&s_efCacheCond, &s_efCacheMutex, &ts);
+    }
+
+    if (i >= 0 && s_efCache[i].pending) {
+        /* its reply was lost, read it directly */
+        RLOGW("Record %d of EF %04x not read ahead in time", p_args->p1, p_args->fileid);
+    } else if (i >= 0) {
+        p_sr->sw1 = s_efCache[i].sw1;
+        p_sr->sw2 = s_efCache[i].sw2;
+        p_sr->simResponse = s_efCache[i].simResponse ? strdup(s_efCache[i].simResponse) : NULL;
+        hit = s_efCache[i].simResponse == NULL || p_sr->simResponse != NULL;
+    }
+
+    *p_generation = s_efCacheGeneration;
+
+    pthread_mutex_unlock(&s_efCacheMutex);
+
+    return hit;
+}
+
+/* Caches the reply "p_sr" to "p_args", unless something was dropped since "generation" */
+static void storeEfCache(const RIL_SIM_IO_v6* p_args, const RIL_SIM_IO_Response* p_sr,
+    unsigned int generation)
+{
+    EfCacheEntry* p_entry;
+    char* simResponse;
+
+    simResponse = p_sr->simResponse ? strdup(p_sr->simResponse) : NULL;
+    if (p_sr->simResponse != NULL && simResponse == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&s_efCacheMutex);
+
+    if (generation != s_efCacheGeneration || s_numEfCacheEntries == MAX_EF_CACHE_ENTRIES
+        || findEfLocked(p_args->command, p_args->fileid, p_args->path,
+               p_args->p1, p_args->p2, p_args->p3)
+            >= 0
+        || (p_entry = addEfLocked(p_args->command, p_args->fileid, p_args->path,
+                p_args->p1, p_args->p2, p_args->p3))
+            == NULL) {
+        pthread_mutex_unlock(&s_efCacheMutex);
+        free(simResponse);
+        return;
+    }
+
+    p_entry->sw1 = p_sr->sw1;
+    p_entry->sw2 = p_sr->sw2;
+    p_entry->simResponse = simResponse;
+
+    pthread_mutex_unlock(&s_efCacheMutex);
+}
+
+/* assumes s_efCacheMutex is held, number of records of a linear fixed EF, 0 if unknown */
+static int linearFixedRecordsLocked(int fileid, const char* path)
+{
+    uint8_t* bytes;
+    size_t len;
+    size_t pos;
+    int records = 0;
+
+    for (int i = 0; i < s_numEfCacheEntries; i++) {
+        const EfCacheEntry* p_entry = &s_efCache[i];
+
+        if (p_entry->command != SIM_CMD_GET_RESPONSE || p_entry->fileid != fileid
+            || p_entry->pending || p_entry->simResponse == NULL
+            || !samePath(p_entry->path, path)) {
+            continue;
+        }
+
+        len = strlen(p_entry->simResponse) / 2;
+        bytes = convertHexStringToBytes(p_entry->simResponse, len * 2);
+        if (bytes == NULL) {
+            return 0;
+        }
+
+        /* FCP template, its file descriptor is 3GPP TS 31.101 11.1.1.4.3 */
+        for (pos = 2; len > 2 && bytes[0] == 0x62 && pos + 2 <= len; pos += 2 + bytes[pos + 1]) {
+            if (bytes[pos] == 0x82 && bytes[pos + 1] >= 5 && pos + 7 <= len) {
+                if ((bytes[pos + 2] & 0x07) == 0x02) {
+                    records = bytes[pos + 6];
+                }
+                break;
+            }
+        }
+
+        free(bytes);
+        return records;
+    }
+
+    return 0;
+}
+
+static void readNextRecord(EfReadAhead* p_read);
+
+/* Reader thread callback of a record read ahead */
+static void onEfRecordRead(int err, ATResponse* p_response, void* ctx)
+{
+    EfReadAhead* p_read = (EfReadAhead*)ctx;
+    RIL_SIM_IO_Response sr;
+    char* simResponse = NULL;
+    bool ok;
+    bool next = false;
+    int i;
+
+    memset(&sr, 0, sizeof(sr));
+    ok = err == AT_ERROR_OK && p_response->success > 0 && p_response->p_intermediates != NULL
+        && parseSimResponseLine(p_response->p_intermediates->line, &sr) == 0
+        && (sr.sw1 == 0x90 || sr.sw1 == 0x91);
+    if (ok && sr.simResponse != NULL) {
+        simResponse = strdup(sr.simResponse);
+        ok = simResponse != NULL;
+    }
+
+    pthread_mutex_lock(&s_efCacheMutex);
+
+    /* a drop since took the entry, or a newer read ahead owns it */
+    i = findEfLocked(SIM_CMD_READ_RECORD, p_read->fileid, p_read->path,
+        p_read->p1, SIM_RECORD_ABSOLUTE, p_read->p3);
+    if (i >= 0 && s_efCache[i].pending && p_read->generation == s_efCacheGeneration) {
+        if (ok) {
+            s_efCache[i].pending = false;
+            s_efCache[i].sw1 = sr.sw1;
+            s_efCache[i].sw2 = sr.sw2;
+            s_efCache[i].simResponse = simResponse;
+            simResponse = NULL;
+            next = true;
+        } else {
+            dropEfLocked(i);
+        }
+        pthread_cond_broadcast(&s_efCacheCond);
+    }
+
+    pthread_mutex_unlock(&s_efCacheMutex);
+
+    free(simResponse);
+    at_response_free(p_response);
+
+    if (next && p_read->p1 < p_read->last) {
+        p_read->p1++;
+        readNextRecord(p_read);
+    } else {
+        free(p_read->path);
+        free(p_read);
+    }
+}
+
+/**
+ * Queues the read of record p1 of "p_read", or of the first one after it
+ * not cached yet, and frees "p_read" if there is none left to read
+ */
+static void readNextRecord(EfReadAhead* p_read)
+{
+    EfCacheEntry* p_entry;
+    char* cmd = NULL;
+
+    for (; p_read->p1 <= p_read->last; p_read->p1++) {
+        if (asprintf(&cmd, "AT+CRSM=%d,%d,%d,%d,%d", SIM_CMD_READ_RECORD,
+                p_read->fileid, p_read->p1, SIM_RECORD_ABSOLUTE, p_read->p3)
+            < 0) {
+            break;
+        }
+
+        pthread_mutex_lock(&s_efCacheMutex);
+
+        /* a drop since the read that started it, the EF may have changed */
+        if (p_read->generation != s_efCacheGeneration
+            || s_numEfCacheEntries == MAX_EF_CACHE_ENTRIES) {
+            pthread_mutex_unlock(&s_efCacheMutex);
+            free(cmd);
+            break;
+        }
+
+        p_entry = NULL;
+        if (findEfLocked(SIM_CMD_READ_RECORD, p_read->fileid, p_read->path,
+                p_read->p1, SIM_RECORD_ABSOLUTE, p_read->p3)
+            < 0) {
+            p_entry = addEfLocked(SIM_CMD_READ_RECORD, p_read->fileid, p_read->path,
+                p_read->p1, SIM_RECORD_ABSOLUTE, p_read->p3);
+        }
+
+        if (p_entry != NULL) {
+            p_entry->pending = true;
+        }
+
+        pthread_mutex_unlock(&s_efCacheMutex);
+
+        if (p_entry == NULL) {
+            /* cached or being read already */
+            free(cmd);
+            cmd = NULL;
+            continue;
+        }
+
+        if (at_channel_send_command_async(p_read->p_channel, cmd, SINGLELINE, "+CRSM:",
+                AT_TIMEOUT_DEFAULT, onEfRecordRead, p_read)
+            != AT_ERROR_OK) {
+            /* the callback will not run, let the waiters read it themselves */
+            onEfRecordRead(AT_ERROR_GENERIC, NULL, p_read);
+        }
+
+        free(cmd);
+        return;
+    }
+
+    free(p_read->path);
+    free(p_read);
+}
+
+/**
+ * Reads ahead the records of the linear fixed EF of "p_args" following
+ * the one it read, so that the framework reading them one by one finds
+ * them cached. Only one of them is queued at a time, the next one when
+ * it is answered, so a request sent meanwhile waits for one read at most.
+ */
+static void readAheadRecords(const RIL_SIM_IO_v6* p_args)
+{
+    EfReadAhead* p_read;
+    int records;
+    int last;
+
+    if (SIM_EF_READ_AHEAD_RECORDS <= 0 || p_args->p2 != SIM_RECORD_ABSOLUTE) {
+        return;
+    }
+
+    p_read = (EfReadAhead*)calloc(1, sizeof(EfReadAhead));
+    if (p_read == NULL) {
+        return;
+    }
+
+    p_read->p_channel = at_get_thread_channel();
+    p_read->fileid = p_args->fileid;
+    p_read->path = p_args->path ? strdup(p_args->path) : NULL;
+    p_read->p1 = p_args->p1 + 1;
+    p_read->p3 = p_args->p3;
+
+    pthread_mutex_lock(&s_efCacheMutex);
+    records = linearFixedRecordsLocked(p_args->fileid, p_args->path);
+    p_read->generation = s_efCacheGeneration;
+    pthread_mutex_unlock(&s_efCacheMutex);
+
+    last = p_args->p1 + SIM_EF_READ_AHEAD_RECORDS;
+    p_read->last = last < records ? last : records;
+
+    if (p_args->path != NULL && p_read->path == NULL) {
+        free(p_read);
+        return;
+    }
+
+    readNextRecord(p_read);
+}
+
 /* do post- SIM ready initialization */
 static void onSIMReady(void)
 {
@@ -519,7 +976,31 @@ on_exit:
 #define USIM_FILE_SIZE_TAG 0x80
 
 /* Returns SIM_NOT_READY on error */
-SIM_Status getSIMStatus(void)
+/* The SIM_Status of the code of a +CPIN: line */
+static SIM_Status cpinStatus(const char* cpinResult)
+{
+    if (0 == strcmp(cpinResult, "SIM PIN")) {
+        return SIM_PIN;
+    } else if (0 == strcmp(cpinResult, "SIM PUK")) {
+        return SIM_PUK;
+    } else if (0 == strcmp(cpinResult, "PH-NET PIN")) {
+        return SIM_NETWORK_PERSONALIZATION;
+    } else if (0 == strcmp(cpinResult, "NOT READY")) {
+        /* the card is still starting, as with CME error 14 */
+        return SIM_NOT_READY;
+    } else if (0 != strcmp(cpinResult, "READY")) {
+        /* we're treating unsupported lock types as "sim absent" */
+        return SIM_ABSENT;
+    }
+
+    return SIM_READY;
+}
+
+/**
+ * Asks the card its status with AT+CPIN?, SIM_READY whatever the radio
+ * state. *p_known is set false when the card could not tell yet
+ */
+static SIM_Status querySIMStatus(bool* p_known)
 {
     ATResponse* p_response = NULL;
     int err;
@@ -527,6 +1008,8 @@ SIM_Status getSIMStatus(void)
     char* cpinLine;
     char* cpinResult;
 
+    *p_known = false;
+
     RLOGD("getSIMStatus(). RadioState: %d", getRadioState());
     err = at_send_command_singleline("AT+CPIN?", "+CPIN:", &p_response);
 
@@ -541,6 +1024,7 @@ SIM_Status getSIMStatus(void)
         break;
 
     case CME_SIM_NOT_INSERTED:
+        *p_known = true;
         ret = SIM_ABSENT;
         goto done;
 
@@ -566,28 +1050,57 @@ SIM_Status getSIMStatus(void)
         goto done;
     }
 
-    if (0 == strcmp(cpinResult, "SIM PIN")) {
-        ret = SIM_PIN;
-        goto done;
-    } else if (0 == strcmp(cpinResult, "SIM PUK")) {
-        ret = SIM_PUK;
-        goto done;
-    } else if (0 == strcmp(cpinResult, "PH-NET PIN")) {
-        return SIM_NETWORK_PERSONALIZATION;
-    } else if (0 != strcmp(cpinResult, "READY")) {
-        /* we're treating unsupported lock types as "sim absent" */
-        ret = SIM_ABSENT;
-        goto done;
-    }
+    ret = cpinStatus(cpinResult);
+    *p_known = ret != SIM_NOT_READY;
 
+done:
     at_response_free(p_response);
-    p_response = NULL;
-    cpinResult = NULL;
+    return ret;
+}
 
-    ret = (getRadioState() == RADIO_STATE_ON) ? SIM_READY : SIM_NOT_READY;
+void invalidateCardStatus(void)
+{
+    pthread_mutex_lock(&s_cardMutex);
+    s_simStatusValid = false;
+    s_cardStatusValid = false;
+    s_cardGeneration++;
+    pthread_mutex_unlock(&s_cardMutex);
+}
+
+/* Keeps "status" as the card status, unless it was dropped since "generation" */
+static void storeSIMStatus(SIM_Status status, unsigned int generation)
+{
+    pthread_mutex_lock(&s_cardMutex);
+    if (generation == s_cardGeneration) {
+        s_simStatus = status;
+        s_simStatusValid = true;
+    }
+    pthread_mutex_unlock(&s_cardMutex);
+}
+
+SIM_Status getSIMStatus(void)
+{
+    unsigned int generation;
+    bool known;
+    int ret;
+
+    pthread_mutex_lock(&s_cardMutex);
+    known = s_simStatusValid;
+    ret = s_simStatus;
+    generation = s_cardGeneration;
+    pthread_mutex_unlock(&s_cardMutex);
+
+    if (!known) {
+        ret = querySIMStatus(&known);
+        if (known) {
+            storeSIMStatus(ret, generation);
+        }
+    }
+
+    if (ret == SIM_READY && getRadioState() != RADIO_STATE_ON) {
+        ret = SIM_NOT_READY;
+    }
 
-done:
-    at_response_free(p_response);
     return ret;
 }
 
@@ -595,14 +1108,13 @@ done:
  * SIM ready means any commands that access the SIM will work, including:
  *  AT+CPIN, AT+CSMS, AT+CNMI, AT+CRSM
  *  (all SMS-related commands)
+ * Returns false while the card cannot tell its status yet
  */
-void pollSIMState(void* param)
+static bool checkSIMState(void)
 {
-    (void)param;
-
-    if (getRadioState() != RADIO_STATE_UNAVAILABLE) {
+    if (getRadioState() != RADIO_STATE_ON) {
         // no longer valid to poll
-        return;
+        return true;
     }
 
     switch (getSIMStatus()) {
@@ -612,20 +1124,68 @@ void pollSIMState(void* param)
     case SIM_NETWORK_PERSONALIZATION:
     default:
         RLOGI("SIM ABSENT or LOCKED");
+        invalidateSimCaches();
         RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_SIM_STATUS_CHANGED, NULL, 0);
-        return;
+        return true;
 
     case SIM_NOT_READY:
         RLOGI("SIM_NOT_READY");
-        RIL_requestTimedCallback(pollSIMState, NULL, &TIMEVAL_SIMPOLL);
-        return;
+        return false;
 
     case SIM_READY:
-        RLOGI("SIM_READY");
+        RLOGI("SIM_READY %" PRIu64 " ms after radio on",
+            (ril_nano_time() - s_simPollStart) / 1000000);
+        invalidateSimCaches();
         onSIMReady();
         RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_SIM_STATUS_CHANGED, NULL, 0);
+        return true;
+    }
+}
+
+/**
+ * Waits for the card after the radio was turned on, "param" NULL. The
+ * SIM indications end the wait as soon as they come, see onSimUnsol();
+ * for modems without them AT+CPIN? is asked again after a delay growing
+ * from SIM_POLL_MIN_MSEC to SIM_POLL_MAX_MSEC. Runs on the event loop
+ * thread, scheduled with RIL_requestTimedCallback()
+ */
+void pollSIMState(void* param)
+{
+    struct timeval tv;
+
+    if (param == NULL) {
+        s_simPolling = true;
+        s_simPollSession++;
+        s_simPollDelayMsec = SIM_POLL_MIN_MSEC;
+        s_simPollStart = ril_nano_time();
+    } else if (!s_simPolling || (uintptr_t)param != s_simPollSession) {
+        /* ended by an indication, or left from an earlier wait */
         return;
     }
+
+    if (checkSIMState()) {
+        s_simPolling = false;
+        return;
+    }
+
+    tv.tv_sec = s_simPollDelayMsec / 1000;
+    tv.tv_usec = (s_simPollDelayMsec % 1000) * 1000;
+    RIL_requestTimedCallback(pollSIMState, (void*)s_simPollSession, &tv);
+
+    s_simPollDelayMsec *= 2;
+    if (s_simPollDelayMsec > SIM_POLL_MAX_MSEC) {
+        s_simPollDelayMsec = SIM_POLL_MAX_MSEC;
+    }
+}
+
+/* A SIM indication came while waiting for the card, see pollSIMState() */
+static void onSIMIndication(void* param)
+{
+    (void)param;
+
+    if (s_simPolling && checkSIMState()) {
+        s_simPolling = false;
+    }
 }
 
 /* Free the card status returned by getCardStatus */
@@ -639,6 +1199,54 @@ static void freeCardStatus(RIL_CardStatus_v1_5* p_card_status)
     free(p_card_status);
 }
 
+/**
+ * Fills "p_card_status" with the card status kept, the ICCID allocated.
+ * Returns false if there is none, with the generation to keep one at in
+ * *p_generation
+ */
+static bool readCardStatus(RIL_CardStatus_v1_5* p_card_status, unsigned int* p_generation)
+{
+    bool hit;
+
+    pthread_mutex_lock(&s_cardMutex);
+
+    hit = s_cardStatusValid;
+    if (hit) {
+        *p_card_status = s_cardStatus;
+        if (s_cardStatus.base.base.iccid != NULL) {
+            p_card_status->base.base.iccid = strdup(s_cardIccid);
+            hit = p_card_status->base.base.iccid != NULL;
+        }
+    }
+
+    *p_generation = s_cardGeneration;
+
+    pthread_mutex_unlock(&s_cardMutex);
+
+    if (!hit) {
+        memset(p_card_status, 0, sizeof(*p_card_status));
+    }
+
+    return hit;
+}
+
+/* Keeps "p_card_status", unless the card status was dropped since "generation" */
+static void storeCardStatus(const RIL_CardStatus_v1_5* p_card_status, unsigned int generation)
+{
+    pthread_mutex_lock(&s_cardMutex);
+
+    if (generation == s_cardGeneration) {
+        s_cardStatus = *p_card_status;
+        if (p_card_status->base.base.iccid != NULL) {
+            snprintf(s_cardIccid, sizeof(s_cardIccid), "%s", p_card_status->base.base.iccid);
+            s_cardStatus.base.base.iccid = s_cardIccid;
+        }
+        s_cardStatusValid = true;
+    }
+
+    pthread_mutex_unlock(&s_cardMutex);
+}
+
 static void getIccId(char* iccid, int size)
 {
     int err = -1;
@@ -649,7 +1257,7 @@ static void getIccId(char* iccid, int size)
         return;
     }
 
-    err = at_send_command_numeric("AT+CICCID", &p_response);
+    err = at_send_command_cached("AT+CICCID", NUMERIC, NULL, &s_simCache, &p_response);
     if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
         RLOGE("Failure occurred in sending %s due to: %s", "AT+CICCID", at_io_err_str(err));
         goto on_exit;
@@ -727,8 +1335,19 @@ static int getCardStatus(RIL_CardStatus_v1_5** pp_card_status)
     };
 
     RIL_CardState card_state;
+    unsigned int generation;
     int num_apps;
 
+    RIL_CardStatus_v1_5* p_card_status = calloc(1, sizeof(RIL_CardStatus_v1_5));
+    if (p_card_status == NULL) {
+        return RIL_E_NO_MEMORY;
+    }
+
+    if (readCardStatus(p_card_status, &generation)) {
+        *pp_card_status = p_card_status;
+        return RIL_E_SUCCESS;
+    }
+
     int sim_status = getSIMStatus();
     if (sim_status == SIM_ABSENT) {
         card_state = RIL_CARDSTATE_ABSENT;
@@ -738,8 +1357,7 @@ static int getCardStatus(RIL_CardStatus_v1_5** pp_card_status)
         num_apps = 3;
     }
 
-    // Allocate and initialize base card status.
-    RIL_CardStatus_v1_5* p_card_status = calloc(1, sizeof(RIL_CardStatus_v1_5));
+    // Initialize base card status.
     p_card_status->base.base.base.card_state = card_state;
     p_card_status->base.base.base.universal_pin_state = RIL_PINSTATE_UNKNOWN;
     p_card_status->base.base.base.gsm_umts_subscription_app_index = -1;
@@ -776,6 +1394,11 @@ static int getCardStatus(RIL_CardStatus_v1_5** pp_card_status)
         p_card_status->base.base.base.applications[2] = app_status_array[sim_status + ISIM_ABSENT];
     }
 
+    /* a card that could not tell its status yet is asked again */
+    if (sim_status != SIM_NOT_READY) {
+        storeCardStatus(p_card_status, generation);
+    }
+
     *pp_card_status = p_card_status;
     return RIL_E_SUCCESS;
 }
@@ -1189,6 +1812,7 @@ static void requestChangeSimPin(int request, void* data, size_t datalen, RIL_Tok
     }
 
     err = at_send_command_singleline(cmd, "+CPIN:", &p_response);
+    invalidateCardStatus();
 
     if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
         RLOGE("Failure occurred in sending %s due to: %s", cmd, at_io_err_str(err));
@@ -1243,6 +1867,7 @@ static void requestEnterSimPin(int request, void* data, size_t datalen, RIL_Toke
     }
 
     err = at_send_command(cmd, &p_response);
+    invalidateCardStatus();
     if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
         RLOGE("Failure occurred in sending %s due to: %s", cmd, at_io_err_str(err));
         ril_err = RIL_E_PASSWORD_INCORRECT;
@@ -1275,6 +1900,9 @@ static void requestSIM_IO(void* data, size_t datalen, RIL_Token t)
     char* cmd = NULL;
     RIL_SIM_IO_v6* p_args = NULL;
     char* line = NULL;
+    char* cachedResponse = NULL;
+    unsigned int generation = 0;
+    bool cacheable;
     int ret = -1;
 
     if (data == NULL) {
@@ -1286,6 +1914,12 @@ static void requestSIM_IO(void* data, size_t datalen, RIL_Token t)
     memset(&sr, 0, sizeof(sr));
     p_args = (RIL_SIM_IO_v6*)data;
 
+    cacheable = isEfRead(p_args->command) && p_args->data == NULL;
+    if (cacheable && readEfCache(p_args, &sr, &generation)) {
+        cachedResponse = sr.simResponse;
+        goto on_exit;
+    }
+
     /* FIXME handle pin2 */
 
     if (p_args->data == NULL) {
@@ -1342,10 +1976,21 @@ static void requestSIM_IO(void* data, size_t datalen, RIL_Token t)
         free(bytes);
     }
 
+    if (cacheable && (sr.sw1 == 0x90 || sr.sw1 == 0x91)) {
+        storeEfCache(p_args, &sr, generation);
+        if (p_args->command == SIM_CMD_READ_RECORD) {
+            readAheadRecords(p_args);
+        }
+    } else if (!isEfRead(p_args->command) && p_args->command != SIM_CMD_STATUS) {
+        /* an update or the like, the card may now read otherwise */
+        invalidateEfCache(p_args->fileid);
+    }
+
 on_exit:
     RIL_onRequestComplete(t, ril_err, ril_err == RIL_E_SUCCESS ? &sr : NULL,
         ril_err == RIL_E_SUCCESS ? sizeof(sr) : 0);
     at_response_free(p_response);
+    free(cachedResponse);
     free(cmd);
 }
 
@@ -1377,7 +2022,7 @@ static void requestGetIMSI(void* data, size_t datalen, RIL_Token t)
     RIL_Errno ril_err = RIL_E_SUCCESS;
     int err = -1;
 
-    err = at_send_command_numeric("AT+CIMI", &p_response);
+    err = at_send_command_cached("AT+CIMI", NUMERIC, NULL, &s_simCache, &p_response);
     if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
         RLOGE("Failure occurred in sending %s due to: %s", "AT+CIMI", at_io_err_str(err));
         ril_err = RIL_E_GENERIC_FAILURE;
@@ -1466,8 +2111,11 @@ static int parseProactiveCmdInd(char* response)
         ret = STK_UNSOL_EVENT_NOTIFY;
         break;
     case STK_REFRESH:
+        /* whatever the type, files of the card may have changed */
+        invalidateSimCaches();
         if (strncasecmp(&(response[typePos + 2]), "04", 2) == 0) { // SIM_RESET
             RLOGD("Type of Refresh is SIM_RESET");
+            invalidateCardStatus();
             s_stkServiceRunning = false;
             ret = STK_UNSOL_PROACTIVE_CMD;
         } else {
@@ -1591,111 +2239,197 @@ void on_request_sim(int request, void* data, size_t datalen, RIL_Token t)
     RLOGI("On request sim end");
 }
 
-bool try_handle_unsol_sim(const char* s)
+static void onStkSessionEndUnsol(const char* s, const char* sms_pdu)
+{
+    (void)s;
+    (void)sms_pdu;
+
+    RLOGI("Receive STK session end URC");
+    RIL_onUnsolicitedResponse(RIL_UNSOL_STK_SESSION_END, NULL, 0);
+}
+
+static void onStkProactiveCommandUnsol(const char* s, const char* sms_pdu)
 {
-    bool ret = false;
     char *line = NULL, *p;
 
-    RLOGD("unsol sim string: %s", s);
-
-    if (strStartsWith(s, "+CUSATEND")) { // session end
-        RLOGI("Receive STK session end URC");
-        RIL_onUnsolicitedResponse(RIL_UNSOL_STK_SESSION_END, NULL, 0);
-        ret = true;
-    } else if (strStartsWith(s, "+CUSATP:")) {
-        RLOGI("Receive +CUSATP URC");
-        line = p = strdup(s);
-        if (!line) {
-            RLOGE("+CUSATP: Unable to allocate memory");
-            return true;
-        }
+    (void)sms_pdu;
 
-        if (at_tok_start(&p) < 0) {
-            RLOGE("invalid +CUSATP response: %s", s);
-            free(line);
-            return true;
-        }
+    RLOGI("Receive +CUSATP URC");
+    line = p = strdup(s);
+    if (!line) {
+        RLOGE("+CUSATP: Unable to allocate memory");
+        return;
+    }
 
-        char* response = NULL;
-        if (at_tok_nextstr(&p, &response) < 0) {
-            RLOGE("%s fail", s);
-            free(line);
-            return true;
-        }
+    if (at_tok_start(&p) < 0) {
+        RLOGE("invalid +CUSATP response: %s", s);
+        free(line);
+        return;
+    }
 
-        StkUnsolEvent event = parseProactiveCmdInd(response);
-        if (event == STK_UNSOL_EVENT_NOTIFY) {
-            RIL_onUnsolicitedResponse(RIL_UNSOL_STK_EVENT_NOTIFY, response,
-                strlen(response) + 1);
-        } else if (event == STK_UNSOL_PROACTIVE_CMD) {
-            RIL_onUnsolicitedResponse(RIL_UNSOL_STK_PROACTIVE_COMMAND, response,
-                strlen(response) + 1);
-        }
+    char* response = NULL;
+    if (at_tok_nextstr(&p, &response) < 0) {
+        RLOGE("%s fail", s);
+        free(line);
+        return;
+    }
+
+    StkUnsolEvent event = parseProactiveCmdInd(response);
+    if (event == STK_UNSOL_EVENT_NOTIFY) {
+        RIL_onUnsolicitedResponse(RIL_UNSOL_STK_EVENT_NOTIFY, response,
+            strlen(response) + 1);
+    } else if (event == STK_UNSOL_PROACTIVE_CMD) {
+        RIL_onUnsolicitedResponse(RIL_UNSOL_STK_PROACTIVE_COMMAND, response,
+            strlen(response) + 1);
+    }
 
+    free(line);
+}
+
+static void onSimStatusChangedUnsol(const char* s, const char* sms_pdu)
+{
+    (void)s;
+    (void)sms_pdu;
+
+    RLOGI("sim card insert/remove");
+    invalidateSimCaches();
+    invalidateCardStatus();
+    RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_SIM_STATUS_CHANGED, NULL, 0);
+    RIL_requestTimedCallback(onSIMIndication, NULL, NULL);
+}
+
+static void onCpinUnsol(const char* s, const char* sms_pdu)
+{
+    char *line = NULL, *p;
+    char* cpinResult = NULL;
+    SIM_Status status;
+
+    (void)sms_pdu;
+
+    line = p = strdup(s);
+    if (!line) {
+        RLOGE("+CPIN: Unable to allocate memory");
+        return;
+    }
+
+    if (at_tok_start(&p) < 0 || at_tok_nextstr(&p, &cpinResult) < 0) {
+        RLOGE("invalid +CPIN response: %s", s);
         free(line);
-        ret = true;
-    } else if (strStartsWith(s, "^MSIMST")) {
-        RLOGI("sim card insert/remove");
-        RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_SIM_STATUS_CHANGED, NULL, 0);
-        ret = true;
-    } else if (strStartsWith(s, "+CUSD:")) {
-        char* message = NULL;
-        char* response[3];
-        int type, dcs;
-
-        RLOGI("Receive +CUSD URC");
-        line = p = strdup(s);
-        if (!line) {
-            RLOGE("+CUSD: Unable to allocate memory");
-            return true;
-        }
+        return;
+    }
 
-        if (at_tok_start(&p) < 0) {
-            RLOGE("invalid +CUSD response: %s", s);
-            free(line);
-            return true;
-        }
+    RLOGI("sim status %s", cpinResult);
+    status = cpinStatus(cpinResult);
+    free(line);
 
-        if (at_tok_nextint(&p, &type) < 0) {
-            RLOGE("%s fail", s);
-            free(line);
-            return true;
-        }
+    if (status == SIM_ABSENT) {
+        invalidateSimCaches();
+    }
 
-        if (at_tok_nextstr(&p, &message) < 0) {
-            RLOGE("%s fail", s);
-            free(line);
-            return true;
-        }
+    /* the URC tells the status, only the card status is built again. A
+     * card not ready yet is asked again, it says when it is */
+    pthread_mutex_lock(&s_cardMutex);
+    s_simStatus = status;
+    s_simStatusValid = status != SIM_NOT_READY;
+    s_cardStatusValid = false;
+    s_cardGeneration++;
+    pthread_mutex_unlock(&s_cardMutex);
 
-        if (at_tok_nextint(&p, &dcs) < 0) {
-            RLOGE("%s fail", s);
-            free(line);
-            return true;
-        }
+    RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_SIM_STATUS_CHANGED, NULL, 0);
+    RIL_requestTimedCallback(onSIMIndication, NULL, NULL);
+}
 
-        if (asprintf(&response[0], "%d", type) < 0) {
-            RLOGE("asprintf type fail in %s", __func__);
-            free(line);
-            return true;
-        }
+/*
+ * Vendor indications of the card having finished its initialization, eg.
+ * ^SIMST: 1 or +QIND: SMS DONE. The status is asked again on the event
+ * loop thread, where the wait for the card runs
+ */
+static void onSimUnsol(const char* s, const char* sms_pdu)
+{
+    (void)sms_pdu;
 
-        response[1] = message;
-        if (asprintf(&response[2], "%d", dcs) < 0) {
-            RLOGE("asprintf dcs fail in %s", __func__);
-            free(response[0]);
-            free(line);
-            return true;
-        }
+    if (strStartsWith(s, "+QIND:") && strstr(s, "DONE") == NULL) {
+        /* other +QIND: reports do not concern the card */
+        return;
+    }
+
+    RLOGI("sim indication %s", s);
+    invalidateCardStatus();
+    RIL_requestTimedCallback(onSIMIndication, NULL, NULL);
+}
+
+static void onUssdUnsol(const char* s, const char* sms_pdu)
+{
+    char *line = NULL, *p;
+    char* message = NULL;
+    char* response[3];
+    int type, dcs;
+
+    (void)sms_pdu;
+
+    RLOGI("Receive +CUSD URC");
+    line = p = strdup(s);
+    if (!line) {
+        RLOGE("+CUSD: Unable to allocate memory");
+        return;
+    }
 
-        RIL_onUnsolicitedResponse(RIL_UNSOL_ON_USSD, response, sizeof(response));
+    if (at_tok_start(&p) < 0) {
+        RLOGE("invalid +CUSD response: %s", s);
+        free(line);
+        return;
+    }
+
+    if (at_tok_nextint(&p, &type) < 0) {
+        RLOGE("%s fail", s);
+        free(line);
+        return;
+    }
+
+    if (at_tok_nextstr(&p, &message) < 0) {
+        RLOGE("%s fail", s);
+        free(line);
+        return;
+    }
+
+    if (at_tok_nextint(&p, &dcs) < 0) {
+        RLOGE("%s fail", s);
+        free(line);
+        return;
+    }
+
+    if (asprintf(&response[0], "%d", type) < 0) {
+        RLOGE("asprintf type fail in %s", __func__);
+        free(line);
+        return;
+    }
+
+    response[1] = message;
+    if (asprintf(&response[2], "%d", dcs) < 0) {
+        RLOGE("asprintf dcs fail in %s", __func__);
         free(response[0]);
-        free(response[2]);
         free(line);
-        ret = true;
-    } else {
-        RLOGD("Can't match any unsol sim handlers");
+        return;
     }
 
-    return ret;
+    RIL_onUnsolicitedResponse(RIL_UNSOL_ON_USSD, response, sizeof(response));
+    free(response[0]);
+    free(response[2]);
+    free(line);
+}
+
+static const ATUnsolPrefix s_simUnsols[] = {
+    { "+CUSATEND", onStkSessionEndUnsol }, // session end
+    { "+CUSATP:", onStkProactiveCommandUnsol },
+    { "^MSIMST", onSimStatusChangedUnsol },
+    { "+CPIN:", onCpinUnsol },
+    { "^SIMST:", onSimUnsol },
+    { "+QIND:", onSimUnsol },
+    { "+CUSD:", onUssdUnsol },
+};
+
+int register_unsol_sim(void)
+{
+    return at_register_unsol_handlers(s_simUnsols,
+        sizeof(s_simUnsols) / sizeof(s_simUnsols[0]));
 }
\ No newline at end of file
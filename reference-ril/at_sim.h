@@ -46,7 +46,10 @@ int getMnc(void);
 int getMncLength(void);
 void pollSIMState(void* param);
 SIM_Status getSIMStatus(void);
+
+/* Forgets the card status kept, see getSIMStatus() */
+void invalidateCardStatus(void);
 void on_request_sim(int request, void* data, size_t datalen, RIL_Token t);
-bool try_handle_unsol_sim(const char* s);
+int register_unsol_sim(void);
 
 #endif
\ No newline at end of file
@@ -36,6 +36,9 @@ static int s_ims_cause_perm_failure = 0; // 1==causes sms over ims to permanent
 static int s_ims_gsm_retry = 0; // 1==causes sms over gsm to temp fail
 static int s_ims_gsm_fail = 0; // 1==causes sms over gsm to permanent fail
 
+/* the service centre and broadcast config are stored on the card */
+static const ATCachePolicy s_simCache = { 0, "+CUSATP:", AT_CACHE_SIM_CHANGED };
+
 static void requestWriteSmsToSim(void* data, size_t datalen, RIL_Token t)
 {
     (void)datalen;
@@ -285,7 +288,7 @@ static void requestGetSmsBroadcastConfig(void* data, size_t datalen, RIL_Token t
     char *serviceIds = NULL, *codeSchemes = NULL, *p = NULL;
     char *serviceId = NULL, *codeScheme = NULL;
 
-    err = at_send_command_singleline("AT+CSCB?", "+CSCB:", &p_response);
+    err = at_send_command_cached("AT+CSCB?", SINGLELINE, "+CSCB:", &s_simCache, &p_response);
     if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
         RLOGE("Failure occurred in sending %s due to: %s", "AT+CSCB?", at_io_err_str(err));
         ril_err = RIL_E_GENERIC_FAILURE;
@@ -474,7 +477,7 @@ static void requestGetSmscAddress(void* data, size_t datalen, RIL_Token t)
     char* decidata = NULL;
     int err = -1;
 
-    err = at_send_command_singleline("AT+CSCA?", "+CSCA:", &p_response);
+    err = at_send_command_cached("AT+CSCA?", SINGLELINE, "+CSCA:", &s_simCache, &p_response);
     if (err != AT_ERROR_OK || !p_response || p_response->success != AT_OK) {
         RLOGE("Failure occurred in sending %s due to: %s", "AT+CSCA?", at_io_err_str(err));
         ril_err = RIL_E_GENERIC_FAILURE;
@@ -611,26 +614,32 @@ void on_request_sms(int request, void* data, size_t datalen, RIL_Token t)
     RLOGD("SMS on request sms end");
 }
 
-bool try_handle_unsol_sms(const char* s, const char* sms_pdu)
+static void onNewSmsUnsol(const char* s, const char* sms_pdu)
 {
-    bool ret = false;
-
-    RLOGD("unsol sms string: %s", s);
-
-    if (strStartsWith(s, "+CMT:")) {
-        RLOGI("Receive incoming sms URC");
-        RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_NEW_SMS,
-            sms_pdu, strlen(sms_pdu));
-        ret = true;
-    } else if (strStartsWith(s, "+CDS:")) {
-        RLOGI("Receive sms status report URC");
-        RIL_onUnsolicitedResponse(
-            RIL_UNSOL_RESPONSE_NEW_SMS_STATUS_REPORT,
-            sms_pdu, strlen(sms_pdu));
-        ret = true;
-    } else {
-        RLOGD("Can't match any unsol sms handlers");
-    }
+    (void)s;
 
-    return ret;
+    RLOGI("Receive incoming sms URC");
+    RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_NEW_SMS,
+        sms_pdu, strlen(sms_pdu));
+}
+
+static void onSmsStatusReportUnsol(const char* s, const char* sms_pdu)
+{
+    (void)s;
+
+    RLOGI("Receive sms status report URC");
+    RIL_onUnsolicitedResponse(
+        RIL_UNSOL_RESPONSE_NEW_SMS_STATUS_REPORT,
+        sms_pdu, strlen(sms_pdu));
+}
+
+static const ATUnsolPrefix s_smsUnsols[] = {
+    { "+CMT:", onNewSmsUnsol },
+    { "+CDS:", onSmsStatusReportUnsol },
+};
+
+int register_unsol_sms(void)
+{
+    return at_register_unsol_handlers(s_smsUnsols,
+        sizeof(s_smsUnsols) / sizeof(s_smsUnsols[0]));
 }
\ No newline at end of file
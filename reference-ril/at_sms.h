@@ -21,6 +21,6 @@
 #include <telephony/ril.h>
 
 void on_request_sms(int request, void* data, size_t datalen, RIL_Token t);
-bool try_handle_unsol_sms(const char* s, const char* sms_pdu);
+int register_unsol_sms(void);
 
 #endif
\ No newline at end of file
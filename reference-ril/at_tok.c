@@ -17,6 +17,7 @@
 
 #include "at_tok.h"
 #include <ctype.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -88,14 +89,62 @@ static char* nextTok(char** p_cur)
     return ret;
 }
 
+/**
+ * Parses the integer at the start of "len" characters at "p", stopping at
+ * the first character that is not a digit, like strtol does
+ * returns 0 on success and -1 if there is no digit
+ */
+static int parseInt(const char* p, size_t len, int base, int* p_out)
+{
+    const char* end = p + len;
+    const char* digits;
+    unsigned long value = 0;
+    int negative = 0;
+    int digit;
+
+    while (p < end && isspace((unsigned char)*p)) {
+        p++;
+    }
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    if (base == 16 && end - p > 2 && p[0] == '0' && (p[1] | 0x20) == 'x'
+        && isxdigit((unsigned char)p[2])) {
+        p += 2;
+    }
+
+    for (digits = p; p < end; p++) {
+        if (*p >= '0' && *p <= '9') {
+            digit = *p - '0';
+        } else if (base == 16 && (*p | 0x20) >= 'a' && (*p | 0x20) <= 'f') {
+            digit = (*p | 0x20) - 'a' + 10;
+        } else {
+            break;
+        }
+
+        value = value * base + digit;
+    }
+
+    if (p == digits) {
+        return -1;
+    }
+
+    *p_out = negative ? -(int)value : (int)value;
+
+    return 0;
+}
+
 /**
  * Parses the next integer in the AT response line and places it in *p_out
  * returns 0 on success and -1 on fail
  * updates *p_cur
- * "base" is the same as the base param in strtol
+ * "base" is 10 or 16
  */
 
-static int at_tok_nextint_base(char** p_cur, int* p_out, int base, int uns)
+static int at_tok_nextint_base(char** p_cur, int* p_out, int base)
 {
     char* ret;
 
@@ -107,23 +156,9 @@ static int at_tok_nextint_base(char** p_cur, int* p_out, int base, int uns)
 
     if (ret == NULL) {
         return -1;
-    } else {
-        long l;
-        char* end;
-
-        if (uns)
-            l = strtoul(ret, &end, base);
-        else
-            l = strtol(ret, &end, base);
-
-        *p_out = (int)l;
-
-        if (end == ret) {
-            return -1;
-        }
     }
 
-    return 0;
+    return parseInt(ret, strlen(ret), base, p_out);
 }
 
 /**
@@ -134,7 +169,7 @@ static int at_tok_nextint_base(char** p_cur, int* p_out, int base, int uns)
  */
 int at_tok_nextint(char** p_cur, int* p_out)
 {
-    return at_tok_nextint_base(p_cur, p_out, 10, 0);
+    return at_tok_nextint_base(p_cur, p_out, 10);
 }
 
 /**
@@ -145,7 +180,7 @@ int at_tok_nextint(char** p_cur, int* p_out)
  */
 int at_tok_nexthexint(char** p_cur, int* p_out)
 {
-    return at_tok_nextint_base(p_cur, p_out, 16, 1);
+    return at_tok_nextint_base(p_cur, p_out, 16);
 }
 
 int at_tok_nextbool(char** p_cur, char* p_out)
@@ -187,3 +222,231 @@ int at_tok_hasmore(char** p_cur)
 {
     return !(*p_cur == NULL || **p_cur == '\0');
 }
+
+int at_view_start(ATView* p_cur, const char* line)
+{
+    const char* colon;
+
+    if (line == NULL) {
+        return -1;
+    }
+
+    // skip prefix
+    // consume "^[^:]:"
+
+    colon = strchr(line, ':');
+
+    if (colon == NULL) {
+        return -1;
+    }
+
+    p_cur->p = colon + 1;
+    p_cur->len = strlen(colon + 1);
+
+    return 0;
+}
+
+/* Moves the rest of the line to start at "p" */
+static void advanceView(ATView* p_cur, const char* p)
+{
+    p_cur->len -= p - p_cur->p;
+    p_cur->p = p;
+}
+
+/* Same as nextTok(), without writing to the line */
+static int nextViewTok(ATView* p_cur, ATView* p_tok)
+{
+    const char* end;
+    const char* p;
+    const char* sep;
+
+    if (p_cur->p == NULL) {
+        return -1;
+    }
+
+    end = p_cur->p + p_cur->len;
+
+    p = p_cur->p;
+    while (p < end && isspace((unsigned char)*p)) {
+        p++;
+    }
+
+    if (p < end && *p == '"') {
+        p++;
+        sep = (const char*)memchr(p, '"', end - p);
+        if (sep == NULL) {
+            p_tok->p = p;
+            p_tok->len = end - p;
+            p_cur->p = NULL;
+            p_cur->len = 0;
+            return 0;
+        }
+
+        p_tok->p = p;
+        p_tok->len = sep - p;
+
+        p = (const char*)memchr(sep, ',', end - sep);
+        advanceView(p_cur, p != NULL ? p + 1 : end);
+    } else {
+        sep = (const char*)memchr(p, ',', end - p);
+        p_tok->p = p;
+        if (sep == NULL) {
+            p_tok->len = end - p;
+            p_cur->p = NULL;
+            p_cur->len = 0;
+        } else {
+            p_tok->len = sep - p;
+            advanceView(p_cur, sep + 1);
+        }
+    }
+
+    return 0;
+}
+
+static int at_view_nextint_base(ATView* p_cur, int* p_out, int base)
+{
+    ATView tok;
+
+    if (nextViewTok(p_cur, &tok) < 0) {
+        return -1;
+    }
+
+    return parseInt(tok.p, tok.len, base, p_out);
+}
+
+int at_view_nextint(ATView* p_cur, int* p_out)
+{
+    return at_view_nextint_base(p_cur, p_out, 10);
+}
+
+int at_view_nexthexint(ATView* p_cur, int* p_out)
+{
+    return at_view_nextint_base(p_cur, p_out, 16);
+}
+
+int at_view_nextbool(ATView* p_cur, char* p_out)
+{
+    int result;
+
+    if (at_view_nextint(p_cur, &result) < 0) {
+        return -1;
+    }
+
+    // booleans should be 0 or 1
+    if (!(result == 0 || result == 1)) {
+        return -1;
+    }
+
+    if (p_out != NULL) {
+        *p_out = (char)result;
+    }
+
+    return 0;
+}
+
+int at_view_nextstr(ATView* p_cur, ATView* p_out)
+{
+    return nextViewTok(p_cur, p_out);
+}
+
+/** returns 1 on "has more tokens" and 0 if no */
+int at_view_hasmore(const ATView* p_cur)
+{
+    return !(p_cur->p == NULL || p_cur->len == 0);
+}
+
+/**
+ * Matches the prefix part of "fmt" against "line", whose prefix ends at
+ * "colon". Moves *p_fmt past it
+ * returns 0 on match, -1 otherwise
+ */
+static int matchPrefix(const char* line, const char* colon, const char** p_fmt)
+{
+    const char* fmt = *p_fmt;
+    const char* f;
+
+    /* a prefix is there if a ':' comes before the first conversion */
+    for (f = fmt; *f != '\0' && *f != ':'; f++) {
+        if (*f == '%') {
+            if (f[1] != '%') {
+                return 0;
+            }
+            f++;
+        }
+    }
+
+    if (*f == '\0') {
+        return 0;
+    }
+
+    for (f = fmt; *f != ':'; f++, line++) {
+        if (*f == '%') {
+            f++;
+        }
+
+        if (*f != *line) {
+            return -1;
+        }
+    }
+
+    if (line != colon) {
+        return -1;
+    }
+
+    *p_fmt = f + 1;
+
+    return 0;
+}
+
+int at_tok_parse(const char* line, const char* fmt, ...)
+{
+    va_list ap;
+    ATView cur;
+    ATView tok;
+    int count = 0;
+    int err;
+
+    if (at_view_start(&cur, line) < 0 || matchPrefix(line, cur.p - 1, &fmt) < 0) {
+        return -1;
+    }
+
+    va_start(ap, fmt);
+
+    for (; *fmt != '\0'; fmt++) {
+        if (*fmt != '%') {
+            /* separators and blanks, the tokenizer takes care of them */
+            continue;
+        }
+
+        switch (*++fmt) {
+        case 'd':
+            err = at_view_nextint(&cur, va_arg(ap, int*));
+            break;
+        case 'h':
+            err = at_view_nexthexint(&cur, va_arg(ap, int*));
+            break;
+        case 'b':
+            err = at_view_nextbool(&cur, va_arg(ap, char*));
+            break;
+        case 's':
+            err = at_view_nextstr(&cur, va_arg(ap, ATView*));
+            break;
+        case '_':
+            err = nextViewTok(&cur, &tok);
+            break;
+        default:
+            err = -1;
+            break;
+        }
+
+        if (err < 0) {
+            break;
+        }
+
+        count++;
+    }
+
+    va_end(ap);
+
+    return count;
+}
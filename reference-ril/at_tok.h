@@ -18,6 +18,8 @@
 #ifndef AT_TOK_H
 #define AT_TOK_H 1
 
+#include <stddef.h>
+
 int at_tok_start(char** p_cur);
 int at_tok_nextint(char** p_cur, int* p_out);
 int at_tok_nexthexint(char** p_cur, int* p_out);
@@ -29,4 +31,37 @@ int at_tok_hasmore(char** p_cur);
 
 void skipNextComma(char** p_cur);
 
+/* "len" characters at "p", not NUL terminated */
+typedef struct {
+    const char* p;
+    size_t len;
+} ATView;
+
+/**
+ * Same as the at_tok_* family, but the line is never written to, so
+ * const or shared lines can be parsed without a copy. "p_cur" is the
+ * unparsed rest of the line, its "p" is NULL once there is none.
+ * String tokens point into the line
+ */
+int at_view_start(ATView* p_cur, const char* line);
+int at_view_nextint(ATView* p_cur, int* p_out);
+int at_view_nexthexint(ATView* p_cur, int* p_out);
+int at_view_nextbool(ATView* p_cur, char* p_out);
+int at_view_nextstr(ATView* p_cur, ATView* p_out);
+int at_view_hasmore(const ATView* p_cur);
+
+/**
+ * Parses a whole response line in one pass, eg.
+ *     at_tok_parse(line, "+CREG: %d,%h,%h", &stat, &lac, &cid)
+ * The text up to the ':' must match the prefix of "line", "%%" stands
+ * for a '%'. Without it any prefix is accepted. Fields are separated by
+ * commas and converted with
+ *     %d  int*, decimal          %h  int*, hexadecimal
+ *     %b  char*, 0 or 1          %s  ATView*, quotes removed
+ *     %_  skipped, no argument
+ * returns the number of fields parsed before the first one that failed
+ * or -1 if the prefix does not match
+ */
+int at_tok_parse(const char* line, const char* fmt, ...);
+
 #endif /*AT_TOK_H */
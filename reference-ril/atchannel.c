@@ -21,14 +21,20 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <telephony/librilutils.h>
 #include <telephony/ril_log.h>
 
 #include "at_tok.h"
@@ -40,15 +46,59 @@
 #define MAX_AT_RESPONSE (8 * 1024)
 #define HANDSHAKE_RETRY_COUNT 8
 #define HANDSHAKE_TIMEOUT_MSEC 250
+#define HANDSHAKE_COMMAND "ATE0Q0V1"
+/* sent after a timeout, see queueResync(). Its reply has a prefix no URC has */
+#define RESYNC_COMMAND "AT+GCAP"
+#define RESYNC_PREFIX "+GCAP:"
+#define RESYNC_TIMEOUT_MSEC 5000
+#define MAX_LINE_BATCH 32
+
+/* command timeouts, see VerbTimeout */
+#define DEFAULT_TIMEOUT_MSEC 30000
+#define MIN_ADAPTIVE_TIMEOUT_MSEC 10000
+#define ADAPTIVE_TIMEOUT_FACTOR 4
+#define MAX_TIMEOUT_VERBS 64
+#define LATENCY_BUCKETS 20
+#define LATENCY_MIN_SAMPLES 20
+#define LATENCY_DECAY_SAMPLES 256
+
+/* query reply cache, see CacheEntry */
+#define MAX_CACHE_ENTRIES 32
 
-static pthread_t s_tid_reader;
-static int s_fd = -1; /* fd of the AT channel */
-static ATUnsolHandler s_unsolHandler;
-
-/* for input buffering */
-
-static char s_ATBuffer[MAX_AT_RESPONSE + 1];
-static char* s_ATBufferCur = s_ATBuffer;
+/*
+ * Unsolicited responses are not handled on the reader threads. A reader
+ * only frames the line(s) and pushes a copy on |s_urcHead|; |s_tid_urc|
+ * pops them in order and calls the handler of the channel they came from.
+ * This way a slow handler (or a slow RIL client behind it) can not delay
+ * the final response of a pending command. All channels share the queue.
+ *
+ * The queue is an intrusive multi-producer single-consumer list: producers
+ * only do an atomic exchange on |s_urcHead|, the consumer owns |s_urcTail|.
+ * |s_urcSem| counts queued nodes so the consumer can sleep. A node with a
+ * NULL line asks the consumer to exit.
+ */
+typedef struct URCNode {
+    _Atomic(struct URCNode*) p_next;
+    ATUnsolHandler handler;
+    char* line;
+    char* sms_pdu;
+    uint64_t enqueueTime;
+} URCNode;
+
+static URCNode s_urcStub;
+static _Atomic(URCNode*) s_urcHead = &s_urcStub;
+static URCNode* s_urcTail = &s_urcStub;
+static sem_t s_urcSem;
+static pthread_t s_tid_urc;
+static bool s_urcJoinable;
+
+/* ATUrcStats fields, atomics so that the reader thread never waits on them */
+static atomic_uint s_urcDepth;
+static atomic_uint s_urcDepthMax;
+static atomic_ullong s_urcCount;
+static atomic_ullong s_readerStallNsTotal;
+static atomic_ullong s_readerStallNsMax;
+static atomic_ullong s_deliveryLatencyNsMax;
 
 #if AT_DEBUG
 void AT_DUMP(const char* prefix __unused, const char* buff, int len)
@@ -60,30 +110,190 @@ void AT_DUMP(const char* prefix __unused, const char* buff, int len)
 #endif
 
 /*
- * There is one reader thread |s_tid_reader| and potentially multiple writer
- * threads. |s_commandmutex| and |s_commandcond| are used to maintain the
- * condition that the writer thread will not read from |sp_response| until the
- * reader thread has signaled itself is finished, etc. |s_writeMutex| is used to
- * prevent multiple writer threads from calling at_send_command_full_nolock
- * function at the same time.
+ * The timeout of a command comes from its verb, eg. "+COPS=?" or "D".
+ * Verbs known to wait on the network or a slow SIM have a fixed timeout.
+ * All others start at DEFAULT_TIMEOUT_MSEC and, once enough replies were
+ * timed, wait ADAPTIVE_TIMEOUT_FACTOR times their 99th percentile
+ * latency, between MIN_ADAPTIVE_TIMEOUT_MSEC and DEFAULT_TIMEOUT_MSEC, so
+ * a modem that stopped answering is always noticed. A timeout counts as a
+ * sample of its full length, so the deadline of a verb that starts to
+ * time out grows back by itself. |s_timeoutMutex| guards the table.
+ */
+typedef struct {
+    char verb[16];
+    long long timeoutMsec; /* 0 means infinite */
+    bool adaptive;
+    unsigned int samples;
+    unsigned int latency[LATENCY_BUCKETS]; /* bucket n counts < 2^n msec */
+} VerbTimeout;
+
+static const struct {
+    const char* verb;
+    long long timeoutMsec;
+} s_fixedTimeouts[] = {
+    { "D", 60000 },
+    { "A", 60000 },
+    { "+COPS=?", 180000 },
+    { "+COPS=", 120000 },
+    { "+COPS?", 60000 },
+    { "+CPIN?", 60000 },
+    { "+CPIN=", 60000 },
+    { "+CLCK=", 60000 },
+    { "+CCFC=", 60000 },
+    { "+CCWA=", 60000 },
+    { "+CFUN=", 60000 },
+    { "+CGATT=", 150000 },
+    { "+CGACT=", 150000 },
+    { "+CGDATA=", 150000 },
+    { "+CMGS=", 60000 },
+    { "+CUSD=", 60000 },
+};
+
+/* verbs that leave command mode or drop input until they are done */
+static const char* const s_exclusiveVerbs[] = {
+    "A", "D", "O", "Z", "&F", "+CFUN=", "+CMUX=",
+};
+
+static VerbTimeout s_verbTimeouts[MAX_TIMEOUT_VERBS];
+static int s_numVerbTimeouts;
+static pthread_mutex_t s_timeoutMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Replies of the commands sent with at_send_command_cached(), by command
+ * line, type and response prefix. An entry is dropped when its TTL runs
+ * out, when a setting of its verb (a NO_RESULT command with "=") is
+ * sent, when a URC starting with its policy's prefix is read, or by
+ * at_cache_invalidate().
+ * |s_cacheGeneration| moves on each drop, so a reply that raced one is
+ * not stored. |s_cacheMutex| guards the table and the stats.
+ */
+typedef struct {
+    char* command;
+    char* responsePrefix;
+    ATCommandType type;
+    const ATCachePolicy* p_policy;
+    char stem[16]; /* the verb without "=" or "?" */
+    uint64_t expiry; /* ril_nano_time(), 0 for never */
+    ATResponse* p_response;
+} CacheEntry;
+
+static CacheEntry s_cache[MAX_CACHE_ENTRIES];
+static int s_numCacheEntries;
+static unsigned int s_cacheGeneration;
+static atomic_int s_cacheUnsolWatchers; /* entries with an unsolPrefix */
+static ATCacheStats s_cacheStats;
+static pthread_mutex_t s_cacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Commands are queued on |commandQueue| and written in order. The oldest
+ * written one, collecting the lines read, is |currentCommand|. When the
+ * reader thread |tid_reader| sees a final response it writes the next queued
+ * command before completing the finished one, so the modem is not left idle
+ * during a thread handoff. With a pipeline depth above 1 up to that many
+ * commands are written ahead, those after |currentCommand| wait on
+ * |pipelined| and final responses are matched to them in FIFO order.
+ * |commandmutex| guards the queues, the current command and writes to the
+ * fd. Synchronous callers wait on |commandcond|.
+ */
+typedef struct ATCommand {
+    struct ATCommand* p_next;
+    char* command;
+    ATCommandType type;
+    char* responsePrefix;
+    char* smsPDU;
+    long long timeoutMsec; /* 0 means infinite */
+    struct timespec deadline;
+    VerbTimeout* p_verb; /* NULL if the verb table is full */
+    uint64_t writeTime;
+    bool exclusive; /* nothing may be written behind it while in flight */
+    bool setter; /* a NO_RESULT command with a verb ending in "=", see CacheEntry */
+    char* resyncReply; /* lines before this one are late replies, see queueResync() */
+    int err;
+    ATResponse* p_response; /* set along with the final response */
+    ATCommandCallback callback;
+    void* ctx;
+} ATCommand;
+
+/*
+ * One AT command stream, eg. the tty or a CMUX DLC. A channel may be
+ * opened again after it was closed; the next open waits for the reader
+ * thread of the previous session to exit.
  */
+struct ATChannel {
+    int fd; /* -1 when closed */
+    pthread_t tid_reader;
+    bool readerJoinable;
+    ATUnsolHandler unsolHandler;
+    void (*onTimeout)(ATChannel* p_channel);
+    void (*onReaderClosed)(ATChannel* p_channel);
+    void* context;
+
+    /* for input buffering, unconsumed data is [ATHead, ATTail) and
+     * [ATHead, ATScanned) is known not to hold a complete line */
+    char ATBuffer[MAX_AT_RESPONSE + 1];
+    size_t ATHead;
+    size_t ATTail;
+    size_t ATScanned;
+    /* first line of a two-line SMS unsolicited response, waiting for the PDU */
+    char* smsUnsolicited;
+
+    /* intermediate responses of the current command, NUL terminated one
+     * after the other, and where each one starts. Kept from command to
+     * command, so collecting lines does not allocate once they have grown */
+    char* lineArena;
+    size_t lineArenaLen;
+    size_t lineArenaSize;
+    size_t* lineOffsets;
+    int numLines;
+    int maxLines;
+
+    pthread_mutex_t commandmutex;
+    pthread_cond_t commandcond;
+
+    ATCommand* currentCommand;
+    ATCommand* pipelined; /* written after currentCommand, oldest first */
+    ATCommand* pipelinedTail;
+    int numPipelined;
+    int pipelineDepth; /* most commands written and not finished */
+    ATCommand* commandQueue;
+    ATCommand* commandQueueTail;
+
+    /* written to make the reader pick up the deadline of a new command */
+    int readerWakeFds[2];
+    int readerClosed;
+
+    /* cleared once a compound line failed where its commands alone did not */
+    bool compound;
+
+    /* the reply to RESYNC_COMMAND read by the last handshake, empty if
+     * none, guarded by commandmutex */
+    char resyncReply[64];
+};
 
-static pthread_mutex_t s_commandmutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t s_commandcond = PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t s_writeMutex = PTHREAD_MUTEX_INITIALIZER;
+/* Result of a command issued through one of the blocking wrappers */
+typedef struct {
+    ATChannel* p_channel;
+    int done;
+    int err;
+    ATResponse* p_response;
+} ATSyncResult;
 
-static ATCommandType s_type;
-static const char* s_responsePrefix = NULL;
-static const char* s_smsPDU = NULL;
-static ATResponse* sp_response = NULL;
+/* the channel of at_open() and of threads without a channel of their own */
+static ATChannel s_defaultChannel;
+static pthread_once_t s_channelsOnce = PTHREAD_ONCE_INIT;
+/* guards opening and closing of channels and s_openChannels */
+static pthread_mutex_t s_channelsMutex = PTHREAD_MUTEX_INITIALIZER;
+static int s_openChannels;
+static pthread_key_t s_threadChannelKey;
 
 static void (*s_onTimeout)(void) = NULL;
 static void (*s_onReaderClosed)(void) = NULL;
-static int s_readerClosed;
 
-static void onReaderClosed(void);
-static int writeCtrlZ(const char* s);
-static int writeline(const char* s);
+static void onReaderClosed(ATChannel* p_channel);
+static int writeCtrlZ(ATChannel* p_channel, const char* s);
+static int writeline(ATChannel* p_channel, const char* s);
+static void completeCommands(ATCommand* p_list);
+static void freeCommand(ATCommand* p_cmd);
 
 #define NS_PER_S 1000000000
 static void setTimespecRelative(struct timespec* p_ts, long long msec)
@@ -114,664 +324,2077 @@ static void sleepMsec(long long msec)
     } while (err < 0 && errno == EINTR);
 }
 
-/* add an intermediate response to sp_response*/
-static void addIntermediate(const char* line)
+/* returns the milliseconds left until p_ts, 0 if it has passed */
+static long long msecUntil(const struct timespec* p_ts)
 {
-    ATLine* p_new;
+    struct timeval tv;
+    long long msec;
 
-    p_new = (ATLine*)malloc(sizeof(ATLine));
+    gettimeofday(&tv, (struct timezone*)NULL);
 
-    p_new->line = strdup(line);
+    msec = (p_ts->tv_sec - tv.tv_sec) * 1000LL
+        + (p_ts->tv_nsec / 1000000L) - (tv.tv_usec / 1000L);
 
-    /* note: this adds to the head of the list, so the list
-     * will be in reverse order of lines received. the order is flipped
-     * again before passing on to the command issuer */
-    p_new->p_next = sp_response->p_intermediates;
-    sp_response->p_intermediates = p_new;
+    return msec > 0 ? msec : 0;
 }
 
-/**
- * returns 1 if line is a final response indicating error
- * See 27.007 annex B
- * WARNING: NO CARRIER and others are sometimes unsolicited
- */
-static const char* s_finalResponsesError[] = {
-    "ERROR",
-    "+CMS ERROR:",
-    "+CME ERROR:",
-    "NO CARRIER", /* sometimes! */
-    "NO ANSWER",
-    "NO DIALTONE",
-};
-
-static int isFinalResponseError(const char* line)
+/* "AT+COPS=?" gives "+COPS=?", "AT+CREG?" gives "+CREG?", "ATD123;" gives "D" */
+static void commandVerb(const char* command, char* verb, size_t size)
 {
-    size_t i;
+    const char* p = command;
+    size_t n = 0;
 
-    for (i = 0; i < NUM_ELEMS(s_finalResponsesError); i++) {
-        if (strStartsWith(line, s_finalResponsesError[i])) {
-            return 1;
-        }
+    if ((p[0] == 'A' || p[0] == 'a') && (p[1] == 'T' || p[1] == 't')) {
+        p += 2;
     }
 
-    return 0;
-}
+    if (*p == '+' || *p == '%' || *p == '^' || *p == '$' || *p == '&') {
+        verb[n++] = *p++;
+    }
 
-/**
- * returns 1 if line is a final response indicating success
- * See 27.007 annex B
- * WARNING: NO CARRIER and others are sometimes unsolicited
- */
-static const char* s_finalResponsesSuccess[] = {
-    "OK",
-    "CONNECT" /* some stacks start up data on another channel */
-};
-static int isFinalResponseSuccess(const char* line)
-{
-    size_t i;
+    if (n == 0) {
+        /* basic command, a single letter */
+        if (isalpha((unsigned char)*p)) {
+            verb[n++] = *p;
+        }
+    } else {
+        while (isalnum((unsigned char)*p) && n + 3 < size) {
+            verb[n++] = *p++;
+        }
+
+        if (*p == '=') {
+            verb[n++] = *p++;
+        }
 
-    for (i = 0; i < NUM_ELEMS(s_finalResponsesSuccess); i++) {
-        if (strStartsWith(line, s_finalResponsesSuccess[i])) {
-            return 1;
+        if (*p == '?') {
+            verb[n++] = *p;
         }
     }
 
-    return 0;
+    verb[n] = '\0';
 }
 
 /**
- * returns 1 if line is the first line in (what will be) a two-line
- * SMS unsolicited response
+ * Returns the entry of "verb", adding it if needed, NULL if the table is
+ * full. assumes s_timeoutMutex is held
  */
-static const char* s_smsUnsoliciteds[] = {
-    "+CMT:",
-    "+CDS:",
-    "+CBM:"
-};
-
-static int isSMSUnsolicited(const char* line)
+static VerbTimeout* findVerbTimeout(const char* verb)
 {
+    VerbTimeout* p_verb;
     size_t i;
 
-    for (i = 0; i < NUM_ELEMS(s_smsUnsoliciteds); i++) {
-        if (strStartsWith(line, s_smsUnsoliciteds[i])) {
-            return 1;
+    for (i = 0; i < (size_t)s_numVerbTimeouts; i++) {
+        if (strcmp(s_verbTimeouts[i].verb, verb) == 0) {
+            return &s_verbTimeouts[i];
         }
     }
 
-    return 0;
-}
-
-/* assumes s_commandmutex is held */
-static void handleFinalResponse(const char* line)
-{
-    sp_response->finalResponse = strdup(line);
-
-    pthread_cond_signal(&s_commandcond);
-}
-
-static void handleUnsolicited(const char* line)
-{
-    if (s_unsolHandler != NULL) {
-        s_unsolHandler(line, NULL);
+    if (s_numVerbTimeouts == MAX_TIMEOUT_VERBS) {
+        return NULL;
     }
-}
 
-static void processLine(const char* line)
-{
-    pthread_mutex_lock(&s_commandmutex);
-
-    if (sp_response == NULL) {
-        /* no command pending */
-        handleUnsolicited(line);
-    } else if (isFinalResponseSuccess(line)) {
-        sp_response->success = 1;
-        handleFinalResponse(line);
-    } else if (isFinalResponseError(line)) {
-        sp_response->success = 0;
-        handleFinalResponse(line);
-    } else if (s_smsPDU != NULL && 0 == strcmp(line, "> ")) {
-        // See eg. TS 27.005 4.3
-        // Commands like AT+CMGS have a "> " prompt
-        writeCtrlZ(s_smsPDU);
-        s_smsPDU = NULL;
-    } else
-        switch (s_type) {
-        case NO_RESULT:
-            handleUnsolicited(line);
-            break;
-        case NUMERIC:
-            if (sp_response->p_intermediates == NULL
-                && isdigit(line[0])) {
-                addIntermediate(line);
-            } else {
-                /* either we already have an intermediate response or
-                 * the line doesn't begin with a digit */
-                handleUnsolicited(line);
-            }
-            break;
-        case SINGLELINE:
-            if (sp_response->p_intermediates == NULL
-                && strStartsWith(line, s_responsePrefix)) {
-                addIntermediate(line);
-            } else {
-                /* we already have an intermediate response */
-                handleUnsolicited(line);
-            }
-            break;
-        case MULTILINE:
-            if (strStartsWith(line, s_responsePrefix)) {
-                addIntermediate(line);
-            } else {
-                handleUnsolicited(line);
-            }
-            break;
+    p_verb = &s_verbTimeouts[s_numVerbTimeouts++];
+    snprintf(p_verb->verb, sizeof(p_verb->verb), "%s", verb);
+    p_verb->timeoutMsec = DEFAULT_TIMEOUT_MSEC;
+    p_verb->adaptive = true;
 
-        default: /* this should never be reached */
-            RLOGE("Unsupported AT command type %d\n", s_type);
-            handleUnsolicited(line);
+    for (i = 0; i < NUM_ELEMS(s_fixedTimeouts); i++) {
+        if (strcmp(s_fixedTimeouts[i].verb, verb) == 0) {
+            p_verb->timeoutMsec = s_fixedTimeouts[i].timeoutMsec;
+            p_verb->adaptive = false;
             break;
         }
-
-    pthread_mutex_unlock(&s_commandmutex);
-}
-
-/**
- * Returns a pointer to the end of the next line
- * special-cases the "> " SMS prompt
- *
- * returns NULL if there is no complete line
- */
-static char* findNextEOL(char* cur)
-{
-    if (cur[0] == '>' && cur[1] == ' ' && cur[2] == '\0') {
-        /* SMS prompt character...not \r terminated */
-        return cur + 2;
     }
 
-    // Find next newline
-    while (*cur != '\0' && *cur != '\r' && *cur != '\n')
-        cur++;
-
-    return *cur == '\0' ? NULL : cur;
+    return p_verb;
 }
 
-/**
- * Reads a line from the AT channel, returns NULL on timeout.
- * Assumes it has exclusive read access to the FD
- *
- * This line is valid only until the next call to readline
- *
- * This function exists because as of writing, android libc does not
- * have buffered stdio.
- */
-static const char* readline(void)
+/* assumes s_timeoutMutex is held */
+static long long verbTimeoutMsec(const VerbTimeout* p_verb)
 {
-    ssize_t count;
-
-    char* p_read = NULL;
-    char* p_eol = NULL;
-    char* ret;
-
-    /* this is a little odd. I use *s_ATBufferCur == 0 to
-     * mean "buffer consumed completely". If it points to a character, than
-     * the buffer continues until a \0 */
-    if (*s_ATBufferCur == '\0') {
-        /* empty buffer */
-        s_ATBufferCur = s_ATBuffer;
-        *s_ATBufferCur = '\0';
-        p_read = s_ATBuffer;
-    } else { /* *s_ATBufferCur != '\0' */
-        /* there's data in the buffer from the last read */
-
-        // skip over leading newlines
-        while (*s_ATBufferCur == '\r' || *s_ATBufferCur == '\n')
-            s_ATBufferCur++;
-
-        p_eol = findNextEOL(s_ATBufferCur);
-
-        if (p_eol == NULL) {
-            /* a partial line. move it up and prepare to read more */
-            size_t len;
-
-            len = strlen(s_ATBufferCur);
+    unsigned int target;
+    unsigned int count = 0;
+    long long timeoutMsec;
+    int i;
 
-            memmove(s_ATBuffer, s_ATBufferCur, len + 1);
-            p_read = s_ATBuffer + len;
-            s_ATBufferCur = s_ATBuffer;
-        }
-        /* Otherwise, (p_eol !- NULL) there is a complete line  */
-        /* that will be returned the while () loop below        */
+    if (p_verb == NULL) {
+        return DEFAULT_TIMEOUT_MSEC;
     }
 
-    while (p_eol == NULL) {
-        if (0 == MAX_AT_RESPONSE - (p_read - s_ATBuffer)) {
-            RLOGE("ERROR: Input line exceeded buffer\n");
-            /* ditch buffer and start over again */
-            s_ATBufferCur = s_ATBuffer;
-            *s_ATBufferCur = '\0';
-            p_read = s_ATBuffer;
-        }
-
-        do {
-            count = read(s_fd, p_read,
-                MAX_AT_RESPONSE - (p_read - s_ATBuffer));
-        } while (count < 0 && errno == EINTR);
-
-        if (count > 0) {
-            AT_DUMP("<< ", p_read, count);
-
-            p_read[count] = '\0';
-
-            // skip over leading newlines
-            while (*s_ATBufferCur == '\r' || *s_ATBufferCur == '\n')
-                s_ATBufferCur++;
+    if (!p_verb->adaptive || p_verb->samples < LATENCY_MIN_SAMPLES) {
+        return p_verb->timeoutMsec;
+    }
 
-            p_eol = findNextEOL(s_ATBufferCur);
-            p_read += count;
-        } else if (count <= 0) {
-            /* read error encountered or EOF reached */
-            if (count == 0) {
-                RLOGD("atchannel: EOF reached");
-            } else {
-                RLOGD("atchannel: read error %s", strerror(errno));
-            }
-            return NULL;
+    /* the upper bound of the bucket holding the 99th percentile */
+    target = p_verb->samples - p_verb->samples / 100;
+    for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        count += p_verb->latency[i];
+        if (count >= target) {
+            break;
         }
     }
 
-    /* a full line in the buffer. Place a \0 over the \r and return */
-
-    ret = s_ATBufferCur;
-    *p_eol = '\0';
-    s_ATBufferCur = p_eol + 1; /* this will always be <= p_read,    */
-    /* and there will be a \0 at *p_read */
+    timeoutMsec = (1LL << i) * ADAPTIVE_TIMEOUT_FACTOR;
+    if (timeoutMsec < MIN_ADAPTIVE_TIMEOUT_MSEC) {
+        timeoutMsec = MIN_ADAPTIVE_TIMEOUT_MSEC;
+    }
 
-    RLOGD("AT< %s\n", ret);
-    return ret;
+    return timeoutMsec < p_verb->timeoutMsec ? timeoutMsec : p_verb->timeoutMsec;
 }
 
-static void onReaderClosed(void)
+static void recordLatency(VerbTimeout* p_verb, long long msec)
 {
-    if (s_onReaderClosed != NULL && s_readerClosed == 0) {
+    unsigned int samples = 0;
+    int i;
 
-        pthread_mutex_lock(&s_commandmutex);
+    if (p_verb == NULL) {
+        return;
+    }
 
-        s_readerClosed = 1;
+    i = 0;
+    while (i < LATENCY_BUCKETS - 1 && (1LL << i) <= msec) {
+        i++;
+    }
 
-        pthread_cond_signal(&s_commandcond);
+    pthread_mutex_lock(&s_timeoutMutex);
 
-        pthread_mutex_unlock(&s_commandmutex);
+    p_verb->latency[i]++;
 
-        s_onReaderClosed();
+    if (++p_verb->samples > LATENCY_DECAY_SAMPLES) {
+        /* age out old samples so the deadline follows the modem */
+        for (i = 0; i < LATENCY_BUCKETS; i++) {
+            p_verb->latency[i] /= 2;
+            samples += p_verb->latency[i];
+        }
+        p_verb->samples = samples;
     }
+
+    pthread_mutex_unlock(&s_timeoutMutex);
 }
 
-static void* readerLoop(void* arg)
+/* add an intermediate response to the current command */
+static void addIntermediate(ATChannel* p_channel, const char* line)
 {
-    for (;;) {
-        const char* line;
-
-        line = readline();
-
-        if (line == NULL) {
-            break;
+    size_t len = strlen(line) + 1;
+    size_t size;
+    char* p_arena;
+    size_t* p_offsets;
+    int maxLines;
+
+    if (p_channel->lineArenaLen + len > p_channel->lineArenaSize) {
+        size = p_channel->lineArenaSize ? p_channel->lineArenaSize : 256;
+        while (size < p_channel->lineArenaLen + len) {
+            size *= 2;
         }
 
-        if (isSMSUnsolicited(line)) {
-            char* line1;
-            const char* line2;
-
-            // The scope of string returned by 'readline()' is valid only
-            // till next call to 'readline()' hence making a copy of line
-            // before calling readline again.
-            line1 = strdup(line);
-            line2 = readline();
+        p_arena = (char*)realloc(p_channel->lineArena, size);
+        if (p_arena == NULL) {
+            RLOGE("Failed to allocate memory for %s", line);
+            return;
+        }
 
-            if (line2 == NULL) {
-                free(line1);
-                break;
-            }
+        p_channel->lineArena = p_arena;
+        p_channel->lineArenaSize = size;
+    }
 
-            if (s_unsolHandler != NULL) {
-                s_unsolHandler(line1, line2);
-            }
-            free(line1);
-        } else {
-            processLine(line);
+    if (p_channel->numLines == p_channel->maxLines) {
+        maxLines = p_channel->maxLines ? p_channel->maxLines * 2 : 16;
+        p_offsets = (size_t*)realloc(p_channel->lineOffsets, maxLines * sizeof(size_t));
+        if (p_offsets == NULL) {
+            RLOGE("Failed to allocate memory for %s", line);
+            return;
         }
-    }
 
-    onReaderClosed();
+        p_channel->lineOffsets = p_offsets;
+        p_channel->maxLines = maxLines;
+    }
 
-    return NULL;
+    memcpy(p_channel->lineArena + p_channel->lineArenaLen, line, len);
+    p_channel->lineOffsets[p_channel->numLines++] = p_channel->lineArenaLen;
+    p_channel->lineArenaLen += len;
 }
 
 /**
- * Sends string s to the radio with a \r appended.
- * Returns AT_ERROR_* on error, 0 on success
- *
- * This function exists because as of writing, android libc does not
- * have buffered stdio.
+ * Packs the collected intermediate responses and "finalResponse" into one
+ * allocation: the ATResponse, its ATLine list in the order the lines were
+ * received, then the text. at_response_free() is a single free().
+ * Returns NULL if out of memory
  */
-static int writeline(const char* s)
+static ATResponse* buildResponse(ATChannel* p_channel,
+    const char* finalResponse, int success)
 {
-    size_t cur = 0;
-    size_t len = strlen(s);
-    ssize_t written;
+    size_t finalLen = strlen(finalResponse) + 1;
+    int n = p_channel->numLines;
+    ATResponse* p_response;
+    ATLine* p_lines;
+    char* p_text;
+    int i;
 
-    if (s_fd < 0 || s_readerClosed > 0) {
-        return AT_ERROR_CHANNEL_CLOSED;
+    p_response = (ATResponse*)malloc(sizeof(ATResponse) + n * sizeof(ATLine)
+        + p_channel->lineArenaLen + finalLen);
+    if (p_response == NULL) {
+        return NULL;
     }
 
-    RLOGD("AT> %s\n", s);
-
-    AT_DUMP(">> ", s, strlen(s));
-
-    /* the main string */
-    while (cur < len) {
-        do {
-            written = write(s_fd, s + cur, len - cur);
-        } while (written < 0 && errno == EINTR);
-
-        if (written < 0) {
-            return AT_ERROR_GENERIC;
-        }
+    p_lines = (ATLine*)(p_response + 1);
+    p_text = (char*)(p_lines + n);
 
-        cur += written;
+    if (p_channel->lineArenaLen > 0) {
+        memcpy(p_text, p_channel->lineArena, p_channel->lineArenaLen);
     }
 
-    /* the \r  */
-
-    do {
-        written = write(s_fd, "\r", 1);
-    } while ((written < 0 && errno == EINTR) || (written == 0));
-
-    if (written < 0) {
-        return AT_ERROR_GENERIC;
+    for (i = 0; i < n; i++) {
+        p_lines[i].line = p_text + p_channel->lineOffsets[i];
+        p_lines[i].p_next = i + 1 < n ? &p_lines[i + 1] : NULL;
     }
 
-    return 0;
+    p_response->success = success;
+    p_response->finalResponse = p_text + p_channel->lineArenaLen;
+    memcpy(p_response->finalResponse, finalResponse, finalLen);
+    p_response->p_intermediates = n > 0 ? p_lines : NULL;
+    p_response->numIntermediates = n;
+
+    return p_response;
 }
 
-static int writeCtrlZ(const char* s)
+/* Returns a copy of a response made by buildResponse(), NULL if out of memory */
+static ATResponse* copyResponse(const ATResponse* p_src)
 {
-    size_t cur = 0;
-    size_t len = strlen(s);
-    ssize_t written;
+    const char* p_base = (const char*)p_src;
+    size_t size = p_src->finalResponse + strlen(p_src->finalResponse) + 1 - p_base;
+    ATResponse* p_copy;
+    ATLine* p_lines;
+    int i;
 
-    if (s_fd < 0 || s_readerClosed > 0) {
-        return AT_ERROR_CHANNEL_CLOSED;
+    p_copy = (ATResponse*)malloc(size);
+    if (p_copy == NULL) {
+        return NULL;
     }
 
-    RLOGD("AT> %s^Z\n", s);
+    memcpy(p_copy, p_src, size);
 
-    /* the main string */
-    while (cur < len) {
-        do {
-            written = write(s_fd, s + cur, len - cur);
-        } while (written < 0 && errno == EINTR);
+    /* the lines follow the response, their text the lines */
+    p_lines = (ATLine*)(p_copy + 1);
+    for (i = 0; i < p_copy->numIntermediates; i++) {
+        p_lines[i].line = (char*)p_copy + (p_src->p_intermediates[i].line - p_base);
+        p_lines[i].p_next = i + 1 < p_copy->numIntermediates ? &p_lines[i + 1] : NULL;
+    }
 
-        if (written < 0) {
-            return AT_ERROR_GENERIC;
-        }
+    p_copy->p_intermediates = p_copy->numIntermediates > 0 ? p_lines : NULL;
+    p_copy->finalResponse = (char*)p_copy + (p_src->finalResponse - p_base);
 
-        cur += written;
-    }
+    return p_copy;
+}
 
-    /* the ^Z  */
+/* Fills "stem" with the verb of "command" without "=" or "?" */
+static void commandStem(const char* command, char* stem, size_t size)
+{
+    size_t n;
 
-    do {
-        written = write(s_fd, "\032", 1);
-    } while ((written < 0 && errno == EINTR) || (written == 0));
+    commandVerb(command, stem, size);
 
-    if (written < 0) {
-        return AT_ERROR_GENERIC;
+    n = strlen(stem);
+    while (n > 0 && (stem[n - 1] == '=' || stem[n - 1] == '?')) {
+        stem[--n] = '\0';
     }
+}
 
-    return 0;
+/* assumes s_cacheMutex is held */
+static void dropCacheEntryLocked(int index)
+{
+    CacheEntry* p_entry = &s_cache[index];
+
+    if (p_entry->p_policy->unsolPrefix != NULL) {
+        atomic_fetch_sub(&s_cacheUnsolWatchers, 1);
+    }
+
+    free(p_entry->command);
+    free(p_entry->responsePrefix);
+    at_response_free(p_entry->p_response);
+
+    *p_entry = s_cache[--s_numCacheEntries];
+    s_cacheGeneration++;
+    s_cacheStats.invalidations++;
 }
 
-static void clearPendingCommand(void)
+/* assumes s_cacheMutex is held */
+static int findCacheEntryLocked(const char* command, ATCommandType type,
+    const char* responsePrefix)
 {
-    if (sp_response != NULL) {
-        at_response_free(sp_response);
+    for (int i = 0; i < s_numCacheEntries; i++) {
+        const CacheEntry* p_entry = &s_cache[i];
+
+        if (p_entry->type == type && strcmp(p_entry->command, command) == 0
+            && (p_entry->responsePrefix == NULL
+                    ? responsePrefix == NULL
+                    : responsePrefix != NULL && strcmp(p_entry->responsePrefix, responsePrefix) == 0)) {
+            return i;
+        }
     }
 
-    sp_response = NULL;
-    s_responsePrefix = NULL;
-    s_smsPDU = NULL;
+    return -1;
 }
 
 /**
- * Starts AT handler on stream "fd'
- * returns 0 on success, -1 on error
+ * Returns a copy of the cached reply to "command", NULL on a miss, with
+ * the generation to store its reply at in *p_generation
  */
-int at_open(int fd, ATUnsolHandler h)
+static ATResponse* lookupCache(const char* command, ATCommandType type,
+    const char* responsePrefix, unsigned int* p_generation)
 {
-    int ret;
-    pthread_attr_t attr;
-
-    s_fd = fd;
-    s_unsolHandler = h;
-    s_readerClosed = 0;
+    ATResponse* p_response = NULL;
+    int i;
 
-    s_responsePrefix = NULL;
-    s_smsPDU = NULL;
-    sp_response = NULL;
+    pthread_mutex_lock(&s_cacheMutex);
 
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    i = findCacheEntryLocked(command, type, responsePrefix);
+    if (i >= 0 && s_cache[i].expiry != 0 && ril_nano_time() >= s_cache[i].expiry) {
+        dropCacheEntryLocked(i);
+        i = -1;
+    }
 
-    ret = pthread_create(&s_tid_reader, &attr, readerLoop, &attr);
+    if (i >= 0) {
+        p_response = copyResponse(s_cache[i].p_response);
+    }
 
-    if (ret < 0) {
-        perror("pthread_create");
-        return -1;
+    if (p_response != NULL) {
+        s_cacheStats.hits++;
+    } else {
+        s_cacheStats.misses++;
     }
 
-    return 0;
+    *p_generation = s_cacheGeneration;
+
+    pthread_mutex_unlock(&s_cacheMutex);
+
+    return p_response;
 }
 
-/* FIXME is it ok to call this from the reader and the command thread? */
-void at_close()
+/* Caches a copy of "p_response", unless something was dropped since "generation" */
+static void storeCache(const char* command, ATCommandType type,
+    const char* responsePrefix, const ATCachePolicy* p_policy,
+    const ATResponse* p_response, unsigned int generation)
 {
-    if (s_fd >= 0) {
-        close(s_fd);
+    CacheEntry entry;
+
+    entry.command = strdup(command);
+    entry.responsePrefix = responsePrefix ? strdup(responsePrefix) : NULL;
+    entry.type = type;
+    entry.p_policy = p_policy;
+    entry.expiry = p_policy->ttlMsec > 0
+        ? ril_nano_time() + (uint64_t)p_policy->ttlMsec * 1000000
+        : 0;
+    entry.p_response = copyResponse(p_response);
+    commandStem(command, entry.stem, sizeof(entry.stem));
+
+    pthread_mutex_lock(&s_cacheMutex);
+
+    if (entry.command == NULL || (responsePrefix && !entry.responsePrefix)
+        || entry.p_response == NULL || generation != s_cacheGeneration
+        || s_numCacheEntries == MAX_CACHE_ENTRIES
+        || findCacheEntryLocked(command, type, responsePrefix) >= 0) {
+        pthread_mutex_unlock(&s_cacheMutex);
+        free(entry.command);
+        free(entry.responsePrefix);
+        at_response_free(entry.p_response);
+        return;
     }
-    s_fd = -1;
 
-    pthread_mutex_lock(&s_commandmutex);
-
-    s_readerClosed = 1;
-
-    pthread_cond_signal(&s_commandcond);
-
-    pthread_mutex_unlock(&s_commandmutex);
+    if (p_policy->unsolPrefix != NULL) {
+        atomic_fetch_add(&s_cacheUnsolWatchers, 1);
+    }
 
-    /* the reader thread should eventually die */
-}
+    s_cache[s_numCacheEntries++] = entry;
 
-static ATResponse* at_response_new(void)
-{
-    return (ATResponse*)calloc(1, sizeof(ATResponse));
+    pthread_mutex_unlock(&s_cacheMutex);
 }
 
-void at_response_free(ATResponse* p_response)
+/* Drops the cached replies of the verb of "command", a setting */
+static void invalidateCacheFamily(const char* command)
 {
-    ATLine* p_line;
-
-    if (p_response == NULL)
-        return;
-
-    p_line = p_response->p_intermediates;
+    char stem[sizeof(((CacheEntry*)0)->stem)];
+    int i;
 
-    while (p_line != NULL) {
-        ATLine* p_toFree;
+    commandStem(command, stem, sizeof(stem));
 
-        p_toFree = p_line;
-        p_line = p_line->p_next;
+    pthread_mutex_lock(&s_cacheMutex);
 
-        free(p_toFree->line);
-        free(p_toFree);
+    for (i = s_numCacheEntries - 1; i >= 0; i--) {
+        if (strcmp(s_cache[i].stem, stem) == 0) {
+            dropCacheEntryLocked(i);
+        }
     }
 
-    free(p_response->finalResponse);
-    free(p_response);
+    pthread_mutex_unlock(&s_cacheMutex);
 }
 
 /**
- * The line reader places the intermediate responses in reverse order
- * here we flip them back
+ * Calls invalidateCacheFamily() for every verb of "command" that sets
+ * something, eg. +CMEE and +CLIR for "AT+CMEE=1;+CLIR=1". Returns
+ * whether there was one
  */
-static void reverseIntermediates(ATResponse* p_response)
+static bool invalidateSetters(const char* command)
 {
-    ATLine *pcur, *pnext;
+    char verb[sizeof(((CacheEntry*)0)->stem)];
+    const char* p = command;
+    bool quoted = false;
+    bool found = false;
+
+    for (;;) {
+        commandVerb(p, verb, sizeof(verb));
+        if (verb[0] != '\0' && verb[strlen(verb) - 1] == '=') {
+            invalidateCacheFamily(p);
+            found = true;
+        }
 
-    pcur = p_response->p_intermediates;
-    p_response->p_intermediates = NULL;
+        /* the next command of the line, ';' may appear in a string */
+        while (*p != '\0' && (quoted || *p != ';')) {
+            if (*p == '"') {
+                quoted = !quoted;
+            }
+            p++;
+        }
 
-    while (pcur != NULL) {
-        pnext = pcur->p_next;
-        pcur->p_next = p_response->p_intermediates;
-        p_response->p_intermediates = pcur;
-        pcur = pnext;
+        if (*p == '\0') {
+            return found;
+        }
+        p++;
     }
 }
 
-/**
- * Internal send_command implementation
- * Doesn't lock or call the timeout callback
- *
- * timeoutMsec == 0 means infinite timeout
- */
-static int at_send_command_full_nolock(const char* command, ATCommandType type,
-    const char* responsePrefix, const char* smspdu,
-    long long timeoutMsec, ATResponse** pp_outResponse)
+/* Drops the cached replies whose policy watches unsolicited "line" */
+static void invalidateCacheUnsol(const char* line)
 {
-    int err = 0;
-    struct timespec ts;
+    int i;
 
-    if (sp_response != NULL) {
-        err = AT_ERROR_COMMAND_PENDING;
-        goto error;
+    if (line == NULL || atomic_load(&s_cacheUnsolWatchers) == 0) {
+        return;
     }
 
-    err = writeline(command);
+    pthread_mutex_lock(&s_cacheMutex);
 
-    if (err < 0) {
-        goto error;
+    for (i = s_numCacheEntries - 1; i >= 0; i--) {
+        if (s_cache[i].p_policy->unsolPrefix != NULL
+            && strStartsWith(line, s_cache[i].p_policy->unsolPrefix)) {
+            dropCacheEntryLocked(i);
+        }
+    }
+
+    pthread_mutex_unlock(&s_cacheMutex);
+}
+
+/* classes of the lines atchannel itself has to recognize */
+enum {
+    LINE_OTHER = 0,
+    LINE_FINAL_SUCCESS,
+    LINE_FINAL_ERROR,
+    LINE_SMS_UNSOLICITED, /* first line of a two-line SMS response */
+};
+
+/**
+ * Final responses and SMS unsolicited responses, see 27.007 annex B
+ * WARNING: NO CARRIER and others are sometimes unsolicited
+ */
+static const struct {
+    const char* prefix;
+    int lineClass;
+} s_linePrefixes[] = {
+    { "OK", LINE_FINAL_SUCCESS },
+    { "CONNECT", LINE_FINAL_SUCCESS }, /* some stacks start up data on another channel */
+    { "ERROR", LINE_FINAL_ERROR },
+    { "+CMS ERROR:", LINE_FINAL_ERROR },
+    { "+CME ERROR:", LINE_FINAL_ERROR },
+    { "NO CARRIER", LINE_FINAL_ERROR }, /* sometimes! */
+    { "NO ANSWER", LINE_FINAL_ERROR },
+    { "NO DIALTONE", LINE_FINAL_ERROR },
+    { "+CMT:", LINE_SMS_UNSOLICITED },
+    { "+CDS:", LINE_SMS_UNSOLICITED },
+    { "+CBM:", LINE_SMS_UNSOLICITED },
+};
+
+#define MAX_PREFIX_NODES 512
+
+/**
+ * One character of the prefix trie. The children of a node form a sibling
+ * list, the top level is indexed by the first character. Index 0 is never
+ * used by a node, so it ends the lists
+ */
+typedef struct {
+    unsigned char ch;
+    unsigned char lineClass;
+    unsigned short child;
+    unsigned short sibling;
+    ATUnsolHandler unsolHandler;
+} PrefixNode;
+
+/* only modified before any channel is open, lookups take no lock */
+static PrefixNode s_prefixNodes[MAX_PREFIX_NODES];
+static unsigned short s_prefixRoots[256];
+static unsigned int s_prefixNodeCount = 1;
+
+/**
+ * Returns the node of the last character of "prefix", adding the missing
+ * ones, or NULL if the trie is full
+ */
+static PrefixNode* insertPrefix(const char* prefix)
+{
+    const unsigned char* p = (const unsigned char*)prefix;
+    unsigned short* p_link;
+    unsigned short idx;
+
+    if (*p == '\0') {
+        return NULL;
+    }
+
+    p_link = &s_prefixRoots[*p];
+
+    for (;;) {
+        idx = *p_link;
+        while (idx != 0 && s_prefixNodes[idx].ch != *p) {
+            p_link = &s_prefixNodes[idx].sibling;
+            idx = *p_link;
+        }
+
+        if (idx == 0) {
+            if (s_prefixNodeCount == MAX_PREFIX_NODES) {
+                return NULL;
+            }
+
+            idx = s_prefixNodeCount++;
+            s_prefixNodes[idx].ch = *p;
+            *p_link = idx;
+        }
+
+        if (*++p == '\0') {
+            return &s_prefixNodes[idx];
+        }
+
+        p_link = &s_prefixNodes[idx].child;
+    }
+}
+
+/**
+ * Walks "line" down the trie once. The longest matching prefix wins, for
+ * the line class and for the unsolicited handler separately
+ */
+static void matchPrefixes(const char* line, int* p_lineClass,
+    ATUnsolHandler* p_unsolHandler)
+{
+    const unsigned char* p = (const unsigned char*)line;
+    const PrefixNode* p_node;
+    unsigned short idx;
+
+    if (p_lineClass != NULL) {
+        *p_lineClass = LINE_OTHER;
+    }
+
+    if (p_unsolHandler != NULL) {
+        *p_unsolHandler = NULL;
+    }
+
+    idx = s_prefixRoots[*p];
+
+    while (idx != 0) {
+        p_node = &s_prefixNodes[idx];
+
+        if (p_lineClass != NULL && p_node->lineClass != LINE_OTHER) {
+            *p_lineClass = p_node->lineClass;
+        }
+
+        if (p_unsolHandler != NULL && p_node->unsolHandler != NULL) {
+            *p_unsolHandler = p_node->unsolHandler;
+        }
+
+        if (*++p == '\0') {
+            break;
+        }
+
+        idx = p_node->child;
+        while (idx != 0 && s_prefixNodes[idx].ch != *p) {
+            idx = s_prefixNodes[idx].sibling;
+        }
+    }
+}
+
+static int classifyLine(const char* line)
+{
+    int lineClass;
+
+    matchPrefixes(line, &lineClass, NULL);
+
+    return lineClass;
+}
+
+static void initPrefixes(void)
+{
+    PrefixNode* p_node;
+    size_t i;
+
+    for (i = 0; i < NUM_ELEMS(s_linePrefixes); i++) {
+        p_node = insertPrefix(s_linePrefixes[i].prefix);
+        if (p_node != NULL) {
+            p_node->lineClass = s_linePrefixes[i].lineClass;
+        }
+    }
+}
+
+/**
+ * Makes "p_cmd" the command the lines read belong to. Its deadline and
+ * latency count from here, as a pipelined command only starts once the
+ * ones before it are done.
+ * assumes p_channel->commandmutex is held
+ */
+static void startCommand(ATChannel* p_channel, ATCommand* p_cmd)
+{
+    if (p_cmd->timeoutMsec != 0) {
+        setTimespecRelative(&p_cmd->deadline, p_cmd->timeoutMsec);
+    }
+
+    p_cmd->writeTime = ril_nano_time();
+    p_channel->lineArenaLen = 0;
+    p_channel->numLines = 0;
+    p_channel->currentCommand = p_cmd;
+}
+
+/* assumes p_channel->commandmutex is held */
+static bool canWriteCommand(ATChannel* p_channel)
+{
+    if (p_channel->currentCommand == NULL) {
+        return true;
+    }
+
+    if (p_channel->numPipelined + 1 >= p_channel->pipelineDepth) {
+        return false;
+    }
+
+    if (p_channel->pipelinedTail != NULL) {
+        return !p_channel->pipelinedTail->exclusive;
+    }
+
+    return !p_channel->currentCommand->exclusive;
+}
+
+/**
+ * Writes queued commands until the pipeline is full or the queue is empty.
+ * Returns the commands that could not be written, to be completed once
+ * the lock is released.
+ * assumes p_channel->commandmutex is held
+ */
+static ATCommand* issueNextCommand(ATChannel* p_channel)
+{
+    ATCommand* p_failed = NULL;
+    ATCommand** pp_failedTail = &p_failed;
+
+    if (p_channel->currentCommand == NULL && p_channel->pipelined != NULL) {
+        ATCommand* p_cmd = p_channel->pipelined;
+
+        p_channel->pipelined = p_cmd->p_next;
+        if (p_channel->pipelined == NULL) {
+            p_channel->pipelinedTail = NULL;
+        }
+        p_channel->numPipelined--;
+        p_cmd->p_next = NULL;
+
+        startCommand(p_channel, p_cmd);
+    }
+
+    while (p_channel->commandQueue != NULL && canWriteCommand(p_channel)) {
+        ATCommand* p_cmd = p_channel->commandQueue;
+
+        /* an exclusive command waits for the ones before it */
+        if (p_cmd->exclusive && p_channel->currentCommand != NULL) {
+            break;
+        }
+
+        p_channel->commandQueue = p_cmd->p_next;
+        if (p_channel->commandQueue == NULL) {
+            p_channel->commandQueueTail = NULL;
+        }
+        p_cmd->p_next = NULL;
+
+        p_cmd->err = writeline(p_channel, p_cmd->command);
+        if (p_cmd->err < 0) {
+            *pp_failedTail = p_cmd;
+            pp_failedTail = &p_cmd->p_next;
+            continue;
+        }
+
+        if (p_channel->currentCommand == NULL) {
+            startCommand(p_channel, p_cmd);
+        } else {
+            if (p_channel->pipelinedTail != NULL) {
+                p_channel->pipelinedTail->p_next = p_cmd;
+            } else {
+                p_channel->pipelined = p_cmd;
+            }
+            p_channel->pipelinedTail = p_cmd;
+            p_channel->numPipelined++;
+        }
+    }
+
+    return p_failed;
+}
+
+/**
+ * Detaches the current command with the given result and writes the next
+ * one. Returns the commands to complete once the lock is released.
+ * assumes p_channel->commandmutex is held
+ */
+static ATCommand* finishCurrentCommand(ATChannel* p_channel, int err)
+{
+    ATCommand* p_done = p_channel->currentCommand;
+
+    p_channel->currentCommand = NULL;
+    p_done->err = err;
+    p_done->p_next = issueNextCommand(p_channel);
+
+    return p_done;
+}
+
+/**
+ * Detaches the current and the pipelined commands with the given result,
+ * without writing anything. Returns them, oldest first.
+ * assumes p_channel->commandmutex is held
+ */
+static ATCommand* failWrittenCommands(ATChannel* p_channel, int err)
+{
+    ATCommand* p_done = p_channel->currentCommand;
+
+    if (p_done == NULL) {
+        return NULL;
+    }
+
+    p_done->p_next = p_channel->pipelined;
+    for (ATCommand* p_cmd = p_done; p_cmd != NULL; p_cmd = p_cmd->p_next) {
+        p_cmd->err = err;
+    }
+
+    p_channel->currentCommand = NULL;
+    p_channel->pipelined = NULL;
+    p_channel->pipelinedTail = NULL;
+    p_channel->numPipelined = 0;
+
+    return p_done;
+}
+
+/* assumes p_channel->commandmutex is held */
+static ATCommand* handleFinalResponse(ATChannel* p_channel, const char* line,
+    int success)
+{
+    ATResponse* p_response = buildResponse(p_channel, line, success);
+
+    recordLatency(p_channel->currentCommand->p_verb,
+        (long long)((ril_nano_time() - p_channel->currentCommand->writeTime) / 1000000));
+
+    if (p_response == NULL) {
+        RLOGE("Failed to allocate memory for response %s", line);
+        return finishCurrentCommand(p_channel, AT_ERROR_GENERIC);
+    }
+
+    p_channel->currentCommand->p_response = p_response;
+
+    return finishCurrentCommand(p_channel, AT_ERROR_OK);
+}
+
+static void urcPush(URCNode* p_node)
+{
+    URCNode* p_prev;
+
+    atomic_store_explicit(&p_node->p_next, NULL, memory_order_relaxed);
+    p_prev = atomic_exchange_explicit(&s_urcHead, p_node, memory_order_acq_rel);
+    atomic_store_explicit(&p_prev->p_next, p_node, memory_order_release);
+}
+
+/* returns NULL if the queue is empty or a producer is mid-push */
+static URCNode* urcPop(void)
+{
+    URCNode* p_tail = s_urcTail;
+    URCNode* p_next = atomic_load_explicit(&p_tail->p_next, memory_order_acquire);
+
+    if (p_tail == &s_urcStub) {
+        if (p_next == NULL) {
+            return NULL;
+        }
+
+        s_urcTail = p_next;
+        p_tail = p_next;
+        p_next = atomic_load_explicit(&p_next->p_next, memory_order_acquire);
+    }
+
+    if (p_next != NULL) {
+        s_urcTail = p_next;
+        return p_tail;
+    }
+
+    if (p_tail != atomic_load_explicit(&s_urcHead, memory_order_acquire)) {
+        return NULL;
+    }
+
+    urcPush(&s_urcStub);
+
+    p_next = atomic_load_explicit(&p_tail->p_next, memory_order_acquire);
+    if (p_next != NULL) {
+        s_urcTail = p_next;
+        return p_tail;
+    }
+
+    return NULL;
+}
+
+static void atomicMax(atomic_uint* p_max, unsigned int value)
+{
+    unsigned int cur = atomic_load(p_max);
+
+    while (value > cur && !atomic_compare_exchange_weak(p_max, &cur, value))
+        ;
+}
+
+static void atomicMax64(atomic_ullong* p_max, unsigned long long value)
+{
+    unsigned long long cur = atomic_load(p_max);
+
+    while (value > cur && !atomic_compare_exchange_weak(p_max, &cur, value))
+        ;
+}
+
+/* line == NULL enqueues the exit request for the URC thread */
+static void enqueueUnsolicited(ATUnsolHandler handler, const char* line,
+    const char* sms_pdu)
+{
+    uint64_t start = ril_nano_time();
+    size_t lineLen = line ? strlen(line) + 1 : 0;
+    size_t pduLen = sms_pdu ? strlen(sms_pdu) + 1 : 0;
+    URCNode* p_node;
+    unsigned int depth;
+    uint64_t stall;
+
+    invalidateCacheUnsol(line);
+
+    p_node = (URCNode*)malloc(sizeof(URCNode) + lineLen + pduLen);
+    if (p_node == NULL) {
+        RLOGE("Failed to allocate memory for unsolicited %s", line);
+        return;
+    }
+
+    p_node->handler = handler;
+    p_node->line = NULL;
+    p_node->sms_pdu = NULL;
+
+    if (line != NULL) {
+        p_node->line = (char*)(p_node + 1);
+        memcpy(p_node->line, line, lineLen);
+    }
+
+    if (sms_pdu != NULL) {
+        p_node->sms_pdu = (char*)(p_node + 1) + lineLen;
+        memcpy(p_node->sms_pdu, sms_pdu, pduLen);
+    }
+
+    p_node->enqueueTime = ril_nano_time();
+    urcPush(p_node);
+    depth = atomic_fetch_add(&s_urcDepth, 1) + 1;
+    sem_post(&s_urcSem);
+
+    stall = ril_nano_time() - start;
+
+    atomic_fetch_add(&s_readerStallNsTotal, stall);
+    atomicMax64(&s_readerStallNsMax, stall);
+    atomicMax(&s_urcDepthMax, depth);
+}
+
+static void* urcLoop(void* arg)
+{
+    (void)arg;
+
+    for (;;) {
+        URCNode* p_node;
+        uint64_t latency;
+
+        while (sem_wait(&s_urcSem) < 0 && errno == EINTR)
+            ;
+
+        /* a producer may have swapped the head but not linked it yet */
+        while ((p_node = urcPop()) == NULL) {
+            sched_yield();
+        }
+
+        atomic_fetch_sub(&s_urcDepth, 1);
+
+        if (p_node->line == NULL) {
+            free(p_node);
+            break;
+        }
+
+        latency = ril_nano_time() - p_node->enqueueTime;
+
+        atomic_fetch_add(&s_urcCount, 1);
+        atomicMax64(&s_deliveryLatencyNsMax, latency);
+
+        if (p_node->handler != NULL) {
+            p_node->handler(p_node->line, p_node->sms_pdu);
+        }
+
+        free(p_node);
+    }
+
+    return NULL;
+}
+
+static void handleUnsolicited(ATChannel* p_channel, const char* line)
+{
+    if (p_channel->unsolHandler != NULL) {
+        enqueueUnsolicited(p_channel->unsolHandler, line, NULL);
+    }
+}
+
+/**
+ * Handles one line, returns the commands it finished
+ * assumes p_channel->commandmutex is held
+ */
+static ATCommand* processLine(ATChannel* p_channel, const char* line,
+    int lineClass)
+{
+    ATCommand* p_cmd = p_channel->currentCommand;
+    ATCommand* p_done = NULL;
+
+    if (p_cmd == NULL) {
+        /* no command pending */
+        handleUnsolicited(p_channel, line);
+    } else if (p_cmd->resyncReply != NULL) {
+        if (strcmp(line, p_cmd->resyncReply) == 0) {
+            /* whatever follows answers the resync command itself */
+            free(p_cmd->resyncReply);
+            p_cmd->resyncReply = NULL;
+        } else if (lineClass == LINE_FINAL_SUCCESS || lineClass == LINE_FINAL_ERROR) {
+            RLOGW("Discarding late response %s", line);
+        } else {
+            handleUnsolicited(p_channel, line);
+        }
+    } else if (lineClass == LINE_FINAL_SUCCESS) {
+        p_done = handleFinalResponse(p_channel, line, 1);
+    } else if (lineClass == LINE_FINAL_ERROR) {
+        p_done = handleFinalResponse(p_channel, line, 0);
+    } else if (p_cmd->smsPDU != NULL && 0 == strcmp(line, "> ")) {
+        // See eg. TS 27.005 4.3
+        // Commands like AT+CMGS have a "> " prompt
+        writeCtrlZ(p_channel, p_cmd->smsPDU);
+        free(p_cmd->smsPDU);
+        p_cmd->smsPDU = NULL;
+    } else
+        switch (p_cmd->type) {
+        case NO_RESULT:
+            handleUnsolicited(p_channel, line);
+            break;
+        case NUMERIC:
+            if (p_channel->numLines == 0
+                && isdigit(line[0])) {
+                addIntermediate(p_channel, line);
+            } else {
+                /* either we already have an intermediate response or
+                 * the line doesn't begin with a digit */
+                handleUnsolicited(p_channel, line);
+            }
+            break;
+        case SINGLELINE:
+            if (p_channel->numLines == 0
+                && strStartsWith(line, p_cmd->responsePrefix)) {
+                addIntermediate(p_channel, line);
+            } else {
+                /* we already have an intermediate response */
+                handleUnsolicited(p_channel, line);
+            }
+            break;
+        case MULTILINE:
+            if (strStartsWith(line, p_cmd->responsePrefix)) {
+                addIntermediate(p_channel, line);
+            } else {
+                handleUnsolicited(p_channel, line);
+            }
+            break;
+
+        default: /* this should never be reached */
+            RLOGE("Unsupported AT command type %d\n", p_cmd->type);
+            handleUnsolicited(p_channel, line);
+            break;
+        }
+
+    return p_done;
+}
+
+/* Handles the lines of one read, taking the command lock once */
+static void processLines(ATChannel* p_channel, const char** p_lines, int n)
+{
+    ATCommand* p_done = NULL;
+    ATCommand** pp_doneTail = &p_done;
+    const char* p_first;
+    int lineClass;
+    int i;
+
+    pthread_mutex_lock(&p_channel->commandmutex);
+
+    for (i = 0; i < n; i++) {
+        lineClass = p_channel->smsUnsolicited == NULL
+            ? classifyLine(p_lines[i])
+            : LINE_SMS_UNSOLICITED;
+
+        if (lineClass != LINE_SMS_UNSOLICITED) {
+            *pp_doneTail = processLine(p_channel, p_lines[i], lineClass);
+            while (*pp_doneTail != NULL) {
+                pp_doneTail = &(*pp_doneTail)->p_next;
+            }
+            continue;
+        }
+
+        if (p_channel->smsUnsolicited != NULL) {
+            /* the PDU of a response whose first line came in an earlier read */
+            p_first = p_channel->smsUnsolicited;
+        } else if (i + 1 < n) {
+            p_first = p_lines[i++];
+        } else {
+            // The lines are valid only till the next read, hence
+            // making a copy before reading the PDU.
+            p_channel->smsUnsolicited = strdup(p_lines[i]);
+            if (p_channel->smsUnsolicited == NULL) {
+                RLOGE("Failed to allocate memory for unsolicited %s", p_lines[i]);
+            }
+            continue;
+        }
+
+        if (p_channel->unsolHandler != NULL) {
+            enqueueUnsolicited(p_channel->unsolHandler, p_first, p_lines[i]);
+        }
+
+        free(p_channel->smsUnsolicited);
+        p_channel->smsUnsolicited = NULL;
+    }
+
+    pthread_mutex_unlock(&p_channel->commandmutex);
+
+    completeCommands(p_done);
+}
+
+/**
+ * Puts RESYNC_COMMAND in front of the queue, to be written before any
+ * other command after one timed out. The modem may still answer the one
+ * that timed out, so every line is dropped until the reply the modem
+ * gave to RESYNC_COMMAND in the last handshake: the final response after
+ * it is the first one that belongs to a command written from now on.
+ * Nothing is queued if that handshake did not read the reply.
+ * assumes p_channel->commandmutex is held
+ */
+static void queueResync(ATChannel* p_channel)
+{
+    ATCommand* p_cmd;
+
+    p_cmd = (ATCommand*)calloc(1, sizeof(ATCommand));
+    if (p_cmd == NULL) {
+        return;
+    }
+
+    if (p_channel->resyncReply[0] != '\0') {
+        p_cmd->resyncReply = strdup(p_channel->resyncReply);
+    }
+
+    p_cmd->command = strdup(RESYNC_COMMAND);
+    if (p_cmd->resyncReply == NULL || p_cmd->command == NULL) {
+        freeCommand(p_cmd);
+        return;
+    }
+
+    p_cmd->type = NO_RESULT;
+    p_cmd->exclusive = true;
+    p_cmd->timeoutMsec = RESYNC_TIMEOUT_MSEC;
+
+    p_cmd->p_next = p_channel->commandQueue;
+    p_channel->commandQueue = p_cmd;
+    if (p_channel->commandQueueTail == NULL) {
+        p_channel->commandQueueTail = p_cmd;
+    }
+}
+
+/* Completes the current command if its deadline has passed */
+static void handleCommandTimeout(ATChannel* p_channel)
+{
+    ATCommand* p_done = NULL;
+
+    pthread_mutex_lock(&p_channel->commandmutex);
+
+    if (p_channel->currentCommand != NULL && p_channel->currentCommand->timeoutMsec != 0
+        && msecUntil(&p_channel->currentCommand->deadline) == 0) {
+        RLOGE("AT command timeout: %s", p_channel->currentCommand->command);
+        recordLatency(p_channel->currentCommand->p_verb,
+            p_channel->currentCommand->timeoutMsec);
+
+        /* a resync that times out is not tried again, the handshake
+         * behind it tells whether the modem still answers at all, and
+         * retries of the handshake are their own resync */
+        if (p_channel->currentCommand->resyncReply == NULL
+            && strcmp(p_channel->currentCommand->command, HANDSHAKE_COMMAND) != 0) {
+            queueResync(p_channel);
+        }
+
+        /* a late reply could not be told from the replies to the
+         * pipelined commands, so they time out as well */
+        p_done = failWrittenCommands(p_channel, AT_ERROR_TIMEOUT);
+        if (p_done != NULL) {
+            ATCommand* p_tail = p_done;
+
+            while (p_tail->p_next != NULL) {
+                p_tail = p_tail->p_next;
+            }
+            p_tail->p_next = issueNextCommand(p_channel);
+        }
+    }
+
+    pthread_mutex_unlock(&p_channel->commandmutex);
+
+    completeCommands(p_done);
+}
+
+static void wakeReader(ATChannel* p_channel)
+{
+    ssize_t ret;
+
+    do {
+        ret = write(p_channel->readerWakeFds[1], " ", 1);
+    } while (ret < 0 && errno == EINTR);
+}
+
+/**
+ * Waits until the AT channel is readable, completing the current command
+ * if its deadline passes meanwhile, then reads from it. Returns like read()
+ */
+static ssize_t readChannel(ATChannel* p_channel, char* p_read, size_t len)
+{
+    struct pollfd fds[2];
+    char buff[16];
+    ssize_t count;
+    int timeout;
+    int ret;
+
+    for (;;) {
+        if (p_channel->fd < 0) {
+            errno = EBADF;
+            return -1;
+        }
+
+        fds[0].fd = p_channel->fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = p_channel->readerWakeFds[0];
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        timeout = -1;
+        pthread_mutex_lock(&p_channel->commandmutex);
+        if (p_channel->currentCommand != NULL && p_channel->currentCommand->timeoutMsec != 0) {
+            timeout = (int)msecUntil(&p_channel->currentCommand->deadline);
+        }
+        pthread_mutex_unlock(&p_channel->commandmutex);
+
+        ret = poll(fds, 2, timeout);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        if (ret == 0) {
+            handleCommandTimeout(p_channel);
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            while (read(p_channel->readerWakeFds[0], buff, sizeof(buff)) > 0)
+                ;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) {
+            break;
+        }
+    }
+
+    do {
+        count = read(p_channel->fd, p_read, len);
+    } while (count < 0 && errno == EINTR);
+
+    return count;
+}
+
+/**
+ * Returns a pointer to the first \r or \n in [p, p + len), NULL if none
+ * Modems end lines with \r so that one is looked for first
+ */
+static char* findEOL(char* p, size_t len)
+{
+    char* cr = (char*)memchr(p, '\r', len);
+    char* lf = (char*)memchr(p, '\n', cr != NULL ? (size_t)(cr - p) : len);
+
+    return lf != NULL ? lf : cr;
+}
+
+/**
+ * Reads from the AT channel until at least one complete line is buffered
+ * and returns up to "max" lines in "p_lines". Assumes it has exclusive read
+ * access to the FD. Returns 0 on EOF or error.
+ *
+ * Lines are terminated in place and stay valid until the next call. The
+ * buffer is only compacted when a partial line reaches its end, so all the
+ * lines of one read() are handed over without copying.
+ */
+static int readLines(ATChannel* p_channel, const char** p_lines, int max)
+{
+    char* buf = p_channel->ATBuffer;
+    ssize_t count;
+    int n = 0;
+
+    for (;;) {
+        while (n < max) {
+            char* p_line = buf + p_channel->ATHead;
+            char* p_end = buf + p_channel->ATTail;
+            char* p_eol;
+            char* p_scan;
+
+            // skip over leading newlines
+            while (p_line < p_end && (*p_line == '\r' || *p_line == '\n')) {
+                p_line++;
+            }
+
+            p_channel->ATHead = p_line - buf;
+
+            if (p_line == p_end) {
+                break;
+            }
+
+            if (p_end - p_line == 2 && p_line[0] == '>' && p_line[1] == ' ') {
+                /* SMS prompt character...not \r terminated */
+                p_eol = p_end;
+            } else {
+                /* the start of a partial line was scanned already */
+                p_scan = buf + p_channel->ATScanned;
+                if (p_scan < p_line) {
+                    p_scan = p_line;
+                }
+
+                p_eol = findEOL(p_scan, p_end - p_scan);
+                if (p_eol == NULL) {
+                    p_channel->ATScanned = p_channel->ATTail;
+                    break;
+                }
+            }
+
+            /* a full line in the buffer. Place a \0 over the \r */
+            *p_eol = '\0';
+            p_channel->ATHead = (p_eol < p_end ? p_eol + 1 : p_end) - buf;
+
+            RLOGD("AT< %s\n", p_line);
+            p_lines[n++] = p_line;
+        }
+
+        if (n > 0) {
+            return n;
+        }
+
+        if (p_channel->ATHead == p_channel->ATTail) {
+            p_channel->ATHead = 0;
+            p_channel->ATTail = 0;
+            p_channel->ATScanned = 0;
+        } else if (p_channel->ATTail == MAX_AT_RESPONSE) {
+            if (p_channel->ATHead == 0) {
+                RLOGE("ERROR: Input line exceeded buffer\n");
+                /* ditch buffer and start over again */
+                p_channel->ATTail = 0;
+                p_channel->ATScanned = 0;
+            } else {
+                /* move the partial line up to make room */
+                memmove(buf, buf + p_channel->ATHead,
+                    p_channel->ATTail - p_channel->ATHead);
+                p_channel->ATTail -= p_channel->ATHead;
+                p_channel->ATScanned -= p_channel->ATHead;
+                p_channel->ATHead = 0;
+            }
+        }
+
+        count = readChannel(p_channel, buf + p_channel->ATTail,
+            MAX_AT_RESPONSE - p_channel->ATTail);
+
+        if (count <= 0) {
+            /* read error encountered or EOF reached */
+            if (count == 0) {
+                RLOGD("atchannel: EOF reached");
+            } else {
+                RLOGD("atchannel: read error %s", strerror(errno));
+            }
+            return 0;
+        }
+
+        AT_DUMP("<< ", buf + p_channel->ATTail, count);
+
+        p_channel->ATTail += count;
+    }
+}
+
+/**
+ * Marks the channel closed and fails every queued or pending command.
+ * Returns the previous closed state
+ */
+static int abortCommands(ATChannel* p_channel)
+{
+    ATCommand* p_done = NULL;
+    int wasClosed;
+
+    pthread_mutex_lock(&p_channel->commandmutex);
+
+    wasClosed = p_channel->readerClosed;
+    p_channel->readerClosed = 1;
+
+    /* nothing more can be written, the queue fails with them */
+    p_done = failWrittenCommands(p_channel, AT_ERROR_CHANNEL_CLOSED);
+
+    for (ATCommand* p_cmd = p_channel->commandQueue; p_cmd != NULL; p_cmd = p_cmd->p_next) {
+        p_cmd->err = AT_ERROR_CHANNEL_CLOSED;
+    }
+
+    if (p_done == NULL) {
+        p_done = p_channel->commandQueue;
+    } else {
+        ATCommand* p_tail = p_done;
+
+        while (p_tail->p_next != NULL) {
+            p_tail = p_tail->p_next;
+        }
+        p_tail->p_next = p_channel->commandQueue;
+    }
+
+    p_channel->commandQueue = NULL;
+    p_channel->commandQueueTail = NULL;
+
+    pthread_mutex_unlock(&p_channel->commandmutex);
+
+    completeCommands(p_done);
+
+    return wasClosed;
+}
+
+static void onReaderClosed(ATChannel* p_channel)
+{
+    if (abortCommands(p_channel) != 0) {
+        return;
+    }
+
+    if (p_channel->onReaderClosed != NULL) {
+        p_channel->onReaderClosed(p_channel);
+    } else if (s_onReaderClosed != NULL) {
+        s_onReaderClosed();
+    }
+}
+
+static void* readerLoop(void* arg)
+{
+    ATChannel* p_channel = (ATChannel*)arg;
+    const char* lines[MAX_LINE_BATCH];
+    int n;
+
+    while ((n = readLines(p_channel, lines, MAX_LINE_BATCH)) > 0) {
+        processLines(p_channel, lines, n);
+    }
+
+    free(p_channel->smsUnsolicited);
+    p_channel->smsUnsolicited = NULL;
+
+    onReaderClosed(p_channel);
+
+    return NULL;
+}
+
+/**
+ * Sends string s to the radio with a \r appended.
+ * Returns AT_ERROR_* on error, 0 on success
+ *
+ * This function exists because as of writing, android libc does not
+ * have buffered stdio.
+ */
+static int writeline(ATChannel* p_channel, const char* s)
+{
+    size_t cur = 0;
+    size_t len = strlen(s);
+    ssize_t written;
+
+    if (p_channel->fd < 0 || p_channel->readerClosed > 0) {
+        return AT_ERROR_CHANNEL_CLOSED;
+    }
+
+    RLOGD("AT> %s\n", s);
+
+    AT_DUMP(">> ", s, strlen(s));
+
+    /* the main string */
+    while (cur < len) {
+        do {
+            written = write(p_channel->fd, s + cur, len - cur);
+        } while (written < 0 && errno == EINTR);
+
+        if (written < 0) {
+            return AT_ERROR_GENERIC;
+        }
+
+        cur += written;
+    }
+
+    /* the \r  */
+
+    do {
+        written = write(p_channel->fd, "\r", 1);
+    } while ((written < 0 && errno == EINTR) || (written == 0));
+
+    if (written < 0) {
+        return AT_ERROR_GENERIC;
+    }
+
+    return 0;
+}
+
+static int writeCtrlZ(ATChannel* p_channel, const char* s)
+{
+    size_t cur = 0;
+    size_t len = strlen(s);
+    ssize_t written;
+
+    if (p_channel->fd < 0 || p_channel->readerClosed > 0) {
+        return AT_ERROR_CHANNEL_CLOSED;
+    }
+
+    RLOGD("AT> %s^Z\n", s);
+
+    /* the main string */
+    while (cur < len) {
+        do {
+            written = write(p_channel->fd, s + cur, len - cur);
+        } while (written < 0 && errno == EINTR);
+
+        if (written < 0) {
+            return AT_ERROR_GENERIC;
+        }
+
+        cur += written;
+    }
+
+    /* the ^Z  */
+
+    do {
+        written = write(p_channel->fd, "\032", 1);
+    } while ((written < 0 && errno == EINTR) || (written == 0));
+
+    if (written < 0) {
+        return AT_ERROR_GENERIC;
+    }
+
+    return 0;
+}
+
+static void initChannel(ATChannel* p_channel)
+{
+    p_channel->fd = -1;
+    p_channel->compound = true;
+    p_channel->pipelineDepth = AT_PIPELINE_DEPTH;
+    p_channel->readerWakeFds[0] = -1;
+    p_channel->readerWakeFds[1] = -1;
+    pthread_mutex_init(&p_channel->commandmutex, NULL);
+    pthread_cond_init(&p_channel->commandcond, NULL);
+}
+
+static void initChannels(void)
+{
+    initChannel(&s_defaultChannel);
+    initPrefixes();
+
+    sem_init(&s_urcSem, 0, 0);
+    pthread_key_create(&s_threadChannelKey, NULL);
+}
+
+static ATChannel* defaultChannel(void)
+{
+    pthread_once(&s_channelsOnce, initChannels);
+
+    return &s_defaultChannel;
+}
+
+/* the channel that the at_send_command* family uses on this thread */
+static ATChannel* threadChannel(void)
+{
+    ATChannel* p_channel;
+
+    pthread_once(&s_channelsOnce, initChannels);
+
+    p_channel = (ATChannel*)pthread_getspecific(s_threadChannelKey);
+
+    return p_channel != NULL ? p_channel : &s_defaultChannel;
+}
+
+/**
+ * Starts the URC thread along with the first open channel
+ * assumes s_channelsMutex is held
+ */
+static int startUrcThread(void)
+{
+    int ret;
+
+    if (s_openChannels++ > 0) {
+        return 0;
+    }
+
+    if (s_urcJoinable) {
+        /* wait for the previous URC thread to drain and exit */
+        pthread_join(s_tid_urc, NULL);
+        s_urcJoinable = false;
+    }
+
+    ret = pthread_create(&s_tid_urc, NULL, urcLoop, NULL);
+    if (ret != 0) {
+        RLOGE("pthread_create urc: %s", strerror(ret));
+        s_openChannels--;
+        return -1;
+    }
+
+    s_urcJoinable = true;
+
+    return 0;
+}
+
+/**
+ * Lets the URC thread exit once the last open channel is closed
+ * and what is queued has been delivered
+ * assumes s_channelsMutex is held
+ */
+static void stopUrcThread(void)
+{
+    ATUrcStats stats;
+
+    if (--s_openChannels > 0) {
+        return;
+    }
+
+    enqueueUnsolicited(NULL, NULL, NULL);
+
+    at_get_urc_stats(&stats);
+    RLOGI("URC stats: count %llu, reader stall total %llu ns max %llu ns, "
+          "delivery latency max %llu ns, queue depth max %u",
+        stats.urcCount, stats.readerStallNsTotal, stats.readerStallNsMax,
+        stats.deliveryLatencyNsMax, stats.queueDepthMax);
+}
+
+ATChannel* at_channel_create(void)
+{
+    ATChannel* p_channel;
+
+    pthread_once(&s_channelsOnce, initChannels);
+
+    p_channel = (ATChannel*)calloc(1, sizeof(ATChannel));
+    if (p_channel == NULL) {
+        RLOGE("Failed to allocate memory for AT channel");
+        return NULL;
+    }
+
+    initChannel(p_channel);
+
+    return p_channel;
+}
+
+/**
+ * Starts AT handler on stream "fd" for "p_channel"
+ * returns 0 on success, -1 on error
+ */
+int at_channel_open(ATChannel* p_channel, int fd, ATUnsolHandler h)
+{
+    int ret;
+
+    if (p_channel->readerJoinable) {
+        /* the reader of the previous session exits once it sees the close */
+        pthread_join(p_channel->tid_reader, NULL);
+        p_channel->readerJoinable = false;
+    }
+
+    if (p_channel->readerWakeFds[0] < 0) {
+        if (pipe(p_channel->readerWakeFds) < 0) {
+            RLOGE("Error in pipe() errno: %d", errno);
+            return -1;
+        }
+        fcntl(p_channel->readerWakeFds[0], F_SETFL, O_NONBLOCK);
+    }
+
+    pthread_mutex_lock(&s_channelsMutex);
+
+    if (p_channel->fd >= 0) {
+        pthread_mutex_unlock(&s_channelsMutex);
+        RLOGE("AT channel is already open");
+        return -1;
+    }
+
+    if (startUrcThread() < 0) {
+        pthread_mutex_unlock(&s_channelsMutex);
+        return -1;
+    }
+
+    p_channel->unsolHandler = h;
+    p_channel->readerClosed = 0;
+    p_channel->ATHead = 0;
+    p_channel->ATTail = 0;
+    p_channel->ATScanned = 0;
+
+    p_channel->currentCommand = NULL;
+    p_channel->pipelined = NULL;
+    p_channel->pipelinedTail = NULL;
+    p_channel->numPipelined = 0;
+    p_channel->commandQueue = NULL;
+    p_channel->commandQueueTail = NULL;
+
+    p_channel->fd = fd;
+
+    pthread_mutex_unlock(&s_channelsMutex);
+
+    ret = pthread_create(&p_channel->tid_reader, NULL, readerLoop, p_channel);
+    if (ret != 0) {
+        RLOGE("pthread_create reader: %s", strerror(ret));
+
+        pthread_mutex_lock(&s_channelsMutex);
+        p_channel->fd = -1;
+        stopUrcThread();
+        pthread_mutex_unlock(&s_channelsMutex);
+        return -1;
+    }
+
+    p_channel->readerJoinable = true;
+
+    return 0;
+}
+
+/* FIXME is it ok to call this from the reader and the command thread? */
+void at_channel_close(ATChannel* p_channel)
+{
+    int fd;
+
+    if (p_channel == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&s_channelsMutex);
+    fd = p_channel->fd;
+    p_channel->fd = -1;
+    pthread_mutex_unlock(&s_channelsMutex);
+
+    if (fd < 0) {
+        /* already closed */
+        return;
+    }
+
+    close(fd);
+
+    abortCommands(p_channel);
+
+    /* let a reader blocked in poll() notice */
+    wakeReader(p_channel);
+
+    /* the reader thread should eventually die */
+
+    pthread_mutex_lock(&s_channelsMutex);
+    stopUrcThread();
+    pthread_mutex_unlock(&s_channelsMutex);
+}
+
+/**
+ * Closes "p_channel" and releases it once its reader has exited
+ * May not be called from the reader or URC thread
+ */
+void at_channel_destroy(ATChannel* p_channel)
+{
+    if (p_channel == NULL || p_channel == &s_defaultChannel) {
+        return;
+    }
+
+    if (p_channel->readerJoinable
+        && 0 != pthread_equal(p_channel->tid_reader, pthread_self())) {
+        RLOGE("AT channel destroyed on its own reader thread");
+        return;
+    }
+
+    at_channel_close(p_channel);
+
+    if (p_channel->readerJoinable) {
+        pthread_join(p_channel->tid_reader, NULL);
+    }
+
+    if (p_channel->readerWakeFds[0] >= 0) {
+        close(p_channel->readerWakeFds[0]);
+        close(p_channel->readerWakeFds[1]);
+    }
+
+    pthread_cond_destroy(&p_channel->commandcond);
+    pthread_mutex_destroy(&p_channel->commandmutex);
+    free(p_channel->lineArena);
+    free(p_channel->lineOffsets);
+    free(p_channel);
+}
+
+void at_channel_set_context(ATChannel* p_channel, void* context)
+{
+    p_channel->context = context;
+}
+
+void* at_channel_get_context(const ATChannel* p_channel)
+{
+    return p_channel->context;
+}
+
+/* This callback is invoked on the command thread */
+void at_channel_set_on_timeout(ATChannel* p_channel,
+    void (*onTimeout)(ATChannel* p_channel))
+{
+    p_channel->onTimeout = onTimeout;
+}
+
+/* This callback is invoked on the reader thread of "p_channel" */
+void at_channel_set_on_reader_closed(ATChannel* p_channel,
+    void (*onClose)(ATChannel* p_channel))
+{
+    p_channel->onReaderClosed = onClose;
+}
+
+void at_channel_set_pipeline_depth(ATChannel* p_channel, int depth)
+{
+    ATCommand* p_failed;
+
+    pthread_mutex_lock(&p_channel->commandmutex);
+    p_channel->pipelineDepth = depth < 1 ? 1 : depth;
+    p_failed = issueNextCommand(p_channel);
+    pthread_mutex_unlock(&p_channel->commandmutex);
+
+    completeCommands(p_failed);
+}
+
+/**
+ * Starts AT handler on stream "fd'
+ * returns 0 on success, -1 on error
+ */
+int at_open(int fd, ATUnsolHandler h)
+{
+    return at_channel_open(defaultChannel(), fd, h);
+}
+
+void at_close()
+{
+    at_channel_close(defaultChannel());
+}
+
+int at_register_unsol_handlers(const ATUnsolPrefix* p_prefixes, int count)
+{
+    PrefixNode* p_node;
+    int ret = 0;
+    int i;
+
+    pthread_once(&s_channelsOnce, initChannels);
+
+    pthread_mutex_lock(&s_channelsMutex);
+
+    for (i = 0; i < count; i++) {
+        p_node = insertPrefix(p_prefixes[i].prefix);
+        if (p_node == NULL) {
+            RLOGE("Unable to register unsolicited prefix %s", p_prefixes[i].prefix);
+            ret = -1;
+            break;
+        }
+
+        p_node->unsolHandler = p_prefixes[i].handler;
     }
 
-    s_type = type;
-    s_responsePrefix = responsePrefix;
-    s_smsPDU = smspdu;
-    sp_response = at_response_new();
+    pthread_mutex_unlock(&s_channelsMutex);
+
+    return ret;
+}
+
+ATUnsolHandler at_find_unsol_handler(const char* line)
+{
+    ATUnsolHandler handler;
+
+    matchPrefixes(line, NULL, &handler);
+
+    return handler;
+}
+
+ATChannel* at_default_channel(void)
+{
+    return defaultChannel();
+}
+
+void at_set_thread_channel(ATChannel* p_channel)
+{
+    pthread_once(&s_channelsOnce, initChannels);
+    pthread_setspecific(s_threadChannelKey, p_channel);
+}
+
+ATChannel* at_get_thread_channel(void)
+{
+    return threadChannel();
+}
+
+void at_get_urc_stats(ATUrcStats* p_stats)
+{
+    p_stats->urcCount = atomic_load(&s_urcCount);
+    p_stats->readerStallNsTotal = atomic_load(&s_readerStallNsTotal);
+    p_stats->readerStallNsMax = atomic_load(&s_readerStallNsMax);
+    p_stats->deliveryLatencyNsMax = atomic_load(&s_deliveryLatencyNsMax);
+    p_stats->queueDepthMax = atomic_load(&s_urcDepthMax);
+}
+
+void at_get_cache_stats(ATCacheStats* p_stats)
+{
+    pthread_mutex_lock(&s_cacheMutex);
+    *p_stats = s_cacheStats;
+    p_stats->entries = (unsigned int)s_numCacheEntries;
+    pthread_mutex_unlock(&s_cacheMutex);
+}
+
+void at_cache_invalidate(int events)
+{
+    int i;
+
+    pthread_mutex_lock(&s_cacheMutex);
 
-    if (timeoutMsec != 0) {
-        setTimespecRelative(&ts, timeoutMsec);
+    for (i = s_numCacheEntries - 1; i >= 0; i--) {
+        if (s_cache[i].p_policy->events & events) {
+            dropCacheEntryLocked(i);
+        }
     }
 
-    while (sp_response->finalResponse == NULL && s_readerClosed == 0) {
-        if (timeoutMsec != 0) {
-            err = pthread_cond_timedwait(&s_commandcond, &s_commandmutex, &ts);
+    pthread_mutex_unlock(&s_cacheMutex);
+}
+
+void at_response_free(ATResponse* p_response)
+{
+    /* the lines and the final response share the allocation */
+    free(p_response);
+}
+
+static void freeCommand(ATCommand* p_cmd)
+{
+    free(p_cmd->command);
+    free(p_cmd->responsePrefix);
+    free(p_cmd->smsPDU);
+    free(p_cmd->resyncReply);
+    at_response_free(p_cmd->p_response);
+    free(p_cmd);
+}
+
+/* Invokes the callbacks of finished commands. Called without the lock held */
+static void completeCommands(ATCommand* p_list)
+{
+    while (p_list != NULL) {
+        ATCommand* p_cmd = p_list;
+        ATResponse* p_response = p_cmd->p_response;
+
+        p_list = p_list->p_next;
+        p_cmd->p_response = NULL;
+
+        /* again, a query on another channel may have raced the set */
+        if (p_cmd->setter) {
+            invalidateSetters(p_cmd->command);
+        }
+
+        if (p_cmd->callback != NULL) {
+            p_cmd->callback(p_cmd->err, p_response, p_cmd->ctx);
         } else {
-            err = pthread_cond_wait(&s_commandcond, &s_commandmutex);
+            at_response_free(p_response);
         }
 
-        if (err == ETIMEDOUT) {
-            err = AT_ERROR_TIMEOUT;
-            goto error;
+        freeCommand(p_cmd);
+    }
+}
+
+/**
+ * Internal async send_command implementation
+ *
+ * timeoutMsec == 0 means infinite timeout, AT_TIMEOUT_DEFAULT picks the
+ * timeout of the command's verb
+ */
+static int at_send_command_async_full(ATChannel* p_channel,
+    const char* command, ATCommandType type, const char* responsePrefix, const char* smspdu, long long timeoutMsec,
+    ATCommandCallback callback, void* ctx)
+{
+    ATCommand* p_cmd;
+    ATCommand* p_failed;
+    char verb[sizeof(((VerbTimeout*)0)->verb)];
+    size_t i;
+    bool wake;
+
+    p_cmd = (ATCommand*)calloc(1, sizeof(ATCommand));
+    if (p_cmd == NULL) {
+        return AT_ERROR_GENERIC;
+    }
+
+    p_cmd->command = strdup(command);
+    p_cmd->responsePrefix = responsePrefix ? strdup(responsePrefix) : NULL;
+    p_cmd->smsPDU = smspdu ? strdup(smspdu) : NULL;
+    if (p_cmd->command == NULL
+        || (responsePrefix && !p_cmd->responsePrefix) || (smspdu && !p_cmd->smsPDU)) {
+        RLOGE("Failed to allocate memory for %s", command);
+        freeCommand(p_cmd);
+        return AT_ERROR_GENERIC;
+    }
+
+    commandVerb(command, verb, sizeof(verb));
+
+    /* queries like AT+CGSN=2 expect a reply, settings do not */
+    p_cmd->setter = type == NO_RESULT && invalidateSetters(command);
+
+    p_cmd->exclusive = smspdu != NULL;
+    for (i = 0; i < NUM_ELEMS(s_exclusiveVerbs); i++) {
+        if (strcmp(verb, s_exclusiveVerbs[i]) == 0) {
+            p_cmd->exclusive = true;
+            break;
         }
     }
 
-    if (pp_outResponse == NULL) {
-        at_response_free(sp_response);
+    pthread_mutex_lock(&s_timeoutMutex);
+    p_cmd->p_verb = findVerbTimeout(verb);
+    if (timeoutMsec == AT_TIMEOUT_DEFAULT) {
+        timeoutMsec = verbTimeoutMsec(p_cmd->p_verb);
+    }
+    pthread_mutex_unlock(&s_timeoutMutex);
+
+    p_cmd->type = type;
+    p_cmd->timeoutMsec = timeoutMsec;
+    p_cmd->callback = callback;
+    p_cmd->ctx = ctx;
+
+    pthread_mutex_lock(&p_channel->commandmutex);
+
+    if (p_channel->fd < 0 || p_channel->readerClosed > 0) {
+        pthread_mutex_unlock(&p_channel->commandmutex);
+        freeCommand(p_cmd);
+        return AT_ERROR_CHANNEL_CLOSED;
+    }
+
+    if (p_channel->commandQueueTail != NULL) {
+        p_channel->commandQueueTail->p_next = p_cmd;
     } else {
-        /* line reader stores intermediate responses in reverse order */
-        reverseIntermediates(sp_response);
-        *pp_outResponse = sp_response;
+        p_channel->commandQueue = p_cmd;
     }
+    p_channel->commandQueueTail = p_cmd;
 
-    sp_response = NULL;
+    p_failed = issueNextCommand(p_channel);
 
-    if (s_readerClosed > 0) {
-        err = AT_ERROR_CHANNEL_CLOSED;
-        goto error;
+    /* the reader has to start watching the deadline */
+    wake = p_channel->currentCommand == p_cmd && timeoutMsec != 0;
+
+    pthread_mutex_unlock(&p_channel->commandmutex);
+
+    if (wake) {
+        wakeReader(p_channel);
     }
 
-    err = 0;
-error:
-    clearPendingCommand();
+    completeCommands(p_failed);
 
-    return err;
+    return AT_ERROR_OK;
+}
+
+static void onSyncCommandComplete(int err, ATResponse* p_response, void* ctx)
+{
+    ATSyncResult* p_result = (ATSyncResult*)ctx;
+    ATChannel* p_channel = p_result->p_channel;
+
+    pthread_mutex_lock(&p_channel->commandmutex);
+
+    p_result->err = err;
+    p_result->p_response = p_response;
+    p_result->done = 1;
+
+    pthread_cond_broadcast(&p_channel->commandcond);
+
+    pthread_mutex_unlock(&p_channel->commandmutex);
+}
+
+/* commands may not be waited for on the threads that complete them */
+static int isChannelThread(ATChannel* p_channel)
+{
+    return 0 != pthread_equal(p_channel->tid_reader, pthread_self())
+        || 0 != pthread_equal(s_tid_urc, pthread_self());
 }
 
 /**
- * Internal send_command implementation
+ * Internal blocking send_command implementation
+ * Doesn't call the timeout callback
  *
  * timeoutMsec == 0 means infinite timeout
  */
-static int at_send_command_full(const char* command, ATCommandType type,
+static int at_send_command_wait(ATChannel* p_channel,
+    const char* command, ATCommandType type,
     const char* responsePrefix, const char* smspdu,
     long long timeoutMsec, ATResponse** pp_outResponse)
 {
+    ATSyncResult result = { p_channel, 0, 0, NULL };
     int err;
 
-    if (0 != pthread_equal(s_tid_reader, pthread_self())) {
-        /* cannot be called from reader thread */
+    if (isChannelThread(p_channel)) {
+        /* cannot be called from reader thread or unsolicited handler */
         return AT_ERROR_INVALID_THREAD;
     }
 
-    pthread_mutex_lock(&s_writeMutex);
-    pthread_mutex_lock(&s_commandmutex);
-
-    err = at_send_command_full_nolock(command, type,
-        responsePrefix, smspdu,
-        timeoutMsec, pp_outResponse);
+    err = at_send_command_async_full(p_channel, command, type, responsePrefix,
+        smspdu, timeoutMsec, onSyncCommandComplete, &result);
+    if (err < 0) {
+        return err;
+    }
 
-    pthread_mutex_unlock(&s_commandmutex);
-    pthread_mutex_unlock(&s_writeMutex);
+    pthread_mutex_lock(&p_channel->commandmutex);
+    while (!result.done) {
+        pthread_cond_wait(&p_channel->commandcond, &p_channel->commandmutex);
+    }
+    pthread_mutex_unlock(&p_channel->commandmutex);
 
-    if (err == AT_ERROR_TIMEOUT && s_onTimeout != NULL) {
-        s_onTimeout();
+    if (pp_outResponse == NULL) {
+        at_response_free(result.p_response);
+    } else {
+        *pp_outResponse = result.p_response;
     }
 
-    return err;
+    return result.err;
 }
 
 /**
- * Issue a single normal AT command with no intermediate response expected
- *
- * "command" should not include \r
- * pp_outResponse can be NULL
+ * Internal send_command implementation
  *
- * if non-NULL, the resulting ATResponse * must be eventually freed with
- * at_response_free
+ * timeoutMsec == 0 means infinite timeout
+ * On a timeout the channel is handshaken, and the timeout callback only
+ * called if that fails too
  */
-int at_send_command(const char* command, ATResponse** pp_outResponse)
+static int at_send_command_full(ATChannel* p_channel,
+    const char* command, ATCommandType type, const char* responsePrefix,
+    const char* smspdu, long long timeoutMsec, ATResponse** pp_outResponse)
 {
     int err;
 
-    err = at_send_command_full(command, NO_RESULT, NULL,
-        NULL, 0, pp_outResponse);
+    err = at_send_command_wait(p_channel, command, type, responsePrefix,
+        smspdu, timeoutMsec, pp_outResponse);
+
+    /* the modem may just have dropped this one command, only give up on
+     * the channel if it does not answer anymore */
+    if (err == AT_ERROR_TIMEOUT && at_channel_handshake(p_channel) != 0) {
+        if (p_channel->onTimeout != NULL) {
+            p_channel->onTimeout(p_channel);
+        } else if (s_onTimeout != NULL) {
+            s_onTimeout();
+        }
+    }
 
     return err;
 }
 
-int at_send_command_singleline(const char* command,
-    const char* responsePrefix,
-    ATResponse** pp_outResponse)
+/* a successful command of these types must have an intermediate response */
+static int checkIntermediate(int err, ATResponse** pp_outResponse)
 {
-    int err;
-
-    err = at_send_command_full(command, SINGLELINE, responsePrefix,
-        NULL, 0, pp_outResponse);
-
     if (err == 0 && pp_outResponse != NULL
         && (*pp_outResponse)->success > 0
         && (*pp_outResponse)->p_intermediates == NULL) {
-        /* successful command must have an intermediate response */
         at_response_free(*pp_outResponse);
         *pp_outResponse = NULL;
         return AT_ERROR_INVALID_RESPONSE;
@@ -780,100 +2403,178 @@ int at_send_command_singleline(const char* command,
     return err;
 }
 
-int at_send_command_numeric(const char* command,
+int at_channel_send_command_async(ATChannel* p_channel, const char* command,
+    ATCommandType type, const char* responsePrefix, long long timeoutMsec,
+    ATCommandCallback callback, void* ctx)
+{
+    return at_send_command_async_full(p_channel, command, type,
+        responsePrefix, NULL, timeoutMsec, callback, ctx);
+}
+
+/**
+ * Issue a single normal AT command with no intermediate response expected
+ *
+ * "command" should not include \r
+ * pp_outResponse can be NULL
+ *
+ * if non-NULL, the resulting ATResponse * must be eventually freed with
+ * at_response_free
+ */
+int at_channel_send_command(ATChannel* p_channel, const char* command,
     ATResponse** pp_outResponse)
 {
-    int err;
+    return at_send_command_full(p_channel, command, NO_RESULT, NULL,
+        NULL, AT_TIMEOUT_DEFAULT, pp_outResponse);
+}
 
-    err = at_send_command_full(command, NUMERIC, NULL,
-        NULL, 0, pp_outResponse);
+int at_channel_send_command_singleline(ATChannel* p_channel,
+    const char* command, const char* responsePrefix,
+    ATResponse** pp_outResponse)
+{
+    int err;
 
-    if (err == 0 && pp_outResponse != NULL
-        && (*pp_outResponse)->success > 0
-        && (*pp_outResponse)->p_intermediates == NULL) {
-        /* successful command must have an intermediate response */
-        at_response_free(*pp_outResponse);
-        *pp_outResponse = NULL;
-        return AT_ERROR_INVALID_RESPONSE;
-    }
+    err = at_send_command_full(p_channel, command, SINGLELINE, responsePrefix,
+        NULL, AT_TIMEOUT_DEFAULT, pp_outResponse);
 
-    return err;
+    return checkIntermediate(err, pp_outResponse);
 }
 
-int at_send_command_sms(const char* command,
-    const char* pdu,
-    const char* responsePrefix,
+int at_channel_send_command_numeric(ATChannel* p_channel, const char* command,
     ATResponse** pp_outResponse)
 {
     int err;
 
-    err = at_send_command_full(command, SINGLELINE, responsePrefix,
-        pdu, 0, pp_outResponse);
-
-    if (err == 0 && pp_outResponse != NULL
-        && (*pp_outResponse)->success > 0
-        && (*pp_outResponse)->p_intermediates == NULL) {
-        /* successful command must have an intermediate response */
-        at_response_free(*pp_outResponse);
-        *pp_outResponse = NULL;
-        return AT_ERROR_INVALID_RESPONSE;
-    }
+    err = at_send_command_full(p_channel, command, NUMERIC, NULL,
+        NULL, AT_TIMEOUT_DEFAULT, pp_outResponse);
 
-    return err;
+    return checkIntermediate(err, pp_outResponse);
 }
 
-int at_send_command_multiline(const char* command,
-    const char* responsePrefix,
+int at_channel_send_command_sms(ATChannel* p_channel, const char* command,
+    const char* pdu, const char* responsePrefix,
     ATResponse** pp_outResponse)
 {
     int err;
 
-    err = at_send_command_full(command, MULTILINE, responsePrefix,
-        NULL, 0, pp_outResponse);
+    err = at_send_command_full(p_channel, command, SINGLELINE, responsePrefix,
+        pdu, AT_TIMEOUT_DEFAULT, pp_outResponse);
 
-    return err;
+    return checkIntermediate(err, pp_outResponse);
 }
 
-/* This callback is invoked on the command thread */
-void at_set_on_timeout(void (*onTimeout)(void))
+int at_channel_send_command_multiline(ATChannel* p_channel,
+    const char* command, const char* responsePrefix,
+    ATResponse** pp_outResponse)
 {
-    s_onTimeout = onTimeout;
+    return at_send_command_full(p_channel, command, MULTILINE, responsePrefix,
+        NULL, AT_TIMEOUT_DEFAULT, pp_outResponse);
 }
 
-/**
- *  This callback is invoked on the reader thread (like ATUnsolHandler)
- *  when the input stream closes before you call at_close
- *  (not when you call at_close())
- *  You should still call at_close()
- */
-void at_set_on_reader_closed(void (*onClose)(void))
+/* sends "command", returns AT_ERROR_GENERIC if the modem rejects it */
+static int sendSetting(ATChannel* p_channel, const char* command)
 {
-    s_onReaderClosed = onClose;
+    ATResponse* p_response = NULL;
+    int err;
+
+    err = at_send_command_full(p_channel, command, NO_RESULT, NULL, NULL,
+        AT_TIMEOUT_DEFAULT, &p_response);
+    if (err == AT_ERROR_OK && p_response->success == 0) {
+        err = AT_ERROR_GENERIC;
+    }
+
+    at_response_free(p_response);
+
+    return err;
+}
+
+int at_channel_send_commands(ATChannel* p_channel, const char* const* commands,
+    int count, int* p_failed)
+{
+    char line[AT_COMPOUND_MAX_LEN + 1];
+    size_t len;
+    size_t cmdLen;
+    int first;
+    int last;
+    int err;
+    int i;
+
+    for (first = 0; first < count; first = last) {
+        /* pack the commands that follow into the line of the first one */
+        len = strlen(commands[first]);
+        last = first + 1;
+
+        if (p_channel->compound && len <= AT_COMPOUND_MAX_LEN) {
+            memcpy(line, commands[first], len);
+
+            while (last < count && strncasecmp(commands[last], "AT", 2) == 0) {
+                cmdLen = strlen(commands[last]) - 2;
+                if (len + 1 + cmdLen > AT_COMPOUND_MAX_LEN) {
+                    break;
+                }
+
+                line[len++] = ';';
+                memcpy(line + len, commands[last] + 2, cmdLen);
+                len += cmdLen;
+                last++;
+            }
+
+            line[len] = '\0';
+        }
+
+        if (last - first > 1) {
+            err = sendSetting(p_channel, line);
+            if (err == AT_ERROR_OK) {
+                continue;
+            }
+
+            if (err != AT_ERROR_GENERIC) {
+                if (p_failed != NULL) {
+                    *p_failed = first;
+                }
+                return err;
+            }
+
+            RLOGW("Compound command failed, sending one by one: %s", line);
+        }
+
+        for (i = first; i < last; i++) {
+            err = sendSetting(p_channel, commands[i]);
+            if (err != AT_ERROR_OK) {
+                RLOGE("%s failed: %s", commands[i], at_io_err_str(err));
+                if (p_failed != NULL) {
+                    *p_failed = i;
+                }
+                return err;
+            }
+        }
+
+        if (last - first > 1) {
+            RLOGW("Modem rejects compound commands, no longer sending them");
+            p_channel->compound = false;
+        }
+    }
+
+    return AT_ERROR_OK;
 }
 
 /**
  * Periodically issue an AT command and wait for a response.
  * Used to ensure channel has start up and is active
  */
-int at_handshake()
+int at_channel_handshake(ATChannel* p_channel)
 {
+    ATResponse* p_response = NULL;
     int i;
     int err = 0;
-    bool inEmulator;
 
-    if (0 != pthread_equal(s_tid_reader, pthread_self())) {
-        /* cannot be called from reader thread */
+    if (isChannelThread(p_channel)) {
+        /* cannot be called from reader thread or unsolicited handler */
         return AT_ERROR_INVALID_THREAD;
     }
-    inEmulator = isInEmulator();
-    if (inEmulator) {
-        pthread_mutex_lock(&s_writeMutex);
-    }
-    pthread_mutex_lock(&s_commandmutex);
 
     for (i = 0; i < HANDSHAKE_RETRY_COUNT; i++) {
         /* some stacks start with verbose off */
-        err = at_send_command_full_nolock("ATE0Q0V1", NO_RESULT,
+        err = at_send_command_wait(p_channel, HANDSHAKE_COMMAND, NO_RESULT,
             NULL, NULL, HANDSHAKE_TIMEOUT_MSEC, NULL);
 
         if (err == 0) {
@@ -888,14 +2589,157 @@ int at_handshake()
         sleepMsec(HANDSHAKE_TIMEOUT_MSEC);
     }
 
-    pthread_mutex_unlock(&s_commandmutex);
-    if (inEmulator) {
-        pthread_mutex_unlock(&s_writeMutex);
+    /* what to wait for after a timeout, see queueResync(), learned
+     * again as the modem may have been replaced or reset */
+    pthread_mutex_lock(&p_channel->commandmutex);
+    p_channel->resyncReply[0] = '\0';
+    pthread_mutex_unlock(&p_channel->commandmutex);
+
+    if (err == 0
+        && at_send_command_wait(p_channel, RESYNC_COMMAND, SINGLELINE, RESYNC_PREFIX,
+               NULL, RESYNC_TIMEOUT_MSEC, &p_response)
+            == 0
+        && p_response->success > 0 && p_response->p_intermediates != NULL) {
+        pthread_mutex_lock(&p_channel->commandmutex);
+        snprintf(p_channel->resyncReply, sizeof(p_channel->resyncReply), "%s",
+            p_response->p_intermediates->line);
+        pthread_mutex_unlock(&p_channel->commandmutex);
+    }
+
+    at_response_free(p_response);
+
+    return err;
+}
+
+int at_set_command_timeout(const char* verb, long long timeoutMsec)
+{
+    VerbTimeout* p_verb;
+
+    pthread_mutex_lock(&s_timeoutMutex);
+
+    p_verb = findVerbTimeout(verb);
+    if (p_verb != NULL) {
+        p_verb->timeoutMsec = timeoutMsec;
+        p_verb->adaptive = false;
+    }
+
+    pthread_mutex_unlock(&s_timeoutMutex);
+
+    return p_verb != NULL ? 0 : -1;
+}
+
+/* The calls below use the channel selected for the calling thread */
+
+int at_send_command_async(const char* command, ATCommandType type,
+    const char* responsePrefix, long long timeoutMsec,
+    ATCommandCallback callback, void* ctx)
+{
+    return at_channel_send_command_async(threadChannel(), command, type,
+        responsePrefix, timeoutMsec, callback, ctx);
+}
+
+int at_send_commands(const char* const* commands, int count, int* p_failed)
+{
+    return at_channel_send_commands(threadChannel(), commands, count, p_failed);
+}
+
+int at_send_command(const char* command, ATResponse** pp_outResponse)
+{
+    return at_channel_send_command(threadChannel(), command, pp_outResponse);
+}
+
+int at_send_command_singleline(const char* command,
+    const char* responsePrefix,
+    ATResponse** pp_outResponse)
+{
+    return at_channel_send_command_singleline(threadChannel(), command,
+        responsePrefix, pp_outResponse);
+}
+
+int at_send_command_numeric(const char* command,
+    ATResponse** pp_outResponse)
+{
+    return at_channel_send_command_numeric(threadChannel(), command,
+        pp_outResponse);
+}
+
+int at_send_command_sms(const char* command,
+    const char* pdu,
+    const char* responsePrefix,
+    ATResponse** pp_outResponse)
+{
+    return at_channel_send_command_sms(threadChannel(), command, pdu,
+        responsePrefix, pp_outResponse);
+}
+
+int at_send_command_multiline(const char* command,
+    const char* responsePrefix,
+    ATResponse** pp_outResponse)
+{
+    return at_channel_send_command_multiline(threadChannel(), command,
+        responsePrefix, pp_outResponse);
+}
+
+int at_send_command_cached(const char* command, ATCommandType type,
+    const char* responsePrefix, const ATCachePolicy* p_policy,
+    ATResponse** pp_outResponse)
+{
+    ATResponse* p_response;
+    unsigned int generation;
+    int err;
+
+    p_response = lookupCache(command, type, responsePrefix, &generation);
+    if (p_response != NULL) {
+        if (pp_outResponse == NULL) {
+            at_response_free(p_response);
+        } else {
+            *pp_outResponse = p_response;
+        }
+
+        return AT_ERROR_OK;
+    }
+
+    err = at_send_command_full(threadChannel(), command, type, responsePrefix,
+        NULL, AT_TIMEOUT_DEFAULT, &p_response);
+    if (type != MULTILINE && type != NO_RESULT) {
+        err = checkIntermediate(err, &p_response);
+    }
+
+    if (err == AT_ERROR_OK && p_response->success > 0) {
+        storeCache(command, type, responsePrefix, p_policy, p_response, generation);
+    }
+
+    if (pp_outResponse == NULL) {
+        at_response_free(p_response);
+    } else {
+        *pp_outResponse = p_response;
     }
 
     return err;
 }
 
+int at_handshake()
+{
+    return at_channel_handshake(threadChannel());
+}
+
+/* This callback is invoked on the command thread */
+void at_set_on_timeout(void (*onTimeout)(void))
+{
+    s_onTimeout = onTimeout;
+}
+
+/**
+ *  This callback is invoked on the reader thread
+ *  when the input stream closes before you call at_close
+ *  (not when you call at_close())
+ *  You should still call at_close()
+ */
+void at_set_on_reader_closed(void (*onClose)(void))
+{
+    s_onReaderClosed = onClose;
+}
+
 /**
  * Returns error code from response
  * Assumes AT+CMEE=1 (numeric) mode
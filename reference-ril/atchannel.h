@@ -62,16 +62,21 @@ typedef struct ATLine {
     char* line;
 } ATLine;
 
-/* Free this with at_response_free() */
+/**
+ * Free this with at_response_free(). The response, its lines and their
+ * text are one allocation, so never free or keep a part of it
+ */
 typedef struct {
     int success; /* true if final response indicates success (eg "OK") */
     char* finalResponse; /* eg OK, ERROR */
     ATLine* p_intermediates; /* any intermediate responses */
+    int numIntermediates; /* length of the p_intermediates list */
 } ATResponse;
 
 /**
  * a user-provided unsolicited response handler function
- * this will be called from the reader thread, so do not block
+ * this will be called from the URC delivery thread, in the order the
+ * lines were read. It may not issue AT commands, so do not block
  * "s" is the line, and "sms_pdu" is either NULL or the PDU response
  * for multi-line TS 27.005 SMS PDU responses (eg +CMT:)
  */
@@ -80,10 +85,37 @@ typedef void (*ATUnsolHandler)(const char* s, const char* sms_pdu);
 int at_open(int fd, ATUnsolHandler h);
 void at_close(void);
 
+/* the handler of unsolicited responses starting with "prefix" */
+typedef struct {
+    const char* prefix;
+    ATUnsolHandler handler;
+} ATUnsolPrefix;
+
+/**
+ * Adds "count" prefixes to the line classifier. The longest registered
+ * prefix of a line picks its handler. Call before any channel is opened
+ * returns 0 on success, -1 if the classifier is full
+ */
+int at_register_unsol_handlers(const ATUnsolPrefix* p_prefixes, int count);
+
+/* Returns the handler registered for "line", NULL if there is none */
+ATUnsolHandler at_find_unsol_handler(const char* line);
+
+/* Unsolicited response delivery metrics, all times in nanoseconds */
+typedef struct {
+    unsigned long long urcCount; /* unsolicited responses delivered */
+    unsigned long long readerStallNsTotal; /* reader thread time spent handing off */
+    unsigned long long readerStallNsMax;
+    unsigned long long deliveryLatencyNsMax; /* read to handler start */
+    unsigned int queueDepthMax;
+} ATUrcStats;
+
+void at_get_urc_stats(ATUrcStats* p_stats);
+
 /* This callback is invoked on the command thread.
  * You should reset or handshake here to avoid getting out of sync */
 void at_set_on_timeout(void (*onTimeout)(void));
-/* This callback is invoked on the reader thread (like ATUnsolHandler)
+/* This callback is invoked on the reader thread
  * when the input stream closes before you call at_close
  * (not when you call at_close())
  * You should still call at_close()
@@ -102,8 +134,180 @@ int at_send_command_multiline(const char* command,
     const char* responsePrefix,
     ATResponse** pp_outResponse);
 
+/* timeoutMsec for the timeout of the command's verb, see at_set_command_timeout() */
+#define AT_TIMEOUT_DEFAULT (-1)
+
+/**
+ * Sets the timeout of the commands with "verb", 0 meaning infinite. The
+ * verb is the command name with "=", "?" or "=?" as it is sent, eg.
+ * "+COPS=?", "+CREG?" or "D" for ATD. This replaces the built-in timeout
+ * and the one learned from the reply latency of the verb.
+ * The at_send_command* calls use these timeouts.
+ * returns 0 on success, -1 if too many verbs are known
+ */
+int at_set_command_timeout(const char* verb, long long timeoutMsec);
+
+/**
+ * Completion of an asynchronous command. "err" is one of AT_ERROR_*, the
+ * callback owns "p_response" (NULL unless err is AT_ERROR_OK) and must free
+ * it with at_response_free(). Called on the reader thread, or on the
+ * submitting thread if the command could not be written, so do not block
+ */
+typedef void (*ATCommandCallback)(int err, ATResponse* p_response, void* ctx);
+
+/**
+ * Queue a command and return without waiting for the modem. Commands are
+ * written in submission order, each as soon as the previous one got its
+ * final response. timeoutMsec == 0 means infinite timeout,
+ * AT_TIMEOUT_DEFAULT the timeout of the command's verb.
+ * Returns AT_ERROR_OK if "callback" will be called, an error otherwise
+ */
+int at_send_command_async(const char* command, ATCommandType type,
+    const char* responsePrefix, long long timeoutMsec,
+    ATCommandCallback callback, void* ctx);
+
 int at_handshake(void);
 
+/* events that drop cached replies, see ATCachePolicy */
+#define AT_CACHE_SIM_CHANGED (1 << 0)
+
+/* how long at_send_command_cached() keeps a reply */
+typedef struct {
+    long long ttlMsec; /* 0 for as long as nothing drops it */
+    const char* unsolPrefix; /* URCs dropping it, NULL for none */
+    int events; /* AT_CACHE_* bits dropping it, see at_cache_invalidate() */
+} ATCachePolicy;
+
+/**
+ * Like at_send_command_singleline(), at_send_command_numeric() or
+ * at_send_command_multiline() by "type", for queries whose reply rarely
+ * changes. A successful reply is kept as "p_policy", which must stay
+ * valid, says, and the same command is then answered with a copy of it.
+ * Any setting of the same verb, a command with "=" sent without a
+ * response prefix, eg. AT+CSCA=... for AT+CSCA?, drops it too, also when
+ * it is one of the commands of a line like AT+CMEE=1;+CSCA=...
+ */
+int at_send_command_cached(const char* command, ATCommandType type,
+    const char* responsePrefix, const ATCachePolicy* p_policy,
+    ATResponse** pp_outResponse);
+
+/* Drops the cached replies whose policy has one of the "events" bits */
+void at_cache_invalidate(int events);
+
+typedef struct {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long invalidations;
+    unsigned int entries; /* replies cached now */
+} ATCacheStats;
+
+void at_get_cache_stats(ATCacheStats* p_stats);
+
+/* longest command line at_send_commands() builds, without "AT" and \r */
+#ifndef AT_COMPOUND_MAX_LEN
+#define AT_COMPOUND_MAX_LEN 128
+#endif
+
+/**
+ * Sends "count" commands that have no intermediate response and may be
+ * repeated, eg. settings, in order. Consecutive ones are joined into
+ * "AT+A;+B;+C" lines of up to AT_COMPOUND_MAX_LEN characters. If such a
+ * line is rejected its commands are sent again one at a time, and if
+ * all of them pass alone the channel stops joining commands.
+ * Stops at the first command that fails, with its index in *p_failed.
+ * returns AT_ERROR_OK if every command got a successful final response,
+ * AT_ERROR_GENERIC if the modem rejected one, another AT_ERROR_* else
+ */
+int at_send_commands(const char* const* commands, int count, int* p_failed);
+
+/**
+ * An AT command stream, eg. a tty or a CMUX DLC. Every channel has its own
+ * input buffer, reader thread, command queue and unsolicited handler, so
+ * several modems or multiplexed channels can run side by side. Unsolicited
+ * responses of all channels are delivered on the one URC thread.
+ *
+ * The at_open() family above works on the default channel, or on the one
+ * picked with at_set_thread_channel() for the calling thread.
+ */
+typedef struct ATChannel ATChannel;
+
+/* Returns a closed channel, NULL on error */
+ATChannel* at_channel_create(void);
+
+/* Releases "p_channel". Must not be called from its reader or URC thread */
+void at_channel_destroy(ATChannel* p_channel);
+
+/**
+ * Starts the channel on stream "fd". A closed channel may be opened again
+ * returns 0 on success, -1 on error
+ */
+int at_channel_open(ATChannel* p_channel, int fd, ATUnsolHandler h);
+void at_channel_close(ATChannel* p_channel);
+
+ATChannel* at_default_channel(void);
+
+/**
+ * Sends the at_send_command* calls of the calling thread to "p_channel"
+ * NULL selects the default channel again
+ */
+void at_set_thread_channel(ATChannel* p_channel);
+
+/* The channel the at_send_command* calls of the calling thread go to */
+ATChannel* at_get_thread_channel(void);
+
+void at_channel_set_context(ATChannel* p_channel, void* context);
+void* at_channel_get_context(const ATChannel* p_channel);
+
+/**
+ * Like at_set_on_timeout() and at_set_on_reader_closed(), for one channel.
+ * A channel without callbacks of its own uses the global ones
+ */
+void at_channel_set_on_timeout(ATChannel* p_channel,
+    void (*onTimeout)(ATChannel* p_channel));
+void at_channel_set_on_reader_closed(ATChannel* p_channel,
+    void (*onClose)(ATChannel* p_channel));
+
+/* commands a channel writes ahead of their final responses by default */
+#ifndef AT_PIPELINE_DEPTH
+#define AT_PIPELINE_DEPTH 1
+#endif
+
+/**
+ * Lets up to "depth" commands be written before the oldest one got its
+ * final response, for modems that buffer input while busy. Final
+ * responses are matched to the commands in the order they were written.
+ * Commands that dial, answer, reset or send an SMS PDU are never written
+ * behind others or followed by any. 1, the default, writes one at a time
+ */
+void at_channel_set_pipeline_depth(ATChannel* p_channel, int depth);
+
+int at_channel_send_command(ATChannel* p_channel, const char* command,
+    ATResponse** pp_outResponse);
+
+int at_channel_send_command_singleline(ATChannel* p_channel,
+    const char* command, const char* responsePrefix,
+    ATResponse** pp_outResponse);
+
+int at_channel_send_command_numeric(ATChannel* p_channel, const char* command,
+    ATResponse** pp_outResponse);
+
+int at_channel_send_command_multiline(ATChannel* p_channel,
+    const char* command, const char* responsePrefix,
+    ATResponse** pp_outResponse);
+
+int at_channel_send_command_sms(ATChannel* p_channel, const char* command,
+    const char* pdu, const char* responsePrefix,
+    ATResponse** pp_outResponse);
+
+int at_channel_send_command_async(ATChannel* p_channel, const char* command,
+    ATCommandType type, const char* responsePrefix, long long timeoutMsec,
+    ATCommandCallback callback, void* ctx);
+
+int at_channel_send_commands(ATChannel* p_channel, const char* const* commands,
+    int count, int* p_failed);
+
+int at_channel_handshake(ATChannel* p_channel);
+
 int at_send_command(const char* command, ATResponse** pp_outResponse);
 
 int at_send_command_sms(const char* command, const char* pdu,
@@ -0,0 +1,641 @@
+/*
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#define LOG_TAG "NETCFG"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <telephony/ril_log.h>
+
+#include "netcfg.h"
+
+/*
+ * Interfaces are configured over one rtnetlink socket opened on first use
+ * and kept. Each change is a batch of requests in one send; their acks
+ * are read when something waits for an answer or before the next batch,
+ * so a data call is set up with a send and a receive or two, whatever
+ * the number of addresses. What was added is remembered per interface
+ * so that netcfg_clear() takes exactly that away. Like the SIOCSIFDSTADDR
+ * it replaces, an address gets the gateway as its peer, the kernel
+ * deriving the on-link route; the routing tables are left alone.
+ */
+#define NETCFG_MAX_IFS 4
+#define NETCFG_MAX_ADDRS 8
+#define NETCFG_BATCH_SIZE 2048
+#define NETCFG_RECV_SIZE 8192
+#define NETCFG_TIMEOUT_SEC 1
+
+typedef struct {
+    int family;
+    int prefixLen;
+    unsigned char bytes[16];
+    unsigned char peer[16]; /* all zero for none */
+} NetAddr;
+
+typedef struct {
+    char name[IFNAMSIZ];
+    int index;
+    NetAddr addrs[NETCFG_MAX_ADDRS];
+    int numAddrs;
+} NetIf;
+
+typedef struct {
+    char buf[NETCFG_BATCH_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    size_t len;
+    int count;
+    bool full;
+    struct nlmsghdr* p_last;
+} NlBatch;
+
+/* guards everything below */
+static pthread_mutex_t s_netcfgMutex = PTHREAD_MUTEX_INITIALIZER;
+static int s_nlFd = -1;
+static uint32_t s_nlSeq;
+static int s_nlPending; /* acks not read yet */
+static NetIf s_ifs[NETCFG_MAX_IFS];
+static int s_numIfs;
+
+static int openNetlink(void)
+{
+    struct sockaddr_nl local;
+    struct timeval tv = { .tv_sec = NETCFG_TIMEOUT_SEC };
+    int fd;
+    int ret;
+
+    if (s_nlFd >= 0) {
+        return 0;
+    }
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        ret = -errno;
+        RLOGE("Failed to open netlink socket: %s (%d)", strerror(-ret), -ret);
+        return ret;
+    }
+
+    memset(&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    if (bind(fd, (struct sockaddr*)&local, sizeof(local)) < 0) {
+        ret = -errno;
+        RLOGE("Failed to bind netlink socket: %s (%d)", strerror(-ret), -ret);
+        close(fd);
+        return ret;
+    }
+
+    /* a receive waited for never blocks the caller for long */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    s_nlFd = fd;
+    s_nlPending = 0;
+
+    return 0;
+}
+
+static void batchInit(NlBatch* p_batch)
+{
+    p_batch->len = 0;
+    p_batch->count = 0;
+    p_batch->full = false;
+    p_batch->p_last = NULL;
+}
+
+static void* batchStart(NlBatch* p_batch, int type, int flags, size_t bodyLen)
+{
+    struct nlmsghdr* p_hdr;
+    size_t len = NLMSG_LENGTH(bodyLen);
+
+    if (p_batch->len + NLMSG_ALIGN(len) > sizeof(p_batch->buf)) {
+        p_batch->full = true;
+        p_batch->p_last = NULL;
+        return NULL;
+    }
+
+    p_hdr = (struct nlmsghdr*)(p_batch->buf + p_batch->len);
+    memset(p_hdr, 0, NLMSG_ALIGN(len));
+    p_hdr->nlmsg_len = len;
+    p_hdr->nlmsg_type = type;
+    p_hdr->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    p_hdr->nlmsg_seq = ++s_nlSeq;
+
+    p_batch->len += NLMSG_ALIGN(len);
+    p_batch->count++;
+    p_batch->p_last = p_hdr;
+
+    return NLMSG_DATA(p_hdr);
+}
+
+/* appends an attribute to the message batchStart() last started */
+static void batchAttr(NlBatch* p_batch, int type, const void* data, size_t len)
+{
+    struct nlmsghdr* p_hdr = p_batch->p_last;
+    struct rtattr* p_rta;
+    size_t rtaLen = RTA_LENGTH(len);
+
+    if (p_hdr == NULL) {
+        return;
+    }
+
+    if (p_batch->len + RTA_ALIGN(rtaLen) > sizeof(p_batch->buf)) {
+        p_batch->full = true;
+        return;
+    }
+
+    p_rta = (struct rtattr*)(p_batch->buf + p_batch->len);
+    memset(p_rta, 0, RTA_ALIGN(rtaLen));
+    p_rta->rta_type = type;
+    p_rta->rta_len = rtaLen;
+    memcpy(RTA_DATA(p_rta), data, len);
+
+    p_hdr->nlmsg_len = NLMSG_ALIGN(p_hdr->nlmsg_len) + RTA_ALIGN(rtaLen);
+    p_batch->len += RTA_ALIGN(rtaLen);
+}
+
+/**
+ * Reads what the kernel sent. Without "waitSeq" only takes what is
+ * already there, else reads until the ack of "waitSeq" and returns its
+ * error. Failed requests not waited for are logged
+ */
+static int readReplies(uint32_t waitSeq, int* p_index)
+{
+    static char buf[NETCFG_RECV_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr* p_hdr;
+    ssize_t n;
+
+    for (;;) {
+        if (waitSeq == 0 && s_nlPending <= 0) {
+            return 0;
+        }
+
+        n = recv(s_nlFd, buf, sizeof(buf), waitSeq != 0 ? 0 : MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == ENOBUFS) {
+                /* acks were dropped, those still wanted will come */
+                RLOGW("netlink receive buffer overrun");
+                s_nlPending = 0;
+                continue;
+            }
+
+            if (errno == EAGAIN && waitSeq == 0) {
+                return 0;
+            }
+
+            n = -errno;
+            RLOGE("Failed to read netlink: %s (%d)", strerror(-n), (int)-n);
+            return n;
+        }
+
+        for (p_hdr = (struct nlmsghdr*)buf; NLMSG_OK(p_hdr, (size_t)n);
+             p_hdr = NLMSG_NEXT(p_hdr, n)) {
+            if (p_hdr->nlmsg_type == NLMSG_ERROR) {
+                struct nlmsgerr* p_err = NLMSG_DATA(p_hdr);
+
+                s_nlPending--;
+                if (waitSeq != 0 && p_hdr->nlmsg_seq == waitSeq) {
+                    return p_err->error;
+                }
+
+                if (p_err->error != 0) {
+                    RLOGE("netlink request %u failed: %s", p_hdr->nlmsg_seq,
+                        strerror(-p_err->error));
+                }
+            } else if (p_hdr->nlmsg_type == RTM_NEWLINK && p_index != NULL
+                && p_hdr->nlmsg_seq == waitSeq) {
+                *p_index = ((struct ifinfomsg*)NLMSG_DATA(p_hdr))->ifi_index;
+            }
+        }
+    }
+}
+
+static int batchSend(NlBatch* p_batch)
+{
+    struct sockaddr_nl kernel;
+    ssize_t n;
+
+    if (p_batch->count == 0) {
+        return 0;
+    }
+
+    if (p_batch->full) {
+        RLOGW("netlink batch full, some requests not sent");
+    }
+
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+
+    do {
+        n = sendto(s_nlFd, p_batch->buf, p_batch->len, 0,
+            (struct sockaddr*)&kernel, sizeof(kernel));
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        n = -errno;
+        RLOGE("Failed to send netlink: %s (%d)", strerror(-n), (int)-n);
+        return n;
+    }
+
+    s_nlPending += p_batch->count;
+
+    return 0;
+}
+
+/* sends "p_batch" and waits for the ack of its last request */
+static int batchSendWait(NlBatch* p_batch, int* p_index)
+{
+    uint32_t seq = p_batch->p_last != NULL ? p_batch->p_last->nlmsg_seq : 0;
+    int ret;
+
+    ret = batchSend(p_batch);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return readReplies(seq, p_index);
+}
+
+/* assumes s_netcfgMutex is held */
+static NetIf* findIf(const char* ifname)
+{
+    NetIf* p_if;
+    NlBatch batch;
+    struct ifinfomsg* p_info;
+    int index = 0;
+    int ret;
+
+    for (int i = 0; i < s_numIfs; i++) {
+        if (strcmp(s_ifs[i].name, ifname) == 0) {
+            return &s_ifs[i];
+        }
+    }
+
+    if (s_numIfs >= NETCFG_MAX_IFS || strlen(ifname) >= IFNAMSIZ) {
+        RLOGE("Cannot keep interface %s", ifname);
+        return NULL;
+    }
+
+    batchInit(&batch);
+    p_info = batchStart(&batch, RTM_GETLINK, 0, sizeof(*p_info));
+    p_info->ifi_family = AF_UNSPEC;
+    batchAttr(&batch, IFLA_IFNAME, ifname, strlen(ifname) + 1);
+
+    ret = batchSendWait(&batch, &index);
+    if (ret < 0 || index <= 0) {
+        RLOGE("Failed to find interface %s: %s", ifname, strerror(ret < 0 ? -ret : ENODEV));
+        return NULL;
+    }
+
+    p_if = &s_ifs[s_numIfs++];
+    memset(p_if, 0, sizeof(*p_if));
+    strcpy(p_if->name, ifname);
+    p_if->index = index;
+
+    return p_if;
+}
+
+/* parses the "len" chars of "text", "a.b.c.d[/len]" or IPv6 alike */
+static int parseAddr(const char* text, size_t len, NetAddr* p_addr)
+{
+    char buf[INET6_ADDRSTRLEN + 4];
+    char* slash;
+    int maxLen;
+
+    if (len >= sizeof(buf)) {
+        return -1;
+    }
+
+    memcpy(buf, text, len);
+    buf[len] = '\0';
+    slash = strchr(buf, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+    }
+
+    memset(p_addr, 0, sizeof(*p_addr));
+    if (inet_pton(AF_INET, buf, p_addr->bytes) == 1) {
+        p_addr->family = AF_INET;
+        maxLen = 32;
+    } else if (inet_pton(AF_INET6, buf, p_addr->bytes) == 1) {
+        p_addr->family = AF_INET6;
+        maxLen = 128;
+    } else {
+        return -1;
+    }
+
+    p_addr->prefixLen = slash != NULL ? atoi(slash + 1) : maxLen;
+    if (p_addr->prefixLen < 0 || p_addr->prefixLen > maxLen) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static size_t addrSize(const NetAddr* p_addr)
+{
+    return p_addr->family == AF_INET ? 4 : 16;
+}
+
+static bool isAnyAddr(const NetAddr* p_addr)
+{
+    for (size_t i = 0; i < addrSize(p_addr); i++) {
+        if (p_addr->bytes[i] != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool hasPeer(const NetAddr* p_addr)
+{
+    for (size_t i = 0; i < addrSize(p_addr); i++) {
+        if (p_addr->peer[i] != 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool sameAddr(const NetAddr* p_a, const NetAddr* p_b)
+{
+    return p_a->family == p_b->family
+        && memcmp(p_a->bytes, p_b->bytes, addrSize(p_a)) == 0;
+}
+
+/* parses the space separated "list" into "addrs", returns their number */
+static int parseAddrList(const char* list, NetAddr* addrs, int max)
+{
+    int n = 0;
+
+    while (list != NULL && *list != '\0' && n < max) {
+        size_t len;
+
+        list += strspn(list, " ");
+        len = strcspn(list, " ");
+        if (len == 0) {
+            break;
+        }
+
+        if (parseAddr(list, len, &addrs[n]) == 0) {
+            n++;
+        } else {
+            RLOGW("Ignoring address %.*s", (int)len, list);
+        }
+
+        list += len;
+    }
+
+    return n;
+}
+
+static void addAddrRequest(NlBatch* p_batch, int type, int flags, const NetIf* p_if,
+    const NetAddr* p_addr)
+{
+    struct ifaddrmsg* p_msg;
+
+    p_msg = batchStart(p_batch, type, flags, sizeof(*p_msg));
+    if (p_msg == NULL) {
+        return;
+    }
+
+    p_msg->ifa_family = p_addr->family;
+    p_msg->ifa_prefixlen = p_addr->prefixLen;
+    /* the network already checked the address is unique */
+    p_msg->ifa_flags = p_addr->family == AF_INET6 ? IFA_F_NODAD : 0;
+    p_msg->ifa_scope = RT_SCOPE_UNIVERSE;
+    p_msg->ifa_index = p_if->index;
+    batchAttr(p_batch, IFA_LOCAL, p_addr->bytes, addrSize(p_addr));
+    batchAttr(p_batch, IFA_ADDRESS, hasPeer(p_addr) ? p_addr->peer : p_addr->bytes,
+        addrSize(p_addr));
+}
+
+int netcfg_set_up(const char* ifname, bool up)
+{
+    NlBatch batch;
+    struct ifinfomsg* p_info;
+    int ret;
+
+    pthread_mutex_lock(&s_netcfgMutex);
+    ret = openNetlink();
+    if (ret < 0) {
+        goto done;
+    }
+
+    readReplies(0, NULL);
+
+    batchInit(&batch);
+    p_info = batchStart(&batch, RTM_NEWLINK, 0, sizeof(*p_info));
+    p_info->ifi_family = AF_UNSPEC;
+    p_info->ifi_flags = up ? IFF_UP : 0;
+    p_info->ifi_change = IFF_UP;
+    batchAttr(&batch, IFLA_IFNAME, ifname, strlen(ifname) + 1);
+
+    ret = batchSendWait(&batch, NULL);
+    if (ret < 0) {
+        RLOGE("Failed to set %s %s: %s", ifname, up ? "up" : "down", strerror(-ret));
+    }
+
+done:
+    pthread_mutex_unlock(&s_netcfgMutex);
+    return ret;
+}
+
+int netcfg_add(const char* ifname, const char* addresses, const char* gateways)
+{
+    NetAddr addrs[NETCFG_MAX_ADDRS];
+    NetAddr gws[NETCFG_MAX_ADDRS];
+    NlBatch batch;
+    NetIf* p_if;
+    int numAddrs;
+    int numGws;
+    int ret;
+    int i, j;
+
+    RLOGD("%s: %s gateways %s on %s", __func__, addresses, gateways, ifname);
+
+    numAddrs = parseAddrList(addresses, addrs, NETCFG_MAX_ADDRS);
+    numGws = parseAddrList(gateways, gws, NETCFG_MAX_ADDRS);
+
+    pthread_mutex_lock(&s_netcfgMutex);
+    ret = openNetlink();
+    if (ret < 0) {
+        goto done;
+    }
+
+    readReplies(0, NULL);
+
+    p_if = findIf(ifname);
+    if (p_if == NULL) {
+        ret = -ENODEV;
+        goto done;
+    }
+
+    batchInit(&batch);
+    for (i = 0; i < numAddrs; i++) {
+        /* the first gateway of its family is the peer */
+        for (j = 0; j < numGws && (gws[j].family != addrs[i].family || isAnyAddr(&gws[j])); j++)
+            ;
+        if (j < numGws) {
+            memcpy(addrs[i].peer, gws[j].bytes, sizeof(addrs[i].peer));
+        }
+
+        for (j = 0; j < p_if->numAddrs && !sameAddr(&p_if->addrs[j], &addrs[i]); j++)
+            ;
+        if (j < p_if->numAddrs && (p_if->addrs[j].prefixLen != addrs[i].prefixLen
+                || memcmp(p_if->addrs[j].peer, addrs[i].peer, sizeof(addrs[i].peer)) != 0)) {
+            /* another peer would be added beside it, not replace it */
+            addAddrRequest(&batch, RTM_DELADDR, 0, p_if, &p_if->addrs[j]);
+        }
+
+        addAddrRequest(&batch, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, p_if, &addrs[i]);
+
+        if (j < p_if->numAddrs) {
+            p_if->addrs[j] = addrs[i];
+        } else if (j < NETCFG_MAX_ADDRS) {
+            p_if->addrs[p_if->numAddrs++] = addrs[i];
+        }
+    }
+
+    ret = batchSend(&batch);
+
+done:
+    pthread_mutex_unlock(&s_netcfgMutex);
+    return ret;
+}
+
+int netcfg_clear(const char* ifname)
+{
+    NlBatch batch;
+    NetIf* p_if;
+    int ret;
+    int i;
+
+    pthread_mutex_lock(&s_netcfgMutex);
+    ret = openNetlink();
+    if (ret < 0) {
+        goto done;
+    }
+
+    readReplies(0, NULL);
+
+    p_if = findIf(ifname);
+    if (p_if == NULL) {
+        ret = -ENODEV;
+        goto done;
+    }
+
+    batchInit(&batch);
+    for (i = 0; i < p_if->numAddrs; i++) {
+        addAddrRequest(&batch, RTM_DELADDR, 0, p_if, &p_if->addrs[i]);
+    }
+
+    p_if->numAddrs = 0;
+
+    ret = batchSend(&batch);
+
+done:
+    pthread_mutex_unlock(&s_netcfgMutex);
+    return ret;
+}
+
+int netcfg_watch_links(void)
+{
+    struct sockaddr_nl local;
+    int fd;
+    int ret;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+    if (fd < 0) {
+        ret = -errno;
+        RLOGE("Failed to open netlink socket: %s (%d)", strerror(-ret), -ret);
+        return ret;
+    }
+
+    memset(&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    local.nl_groups = RTMGRP_LINK;
+    if (bind(fd, (struct sockaddr*)&local, sizeof(local)) < 0) {
+        ret = -errno;
+        RLOGE("Failed to bind netlink socket: %s (%d)", strerror(-ret), -ret);
+        close(fd);
+        return ret;
+    }
+
+    return fd;
+}
+
+int netcfg_read_link_events(int fd, const char* ifname, bool* p_running)
+{
+    char buf[NETCFG_RECV_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr* p_hdr;
+    int count = 0;
+    ssize_t n;
+
+    for (;;) {
+        n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                return count;
+            }
+
+            /* events dropped on ENOBUFS, the link may have come up then */
+            n = -errno;
+            RLOGE("Failed to read netlink: %s (%d)", strerror(-n), (int)-n);
+            return n;
+        }
+
+        for (p_hdr = (struct nlmsghdr*)buf; NLMSG_OK(p_hdr, (size_t)n);
+             p_hdr = NLMSG_NEXT(p_hdr, n)) {
+            struct ifinfomsg* p_info = NLMSG_DATA(p_hdr);
+            struct rtattr* p_rta;
+            int len;
+
+            if (p_hdr->nlmsg_type != RTM_NEWLINK && p_hdr->nlmsg_type != RTM_DELLINK) {
+                continue;
+            }
+
+            len = IFLA_PAYLOAD(p_hdr);
+            for (p_rta = IFLA_RTA(p_info); RTA_OK(p_rta, len); p_rta = RTA_NEXT(p_rta, len)) {
+                if (p_rta->rta_type == IFLA_IFNAME
+                    && strncmp(RTA_DATA(p_rta), ifname, RTA_PAYLOAD(p_rta)) == 0) {
+                    *p_running = p_hdr->nlmsg_type == RTM_NEWLINK
+                        && (p_info->ifi_flags & IFF_RUNNING);
+                    count++;
+                }
+            }
+        }
+    }
+}
\ No newline at end of file
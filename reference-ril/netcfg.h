@@ -0,0 +1,58 @@
+/*
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef _NETCFG_H
+#define _NETCFG_H
+
+#include <stdbool.h>
+
+/**
+ * Sets interface "ifname" up or down and waits for the kernel to answer.
+ * Returns 0 on success, -ENODEV if there is no such interface or another
+ * negative errno on error
+ */
+int netcfg_set_up(const char* ifname, bool up);
+
+/**
+ * Adds the space separated "addresses" ("a.b.c.d/len" or IPv6, the prefix
+ * length defaulting to the whole address) to "ifname", each with the first
+ * of "gateways" of its family as its peer. "0.0.0.0" or "::" is no peer.
+ * No route is added or replaced beyond those the kernel derives from the
+ * addresses. Sent in one batch and not waited for, the kernel's errors are
+ * logged when its answers are read.
+ * Returns 0 on success, a negative errno if nothing could be sent
+ */
+int netcfg_add(const char* ifname, const char* addresses, const char* gateways);
+
+/* Removes what netcfg_add() put on "ifname", same as netcfg_add() */
+int netcfg_clear(const char* ifname);
+
+/**
+ * Opens a non-blocking socket told of link changes, to be read with
+ * netcfg_read_link_events() when it polls readable and closed by the
+ * caller. Returns the fd, or a negative errno on error
+ */
+int netcfg_watch_links(void);
+
+/**
+ * Reads the link changes pending on "fd" of netcfg_watch_links(). Sets
+ * "*p_running" to whether the last of them for "ifname" has it running,
+ * untouched if there is none. Returns the number of them, or a negative
+ * errno on error
+ */
+int netcfg_read_link_events(int fd, const char* ifname, bool* p_running);
+
+#endif
\ No newline at end of file
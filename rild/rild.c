@@ -45,10 +45,14 @@ extern void RIL_onUnsolicitedResponse(int unsolResponse, const void* data,
 extern void RIL_requestTimedCallback(RIL_TimedCallback callback,
     void* param, const struct timeval* relativeTime);
 
+extern void RIL_setRequestLanes(int numLanes, int (*getLane)(int request));
+
 static struct RIL_Env s_rilEnv = {
     RIL_onRequestComplete,
     RIL_onUnsolicitedResponse,
-    RIL_requestTimedCallback
+    RIL_requestTimedCallback,
+    NULL,
+    RIL_setRequestLanes
 };
 
 int main(int argc, char** argv)